@@ -58,13 +58,192 @@
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <util/atomic.h>
+#include <util/crc16.h>
 #include <stdlib.h>
 #include "usbdrv.h"
 #include "digital.h"
 #define delayMicroseconds(value) _delay_us(value);
 #define sbi(register,bit) (register|=(1<<bit))
 #define cbi(register,bit) (register&=~(1<<bit))
-const uint8_t LITTLE_WIRE_VERSION = 0x13;
+const uint8_t LITTLE_WIRE_VERSION = 0x15;
+
+// Timing counters cost flash and a little time on every main loop pass,
+// so they are only built with LW_TIMING=1, see request 86.
+#ifndef LW_TIMING
+#define LW_TIMING 0
+#endif
+// The PIC24F programmer is only of use on a programming fixture and takes
+// flash, so it is only built with LW_PIC24=1, see request 88.
+#ifndef LW_PIC24
+#define LW_PIC24 0
+#endif
+// V-USB and the older requests fill most of the ATtiny85's 512 bytes of
+// SRAM and most of the 6012 bytes of flash micronucleus leaves, so each of
+// the newer requests, and of the larger additions to older ones, is built
+// only when asked for, make hex BATCH=1 CAPTURE=1 and so on, see the
+// Makefile for their flags and a size report. A few depend on others,
+// which are then built too.
+#if LW_MACRO                   // a macro is a stored command batch
+#undef LW_BATCH
+#define LW_BATCH 1
+#endif
+#if LW_SERVO_MUX               // the multiplexer is a servo pattern
+#undef LW_SERVO
+#define LW_SERVO 1
+#endif
+#if LW_SERVO                   // played by the sequencer
+#undef LW_SEQUENCER
+#define LW_SEQUENCER 1
+#endif
+#if LW_WS2812_PARALLEL         // an encoding of the frame upload
+#undef LW_WS2812_FRAME
+#define LW_WS2812_FRAME 1
+#endif
+#if LW_TIMING                  // timed on the device clock
+#undef LW_CLOCK
+#define LW_CLOCK 1
+#endif
+#ifndef LW_PORT_UPDATE
+#define LW_PORT_UPDATE 0       // 67 port update
+#endif
+#ifndef LW_SOFT_PWM_TIMER
+#define LW_SOFT_PWM_TIMER 0    // 47, 48 soft PWM on Timer0 with gamma, else in the main loop
+#endif
+#ifndef LW_FAST_ISP
+#define LW_FAST_ISP 0          // USBtiny SCK without delays and halved when the target falls behind
+#endif
+#ifndef LW_DW_BAUD
+#define LW_DW_BAUD 0           // debugWIRE bit time following the target's clock
+#endif
+#ifndef LW_BATCH
+#define LW_BATCH 0             // 56 command batch
+#endif
+#ifndef LW_SPI_STREAM
+#define LW_SPI_STREAM 0        // 57, 58 SPI stream
+#endif
+#ifndef LW_I2C_TRANSFER
+#define LW_I2C_TRANSFER 0      // 59, 61 i2c transfer and register read
+#endif
+#ifndef LW_ONEWIRE_BULK
+#define LW_ONEWIRE_BULK 0      // 62, 63 1-Wire search and block transfer
+#endif
+#ifndef LW_ADC_STREAM
+#define LW_ADC_STREAM 0        // 64, 65 ADC stream
+#endif
+#ifndef LW_PIN_EVENTS
+#define LW_PIN_EVENTS 0        // 66 pin change events, see usbconfig.h
+#endif
+#ifndef LW_SEQUENCER
+#define LW_SEQUENCER 0         // 68 pattern sequencer
+#endif
+#ifndef LW_WS2812_FRAME
+#define LW_WS2812_FRAME 0      // 69, 70 WS2812 frame upload and effects
+#endif
+#ifndef LW_SERVO
+#define LW_SERVO 0             // 71, 72 servo motion
+#endif
+#ifndef LW_DW_STREAM
+#define LW_DW_STREAM 0         // 75 debugWIRE stream read
+#endif
+#ifndef LW_DW_REPEAT
+#define LW_DW_REPEAT 0         // 76 debugWIRE repeat
+#endif
+#ifndef LW_DW_TRACE
+#define LW_DW_TRACE 0          // 77 debugWIRE trace
+#endif
+#ifndef LW_DW_BREAK
+#define LW_DW_BREAK 0          // debugWIRE break reported on the interrupt-in endpoint
+#endif
+#ifndef LW_CAPTURE
+#define LW_CAPTURE 0           // 78 logic capture
+#endif
+#ifndef LW_MEASURE
+#define LW_MEASURE 0           // 79 frequency and pulse measurement
+#endif
+#ifndef LW_DEBUG_FIFO
+#define LW_DEBUG_FIFO 0        // 80 buffered debug console
+#endif
+#ifndef LW_UART
+#define LW_UART 0              // 81 serial bridge
+#endif
+#ifndef LW_MACRO
+#define LW_MACRO 0             // 82 stored macros
+#endif
+#ifndef LW_CLOCK
+#define LW_CLOCK 0             // 83 device clock
+#endif
+#ifndef LW_FAST_PWM
+#define LW_FAST_PWM 0          // 84 PLL clocked Timer1 PWM
+#endif
+#ifndef LW_I2C_USI
+#define LW_I2C_USI 0           // 49 USI driven I2C
+#endif
+#ifndef LW_WS2812_PARALLEL
+#define LW_WS2812_PARALLEL 0   // 69 encoding 3, parallel strips
+#endif
+#ifndef LW_ONEWIRE_SWEEP
+#define LW_ONEWIRE_SWEEP 0     // 85 1-Wire temperature sweep
+#endif
+#ifndef LW_ADC_SCAN
+#define LW_ADC_SCAN 0          // 87 oversampled ADC scan
+#endif
+#ifndef LW_SERVO_MUX
+#define LW_SERVO_MUX 0         // 89 servo multiplexer
+#endif
+// The Timer1 overflow count shared by the pin event timestamps, the device
+// clock and the edge count of a measurement
+#define LW_TIMER1_OVF (LW_PIN_EVENTS || LW_CLOCK || LW_MEASURE)
+
+// Capability bitmap returned after the version by request 34, so hosts
+// can tell which of the newer requests a firmware answers. A bit is only
+// set when its requests are built in.
+#define LW_CAP_BATCH        (1UL << 0)   // 56 command batch
+#define LW_CAP_SPI_STREAM   (1UL << 1)   // 57, 58 SPI stream
+#define LW_CAP_I2C_TRANSFER (1UL << 2)   // 59, 61 i2c transfer and register read
+#define LW_CAP_ONEWIRE_BULK (1UL << 3)   // 62, 63 onewire search and block transfer
+#define LW_CAP_ADC_STREAM   (1UL << 4)   // 64, 65 ADC stream
+#define LW_CAP_PIN_EVENTS   (1UL << 5)   // 66 pin change events
+#define LW_CAP_PORT_UPDATE  (1UL << 6)   // 67 port update
+#define LW_CAP_SEQUENCER    (1UL << 7)   // 68 pattern sequencer
+#define LW_CAP_WS2812_FRAME (1UL << 8)   // 69, 70 WS2812 frame and effects
+#define LW_CAP_SERVO        (1UL << 9)   // 71, 72 servo
+#define LW_CAP_SERIAL       (1UL << 10)  // 73 serial number change
+#define LW_CAP_JOB_STATUS   (1UL << 11)  // 74 job status
+#define LW_CAP_DW_STREAM    (1UL << 12)  // 75 debugWIRE stream read
+#define LW_CAP_DW_REPEAT    (1UL << 13)  // 76 debugWIRE repeat
+#define LW_CAP_DW_TRACE     (1UL << 14)  // 77 debugWIRE trace
+#define LW_CAP_DW_BREAK     (1UL << 15)  // debugWIRE break reported on the interrupt-in endpoint
+#define LW_CAP_LOGIC        (1UL << 16)  // 78 logic capture
+#define LW_CAP_MEASURE      (1UL << 17)  // 79 frequency and pulse measurement
+#define LW_CAP_DEBUG_FIFO   (1UL << 18)  // 80 buffered debug console
+#define LW_CAP_UART         (1UL << 19)  // 81 serial bridge
+#define LW_CAP_MACRO        (1UL << 20)  // 82 stored macros
+#define LW_CAP_CLOCK        (1UL << 21)  // 83 device clock
+#define LW_CAP_PWM_FAST     (1UL << 22)  // 84 PLL clocked Timer1 PWM
+#define LW_CAP_I2C_USI      (1UL << 23)  // 49 USI driven I2C at 100 and 400 kHz
+#define LW_CAP_WS2812_PARALLEL (1UL << 24) // 69 encoding 3, strips on PB0-PB2 at once
+#define LW_CAP_ONEWIRE_SWEEP (1UL << 25) // 85 convert all sensors, read their scratchpads
+#define LW_CAP_TIMING       (1UL << 26)  // 86 request and job timing
+#define LW_CAP_ADC_SCAN     (1UL << 27)  // 87 oversampled scan of several ADC channels
+#define LW_CAP_PIC24        (1UL << 28)  // 88 PIC24F ICSP batches
+#define LW_CAP_SERVO_MUX    (1UL << 29)  // 89 servos on every free pin or a shift register
+#define LITTLE_WIRE_CAPABILITIES (LW_CAP_JOB_STATUS | \
+  (LW_PORT_UPDATE ? LW_CAP_PORT_UPDATE : 0) | (SERIAL_MAX_DIGITS > 3 ? LW_CAP_SERIAL : 0) | \
+  (LW_BATCH ? LW_CAP_BATCH : 0) | (LW_SPI_STREAM ? LW_CAP_SPI_STREAM : 0) | \
+  (LW_I2C_TRANSFER ? LW_CAP_I2C_TRANSFER : 0) | (LW_ONEWIRE_BULK ? LW_CAP_ONEWIRE_BULK : 0) | \
+  (LW_ADC_STREAM ? LW_CAP_ADC_STREAM : 0) | (LW_PIN_EVENTS ? LW_CAP_PIN_EVENTS : 0) | \
+  (LW_SEQUENCER ? LW_CAP_SEQUENCER : 0) | (LW_WS2812_FRAME ? LW_CAP_WS2812_FRAME : 0) | \
+  (LW_SERVO ? LW_CAP_SERVO : 0) | (LW_DW_STREAM ? LW_CAP_DW_STREAM : 0) | \
+  (LW_DW_REPEAT ? LW_CAP_DW_REPEAT : 0) | (LW_DW_TRACE ? LW_CAP_DW_TRACE : 0) | \
+  (LW_DW_BREAK ? LW_CAP_DW_BREAK : 0) | (LW_DEBUG_FIFO ? LW_CAP_DEBUG_FIFO : 0) | \
+  (LW_CLOCK ? LW_CAP_CLOCK : 0) | \
+  (LW_CAPTURE ? LW_CAP_LOGIC : 0) | (LW_MEASURE ? LW_CAP_MEASURE : 0) | \
+  (LW_UART ? LW_CAP_UART : 0) | (LW_MACRO ? LW_CAP_MACRO : 0) | \
+  (LW_FAST_PWM ? LW_CAP_PWM_FAST : 0) | (LW_I2C_USI ? LW_CAP_I2C_USI : 0) | \
+  (LW_WS2812_PARALLEL ? LW_CAP_WS2812_PARALLEL : 0) | (LW_ONEWIRE_SWEEP ? LW_CAP_ONEWIRE_SWEEP : 0) | \
+  (LW_ADC_SCAN ? LW_CAP_ADC_SCAN : 0) | (LW_SERVO_MUX ? LW_CAP_SERVO_MUX : 0) | \
+  (LW_TIMING ? LW_CAP_TIMING : 0) | (LW_PIC24 ? LW_CAP_PIC24 : 0))
+
 enum
 {
   // Generic requests
@@ -115,9 +294,16 @@ enum
 #define DDR DDRB
 #define PIN PINB
 
-uint8_t* EE_addr = (uint8_t*)32;
+// The serial number is 1 to 8 ASCII digits in EEPROM from EE_addr, ended
+// by the first byte which is not a digit. Its descriptor takes 2 bytes of
+// SRAM a digit, so only the 3 request 55 writes are built in unless asked
+// for, make hex SERIAL_DIGITS=8, which also builds request 73.
+#ifndef SERIAL_MAX_DIGITS
+#define SERIAL_MAX_DIGITS 3
+#endif
+#define EE_addr ((uint8_t*)32)
 static inline void initSerialNumber();
-int usbDescriptorStringSerialNumber[] = {
+int usbDescriptorStringSerialNumber[1+SERIAL_MAX_DIGITS] = {
   USB_STRING_DESCRIPTOR_HEADER( USB_CFG_SERIAL_NUMBER_LEN ),
   USB_CFG_SERIAL_NUMBER
 };
@@ -154,12 +340,22 @@ static uchar    cmd[4];        // SPI command buffer
 static uchar    res[4];        // SPI result buffer
 static uint16_t SPI_DELAY=10;  // in microseconds. USI driven SPI mode
 static uint16_t I2C_DELAY=0;   // in microseconds. USI driven SPI mode
+#if LW_I2C_USI
+static uchar    i2cUSI;        // 0: bit banged I2C, 1: USI at 100 kHz, 2: USI at 400 kHz
+#else
+#define i2cUSI 0
+#endif
+#if LW_SPI_STREAM
+static uchar    spiFill;       // byte sent while streaming SPI reads
+static uchar    spiStreamLeft; // bytes left in an SPI stream read, 0 if none
+static uchar    spiCS;         // SPI stream chip select: 1 assert at start, 2 release at end
+#endif
 // ----------------------------------------------------------------------
 volatile uint8_t sendBuffer[9];
 volatile uint8_t rxBuffer[8];
-static   uint8_t t,q;
 static   uint8_t counter=0;
-static   uint8_t softPWM=0;
+volatile uint8_t softPWM=0;      // 1: running, 2: gamma corrected compare values,
+                                 // 4: compare0..2 hold new values for the next period
 static   uint8_t cmp0,cmp1,cmp2,compare0,compare1,compare2;
 static   uint8_t adcSetting=0;
 volatile uint8_t jobState=0;
@@ -171,12 +367,246 @@ volatile uint8_t jobState=0;
 static uint8_t ws2812_grb[ws2812_maxleds*3];
 static uint8_t ws2812_mask;
 static uint8_t ws2812_ptr=0;
+#if LW_WS2812_FRAME
+static uint8_t ws2812_mode;     // encoding of ws2812_grb: 0 GRB, 1 runs, 2 palette, 3 parallel
+static uint16_t ws2812_leds;    // number of LEDs of a palette frame
+static uint8_t ws2812_in;       // bytes left in a frame upload
+static uint8_t ws2812_flushAfter; // flush once the upload completes
+// ws2812 effects, rendered into ws2812_grb by the main loop
+#define FX_MODE 0               // fxParam layout, see fxPoll
+#define FX_PIN 1
+#define FX_LEDS 2
+#define FX_INTERVAL 3
+#define FX_COLOUR_A 4
+#define FX_COLOUR_B 7
+#define FX_ARG1 10
+#define FX_ARG2 11
+static uint8_t fxParam[12];
+static uint8_t fxIn;            // bytes left in an effect upload
+static uint8_t fxLast;          // Timer1 count at the last frame
+static uint16_t fxPhase;        // frame number within the effect
+#endif
 // ----------------------------------------------------------------------
 // debugWIRE support
 volatile uint8_t dwBuf[128];
 volatile uint8_t dwLen;        // Length being received from host or avr device
 volatile uint8_t dwIn;         // Input pointer: where usbDwFunctionWrite writes into dwBuf
 volatile uint8_t dwState;      // Current debugWIRE action underway, 0 if none
+                               // 0x80: dwBuf is in use by another job, see dwJob
+                               // 0x40: dwBuf is held by the ADC stream or the sequencer
+volatile uint8_t dwJob;        // Job to start once usbFunctionWrite has filled dwBuf
+volatile uint8_t dwReadMax;    // Bytes expected by dwReadBytes, it stops as soon as they are in
+uint16_t dwBitTime;            // Each debugWIRE bit takes 4*dwBitTime+8 cycles to transmit
+#if LW_DW_BAUD
+uint16_t dwStopWait;           // Stop bit wait count left by dwReadBytes after a byte ending in 0, 0 if none
+#endif
+#if LW_DW_BREAK
+static   uint8_t dwBreakWatch; // 1: report the end of a wait for the target on the interrupt-in endpoint
+#endif
+// ----------------------------------------------------------------------
+#if LW_DW_STREAM
+// debugWIRE stream read, data area chunks captured into dwBuf one after another
+static   uint16_t dwStreamAddr; // target address of the next chunk
+static   uint16_t dwStreamLeft; // bytes still to capture from the target
+static   uint8_t dwStreamOut;   // bytes of the chunk in dwBuf, 0 if none is ready
+static   uint8_t dwStreamPos;   // bytes of the chunk already read by the host
+static   uint8_t dwStreamRead;  // 1: usbFunctionRead is serving the chunk
+#endif
+#if LW_DW_REPEAT
+// debugWIRE repeat, a command sequence in dwBuf sent once per data byte
+static   uint8_t dwRepeatCount; // times to send the sequence
+static   uint8_t dwRepeatLen;   // length of the sequence, the data bytes follow it
+static   uint8_t dwRepeatPatch; // offset in the sequence replaced by the next data byte, 0xFF if none
+static   uint8_t dwRepeatFlags; // 0x80: read a reply byte each time, 0x7F: ms to wait each time
+#endif
+#if LW_DW_TRACE
+// debugWIRE trace, single steps with the PC read back after each
+static   uint8_t dwTraceCount;  // steps to take
+static   uint16_t dwTracePC;    // word address of the next instruction
+#endif
+#if LW_UART
+// Serial bridge, dwSendBytes and dwReadBytes as a half duplex UART on PB5
+static   uint16_t uartBitTime;  // as dwBitTime, kept apart from the debugWIRE target's
+static   uint8_t uartReadMax;   // bytes to receive after sending, 0 for none
+static   uint8_t uartOut;       // bytes received and not yet read by the host
+#endif
+// ----------------------------------------------------------------------
+#if LW_ADC_STREAM
+// ADC stream support, samples are queued in dwBuf used as a ring buffer
+#define ADC_RING_MASK (sizeof(dwBuf)-1)
+static   uint8_t adcStream;    // 1: running, 2: 8 bit samples, 0 if stopped
+volatile uint8_t adcHead;      // ring buffer write index, advanced by the ADC interrupt
+static   uint8_t adcTail;      // ring buffer read index, advanced by usbFunctionRead
+volatile uint8_t adcDropped;   // samples lost to a full ring buffer since the last read
+static   uint8_t adcHeader[3]; // sample count, flags and dropped count of the block being read
+static   uint8_t adcReadLeft;  // bytes left in the block being read, 0 if none
+static   uint8_t adcReadPos;   // bytes of the block already read
+#endif
+// ----------------------------------------------------------------------
+#if LW_PIN_EVENTS
+// Pin change events, reported on the interrupt-in endpoint
+#define PIN_EVENT_QUEUE 4
+volatile uint8_t pinEventLatch;  // 0x40: events on, 0x80: sample in bits 0-5, see usbconfig.h
+static   uint8_t pinEventMask;   // pins watched, 0 if events are off
+static   uint8_t pinEventPins;   // last state reported
+static   uint8_t pinEventCount;  // events queued
+static   uint8_t pinEventLost;   // 0x40 if events were dropped since the last one queued
+static   uint8_t pinEventQueue[PIN_EVENT_QUEUE][4]; // pins and flags, 24 bit timestamp
+volatile uint8_t pinEventStamp[4]; // TCNT1, pinEventTimeHi and TIFR when pinEventLatch was sampled, see usbconfig.h
+#else
+#define pinEventMask 0
+#endif
+#if LW_TIMER1_OVF
+volatile uint16_t pinEventTimeHi; // Timer1 overflows, upper bits of the timestamp, or the gate time of an edge count
+volatile uint8_t clockTop;       // wraps of pinEventTimeHi, top byte of the device clock
+#endif
+#if LW_CLOCK
+static   uint8_t clockOn;        // 1: device clock kept running by request 83
+#else
+#define clockOn 0
+#endif
+// ----------------------------------------------------------------------
+#if LW_SEQUENCER
+// Pattern sequencer, the pattern is held in dwBuf
+volatile uint8_t seqPos;       // next entry in dwBuf, 0 if stopped
+static   uint16_t seqWait;     // Timer1 ticks left before the next entry
+static   uint16_t seqMin;      // shortest wait, about 256 cycles
+volatile uint8_t seqLoops;     // loops left, 0 to loop forever
+volatile uint8_t seqFrames;    // passes through the pattern, wraps
+#endif
+// ----------------------------------------------------------------------
+#if LW_SERVO
+// Servo motion, the pulses are a pattern played by the sequencer
+static   uint8_t servoOn;        // 1: servo pattern playing, 2: multiplexer pattern, 0 if stopped
+static   uint8_t servoFrame;     // last seqFrames seen by servoPoll
+static   uint16_t servoNow[2];   // pulse widths in microseconds
+static   uint16_t servoFrom[2];  // start of the current move
+static   uint16_t servoTo[2];    // end of the current move
+static   uint8_t servoSteps[2];  // frames of the current move
+static   uint8_t servoDone[2];   // frames of the current move already played
+static   uint8_t servoCurve[2];  // motion profile of the current move
+#endif
+#if LW_SERVO_MUX
+// Servo multiplexer, request 89, a pattern of many servo pulses
+#define SERVO_MUX_MAX 16
+static   uint8_t servoMuxCount;  // channels
+static   uint8_t servoMuxFirst;  // dwBuf offset of the entry timing the first pulse
+static   uint8_t servoMuxStride; // bytes from one such entry to the next
+static   uint8_t servoMuxTrim;   // ticks of the pulse in the entries before it
+static   uint8_t servoMuxIn;     // bytes of pulse widths left to receive
+static   uint8_t servoMuxPos;    // bytes of pulse widths received
+static   uint8_t servoMuxPending; // 1: servoMuxNext waits for the rest of a frame
+static   uint16_t servoMuxNext[SERVO_MUX_MAX]; // pulse widths in microseconds
+#endif
+// ----------------------------------------------------------------------
+#if LW_CAPTURE
+// Logic capture, PB0, PB1, PB2 and PB5 sampled into dwBuf as channels 0-3
+#define CAP_SAMPLES 0x10       // capFlags mode: two 4 bit samples per byte
+#define CAP_EDGES 0x20         // capFlags mode: 2 bytes per change, channels and ticks since the last
+#define CAP_EDGE_TRIGGER 0x40  // capFlags: the trigger pattern must be entered, not just present
+#define CAP_TIMED 0x80         // capFlags: running, sampled by the Timer1 compare match interrupt
+#define CAP_TIMED_CYCLES 4096  // slowest sample period, in cycles, that the busy loop takes
+#define CAP_BUSY_CYCLES 82500  // longest busy loop capture, 5 ms, it ends early after that
+static   uint8_t capFlags;     // Timer1 clock select in bits 0-3 and the above, 0 if off
+static   uint8_t capTop;       // Timer1 top, a sample every capTop+1 ticks
+static   uint8_t capTrigger;   // channel mask in bits 0-3, values in bits 4-7, 0 to start at once
+static   uint8_t capLen;       // bytes to capture
+static   uint8_t capSeen;      // 1: the trigger pattern was absent since arming
+static   uint8_t capOut;       // bytes captured, 0 while armed
+static   uint8_t capPos;       // bytes of the capture already read by the host
+static   uint8_t capRead;      // 1: usbFunctionRead is serving the capture
+static   uint8_t capN;         // bytes captured so far, while running
+static   uint8_t capLast;      // channels at the last edge entry
+static   uint16_t capTicks;    // samples so far, or ticks since the last edge entry
+#endif
+// ----------------------------------------------------------------------
+#if LW_MEASURE
+// Frequency and pulse measurement
+#define MEAS_RUNNING 1         // measResult[0]
+#define MEAS_DONE 2
+#define MEAS_TIMEOUT 3
+#define MEAS_WINDOW 258        // Timer1 overflows of 256 cycles, 4 ms, a pulse measurement keeps interrupts off for at a time
+static   uint8_t measPin;      // pin timed by a pulse measurement
+static   uint8_t measPeriods;  // periods to time
+static   uint16_t measGate;    // Timer1 overflows to count edges for, or windows left before a pulse measurement gives up
+volatile uint8_t measOvf;      // Timer0 overflows while counting edges, 256 edges each
+static   uint8_t measResult[10]; // state, periods, high cycles or edges, low cycles or gate overflows
+#endif
+// ----------------------------------------------------------------------
+#if LW_DEBUG_FIFO
+// Debug console, bytes clocked in from the debugSpi target queued in dwBuf
+#define DEBUG_RING_MASK (sizeof(dwBuf)-1)
+static   uint8_t debugOn;      // 1: the console polls the target
+static   uint8_t debugGap;     // microseconds to leave the target before each byte
+static   uint8_t debugHead;    // ring buffer write index, advanced by debugPoll
+static   uint8_t debugTail;    // ring buffer read index, advanced by usbFunctionRead
+static   uint8_t debugHeader[2]; // byte count and flags of the block being read
+static   uint8_t debugReadLeft; // bytes left in the block being read, 0 if none
+static   uint8_t debugReadPos; // bytes of the block already read
+#endif
+// ----------------------------------------------------------------------
+#if LW_MACRO
+// Stored macros, command batches kept in EEPROM and run by the main loop
+#define MACRO_EE_START 48      // after the serial number at EE_addr
+#define MACRO_EE_END 512       // end of the ATtiny85 EEPROM
+#define MACRO_WAIT 82          // in a macro, request 82 waits Value milliseconds
+static   uint16_t macroPos;    // EEPROM address of the next command, 0 if no macro is running
+static   uint8_t macroLeft;    // commands left to run
+static   uint8_t macroNumber;  // macro running or run last
+static   uint16_t macroWait;   // milliseconds to wait before the next command
+static   uint8_t macroOut;     // reply bytes collected in dwBuf after the 3 byte header
+static   uint16_t macroStoreAt; // offset into the macro area of a request 82 store
+static   uint8_t macroPins;    // pins watched for the trigger, 0 if none
+static   uint8_t macroLevels;  // their levels that start the macro
+static   uint8_t macroTrigger; // macro started by the trigger
+static   uint8_t macroMatch;   // 1: the pins were at macroLevels on the last pass
+#endif
+// ----------------------------------------------------------------------
+#if LW_ONEWIRE_SWEEP
+// 1-Wire temperature sweep, request 85
+static   uint8_t owConvert;    // 1: conversion running, 2: no presence pulse for the last one
+static   uint8_t owScanPos;    // next ROM in dwBuf to read the scratchpad of
+static   uint8_t owScanLeft;   // scratchpads left to read, one per main loop pass
+static   uint8_t owResults;    // sensors read by the last sweep
+#endif
+// ----------------------------------------------------------------------
+#if LW_ADC_SCAN
+// ADC oversampling scan, request 87
+#define ADC_SCAN_CHANNELS 3    // RESET pin, SCK pin and temperature sensor, as for request 15
+static struct {
+  uint8_t  running;
+  uint16_t result[ADC_SCAN_CHANNELS]; // one per channel scanned, in channel order
+} adcScan;                     // returned by request 87, 1 byte while running
+static   uint8_t adcScanMask;  // channels to scan, bit n for channel n
+static   uint8_t adcScanShift; // 4^shift conversions per channel, summed and shifted right by shift
+static   uint8_t adcScanChannel; // channel being converted
+static   uint8_t adcScanCount; // channels done
+static   uint16_t adcScanLeft; // conversions left on the channel, the first one is not summed
+static   uint32_t adcScanSum;
+#endif
+// ----------------------------------------------------------------------
+// Timing counters, request 86
+#define TIMING_SLOTS 6         // slowest requests and jobs kept
+#define TIMING_FRAME_TICKS 129 // device clock ticks in a 1 ms USB frame
+#define TIMING_ON 1            // timing.flags
+#define TIMING_TIMER_TAKEN 2   // timing.flags: another function had Timer1, some time was not counted
+#define TIMING_IRQ_OFF 4       // timing.flags: in an interrupts-off window
+#if LW_TIMING
+static struct {
+  uint8_t  flags;
+  uint8_t  slots;              // TIMING_SLOTS, for the host
+  uint16_t offMax;             // longest interrupts-off window
+  uint32_t offTotal;           // ticks with interrupts off
+  uint16_t missedSof;          // USB frames estimated lost in those windows
+  uint16_t loopMax;            // longest main loop pass
+  struct {uint8_t job; uint8_t id; uint8_t count; uint16_t max;} slow[TIMING_SLOTS];
+} timing;                      // returned as it is by request 86, times in device clock ticks
+static   uint16_t timingOffStart; // tick the interrupts-off window began
+static   uint16_t timingLoopStart; // tick the main loop pass began
+static   uint8_t timingSofPart;   // ticks of interrupts-off time short of a whole frame
+static   uint8_t timingReq;       // request handled by the current usbPoll, 0xFF if none
+static   uint8_t timingClock;     // 1: timingStart started the device clock
+#endif
 // ----------------------------------------------------------------------
 
 
@@ -258,7 +688,11 @@ void _delay_ms(uint16_t ms) {  // millisecond parameter is passed in r25:r24
 
 
 
-#if 0
+#if LW_PIC24
+// ----------------------------------------------------------------------
+// PIC24F ICSP, request 88. Bits are clocked SPI_DELAY microseconds per
+// edge, least significant bit first, see the PIC24F flash programming
+// specification.
 // MCLR 0x04 (100)  => SCK  -pin2
 // PGD  0x02 (010)  => MISO -pin1
 // PGC  0x01 (001)  => MOSI -pin4
@@ -340,6 +774,90 @@ static inline void PinByte(uint8_t *value)
   PORTB &= ~0x02; //deactivate pull-up...
 }
 
+// Clock out a byte most significant bit first, for the ICSP entry key
+static void ClockByteMsb(uint8_t value)
+{
+  uint8_t i;
+  uint8_t mask = 0x80;
+  while(mask)
+  {
+    if(value & mask)
+      PORTB = (PORTB & ~0x01) | 0x02;
+    else
+      PORTB &= ~0x03;
+    mask >>= 1;
+    for(i=0;i<SPI_DELAY;i++)  _delay_us(1);
+    PORTB |= 0x01; //pop clock
+    for(i=0;i<SPI_DELAY;i++)  _delay_us(1);
+  }
+  PORTB &= ~0x03;
+}
+
+// Batch operations, each an op byte and its operands
+#define PIC24_SIX    0         // 3 bytes instruction, low byte first
+#define PIC24_REGOUT 1         // read VISI, 2 bytes to the reply, low byte first
+#define PIC24_NOPS   2         // count: SIX NOP that many times
+#define PIC24_ENTER  3         // 4 bytes key, sent first byte first and msb first
+#define PIC24_EXIT   4         // hold MCLR low and release PGC and PGD
+#define PIC24_WAIT   5         // milliseconds
+
+// Run the batch of dwLen bytes in dwBuf. The words read are collected
+// behind the batch, then moved to dwBuf[1] with dwBuf[0] set to 1 if
+// every operation ran, 0 if one was unknown or had no room for its reply.
+static void pic24Batch(void)
+{
+  uint8_t op, pos = 0, out = dwLen, ok = 1;
+  uint8_t n, lo, hi;
+
+  while (pos < dwLen)
+  {
+    wdt_reset();
+    op = dwBuf[pos++];
+    if (op == PIC24_SIX && pos + 3 <= dwLen) {
+      ClockControlBits(0x00);
+      ClockByte(dwBuf[pos]);
+      ClockByte(dwBuf[pos+1]);
+      ClockByte(dwBuf[pos+2]);
+      pos += 3;
+    } else if (op == PIC24_REGOUT && out + 2 <= sizeof(dwBuf)) {
+      ClockControlBits(0x01);
+      PinByte(&lo);            // 8 idle clocks, PGD turns around
+      PinByte(&lo);
+      PinByte(&hi);
+      dwBuf[out++] = lo;
+      dwBuf[out++] = hi;
+    } else if (op == PIC24_NOPS && pos < dwLen) {
+      for (n = dwBuf[pos++]; n; n--) {
+        ClockControlBits(0x00);
+        ClockLowXTimes(24);
+      }
+    } else if (op == PIC24_ENTER && pos + 4 <= dwLen) {
+      PORTB &= ~0x07;          // MCLR, PGD and PGC low
+      DDRB |= 0x07;
+      _delay_ms(1);
+      PORTB |= 0x04;           // MCLR pulse
+      _delay_us(1);
+      PORTB &= ~0x04;
+      _delay_ms(1);
+      for (n = 0; n < 4; n++) ClockByteMsb(dwBuf[pos++]);
+      PORTB |= 0x04;           // MCLR high, into ICSP mode
+      for (n = 0; n < 50; n++) {wdt_reset(); _delay_ms(1);}
+      ClockLowXTimes(5);       // the first SIX takes five more clocks
+    } else if (op == PIC24_EXIT) {
+      PORTB &= ~0x07;
+      _delay_ms(1);
+      DDRB &= ~0x03;           // MCLR stays low, holding the target in reset
+    } else if (op == PIC24_WAIT && pos < dwLen) {
+      for (n = dwBuf[pos++]; n; n--) {wdt_reset(); _delay_ms(1);}
+    } else {
+      ok = 0;
+      break;
+    }
+  }
+  for (n = dwLen; n < out; n++) dwBuf[1 + n - dwLen] = dwBuf[n];
+  dwBuf[0] = ok;
+  dwLen = 1 + out - dwLen;
+}
 #endif
 
 
@@ -364,6 +882,44 @@ static inline void spi_delay ( void )
 
 
 
+#if LW_FAST_ISP
+// ----------------------------------------------------------------------
+// Issue one SPI command with no delay loops, used for sck_period 1.
+// About 14 cycles a bit, SCK near 1.2 MHz with a high time of 5 cycles,
+// so the target needs a clock of 8 MHz or more. A 4 byte command takes
+// about 27 microseconds.
+// ----------------------------------------------------------------------
+static  void  spi_fast ( uchar* cmd, uchar* res )
+{
+  uchar i;
+  uchar c;
+  uchar r;
+  uchar mask;
+
+  for ( i = 0; i < 4; i++ )
+  {
+    c = *cmd++;
+    r = 0;
+    for ( mask = 0x80; mask; mask >>= 1 )
+    {
+      if  ( c & mask )
+      {
+        PORT |= MOSI_MASK;
+      }
+      PORT |= SCK_MASK;
+      r <<= 1;
+      if  ( PIN & MISO_MASK )
+      {
+        r++;
+      }
+      PORT &= ~MOSI_MASK;
+      PORT &= ~SCK_MASK;
+    }
+    *res++ = r;
+  }
+}
+#endif
+
 // ----------------------------------------------------------------------
 // Issue one SPI command.
 // ----------------------------------------------------------------------
@@ -374,6 +930,14 @@ static  void  spi ( uchar* cmd, uchar* res )
   uchar r;
   uchar mask;
 
+#if LW_FAST_ISP
+  if  ( sck_period <= 1 )
+  {
+    spi_fast( cmd, res );
+    return;
+  }
+#endif
+
   for ( i = 0; i < 4; i++ )
   {
     c = *cmd++;
@@ -421,6 +985,31 @@ static  void  spi_rw ( void )
   spi( cmd, res );
 }
 
+// ----------------------------------------------------------------------
+// USI driven SPI. mode 0, idle clock low, SPI_DELAY us per clock edge.
+// ----------------------------------------------------------------------
+static void usiSetup(void)
+{
+  DDRB |= MISO_MASK;
+  DDRB &= ~MOSI_MASK;
+  DDRB |= SCK_MASK;
+  PORTB &= ~SCK_MASK;
+  USICR = (1<<USIWM0)|(1<<USICS1)|(1<<USICLK);
+}
+
+static uchar usiTransfer(uchar value)
+{
+  uint16_t i;
+
+  USIDR = value;
+  USISR = (1<<USIOIF);
+  do {
+    USICR = (1<<USIWM0)|(1<<USICS1)|(1<<USICLK)|(1<<USITC);
+    for(i=0;i<SPI_DELAY;i++)  _delay_us(1);
+  } while ((USISR & (1<<USIOIF))==0);
+  return USIDR;
+}
+
 // ----------------------------------------------------------------------
 // Handle an spi IN packet.
 // ----------------------------------------------------------------------
@@ -428,6 +1017,76 @@ uchar usbFunctionRead(uchar *data, uchar len)
 {
   uchar i;
 
+#if LW_ADC_STREAM
+  if (adcReadLeft) { // ADC stream block, request 65
+    if (len > adcReadLeft) len = adcReadLeft;
+    for (i=0; i<len; i++) {
+      if (adcReadPos < sizeof(adcHeader)) {
+        data[i] = adcHeader[adcReadPos++];
+      } else {
+        data[i] = dwBuf[adcTail];
+        adcTail = (adcTail+1) & ADC_RING_MASK;
+      }
+    }
+    adcReadLeft -= len;
+    return len;
+  }
+#endif
+
+#if LW_DW_STREAM
+  if (dwStreamRead) { // debugWIRE stream chunk, request 75
+    if (len > dwStreamOut - dwStreamPos) len = dwStreamOut - dwStreamPos;
+    for (i=0; i<len; i++) data[i] = dwBuf[dwStreamPos++];
+    if (dwStreamOut && dwStreamPos == dwStreamOut) { // whole chunk handed over
+      dwStreamOut = 0;
+      dwStreamPos = 0;
+      if (dwStreamLeft) jobState = 28; // capture the next one
+      else dwState = 0;
+    }
+    return len;
+  }
+#endif
+
+#if LW_DEBUG_FIFO
+  if (debugReadLeft) { // debug console block, request 80
+    if (len > debugReadLeft) len = debugReadLeft;
+    for (i=0; i<len; i++) {
+      if (debugReadPos < sizeof(debugHeader)) {
+        data[i] = debugHeader[debugReadPos++];
+      } else {
+        data[i] = dwBuf[debugTail];
+        debugTail = (debugTail+1) & DEBUG_RING_MASK;
+      }
+    }
+    debugReadLeft -= len;
+    return len;
+  }
+#endif
+
+#if LW_CAPTURE
+  if (capRead) { // logic capture, request 78
+    if (len > capOut - capPos) len = capOut - capPos;
+    for (i=0; i<len; i++) data[i] = dwBuf[capPos++];
+    if (capOut && capPos == capOut) { // all read, release dwBuf
+      capOut   = 0;
+      capPos   = 0;
+      capFlags = 0;
+      dwState  = 0;
+    }
+    return len;
+  }
+#endif
+
+#if LW_SPI_STREAM
+  if (spiStreamLeft) { // SPI stream read, request 58
+    if (len > spiStreamLeft) len = spiStreamLeft;
+    for (i=0; i<len; i++) data[i] = usiTransfer(spiFill);
+    spiStreamLeft -= len;
+    if (!spiStreamLeft && (spiCS & 2)) PORT |= (1<<5);
+    return len;
+  }
+#endif
+
   for ( i = 0; i < len; i++ )
   {
     spi_rw();
@@ -437,7 +1096,7 @@ uchar usbFunctionRead(uchar *data, uchar len)
 }
 
 // ----------------------------------------------------------------------
-// Handle a dWIRE or spi OUT packet.
+// Handle a dWIRE, command batch or spi OUT packet.
 // ----------------------------------------------------------------------
 uchar usbFunctionWrite(uchar *data, uchar len)
 {
@@ -446,12 +1105,48 @@ uchar usbFunctionWrite(uchar *data, uchar len)
   uchar r;
   //uchar last = (len != 8);
 
-  if (dwState) { // Handle a debugWIRE OUT data packet
+#if LW_WS2812_FRAME
+  if (fxIn) { // Handle a ws2812 effect upload packet, request 70
+
+    if (len > fxIn) len = fxIn;
+    for (i=0; i<len; i++) fxParam[sizeof(fxParam)-fxIn+i] = data[i];
+    fxIn -= len;
+    if (fxIn) return 0;
+    jobState = 27;
+    return 1;
+
+  } else if (ws2812_in) { // Handle a ws2812 frame upload packet, request 69
+
+    if (len > ws2812_in) len = ws2812_in;
+    for (i=0; i<len; i++) ws2812_grb[ws2812_ptr++] = data[i];
+    ws2812_in -= len;
+    if (ws2812_in) return 0;
+    if (ws2812_flushAfter) {
+      jobState = 17;
+      DDRB |= ws2812_mask;
+    }
+    return 1;
+
+  } else
+#endif
+#if LW_SERVO_MUX
+  if (servoMuxIn) { // Handle a servo multiplexer packet, request 89
+
+    if (len > servoMuxIn) len = servoMuxIn;
+    for (i=0; i<len; i++) ((uint8_t*)servoMuxNext)[servoMuxPos++] = data[i];
+    servoMuxIn -= len;
+    if (servoMuxIn) return 0;
+    servoMuxPending = 1;
+    return 1;
+
+  } else
+#endif
+  if (dwState && !(dwState & 0x40)) { // Handle a debugWIRE OUT data packet
 
     uint8_t isLastBlock = dwIn + len >= dwLen;
     if (isLastBlock) {
       len = dwLen - dwIn;
-      jobState = 20;
+      jobState = dwJob;
     }
     for (i=0; i<len; i++) dwBuf[dwIn++] = data[i];
     return isLastBlock;
@@ -464,7 +1159,7 @@ uchar usbFunctionWrite(uchar *data, uchar len)
       spi_rw();
       cmd[0] ^= 0x60; // turn write into read
       //
-      for ( usec = 0; usec < timeout; usec += 32 * sck_period )
+      for ( usec = 0; usec < timeout; usec += sck_period > 1 ? 32 * sck_period : 24 )
       { // when timeout > 0, poll until byte is written
         spi( cmd, res );
         r = res[3];
@@ -544,749 +1239,3099 @@ void ws2812_sendarray_mask(uint8_t *data,uint16_t datlen,uint8_t maskhi)
   }
 }
 
+#if LW_WS2812_PARALLEL
+// Up to three strips at once on the pins of mask among PB0, PB1 and PB2. Each
+// byte position of the frame holds a byte of every strip, in pin order. The
+// bit times are those of ws2812_sendarray_mask: all pins go high, the pins
+// sending a 0 go low at 7 cycles and the others at 11. The pattern of the
+// next bit is put together from the top bits of the three bytes meanwhile.
+void ws2812_sendparallel(uint8_t *data,uint16_t datlen,uint8_t mask)
+{
+  uint8_t a,b,c,m0,m1,m2,lanes,ctr,pat,maskhi,masklo;
+  m0 = mask & 1;
+  m1 = mask & 2;
+  m2 = mask & 4;
+  lanes = (m0 != 0) + (m1 != 0) + (m2 != 0);
+  if (!lanes) return;
+  masklo = ~(m0|m1|m2) & ws2812_port;
+  maskhi = (m0|m1|m2) | ws2812_port;
+
+  for (; datlen >= lanes; datlen -= lanes) {
+    a = m0 ? *data++ : 0;
+    b = m1 ? *data++ : 0;
+    c = m2 ? *data++ : 0;
+
+    asm volatile(
+      "         ldi   %0,8     ;                       \n"
+      "         mov   %1,%9    ; pattern of bit 7      \n"
+      "         sbrc  %2,7     ;                       \n"
+      "         or    %1,%6    ;                       \n"
+      "         sbrc  %3,7     ;                       \n"
+      "         or    %1,%7    ;                       \n"
+      "         sbrc  %4,7     ;                       \n"
+      "         or    %1,%8    ;                       \n"
+      "loop%=:  out   %5,%10   ; 1                     \n"
+      "         lsl   %2       ; 2                     \n"
+      "         lsl   %3       ; 3                     \n"
+      "         lsl   %4       ; 4                     \n"
+      "         rjmp  .+0      ; 6                     \n"
+      "         out   %5,%1    ; 7   zeros low         \n"
+      "         mov   %1,%9    ; 8                     \n"
+      "         sbrc  %2,7     ; 9   / skip 10         \n"
+      "         or    %1,%6    ; 10                    \n"
+      "         out   %5,%9    ; 11  ones low          \n"
+      "         sbrc  %3,7     ; 12  / skip 13         \n"
+      "         or    %1,%7    ; 13                    \n"
+      "         sbrc  %4,7     ; 14  / skip 15         \n"
+      "         or    %1,%8    ; 15                    \n"
+      "         dec   %0       ; 16                    \n"
+      "         rjmp  .+0      ; 18                    \n"
+      "         brne  loop%=   ; 20                    \n"
+
+      :  "=&d" (ctr), "=&r" (pat), "+r" (a), "+r" (b), "+r" (c)
+      :  "I" (_SFR_IO_ADDR(ws2812_port)), "r" (m0), "r" (m1), "r" (m2), "r" (masklo), "r" (maskhi)
+    );
+  }
+}
+#endif
+
 
 /* ------------------------------------------------------------------------- */
-/* ------------------------ interface to USB driver ------------------------ */
+/* ------------------------------- ADC stream ------------------------------ */
 /* ------------------------------------------------------------------------- */
 
+// Both interrupts re-enable interrupts straight away so they never delay
+// the USB interrupt. The Timer1 compare match that starts each conversion
+// of a timed stream is shared with the logic capture, see below.
 
-// ----------------------------------------------------------------------
-// Handle a non-standard SETUP packet.
-// ----------------------------------------------------------------------
-
-uchar usbFunctionSetup(uchar data[8])
+#if LW_ADC_STREAM
+// Conversion complete: queue the sample, or count it as dropped
+ISR(ADC_vect, ISR_NOBLOCK)
 {
-// ----------------------------------------------------------------------
-//
-// Nominal packet format:
-//
-//   data[0] - Request type
-//   data[1] - Request id
-//   data[2] - lo8(Value)
-//   data[3] - hi8(Value)
-//   data[4] - lo8(Index)
-//   data[5] - hi8(Index)
-//   data[6] - lo8(Length)
-//   data[7] - hi8(Length)
-//
-// usbFunctionSetup is called when request type is not USBRQ_TYPE_STANDARD.
-//
-// 'Value' and 'Index' are names assigned by the USB standard for some
-// request types, but we are free to use them as 4 arbitrary data bytes.
-//
-// ----------------------------------------------------------------------
-  uint8_t i;
-  uchar bit;
-  uchar mask;
-  uchar req;
+  uint8_t lo, hi, head;
+
+  lo = ADCL;                   // ADCL must be read first
+  hi = ADCH;
+  head = adcHead;
+  if (adcStream & 2) {
+    if (((head - adcTail) & ADC_RING_MASK) == ADC_RING_MASK) {
+      if (adcDropped < 255) adcDropped++;
+      return;
+    }
+    dwBuf[head] = hi;          // left adjusted, the top 8 bits
+  } else {
+    if (((head - adcTail) & ADC_RING_MASK) >= ADC_RING_MASK-1) {
+      if (adcDropped < 255) adcDropped++;
+      return;
+    }
+    dwBuf[head] = lo;
+    head = (head+1) & ADC_RING_MASK;
+    dwBuf[head] = hi;
+  }
+  adcHead = (head+1) & ADC_RING_MASK;
+}
+#endif
 
-  // Generic requests
-  req = data[1];
-  if  ( req == USBTINY_ECHO )
-  {
-    data[1]=0x21;
-    usbMsgPtr = data;
-    return 8;
+#if LW_ADC_STREAM || LW_ADC_SCAN
+// Select channel 0 RESET pin, 1 SCK pin, anything else the temperature sensor
+static void adcSelect(uint8_t channel)
+{
+  if (channel == 0) {
+    ADMUX = adcSetting | 0;
+    sbi(DIDR0,ADC0D);          // disable the digital input buffer
+  } else if (channel == 1) {
+    ADMUX = adcSetting | 1;
+    sbi(DIDR0,ADC1D);
+  } else {
+    ADMUX = 0b10001111;        // ADC4 against the 1.1 V reference
   }
+}
+#endif
 
-  if  ( req == USBTINY_READ )
-  {
-    data[0] = PIN;
-    usbMsgPtr = data;
-    return 1;
+#if LW_ADC_SCAN
+// Start on the next channel of an oversampling scan from channel on, or
+// end the scan when there is none
+static void adcScanNext(uint8_t channel)
+{
+  while (channel < ADC_SCAN_CHANNELS && !(adcScanMask & (1<<channel))) channel++;
+  if (channel >= ADC_SCAN_CHANNELS) {
+    DIDR0 = 0x00;
+    adcScan.running = 0;
+    return;
   }
+  adcScanChannel = channel;
+  adcScanLeft = ((uint16_t)1 << (2*adcScanShift)) + 1;
+  adcScanSum = 0;
+  adcScan.running = 1;
+  DIDR0 = 0x00;
+  adcSelect(channel);
+  sbi(ADCSRA,ADSC);
+}
 
-  if  ( req == USBTINY_WRITE )
-  {
-    PORT = data[2];
-    return 0;
+// Collect a conversion of an oversampling scan, request 87, and start the
+// next. Called from the main loop, so USB is served between conversions.
+// The first conversion on a channel is thrown away, it may still settle
+// from the change of channel and reference.
+static void adcScanPoll(void)
+{
+  uint16_t value;
+
+  if (!adcScan.running) return;
+  if (checkBit(ADCSRA,ADSC)) return; // conversion running
+  value = ADCL;                // ADCL must be read first
+  value |= ADCH << 8;
+  if (--adcScanLeft < ((uint16_t)1 << (2*adcScanShift))) adcScanSum += value;
+  if (adcScanLeft) {
+    sbi(ADCSRA,ADSC);
+    return;
   }
+  adcScan.result[adcScanCount++] = adcScanSum >> adcScanShift;
+  adcScanNext(adcScanChannel+1);
+}
+#else
+#define adcScanPoll()
+#endif
 
-  bit = data[2] & 7;
-  mask = 1 << bit;
-  if  ( req == USBTINY_CLR )
-  {
-    PORT &= ~ mask;
-    return 0;
+#if LW_ADC_STREAM
+// Stop the stream and give dwBuf back
+static void adcStreamStop(void)
+{
+  if (!adcStream) return;
+  if (TIMSK & (1<<OCIE1A)) {
+    TIMSK &= ~(1<<OCIE1A);
+    TCCR1 = 0;
   }
+  ADCSRA &= ~((1<<ADATE)|(1<<ADIE));
+  cbi(ADMUX,ADLAR);
+  DIDR0 = 0x00;
+  dwState = 0;
+  adcStream = 0;
+}
+#else
+#define adcStreamStop()
+#define adcStream 0
+#endif
 
-  if  ( req == USBTINY_SET )
-  {
-    PORT |= mask;
-    return 0;
+/* ------------------------------------------------------------------------- */
+/* -------------------------------- Soft PWM ------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if LW_SOFT_PWM_TIMER
+// Three channels on pins 0, 1 and 2, 8 bit resolution. Timer0 in CTC mode
+// at CK/8 with a top of 79 ticks the counter at 25.8 kHz, for a PWM
+// frequency of about 100 Hz regardless of what the main loop is doing.
+// New compare values are taken at the start of a period, so a duty cycle
+// change never produces a partial period.
+
+ISR(TIMER0_COMPA_vect, ISR_NOBLOCK)
+{
+  uint8_t c = ++counter;
+
+  if (!c && (softPWM & 4)) {
+    cmp0 = compare0;
+    cmp1 = compare1;
+    cmp2 = compare2;
+    softPWM &= ~4;
   }
+  if (c < cmp0 || cmp0 == 255) sbi(PORTB,0); else cbi(PORTB,0);
+  if (c < cmp1 || cmp1 == 255) sbi(PORTB,1); else cbi(PORTB,1);
+  if (c < cmp2 || cmp2 == 255) sbi(PORTB,2); else cbi(PORTB,2);
+}
 
-  // Programming requests
-  if  ( req == USBTINY_POWERUP )
+// Brightness to compare value, squared when gamma correction is on
+static uchar softPWMValue(uchar value)
+{
+  if (softPWM & 2) value = ((uint16_t)value * value + 255) >> 8;
+  return value;
+}
+
+static void softPWMStart(uchar gamma)
+{
+  pinMode(B,0,OUTPUT);
+  pinMode(B,1,OUTPUT);
+  pinMode(B,2,OUTPUT);
+  softPWM = 1 | (gamma ? 2 : 0);
+  TCCR0A = (1<<WGM01);         // CTC
+  TCCR0B = (1<<CS01);          // CK/8
+  OCR0A = 79;
+  TCNT0 = 0;
+  TIMSK |= (1<<OCIE0A);
+}
+
+static void softPWMStop(void)
+{
+  if (!softPWM) return;
+  TIMSK &= ~(1<<OCIE0A);
+  TCCR0A = 0;
+  TCCR0B = 0;
+  softPWM = 0;
+  cbi(PORTB,0);
+  cbi(PORTB,1);
+  cbi(PORTB,2);
+}
+#define softPWMPoll()
+#else
+// Without the timer the main loop steps the counter, as the original
+// firmware did, so the period depends on the USB traffic and there is no
+// gamma curve.
+static void softPWMStart(uchar gamma)
+{
+  pinMode(B,0,OUTPUT);
+  pinMode(B,1,OUTPUT);
+  pinMode(B,2,OUTPUT);
+  softPWM = 1;
+}
+#define softPWMStop()       (softPWM = 0)
+#define softPWMValue(value) (value)
+
+static void softPWMPoll(void)
+{
+  if(softPWM & 1)
   {
-    sck_period = data[2];
-    mask = POWER_MASK;
-    if  ( data[4] )
+    if(counter==0)
     {
-      mask |= RESET_MASK;
+      cmp0=compare0;
+      cmp1=compare1;
+      cmp2=compare2;
     }
-    DDR  &= ~MISO_MASK;
-    DDR  |= (RESET_MASK|SCK_MASK|MOSI_MASK);
-    PORT &= ~(RESET_MASK|SCK_MASK|MOSI_MASK|MISO_MASK);
-    return 0;
+    else
+    {
+      if(counter>cmp0)
+        digitalWrite(B,0,LOW);
+      else
+        digitalWrite(B,0,HIGH);
+      if(counter>cmp1)
+        digitalWrite(B,1,LOW);
+      else
+        digitalWrite(B,1,HIGH);
+      if(counter>cmp2)
+        digitalWrite(B,2,LOW);
+      else
+        digitalWrite(B,2,HIGH);
+    }
+    counter++;
   }
+}
+#endif
 
-  if  ( req == USBTINY_POWERDOWN )
-  {
-    /* set all the pins to Hi-Z */
-    pinMode(B,0,INPUT);
-    internalPullup(B,0,DISABLE);
-    pinMode(B,1,INPUT);
-    internalPullup(B,1,DISABLE);
-    pinMode(B,2,INPUT);
-    internalPullup(B,2,DISABLE);
-    pinMode(B,5,INPUT);
-    internalPullup(B,5,DISABLE);
-    return 0;
-  }
+#if LW_FAST_PWM
+// Timer1 PWM clocked by the PLL, 4*F_CPU = 66 MHz, on OC1A (PB1) and its
+// inverse on PB0. OC1B is on the USB pins and stays off. PCKE marks it on.
+static void fastPWMStop(void)
+{
+  if (!(PLLCSR & (1<<PCKE))) return;
+  TCCR1 = 0;
+  PLLCSR &= ~(1<<PCKE);        // back to the system clock for the other Timer1 users
+  DT1A = 0;
+  DTPS1 = 0;
+  cbi(PORTB,0);
+  cbi(PORTB,1);
+}
+#else
+#define fastPWMStop()
+#endif
 
-  if  ( req == USBTINY_SPI )
-  {
-    spi( data + 2, data + 0 );
-    usbMsgPtr = data;
-    return 4;
-  }
+/* ------------------------------------------------------------------------- */
+/* --------------------------- Pin change events --------------------------- */
+/* ------------------------------------------------------------------------- */
 
-  if  ( req == USBTINY_POLL_BYTES )
-  {
-    poll1 = data[2];
-    poll2 = data[3];
-    return 0;
-  }
+// Timer1 runs at F_CPU/128, about 7.76us per tick, for the event timestamps.
+// The same count, extended to 32 bits, is the device clock of request 83,
+// which keeps it running without pin events so that results can be stamped.
+// An edge count runs it at F_CPU/64 and times its gate by the overflows.
+#if LW_TIMER1_OVF
+ISR(TIMER1_OVF_vect, ISR_NOBLOCK)
+{
+  uint16_t hi = pinEventTimeHi + 1;
 
-  address = * (unsigned*) & data[4];
-  if  ( req == USBTINY_FLASH_READ )
-  {
-    cmd0 = 0x20;
-    return 0xff;  // usb_in() will be called to get the data
-  }
+  cli();                       // the pin change hook reads both bytes
+  pinEventTimeHi = hi;
+  sei();
+  if (!hi) clockTop++;
+}
+#endif
 
-  if  ( req == USBTINY_EEPROM_READ )
-  {
-    cmd0 = 0xa0;
-    return 0xff;  // usb_in() will be called to get the data
-  }
+#if LW_PIN_EVENTS || LW_CLOCK
+static void clockTimerStart(void)
+{
+  pinEventTimeHi = 0;
+  clockTop = 0;
+  TCNT1 = 0;
+  TCCR1 = (1<<CS13);           // CK/128
+  TIMSK |= (1<<TOIE1);
+}
 
-  timeout = * (unsigned*) & data[2];
-  if  ( req == USBTINY_FLASH_WRITE )
-  {
-    cmd0 = 0x40;
-    return 0xff;  // data will be received by usb_out()
-  }
+static void clockTimerStop(void)
+{
+  TIMSK &= ~(1<<TOIE1);
+  TCCR1 = 0;
+}
 
-  if  ( req == USBTINY_EEPROM_WRITE )
-  {
-    cmd0 = 0xc0;
-    return 0xff;  // data will be received by usb_out()
-  }
+// Reads the clock into t[0..3], low byte first
+static void clockRead(uchar* t)
+{
+  uchar lo, top;
+  uint16_t hi;
 
-  // - ihsan Kehribar -
-  if( req == USBTINY_PIN_SET_INPUT ) // 13
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    DDR &= ~(1<<bit);
-    return 0;
+    lo = TCNT1;
+    hi = pinEventTimeHi;
+    top = clockTop;
+    if ((TIFR & (1<<TOV1)) && !(lo & 0x80)) { // overflow not counted yet
+      if (!++hi) top++;
+    }
   }
+  t[0] = lo;
+  t[1] = hi;
+  t[2] = hi >> 8;
+  t[3] = top;
+}
+#endif
 
-  if( req == USBTINY_PIN_SET_OUTPUT ) // 14
-  {
-    DDR |= (1<<bit);
-    return 0;
+#if LW_CLOCK
+static uchar clockStart(void)
+{
+  if (!clockOn && !pinEventMask) {
+    if (TCCR1) return 0;       // Timer1 is taken
+    clockTimerStart();
   }
+  clockOn = 1;
+  return 1;
+}
 
-  if( req == USBTINY_READ_ADC ) // 15
-  {
-    // unsigned char temp=DDR;
+static void clockStop(void)
+{
+  if (!clockOn) return;
+  clockOn = 0;
+  if (!pinEventMask) clockTimerStop();
+}
+#endif
 
-    if(data[2]==0) // Read ADC from RESET pin
-    {
-      ADMUX = adcSetting | 0; // Set the desired channel
-      sbi(DIDR0,ADC0D); // Disable digital buffer ...
-      // DDR &= ~(1<<5);
-    }
-    else if(data[2]==1) // Read ADC from SCK pin
-    {
-      ADMUX = adcSetting | 1; // Set the desired channel
-      sbi(DIDR0,ADC1D); // Disable digital buffer ...
-      // DDR &= ~(1<<2);
-    }
-    else if(data[2]==2) // Read ADC from internal Temperature sensor
-    {
-      ADMUX=0b10001111;
-    }
-    sbi(ADCSRA,ADSC); // Start conversion
-    while(checkBit(ADCSRA,ADSC)); // Wait for conversion
-    data[0]=(unsigned char)ADCL;
-    data[1]=(unsigned char)ADCH;
-    usbMsgPtr = data;
-    // DDR=temp;
-    DIDR0=0x00;
-    return 2;
-  }
+#if LW_PIN_EVENTS
+static void pinEventsStart(uchar mask)
+{
+#if LW_DW_BREAK
+  dwBreakWatch = 0;            // pin events replace the debugWIRE capture
+#endif
+  pinEventMask = mask;
+  pinEventPins = PINB & mask;
+  pinEventCount = 0;
+  pinEventLost = 0;
+  if (!clockOn) clockTimerStart();
+  pinEventLatch = 0x40;
+  PCMSK |= mask;
+}
 
-  if( req == USBTINY_SETUP_PWM ) // 16
-  {
-    DDR |= (1<<0); // Set PORTB0 Output
-    DDR |= (1<<1); // Set PORTB1 Output
-    TCCR0A |= (1<<COM0A1)|(0<<COM0A0)|(1<<COM0B1)|(0<<COM0B0); // Clear OC0A/OC0B on Compare Match, set OC0A/OC0B at BOTTOM (non-inverting mode)
-    TCCR0A |= (1<<WGM01)|(1<<WGM00); // Fast PWM mode
-    TCCR0B |= (1<<CS02)|(0<<CS01)|(1<<CS00); // Timer prescale: 1024 => PWM signal update frequency: ( 16.500.000 / ( 255 * 1024) ) = ~ 63 Hertz
-    return 0;
-  }
+static void pinEventsStop(void)
+{
+  if (!pinEventMask) return;
+  PCMSK &= ~pinEventMask;
+  pinEventLatch = 0;
+  pinEventMask = 0;
+  if (!clockOn) clockTimerStop();
+}
 
-  if( req == USBTINY_UPDATE_PWM_COMPARE ) // 17
-  {
-    OCR0A=data[2];
-    OCR0B=data[4];
-    return 0;
+// Queues pins if they changed, stamped with t[0..2], or with the clock if t is 0
+static void pinEventPush(uchar pins, uchar* t)
+{
+  uchar now[4];
+
+  pins &= pinEventMask;
+  if (pins == pinEventPins) return;
+  pinEventPins = pins;
+  if (pinEventCount >= PIN_EVENT_QUEUE) {
+    pinEventLost = 0x40;
+    return;
   }
-
-  if( req == USBTINY_PIN_SET_HIGH ) // 18
-  {
-    PORT |= (1<<bit);
-    return 0;
+  if (!t) {
+    clockRead(now);
+    t = now;
   }
+  pinEventQueue[pinEventCount][0] = 0x80 | pinEventLost | pins;
+  pinEventQueue[pinEventCount][1] = t[0];
+  pinEventQueue[pinEventCount][2] = t[1];
+  pinEventQueue[pinEventCount][3] = t[2];
+  pinEventCount++;
+  pinEventLost = 0;
+}
 
-  if( req == USBTINY_PIN_SET_LOW ) // 19
-  {
-    PORT &= ~(1<<bit);
-    return 0;
-  }
+// Called from the main loop: queue pin changes and send them, two per report
+static void pinEventPoll(void)
+{
+  uchar latch, i;
+  uchar report[8];
+  uchar t[4];
+  uint16_t hi;
 
-  if( req == USBTINY_PIN_READ ) // 20
-  {
-    data[0]=(PIN&(1<<bit))>>bit;
-    usbMsgPtr = data;
-    return 1;
-  }
+  if (!pinEventMask) return;
 
-  //-----------------------------------------------//
-  if( req == USBTINY_CHANGE_PWM_PRESCALE ) // 22
-  {
-    if(data[2]==0) // ~ 64kHz update frequency
-    {
-       cbi(TCCR0B,CS02);
-       cbi(TCCR0B,CS01);
-       sbi(TCCR0B,CS00);
-    }
-    else if(data[2]==1) // ~ 8kHz Hertz update frequency
-    {
-       cbi(TCCR0B,CS02);
-       sbi(TCCR0B,CS01);
-       cbi(TCCR0B,CS00);
-    }
-    else if(data[2]==2) // ~ 1 kHz update frequency
-    {
-       cbi(TCCR0B,CS02);
-       sbi(TCCR0B,CS01);
-       sbi(TCCR0B,CS00);
-    }
-    else if(data[2]==3) // ~ 252 Hertz update frequency
-    {
-       sbi(TCCR0B,CS02);
-       cbi(TCCR0B,CS01);
-       cbi(TCCR0B,CS00);
-    }
-    else if(data[2]==4) // ~ 63 Hertz update frequency -> Suitable for Servo driving. -> Default
-    {
-       sbi(TCCR0B,CS02);
-       cbi(TCCR0B,CS01);
-       sbi(TCCR0B,CS00);
+  cli();
+  latch = pinEventLatch;
+  for (i=0; i<4; i++) t[i] = pinEventStamp[i];
+  pinEventLatch = 0x40;
+  sei();
+  if (latch & 0x80) {          // stamp the latched edge with the time it was sampled
+    hi = t[1] | (t[2] << 8);
+    if ((t[3] & (1<<TOV1)) && !(t[0] & 0x80)) hi++; // overflow not counted yet, as in clockRead
+    t[1] = hi;
+    t[2] = hi >> 8;
+    pinEventPush(latch, t);
+  }
+  pinEventPush(PINB, 0);
+
+  if (pinEventCount && usbInterruptIsReady()) {
+    for (i=0; i<8; i++) report[i] = i < pinEventCount*4 ? ((uchar*)pinEventQueue)[i] : 0;
+    i = pinEventCount > 2 ? 2 : pinEventCount;
+    pinEventCount -= i;
+    if (pinEventCount) {
+      for (i=0; i<pinEventCount*4; i++) ((uchar*)pinEventQueue)[i] = ((uchar*)pinEventQueue)[i+8];
     }
-    return 0;
+    usbSetInterrupt(report, 8);
   }
+}
+#else
+#define pinEventsStop()
+#define pinEventPoll()
+#endif
 
-  if( req == USBTINY_SPI_UPDATE_DELAY ) // 31
-  {
-    SPI_DELAY = (data[3]<<8) + data[2] ;
-    return 0;
-  }
+#if LW_DW_BREAK
+// Called from the main loop: once the debugWIRE capture armed by a wait
+// (dwState 0x08) has seen the target break, send a one byte report 0x20
+// so the host need not poll request 60. The capture clears PCMSK bit 5.
+static void dwBreakPoll(void)
+{
+  uchar report = 0x20;
 
-  if( req == USBTINY_STOP_PWM ) // 32
-  {
-    TCCR0A = 0;
-    TCCR0B = 0;
-    return 0;
-  }
+  if (!dwBreakWatch || dwState || (PCMSK & (1<<5)) || !usbInterruptIsReady()) return;
+  dwBreakWatch = 0;
+  usbSetInterrupt(&report, 1);
+}
+#else
+#define dwBreakPoll()
+#endif
 
-  if( req == USBTINY_DEBUG_SPI ) // 33
-  {
-    rxBuffer[0] = data[2]; // Data to send
-    jobState = 1;
-    return 0;
-  }
+/* ------------------------------------------------------------------------- */
+/* ---------------------------- Timing counters ---------------------------- */
+/* ------------------------------------------------------------------------- */
 
-  if( req == 34 ) // This has to be hardcoded to 34!
-  {
-    data[0]=LITTLE_WIRE_VERSION;
-    usbMsgPtr = data;
-    return 1;
-  }
+// The requests and jobs are timed on the device clock, 128 cycles a tick,
+// to show which of them overrun the 1 ms USB frame. The main loop times
+// each usbPoll that handled a request and each runJob pass that ran a
+// job, and the TIMING_SLOTS slowest of them are kept with their longest
+// time and how often they ran since. The debugWIRE transfers and WS2812
+// writes, which run with interrupts off, add their windows to offMax and
+// offTotal. V-USB cannot count SOF packets with its interrupt on D+, so
+// missedSof estimates them as one per frame of interrupts-off time.
+// Nothing is counted while another function has Timer1. A window longer
+// than two Timer1 overflows, about 4 ms, reads short.
+#if LW_TIMING
+static uint16_t timingNow(void)
+{
+  uchar lo, hi;
 
-  if ( req == 35 ) /* init ADC */
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    sbi(ADCSRA,ADEN); // Enable the ADC peripheral
-    ADCSRA |= data[2]; // Least significant three bits are prescale settings
-    switch(data[3])
-    {
-      case 0: // Use VCC as Vref.
-        adcSetting = 0;
-        break;
-      case 1: // 1.1V
-        sbi(adcSetting,REFS1);
-        break;
-      case 2: // 2.56V
-        sbi(adcSetting,REFS1);
-        sbi(adcSetting,REFS2);
-        break;
-    }
-    return 0;
+    lo = TCNT1;
+    hi = pinEventTimeHi;
+    if ((TIFR & (1<<TOV1)) && !(lo & 0x80)) hi++; // overflow not counted yet
   }
+  return (hi << 8) | lo;
+}
 
-  if (req == 40) /* read the results */
-  {
-    usbMsgPtr = (uchar*)sendBuffer;
-    return sendBuffer[8];
-  }
+static uchar timingRunning(void)
+{
+  if (!(timing.flags & TIMING_ON)) return 0;
+  if (TCCR1 == (1<<CS13)) return 1; // the device clock
+  timing.flags |= TIMING_TIMER_TAKEN;
+  return 0;
+}
 
-  if (req == 41) /* onewire reset pulse */
-  {
-    jobState = 2;
-    return 0;
-  }
+static uchar timingStart(void)
+{
+  uchar i;
 
-  if ( req == 42) /* onewire send byte */
-  {
-    jobState = 3;
-    rxBuffer[0]=data[2];
-    return 0;
+  timingClock = !clockOn;
+  if (!clockStart()) return 0;
+  timing.flags = TIMING_ON;
+  timing.slots = TIMING_SLOTS;
+  timing.offMax = 0;
+  timing.offTotal = 0;
+  timing.missedSof = 0;
+  timing.loopMax = 0;
+  for (i=0; i<TIMING_SLOTS; i++) {
+    timing.slow[i].count = 0;
+    timing.slow[i].max = 0;
   }
+  timingSofPart = 0;
+  timingReq = 0xFF;
+  timingLoopStart = timingNow();
+  return 1;
+}
 
-  if (req == 43) /* onewire read byte */
-  {
-    jobState = 4;
-    return 0;
-  }
+static void timingStop(void)
+{
+  if (!(timing.flags & TIMING_ON)) return;
+  timing.flags = 0;
+  if (timingClock) clockStop();
+}
 
-  if (req == 44) /* i2c init */
-  {
-    jobState=8;
-    return 0;
+// Keeps the time since start against a request (job 0) or a job
+static void timingRecord(uchar job, uchar id, uint16_t start)
+{
+  uint16_t ticks;
+  uchar i, slot = 0;
+
+  if (!timingRunning()) return;
+  ticks = timingNow() - start;
+  for (i=0; i<TIMING_SLOTS; i++) {
+    if (timing.slow[i].count && timing.slow[i].job == job && timing.slow[i].id == id) {slot = i; break;}
+    if (timing.slow[i].max < timing.slow[slot].max) slot = i;
   }
-
-  if (req == 45) /* i2c begin */
-  {
-    jobState=9;
-    rxBuffer[0]=data[2]; // -- address
-    return 0;
+  if (i == TIMING_SLOTS) {       // not kept yet: replaces the fastest if slower
+    if (ticks <= timing.slow[slot].max) return;
+    timing.slow[slot].job = job;
+    timing.slow[slot].id = id;
+    timing.slow[slot].count = 0;
+    timing.slow[slot].max = 0;
   }
+  if (timing.slow[slot].count != 255) timing.slow[slot].count++;
+  if (ticks > timing.slow[slot].max) timing.slow[slot].max = ticks;
+}
 
-  if (req == 46) /* i2c read */
-  {
-    jobState=11;
-    rxBuffer[0]=data[2]; // -- should we end with Nack ?
-    rxBuffer[1]=data[3]; // -- length
-    rxBuffer[2]=data[4]; // -- should we issue a Stop ?
-    return 0;
-  }
+// Called at the start of every main loop pass
+static void timingLoop(void)
+{
+  uint16_t now, ticks;
 
-  if (req == 47) /* init softPWM */
-  {
-    if(data[2]==1)
-    {
-      pinMode(B,0,OUTPUT);
-      pinMode(B,1,OUTPUT);
-      pinMode(B,2,OUTPUT);
-      softPWM=1;
-    }
-    else
-      softPWM=0;
-    return 0;
-  }
+  if (!timingRunning()) return;
+  now = timingNow();
+  ticks = now - timingLoopStart;
+  if (ticks > timing.loopMax) timing.loopMax = ticks;
+  timingLoopStart = now;
+}
 
-  if( req == 48) /* update softPWM */
-  {
-    compare0=data[2];
-    compare1=data[3];
-    compare2=data[4];
-    return 0;
-  }
+// Called before interrupts go off, and once or more after they are back on
+static void timingIrqOff(void)
+{
+  if (!timingRunning()) return;
+  timingOffStart = timingNow();
+  timing.flags |= TIMING_IRQ_OFF;
+}
 
-  if( req == 49) /* i2c update delay */
-  {
-    I2C_DELAY = data[2];
-    return 0;
+static void timingIrqOn(void)
+{
+  uint16_t ticks;
+
+  if (!(timing.flags & TIMING_IRQ_OFF)) return;
+  timing.flags &= ~TIMING_IRQ_OFF;
+  if (!timingRunning()) return;
+  ticks = timingNow() - timingOffStart;
+  if (ticks > timing.offMax) timing.offMax = ticks;
+  timing.offTotal += ticks;
+  while (ticks >= TIMING_FRAME_TICKS - timingSofPart) {
+    ticks -= TIMING_FRAME_TICKS - timingSofPart;
+    timingSofPart = 0;
+    timing.missedSof++;
   }
+  timingSofPart += ticks;
+}
+#else
+#define timingLoop()
+#define timingIrqOff()
+#define timingIrqOn()
+#endif
 
-  if( req == 50 ) /* onewire read bit */
-  {
-    jobState=5;
-    return 0;
-  }
+/* ------------------------------------------------------------------------- */
+/* --------------------------- Pattern sequencer --------------------------- */
+/* ------------------------------------------------------------------------- */
 
-  if( req == 51 ) /* onewire write bit */
-  {
-    rxBuffer[0]=data[2];
-    jobState=6;
-    return 0;
+// dwBuf[0]: pin mask, dwBuf[1]: Timer1 clock select, dwBuf[2]: loops,
+// dwBuf[3..]: entries of port value and 16 bit wait in Timer1 ticks.
+//
+// Timer1 free runs and OCR1B is advanced by each wait, so the timing does
+// not depend on interrupt latency. Waits longer than 256 ticks take several
+// compare matches. Every wait is at least seqMin ticks so the interrupt,
+// which lets the USB interrupt in, is never re-entered.
+
+#if LW_SEQUENCER
+static void seqStop(void)
+{
+  if (!seqPos) return;
+  TIMSK &= ~(1<<OCIE1B);
+  TCCR1 = 0;
+  seqPos = 0;
+#if LW_SERVO
+  servoOn = 0;
+#endif
+  dwState = 0;
+}
+
+static void seqStep(void)
+{
+  uchar pos;
+
+  if (!seqWait) {
+    pos = seqPos;
+    PORT = (PORT & ~dwBuf[0]) | (dwBuf[pos] & dwBuf[0]);
+    seqWait = dwBuf[pos+1] | (dwBuf[pos+2] << 8);
+    if (seqWait < seqMin) seqWait = seqMin;
+    pos += 3;
+    if (pos + 3 > dwLen) {   // end of the pattern
+      pos = 3;
+      seqFrames++;
+      if (seqLoops && !--seqLoops) {
+        seqStop();
+        return;
+      }
+    }
+    seqPos = pos;
   }
+  if (seqWait >= 256) {
+    seqWait -= 256;            // the next match is a full timer cycle away
+  } else {
+    OCR1B += seqWait;
+    seqWait = 0;
+  }
+}
 
-#if 0
-  // --- experimental --
-  if( req == 52 ) /* pic24f programming? */
-  {
-    jobState=data[2];
-    rxBuffer[0]=data[3];
-    rxBuffer[1]=data[4];
-    rxBuffer[2]=data[5];
-    return 0;
+ISR(TIMER1_COMPB_vect, ISR_NOBLOCK)
+{
+  seqStep();
+}
+
+// Job 26: start the pattern received by request 68
+static void seqStart(void)
+{
+  uchar cs = dwBuf[1] & 0x0F;
+
+  if (!cs || dwLen < 6 || TCCR1) { // no clock, no entry, or Timer1 is taken
+    dwState = 0;
+    return;
   }
-  if( req == 53 ) /* pic24f sendsix? */
+  dwState = 0x40;              // keep dwBuf while playing
+  dwBuf[0] &= 0x27;
+  DDR |= dwBuf[0];
+  seqLoops = dwBuf[2];
+  seqMin = (cs > 8) ? 1 : 256 >> (cs-1);
+  seqWait = 0;
+  seqPos = 3;
+  TCNT1 = 0;
+  OCR1B = 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    rxBuffer[0]=data[2]; // NOP count
-    rxBuffer[1]=data[3];
-    rxBuffer[2]=data[4];
-    rxBuffer[3]=data[5];
-    jobState=16;
-    return 0;
+    seqStep();                 // first entry straight away
+    if (seqPos) {
+      TIFR = (1<<OCF1B);
+      TIMSK |= (1<<OCIE1B);
+      TCCR1 = cs;
+    }
   }
+}
+#else
+#define seqStop()
 #endif
 
-// WS2812 Support - T. Bscke May 26th, 2013
-  if( req == 54 ) /* WS2812_write */
-  {
-    if ((data[2]&0x20)&&(ws2812_ptr<ws2812_maxleds*3))  // bit 5 set = add to buffer
-    {
-      ws2812_grb[ws2812_ptr++]=data[3];
-      ws2812_grb[ws2812_ptr++]=data[4];
-      ws2812_grb[ws2812_ptr++]=data[5];
-    }
+/* ------------------------------------------------------------------------- */
+/* ----------------------------- Servo motion ------------------------------ */
+/* ------------------------------------------------------------------------- */
 
-    if ((data[2]&0x10)&&(ws2812_ptr>0))  // bit 4 set = send buffer to ws2812
-    {
-      jobState=17;
-      DDRB|=mask;
-      ws2812_mask=mask;
-    }
-    return 0;
-  }
+// The servos on PB0 and PB1 are driven by a pattern of three entries played
+// by the sequencer at CK/16, where a tick is 32/33 us: the pulse on PB0, the
+// pulse on PB1, then both low for the rest of the 20 ms frame. Once per frame
+// servoPoll moves the pulse widths along their motion profile. It runs while
+// the last entry plays, so the next frame gets both new pulses and the rest
+// of the frame that goes with them.
 
-// end ws2812 support
+#if LW_SERVO
+#define SERVO_FRAME_TICKS 20625  // 20 ms
+#define SERVO_MIN_US 400
+#define SERVO_MAX_US 2600
 
-  /* Change serial number ... */
-  if( req == 55)
-  {
-    eeprom_write_byte((EE_addr+0),data[2]);
-    eeprom_write_byte((EE_addr+1),data[3]);
-    eeprom_write_byte((EE_addr+2),data[4]);
+static void servoWidth(uchar ch, uint16_t us)
+{
+  uint16_t ticks;
 
-    // data[0] = eeprom_read_byte(EE_addr+0);
-    // data[1] = eeprom_read_byte(EE_addr+1);
-    // data[2] = eeprom_read_byte(EE_addr+2);
-    // usbMsgPtr = data;
-    // return 3;
+  if (us < SERVO_MIN_US) us = SERVO_MIN_US;
+  if (us > SERVO_MAX_US) us = SERVO_MAX_US;
+  servoNow[ch] = us;
+  ticks = us + (us >> 5);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    dwBuf[4+3*ch] = ticks;
+    dwBuf[5+3*ch] = ticks >> 8;
+    ticks = SERVO_FRAME_TICKS - (dwBuf[4] | (dwBuf[5] << 8)) - (dwBuf[7] | (dwBuf[8] << 8));
+    dwBuf[10] = ticks;
+    dwBuf[11] = ticks >> 8;
+  }
+}
 
-    return 0;
+static uchar servoStart(void)
+{
+  uchar ch;
+
+  if (dwState || TCCR1) return 0; // dwBuf or Timer1 is taken
+  softPWMStop();
+  TCCR0A &= ~((1<<COM0A1)|(1<<COM0A0)|(1<<COM0B1)|(1<<COM0B0)); // release PB0/PB1 from hardware PWM
+  dwBuf[0] = 0x03;             // PB0 and PB1
+  dwBuf[1] = 5;                // CK/16
+  dwBuf[2] = 0;                // loop forever
+  dwBuf[3] = 0x01;
+  dwBuf[6] = 0x02;
+  dwBuf[9] = 0x00;
+  dwLen = 12;
+  for (ch=0; ch<2; ch++) {
+    servoFrom[ch] = servoTo[ch] = 1500; // centre
+    servoSteps[ch] = servoDone[ch] = 0;
+    servoWidth(ch, 1500);
   }
+  seqStart();
+  servoFrame = seqFrames;
+  servoOn = seqPos != 0;
+  return servoOn;
+}
 
+#if LW_SERVO_MUX
+// The multiplexer drives up to four servos on the pins of a mask, PB0,
+// PB1, PB2 and PB5, one after the other, or up to 16 through a chain of
+// 74HC164 shift registers with data on PB0 and clock on PB2. A 1 is shifted
+// in at the start of the frame and moved along by one clock per servo, so
+// output n is high from clock n to clock n+1:
+//
+//   lead-in: data | clocks n: clock (+data for 0), low for the pulse | clock | rest
+//
+// The clock entries take seqMin ticks, which the pulses they start include.
+// The frame stays 20 ms unless the pulses add up to more. New pulse widths
+// are copied in while the rest of the frame plays, all at once.
 
-  if (req == 60) { // debugWIRE transfer
-    if (dwState) {return 0;}   // Prior operation has not yet completed
+#define SERVO_MUX_CLOCK 16       // ticks of a clock entry, seqMin at CK/16
+#define SERVO_MUX_MIN_REST 1031  // 1 ms
 
-    if (data[0] & 0x80) {
+static void servoMuxEntry(uchar pos, uchar pins, uint16_t ticks)
+{
+  dwBuf[pos]   = pins;
+  dwBuf[pos+1] = ticks;
+  dwBuf[pos+2] = ticks >> 8;
+}
 
-      // IN transfer - device to host: return buffered data
-      usbMsgPtr = (uchar*)dwBuf; // Operation complete, result is in dwBuf
-      return dwLen;
+// Write servoMuxNext into the pattern and fit the rest of the frame
+static void servoMuxFill(void)
+{
+  uchar ch, pos;
+  uint16_t us, sum = 0;
+
+  for (ch=0; ch<servoMuxCount; ch++) {
+    us = servoMuxNext[ch];
+    if (us < SERVO_MIN_US) us = SERVO_MIN_US;
+    if (us > SERVO_MAX_US) us = SERVO_MAX_US;
+    pos = servoMuxFirst + servoMuxStride*ch;
+    servoMuxEntry(pos, dwBuf[pos], us + (us >> 5) - servoMuxTrim);
+  }
+  for (pos=3; pos+3 < dwLen; pos+=3) sum += dwBuf[pos+1] | (dwBuf[pos+2] << 8);
+  sum = (sum + SERVO_MUX_MIN_REST > SERVO_FRAME_TICKS) ? SERVO_MUX_MIN_REST : SERVO_FRAME_TICKS - sum;
+  servoMuxEntry(dwLen-3, dwBuf[dwLen-3], sum);
+  servoMuxPending = 0;
+}
 
-    } else {
+// Fill in the new pulse widths if the rest of the frame is playing and a
+// timer cycle or more of it is left, otherwise try again later
+static void servoMuxApply(void)
+{
+  uchar ok;
 
-      // OUT transfer - host to device. rq->wValue specifies action to take.
-      dwState = data[2];                // action required, from low byte of rq->wValue
-      dwLen   = *((uint16_t*)(data+6)); // rq->wLength
-      if (dwLen == 0) {
-        jobState = 20; // No out data transfer, go straight to job part
-      } else {
-        if (dwLen > sizeof(dwBuf)) dwLen = sizeof(dwBuf);
-        dwIn = 0;
-        return USB_NO_MSG;     // jobState will be set in usbFunctionDwWrite
-      }
-      return 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    ok = seqPos == 3 && seqWait >= 256; // the last entry plays, entry 0 is next
+  }
+  if (ok) servoMuxFill();
+}
+
+// mode 1: servos on the pins of mask arg, mode 2: arg servos on shift registers
+static uchar servoMuxStart(uchar mode, uchar arg)
+{
+  uchar ch, pos = 3, count = 0;
+
+  if (dwState || TCCR1) return 0; // dwBuf or Timer1 is taken
+  if (mode == 1) {
+    arg &= 0x27;
+    for (ch=0; ch<6; ch++) if (arg & (1<<ch)) count++;
+  } else if (mode == 2 && arg <= SERVO_MUX_MAX) {
+    count = arg;
+  }
+  if (!count) return 0;
+  softPWMStop();
+  TCCR0A &= ~((1<<COM0A1)|(1<<COM0A0)|(1<<COM0B1)|(1<<COM0B0)); // release PB0/PB1 from hardware PWM
+  dwBuf[1] = 5;                // CK/16
+  dwBuf[2] = 0;                // loop forever
+  if (mode == 1) {
+    dwBuf[0] = arg;
+    for (ch=0; ch<6; ch++) {
+      if (!(arg & (1<<ch))) continue;
+      servoMuxEntry(pos, 1<<ch, 0);
+      pos += 3;
+    }
+    servoMuxFirst  = 3;
+    servoMuxStride = 3;
+    servoMuxTrim   = 0;
+  } else {
+    dwBuf[0] = 0x05;           // data on PB0, clock on PB2
+    servoMuxEntry(pos, 0x01, SERVO_MUX_CLOCK);
+    pos += 3;
+    for (ch=0; ch<count; ch++) {
+      servoMuxEntry(pos, ch ? 0x04 : 0x05, SERVO_MUX_CLOCK);
+      servoMuxEntry(pos+3, 0x00, 0);
+      pos += 6;
     }
+    servoMuxEntry(pos, 0x04, SERVO_MUX_CLOCK); // shifts the 1 past the last servo
+    pos += 3;
+    servoMuxFirst  = 9;
+    servoMuxStride = 6;
+    servoMuxTrim   = SERVO_MUX_CLOCK;
   }
+  servoMuxEntry(pos, 0x00, 0); // rest of the frame
+  dwLen = pos + 3;
+  servoMuxCount = count;
+  servoMuxIn = 0;
+  for (ch=0; ch<count; ch++) servoMuxNext[ch] = 1500; // centre
+  servoMuxFill();
+  seqStart();
+  servoOn = seqPos ? 2 : 0;
+  return servoOn;
+}
+#endif
 
+// Position along a move, t and the result run from 0 to 256
+static uint16_t servoProfile(uchar curve, uint16_t t)
+{
+  uint16_t u;
 
-#if 0
-  if ((req & 0xF0) == 0xD0) /* pic24f send bytes */
-  {
-    rxBuffer[0]=req&0x07; // length
+  if (curve == 1) {            // trapezoid: speed up for a quarter, slow down for the last quarter
+    if (t < 64) return ((uint32_t)t * t) / 96;
+    if (t > 192) {
+      u = 256 - t;
+      return 256 - ((uint32_t)u * u) / 96;
+    }
+    return (4*t - 128) / 3;
+  }
+  if (curve == 2)              // ease in and out, 3t^2 - 2t^3
+    return ((uint32_t)t * t * (768 - 2*t)) >> 16;
+  return t;                    // linear
+}
 
-    rxBuffer[1]=data[2];
-    rxBuffer[2]=data[3];
-    rxBuffer[3]=data[4];
-    rxBuffer[4]=data[5];
+static void servoPoll(void)
+{
+  uchar ch;
+  uint16_t p;
 
-    jobState=14;
-    return 0;
+#if LW_SERVO_MUX
+  if (servoOn == 2) {
+    if (servoMuxPending) servoMuxApply();
+    return;
   }
 #endif
-
-  // --- experimental --
-  if ((req & 0xF0) == 0xE0) // Special multiple I2C message send function
+  if (!servoOn) return;
+  if (seqFrames == servoFrame) return;
+  servoFrame = seqFrames;
+
+  for (ch=0; ch<2; ch++) {
+    if (servoDone[ch] >= servoSteps[ch]) continue;
+    servoDone[ch]++;
+    p = servoProfile(servoCurve[ch], ((uint16_t)servoDone[ch] << 8) / servoSteps[ch]);
+    servoWidth(ch, servoFrom[ch] + (((int32_t)servoTo[ch] - servoFrom[ch]) * p) / 256);
+  }
+}
+#else
+#define servoPoll()
+#endif
+
+// Send ws2812_grb in its encoding. Encoded frames are expanded an LED at a
+// time, which leaves a gap of a few microseconds between LEDs, well below
+// the reset time.
+static void ws2812_send(void)
+{
+#if LW_WS2812_FRAME
+  uint16_t led;
+  uint8_t  i, n, index;
+
+  if (ws2812_mode == 1) {
+    for (i=0; i+4<=ws2812_ptr; i+=4)
+      for (n=ws2812_grb[i]; n; n--)
+        ws2812_sendarray_mask(ws2812_grb+i+1,3,ws2812_mask);
+  } else if (ws2812_mode == 2) {
+    for (led=0; led<ws2812_leds && 48+(led>>1)<ws2812_ptr; led++) {
+      index = ws2812_grb[48+(led>>1)];
+      if (led & 1) index >>= 4;
+      ws2812_sendarray_mask(ws2812_grb+(index&15)*3,3,ws2812_mask);
+    }
+#if LW_WS2812_PARALLEL
+  } else if (ws2812_mode == 3) {
+    ws2812_sendparallel(ws2812_grb,ws2812_ptr,ws2812_mask);
+#endif
+  } else
+#endif
   {
-    jobState=10;
+    ws2812_sendarray_mask(ws2812_grb,ws2812_ptr,ws2812_mask);   //mask=1<<(data[2]&7)
+  }
+}
 
-    rxBuffer[0]=req&0x07; // length
-    rxBuffer[1]=req&0x08; // should we send a Stop?
 
-    for(i=0;i<rxBuffer[0];i++)
-      rxBuffer[2+i]=data[2+i];
+#if LW_WS2812_FRAME
+// ----------------------------------------------------------------------
+// ws2812 effects. fxParam holds:
+//   FX_MODE      1: fade, 2: hue cycle, 3: chase
+//   FX_PIN       pin of the strip
+//   FX_LEDS      number of LEDs, up to 64
+//   FX_INTERVAL  time between frames in Timer1 ticks of 0.993 ms
+//   FX_COLOUR_A, FX_COLOUR_B  two GRB colours
+//   FX_ARG1, FX_ARG2  depend on the mode:
+//     fade:  frames from A to B, bit 0 of ARG2 set to fade back again
+//     hue:   hue step from one LED to the next, brightness
+//     chase: length of the lit segment in colour A, on a background of B
+// The main loop renders and sends a frame whenever the interval has passed.
+// Timer1 free runs at CK/16384 while an effect runs.
+// ----------------------------------------------------------------------
+static void fxStop(void)
+{
+  if (!fxParam[FX_MODE]) return;
+  fxParam[FX_MODE] = 0;
+  TCCR1 = 0;
+}
 
-    return 0;
+static void fxStart(void)
+{
+  if (fxParam[FX_LEDS] > ws2812_maxleds) fxParam[FX_LEDS] = ws2812_maxleds;
+  if (!fxParam[FX_INTERVAL]) fxParam[FX_INTERVAL] = 1;
+  if (TCCR1 || !fxParam[FX_LEDS] || fxParam[FX_MODE] > 3) { // Timer1 is taken or bad parameters
+    fxParam[FX_MODE] = 0;
+    return;
   }
+  ws2812_mask = 1 << (fxParam[FX_PIN] & 7);
+  DDRB |= ws2812_mask;
+  fxPhase = 0;
+  TCNT1 = 0;
+  fxLast = -fxParam[FX_INTERVAL]; // first frame straight away
+  TCCR1 = 0x0F;                // CK/16384
+}
 
-  if ((req & 0xF0) == 0xF0) // Special multiple SPI message send function
-  {
-    jobState=7;
-
-    rxBuffer[0]=req&0x08; // auto chip select ?
-    rxBuffer[1]=req&0x07; // length
-
-    for(i=0;i<rxBuffer[1];i++)
-      rxBuffer[2+i]=data[2+i];
+static uchar fxScale(uchar value, uchar scale)
+{
+  return ((uint16_t)value * scale) >> 8;
+}
 
-    return 0;
+static void fxPoll(void)
+{
+  uchar i, j, c0, c1, c2;
+  uint16_t steps, t;
+  uchar *a = fxParam+FX_COLOUR_A;
+  uchar *b = fxParam+FX_COLOUR_B;
+  uchar *p = ws2812_grb;
+
+  if (!fxParam[FX_MODE]) return;
+  if ((uchar)(TCNT1 - fxLast) < fxParam[FX_INTERVAL]) return;
+  fxLast += fxParam[FX_INTERVAL]; // keep a steady rate even if a frame was late
+
+  for (i=0; i<fxParam[FX_LEDS]; i++, p+=3) {
+    if (fxParam[FX_MODE] == 1) {        // fade
+      steps = fxParam[FX_ARG1] ? fxParam[FX_ARG1] : 1;
+      t = fxPhase % ((fxParam[FX_ARG2] & 1) ? 2*steps : steps+1);
+      if (t > steps) t = 2*steps - t;
+      for (j=0; j<3; j++)
+        p[j] = a[j] + ((int32_t)(b[j] - a[j]) * t) / (int16_t)steps; // 255*255 overflows int16_t
+    } else if (fxParam[FX_MODE] == 2) { // hue cycle, colour wheel in three segments
+      t = (uchar)(fxPhase + i * fxParam[FX_ARG1]);
+      c0 = t < 85 ? 255 - 3*t : t < 170 ? 0 : 3*(t-170);
+      c1 = t < 85 ? 3*t : t < 170 ? 255 - 3*(t-85) : 0;
+      c2 = t < 85 ? 0 : t < 170 ? 3*(t-85) : 255 - 3*(t-170);
+      p[0] = fxScale(c1, fxParam[FX_ARG2]);
+      p[1] = fxScale(c0, fxParam[FX_ARG2]);
+      p[2] = fxScale(c2, fxParam[FX_ARG2]);
+    } else {                            // chase
+      t = (i + fxParam[FX_LEDS] - fxPhase % fxParam[FX_LEDS]) % fxParam[FX_LEDS];
+      for (j=0; j<3; j++) p[j] = t < fxParam[FX_ARG1] ? a[j] : b[j];
+    }
   }
+  fxPhase++;
+  ws2812_ptr = 0;
+  ws2812_mode = 0;
 
-  return 0;
+  _delay_ms(1); // as for job 17, let USB communication finish before the atomic block
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    ws2812_sendarray_mask(ws2812_grb,fxParam[FX_LEDS]*3,ws2812_mask);
+  }
 }
+#else
+#define fxStop()
+#define fxPoll()
+#endif
+
 
 /* ------------------------------------------------------------------------- */
-/* ------------------------ Oscillator Calibration ------------------------- */
+/* ----------------------------- Logic capture ----------------------------- */
 /* ------------------------------------------------------------------------- */
 
-/* Calibrate the RC oscillator to 8.25 MHz. The core clock of 16.5 MHz is
- * derived from the 66 MHz peripheral clock by dividing. Our timing reference
- * is the Start Of Frame signal (a single SE0 bit) available immediately after
- * a USB RESET. We first do a binary search for the OSCCAL value and then
- * optimize this value with a neighboorhod search.
- * This algorithm may also be used to calibrate the RC oscillator directly to
- * 12 MHz (no PLL involved, can therefore be used on almost ALL AVRs), but this
- * is wide outside the spec for the OSCCAL value and the required precision for
- * the 12 MHz clock! Use the RC oscillator calibrated to 12 MHz for
- * experimental purposes only!
- */
-static void calibrateOscillator(void)
+#if LW_CAPTURE
+// The four pins not used by USB as channels 0-3: PB0, PB1, PB2 and PB5
+static inline uchar capChannels(void)
 {
-uchar       step = 128;
-uchar       trialValue = 0, optimumValue;
-int         x, optimumDev, targetValue = (unsigned)(1499 * (double)F_CPU / 10.5e6 + 0.5);
+  uchar pins = PINB;
+  return (pins & 0x07) | ((pins >> 2) & 0x08);
+}
 
-  /* do a binary search: */
-  do{
-    OSCCAL = trialValue + step;
-    x = usbMeasureFrameLength();    /* proportional to current real frequency */
-    if(x < targetValue)             /* frequency still too low */
-      trialValue += step;
-    step >>= 1;
-  }while(step > 0);
-  /* We have a precision of +/- 1 for optimum OSCCAL here */
-  /* now do a neighborhood search for optimum value */
-  optimumValue = trialValue;
-  optimumDev = x; /* this is certainly far away from optimum */
-  for(OSCCAL = trialValue - 1; OSCCAL <= trialValue + 1; OSCCAL++){
-    x = usbMeasureFrameLength() - targetValue;
-    if(x < 0)
-      x = -x;
-    if(x < optimumDev){
-      optimumDev = x;
-      optimumValue = OSCCAL;
-    }
+static void capStop(void)
+{
+  if (!capFlags) return;
+  if (capFlags & CAP_TIMED) {
+    TIMSK &= ~(1<<OCIE1A);
+    TCCR1 = 0;
   }
-  OSCCAL = optimumValue;
+  if (jobState == 31) jobState = 0;
+  capFlags = 0;
+  capOut   = 0;
+  capRead  = 0;
+  dwState  = 0;
 }
 
-void usbEventResetReady(void)
+// Takes one sample into dwBuf, returns 1 once capLen bytes are in
+static inline __attribute__((always_inline)) uchar capSample(uchar now)
 {
-  calibrateOscillator();
-  eeprom_write_byte(0, OSCCAL);   /* store the calibrated value in EEPROM */
+  if (capFlags & CAP_EDGES) {
+    if (now != capLast || ++capTicks == 0x0FFF) { // 12 bit ticks, a repeat entry when they run out
+      if (now != capLast) capTicks++;
+      if (capN >= capLen) return 1;
+      dwBuf[capN++] = now | ((capTicks >> 4) & 0xF0);
+      dwBuf[capN++] = capTicks;
+      capLast  = now;
+      capTicks = 0;
+    }
+  } else if (capTicks++ & 1) {      // even samples in the low nibble, odd in the high
+    if (++capN >= capLen) return 1;
+    dwBuf[capN] = now;
+  } else {
+    dwBuf[capN] |= now << 4;
+  }
+  return 0;
 }
 
+static void capDone(void)
+{
+  TIMSK &= ~(1<<OCIE1A);
+  TCCR1 = 0;
+  capFlags &= ~CAP_TIMED;
+  capOut = capN;
+  dwLen  = capN;
+}
 
-
-// ----------------------------------------------------------------------------
-//   bitBang i2c routines
-// ----------------------------------------------------------------------------
-
-// Port for the I2C
-#define I2C_DDR DDRB
-#define I2C_PIN PINB
-#define I2C_PORT PORTB
-
-// Pins to be used in the bit banging
-#define I2C_CLK 2
-#define I2C_DAT 0
-
-#define I2C_DATA_HI() I2C_DDR &= ~( 1 << I2C_DAT );
-#define I2C_DATA_LO() I2C_DDR |= ( 1 << I2C_DAT );
-
-#define I2C_CLOCK_HI() I2C_DDR &= ~( 1 << I2C_CLK );
-#define I2C_CLOCK_LO() I2C_DDR |= ( 1 << I2C_CLK );
-
-void I2C_WriteBit( unsigned char c )
+// Samples the channels at every Timer1 compare match until capLen bytes
+// are in dwBuf. Sample periods of CAP_TIMED_CYCLES and more are taken by
+// the interrupt, so USB is served throughout and a sample is late by at
+// most one USB interrupt. Faster ones are polled with interrupts off so
+// that no sample is late, and USB is not served until the capture ends,
+// after CAP_BUSY_CYCLES at the most.
+static void capRun(void)
 {
-  uint8_t i;
-  if ( c > 0 )
-  {
-    I2C_DATA_HI();
-  }
-  else
-  {
-    I2C_DATA_LO();
+  uint32_t period = (uint32_t)(capTop + 1) << ((capFlags & 0x0F) - 1);
+  uint32_t budget;             // samples, CAP_BUSY_CYCLES at CK/1 needs 17 bits
+
+  capN     = 0;
+  capTicks = 0;
+  capLast  = capChannels();
+  if (capFlags & CAP_EDGES) {       // channels at the trigger
+    dwBuf[capN++] = capLast;
+    dwBuf[capN++] = 0;
+  } else {
+    dwBuf[capN] = capLast;
   }
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
-
-  I2C_CLOCK_HI();
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
 
-  I2C_CLOCK_LO();
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+  TCNT1 = 0;
+  OCR1C = capTop;
+  OCR1A = capTop;
+  TIFR  = (1<<OCF1A);
+  if (period >= CAP_TIMED_CYCLES) {
+    capFlags |= CAP_TIMED;
+    TIMSK |= (1<<OCIE1A);
+    TCCR1 = (1<<CTC1) | (capFlags & 0x0F);
+    return;
+  }
 
-  if ( c > 0 )
-  {
-    I2C_DATA_LO();
+  budget = CAP_BUSY_CYCLES / period;
+  cli();
+  TCCR1 = (1<<CTC1) | (capFlags & 0x0F);
+  for (;;) {
+    while (!(TIFR & (1<<OCF1A))) ;
+    TIFR = (1<<OCF1A);
+    if (capSample(capChannels()) || !--budget) break;
   }
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+  capDone();
+  sei();
 }
 
-unsigned char I2C_ReadBit()
+// Job 31: waits about a millisecond for the trigger with interrupts on,
+// then returns to the main loop to serve USB and is run again. A pulse
+// shorter than one pass of the main loop may be missed between waits.
+static void capArmed(void)
 {
-  uint8_t i;
-  I2C_DATA_HI();
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+  uchar mask = capTrigger & 0x0F;
+  uchar want = (capTrigger >> 4) & mask;
+  uint16_t tries;
+
+  for (tries=0; tries<1000; tries++) {
+    if ((capChannels() & mask) != want) {
+      capSeen = 1;
+    } else if (capSeen || !(capFlags & CAP_EDGE_TRIGGER)) {
+      capRun();
+      jobState = 0;
+      return;
+    }
+  }
+}
+#endif
 
-  I2C_CLOCK_HI();
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+// Timer1 compare match: the next sample of a slow capture, or the next
+// conversion of a timed ADC stream
+#if LW_CAPTURE || LW_ADC_STREAM
+ISR(TIMER1_COMPA_vect, ISR_NOBLOCK)
+{
+#if LW_CAPTURE
+  if (capFlags & CAP_TIMED) {
+    if (capSample(capChannels())) capDone();
+    return;
+  }
+#endif
+#if LW_ADC_STREAM
+  sbi(ADCSRA,ADSC);
+#endif
+}
+#endif
 
-  unsigned char c = I2C_PIN;
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
 
-  I2C_CLOCK_LO();
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+/* ------------------------------------------------------------------------- */
+/* -------------------- Frequency and pulse measurement -------------------- */
+/* ------------------------------------------------------------------------- */
 
-  return ( c >> I2C_DAT ) & 1;
+#if LW_MEASURE
+// Edges on PB2 clock Timer0 from its T0 input, so they are counted without
+// the CPU. Timer1 overflows every 16384 cycles, about 993 us, time the gate.
+ISR(TIMER0_OVF_vect, ISR_NOBLOCK)
+{
+  measOvf++;
 }
 
-void I2C_Init()
+static void measPut(uchar at, uint32_t v)
 {
-  uint8_t i;
-  I2C_PORT &= ~( ( 1 << I2C_DAT ) | ( 1 << I2C_CLK ) );
-
-  I2C_CLOCK_HI();
-  I2C_DATA_HI();
-
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+  measResult[at]   = v;
+  measResult[at+1] = v >> 8;
+  measResult[at+2] = v >> 16;
+  measResult[at+3] = v >> 24;
 }
 
-void I2C_Start()
+static void measStop(void)
 {
-  uint8_t i;
-  // set both to high at the same time
-  I2C_DDR &= ~( ( 1 << I2C_DAT ) | ( 1 << I2C_CLK ) );
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
-
-  I2C_DATA_LO();
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
-
-  I2C_CLOCK_LO();
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+  if (measResult[0] != MEAS_RUNNING) return;
+  if (TIMSK & (1<<TOIE0)) {    // an edge count
+    TIMSK &= ~((1<<TOIE0)|(1<<TOIE1));
+    TCCR0B = 0;
+    TCCR1  = 0;
+    if (jobState == 32) jobState = 0;
+  } else if (jobState == 33) { // pulses, between two windows
+    TCCR1 = 0;
+    jobState = 0;
+  }
+  measResult[0] = 0;
 }
 
-void I2C_Stop()
+static void measCountStart(uchar falling)
 {
-  uint8_t i;
-  I2C_DATA_LO();
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
-
-  I2C_CLOCK_LO();
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
-
-  I2C_CLOCK_HI();
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
-
-  I2C_DATA_HI();
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+  measOvf = 0;
+  pinEventTimeHi = 0;
+  TCCR0A = 0;
+  TCNT0  = 0;
+  TCNT1  = 0;
+  TIFR   = (1<<TOV0)|(1<<TOV1);
+  TIMSK |= (1<<TOIE0)|(1<<TOIE1);
+  TCCR0B = falling ? (1<<CS02)|(1<<CS01) : (1<<CS02)|(1<<CS01)|(1<<CS00);
+  TCCR1  = (1<<CS12)|(1<<CS11)|(1<<CS10); // CK/64
 }
 
-unsigned char I2C_Write( unsigned char c )
+// Job 32: ends the edge count once the gate has passed, run every pass of
+// the main loop so USB is served throughout.
+static void measCountPoll(void)
 {
-  uint8_t i;
-  for (i=0;i<8;i++)
-  {
-    I2C_WriteBit( c & 128 );
-
-    c<<=1;
-  }
+  uchar lo, hi;
+
+  if (pinEventTimeHi < measGate) return;
+  cli();
+  TCCR0B = 0;
+  lo = TCNT0;
+  hi = measOvf;
+  if ((TIFR & (1<<TOV0)) && lo < 128) hi++; // overflow not yet counted
+  TIMSK &= ~((1<<TOIE0)|(1<<TOIE1));
+  TCCR1  = 0;
+  sei();
+  measPut(2, ((uint32_t)hi << 8) | lo);
+  measPut(6, measGate);
+  measResult[1] = 0;
+  measResult[0] = MEAS_DONE;
+  jobState = 0;
+}
 
-  return I2C_ReadBit();
+static void measAdd(uchar at, uint32_t v)
+{
+  measPut(at, *((uint32_t*)(measResult+at)) + v);
 }
 
-unsigned char I2C_Read( unsigned char ack )
+// Job 33: times measPeriods high and low phases on measPin, starting at a
+// rising edge, in CPU cycles. Interrupts are off so Timer1 overflows can be
+// counted by polling, each edge is seen within one pass of the loop, about
+// a microsecond. To keep USB served it times in windows of MEAS_WINDOW and
+// returns between them, adding only the periods that fit in a window, so a
+// period longer than about 2 ms may never be timed. Returns 1 once done.
+static uchar measPulses(void)
 {
-  uint8_t i;
-  unsigned char res = 0;
+  uchar m = 1 << measPin;
+  uchar phase = 0;             // 0 wait for low, 1 for the rising edge, 2 high, 3 low
+  uchar level, lo;
+  uint16_t hi = 0;
+  uint32_t t, edge = 0, high = 0;
+
+  cli();
+  TCNT1 = 0;
+  TIFR  = (1<<TOV1);
+  TCCR1 = (1<<CS10);           // CK/1, overflows every 256 cycles
+  for (;;) {
+    if (TIFR & (1<<TOV1)) {
+      TIFR = (1<<TOV1);
+      if (++hi >= MEAS_WINDOW) break; // the period underway is dropped
+    }
+    level = PINB & m;
+    if ((phase & 1) ? !level : level) continue; // no edge yet
+    if (!phase) {phase = 1; continue;}
+    lo = TCNT1;
+    t = hi;
+    if ((TIFR & (1<<TOV1)) && lo < 128) t++;
+    t = (t << 8) | lo;
+    if (phase == 2) {
+      high = t - edge;
+    } else if (phase == 3) {   // a whole period
+      measAdd(2, high);
+      measAdd(6, t - edge);
+      if (++measResult[1] >= measPeriods) break;
+    }
+    edge  = t;
+    phase = phase == 3 ? 2 : phase + 1;
+  }
+  sei();                       // Timer1 is left running so that it stays taken
 
-  for (i=0;i<8;i++)
-  {
-    res <<= 1;
-    res |= I2C_ReadBit();
+  if (measResult[1] >= measPeriods) {
+    measResult[0] = MEAS_DONE;
+  } else if (--measGate) {
+    return 0;
+  } else {
+    measResult[0] = MEAS_TIMEOUT;
   }
+  TCCR1 = 0;
+  return 1;
+}
+#endif
 
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
 
-  if ( ack > 0)
-  {
-    I2C_WriteBit( 0 );
-  }
-  else
+/* ------------------------------------------------------------------------- */
+/* ----------------------------- Debug console ----------------------------- */
+/* ------------------------------------------------------------------------- */
+
+// Exchanges a byte with the debugSpi target, SPI mode 3 at SPI_DELAY, see job 1
+static uchar debugSpiByte(uchar t)
+{
+  uchar q, r = 0;
+  uint16_t i;
+
+  DDRB |= MOSI_MASK;
+  DDRB &= ~MISO_MASK;
+  DDRB |= SCK_MASK;
+  PORTB |= SCK_MASK;
+  for ( q = 0x80; q; q >>= 1 )
   {
-    I2C_WriteBit( 1 );
+    PORT &= ~MOSI_MASK; /* Clear send data */
+    for(i=0;i<SPI_DELAY;i++) _delay_us(1); /* Small delay */
+    if  ( t & q ) { PORTB |= MOSI_MASK; } /* Send the data */
+    PORT &= ~SCK_MASK; /* High to low edge */
+    r<<=1; /* Shift the register */
+    r+=((PINB&(MISO_MASK))>>1); /* Sample the data */
+    for(i=0;i<SPI_DELAY;i++) _delay_us(1); /* Small delay */
+    PORT |= SCK_MASK; /* Low to high edge */
   }
-
-  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
-
-  return res;
+  return r;
 }
 
-
-// ----------------------------------------------------------------------------
-// ----------------------------------------------------------------------------
-
+#if LW_DEBUG_FIFO
+// Called every pass of the main loop while the console is on: clocks one
+// byte in from the target and queues it unless it is 0, the target's
+// nothing to say. Nothing is clocked while the ring buffer is full, so the
+// target simply holds on to its byte until the host has read.
+static void debugPoll(void)
+{
+  uchar c;
+  uchar gap;
+
+  if (!debugOn || ((debugHead+1) & DEBUG_RING_MASK) == debugTail) return;
+  for (gap = debugGap; gap; gap--) _delay_us(1);
+  c = debugSpiByte(0);
+  if (!c) return;
+  dwBuf[debugHead] = c;
+  debugHead = (debugHead+1) & DEBUG_RING_MASK;
+}
+#else
+#define debugPoll()
+#endif
 
 
 /* ------------------------------------------------------------------------- */
-/* ------------------------------- DebugWIRE ------------------------------- */
+/* ------------------------ interface to USB driver ------------------------ */
 /* ------------------------------------------------------------------------- */
 
 
-// RS232 levels are
-//
-//   5v ttl  =  mark   =  1  =  idle   =  stop-bit   =  -3v..-15v line
-//   0v ttl  =  space  =  0  =  break  =  start-bit  =  +3v..+15v line
-//
-//   Least significant bit sent first.
+// ----------------------------------------------------------------------
+// Handle a non-standard SETUP packet.
+// ----------------------------------------------------------------------
 
-uint16_t dwBitTime;      // Each bit takes 4*dwBitTime+8 cycles to transmit
+static void runJob(void);
+#if LW_MACRO
+static uchar macroStart(uchar n);
+static void macroStop(void);
+#endif
+#if LW_I2C_TRANSFER
+static uchar i2cTransfer(uchar address, uchar *wbuf, uchar wlen, uchar *rbuf, uchar rlen);
+#endif
+void I2C_Init();
+static uchar owReadBit(void);
 
-void dwCaptureWidths() {
-  // r18 through r25 free to use without restoring
-  // r27:r26 is 'x', free to use without restoring
-  // r31:r30 is 'z', free to use without restoring
+// ----------------------------------------------------------------------
+// Run the job just started by a request straight away and return its
+// result as the reply, so the host does not need a separate request 40.
+// Only used for jobs short enough to complete within the control transfer.
+// The result also stays in sendBuffer for hosts that still send 40.
+// ----------------------------------------------------------------------
+static uchar jobReply(void)
+{
+  sendBuffer[8] = 0;
+  runJob();
+  usbMsgPtr = (uchar*)sendBuffer;
+  return sendBuffer[8];
+}
 
+uchar usbFunctionSetup(uchar data[8])
+{
+// ----------------------------------------------------------------------
+//
+// Nominal packet format:
+//
+//   data[0] - Request type
+//   data[1] - Request id
+//   data[2] - lo8(Value)
+//   data[3] - hi8(Value)
+//   data[4] - lo8(Index)
+//   data[5] - hi8(Index)
+//   data[6] - lo8(Length)
+//   data[7] - hi8(Length)
+//
+// usbFunctionSetup is called when request type is not USBRQ_TYPE_STANDARD.
+//
+// 'Value' and 'Index' are names assigned by the USB standard for some
+// request types, but we are free to use them as 4 arbitrary data bytes.
+//
+// ----------------------------------------------------------------------
+  uint8_t i;
+  uchar bit;
+  uchar mask;
+  uchar req;
+#if LW_ADC_STREAM || LW_DEBUG_FIFO
+  uchar q;
+#endif
+
+  // A new request ends any unfinished SPI stream read, ADC stream read,
+  // ws2812 frame or effect upload, debugWIRE stream chunk, logic capture
+  // or debug console block
+#if LW_SPI_STREAM
+  spiStreamLeft = 0;
+#endif
+#if LW_ADC_STREAM
+  adcReadLeft = 0;
+#endif
+#if LW_WS2812_FRAME
+  ws2812_in = 0;
+  fxIn = 0;
+#endif
+#if LW_DW_STREAM
+  dwStreamRead = 0;
+#endif
+#if LW_CAPTURE
+  capRead = 0;
+#endif
+#if LW_DEBUG_FIFO
+  debugReadLeft = 0;
+#endif
+
+  // Generic requests
+  req = data[1];
+#if LW_TIMING
+  timingReq = req;             // timed by the main loop
+#endif
+  // wValue and wIndex as the programming and pin requests use them
+  bit = data[2] & 7;
+  mask = 1 << bit;
+  address = * (unsigned*) & data[4];
+  timeout = * (unsigned*) & data[2];
+
+  // A dense switch, which gcc compiles to a jump table, so every request
+  // costs the same few cycles to dispatch whatever its number.
+
+  switch (req)
+  {
+    case USBTINY_ECHO:
+    {
+      data[1]=0x21;
+      usbMsgPtr = data;
+      return 8;
+    }
+
+    case USBTINY_READ:
+    {
+      data[0] = PIN;
+      usbMsgPtr = data;
+      return 1;
+    }
+
+    case USBTINY_WRITE:
+    {
+      PORT = data[2];
+      return 0;
+    }
+
+    case USBTINY_CLR:
+    {
+      PORT &= ~ mask;
+      return 0;
+    }
+
+    case USBTINY_SET:
+    {
+      PORT |= mask;
+      return 0;
+    }
+
+    // Programming requests
+    case USBTINY_POWERUP:
+    {
+      sck_period = data[2];
+      mask = POWER_MASK;
+      if  ( data[4] )
+      {
+        mask |= RESET_MASK;
+      }
+      DDR  &= ~MISO_MASK;
+      DDR  |= (RESET_MASK|SCK_MASK|MOSI_MASK);
+      PORT &= ~(RESET_MASK|SCK_MASK|MOSI_MASK|MISO_MASK);
+      return 0;
+    }
+
+    case USBTINY_POWERDOWN:
+    {
+      /* set all the pins to Hi-Z */
+      pinMode(B,0,INPUT);
+      internalPullup(B,0,DISABLE);
+      pinMode(B,1,INPUT);
+      internalPullup(B,1,DISABLE);
+      pinMode(B,2,INPUT);
+      internalPullup(B,2,DISABLE);
+      pinMode(B,5,INPUT);
+      internalPullup(B,5,DISABLE);
+      return 0;
+    }
+
+    case USBTINY_SPI:
+    {
+      cmd[0] = data[2]; cmd[1] = data[3]; cmd[2] = data[4]; cmd[3] = data[5];
+      spi( cmd, data );
+#if LW_FAST_ISP
+      // Programming enable not echoed: the target may be clocked too slowly
+      // for this SCK. Pulse RESET and try again at half the speed, so the
+      // fastest SCK the target keeps up with is kept for the session.
+      while ( cmd[0] == 0xac && cmd[1] == 0x53 && data[2] != 0x53 && sck_period < 128 )
+      {
+        sck_period = sck_period <= 1 ? 2 : sck_period << 1;
+        PORT |= RESET_MASK;
+        _delay_us(100);
+        PORT &= ~RESET_MASK;
+        _delay_ms(20);
+        spi( cmd, data );
+      }
+#endif
+      usbMsgPtr = data;
+      return 4;
+    }
+
+    case USBTINY_POLL_BYTES:
+    {
+      poll1 = data[2];
+      poll2 = data[3];
+      return 0;
+    }
+
+    case USBTINY_FLASH_READ:
+    {
+      cmd0 = 0x20;
+      return 0xff;  // usb_in() will be called to get the data
+    }
+
+    case USBTINY_EEPROM_READ:
+    {
+      cmd0 = 0xa0;
+      return 0xff;  // usb_in() will be called to get the data
+    }
+
+    case USBTINY_FLASH_WRITE:
+    {
+      cmd0 = 0x40;
+      return 0xff;  // data will be received by usb_out()
+    }
+
+    case USBTINY_EEPROM_WRITE:
+    {
+      cmd0 = 0xc0;
+      return 0xff;  // data will be received by usb_out()
+    }
+
+    // - ihsan Kehribar -
+    case USBTINY_PIN_SET_INPUT: // 13
+    {
+      DDR &= ~(1<<bit);
+      return 0;
+    }
+
+    case USBTINY_PIN_SET_OUTPUT: // 14
+    {
+      DDR |= (1<<bit);
+      return 0;
+    }
+
+    case USBTINY_READ_ADC: // 15
+    {
+      // unsigned char temp=DDR;
+
+      if(data[2]==0) // Read ADC from RESET pin
+      {
+        ADMUX = adcSetting | 0; // Set the desired channel
+        sbi(DIDR0,ADC0D); // Disable digital buffer ...
+        // DDR &= ~(1<<5);
+      }
+      else if(data[2]==1) // Read ADC from SCK pin
+      {
+        ADMUX = adcSetting | 1; // Set the desired channel
+        sbi(DIDR0,ADC1D); // Disable digital buffer ...
+        // DDR &= ~(1<<2);
+      }
+      else if(data[2]==2) // Read ADC from internal Temperature sensor
+      {
+        ADMUX=0b10001111;
+      }
+      sbi(ADCSRA,ADSC); // Start conversion
+      while(checkBit(ADCSRA,ADSC)); // Wait for conversion
+      data[0]=(unsigned char)ADCL;
+      data[1]=(unsigned char)ADCH;
+      usbMsgPtr = data;
+      // DDR=temp;
+      DIDR0=0x00;
+      return 2;
+    }
+
+    case USBTINY_SETUP_PWM: // 16
+    {
+      softPWMStop(); // Timer0 and pins 0 and 1 are shared with the soft PWM
+      fastPWMStop(); // and pins 0 and 1 with the Timer1 fast PWM
+      DDR |= (1<<0); // Set PORTB0 Output
+      DDR |= (1<<1); // Set PORTB1 Output
+      TCCR0A |= (1<<COM0A1)|(0<<COM0A0)|(1<<COM0B1)|(0<<COM0B0); // Clear OC0A/OC0B on Compare Match, set OC0A/OC0B at BOTTOM (non-inverting mode)
+      TCCR0A |= (1<<WGM01)|(1<<WGM00); // Fast PWM mode
+      TCCR0B |= (1<<CS02)|(0<<CS01)|(1<<CS00); // Timer prescale: 1024 => PWM signal update frequency: ( 16.500.000 / ( 255 * 1024) ) = ~ 63 Hertz
+      return 0;
+    }
+
+    case USBTINY_UPDATE_PWM_COMPARE: // 17
+    {
+      OCR0A=data[2];
+      OCR0B=data[4];
+      return 0;
+    }
+
+    case USBTINY_PIN_SET_HIGH: // 18
+    {
+      PORT |= (1<<bit);
+      return 0;
+    }
+
+    case USBTINY_PIN_SET_LOW: // 19
+    {
+      PORT &= ~(1<<bit);
+      return 0;
+    }
+
+    case USBTINY_PIN_READ: // 20
+    {
+      data[0]=(PIN&(1<<bit))>>bit;
+      usbMsgPtr = data;
+      return 1;
+    }
+
+    //-----------------------------------------------//
+    case USBTINY_CHANGE_PWM_PRESCALE: // 22
+    {
+      if(data[2]==0) // ~ 64kHz update frequency
+      {
+         cbi(TCCR0B,CS02);
+         cbi(TCCR0B,CS01);
+         sbi(TCCR0B,CS00);
+      }
+      else if(data[2]==1) // ~ 8kHz Hertz update frequency
+      {
+         cbi(TCCR0B,CS02);
+         sbi(TCCR0B,CS01);
+         cbi(TCCR0B,CS00);
+      }
+      else if(data[2]==2) // ~ 1 kHz update frequency
+      {
+         cbi(TCCR0B,CS02);
+         sbi(TCCR0B,CS01);
+         sbi(TCCR0B,CS00);
+      }
+      else if(data[2]==3) // ~ 252 Hertz update frequency
+      {
+         sbi(TCCR0B,CS02);
+         cbi(TCCR0B,CS01);
+         cbi(TCCR0B,CS00);
+      }
+      else if(data[2]==4) // ~ 63 Hertz update frequency -> Suitable for Servo driving. -> Default
+      {
+         sbi(TCCR0B,CS02);
+         cbi(TCCR0B,CS01);
+         sbi(TCCR0B,CS00);
+      }
+      return 0;
+    }
+
+    case USBTINY_SPI_UPDATE_DELAY: // 31
+    {
+      SPI_DELAY = (data[3]<<8) + data[2] ;
+      return 0;
+    }
+
+    case USBTINY_STOP_PWM: // 32
+    {
+      TCCR0A = 0;
+      TCCR0B = 0;
+      return 0;
+    }
+
+    case USBTINY_DEBUG_SPI: // 33
+    {
+      rxBuffer[0] = data[2]; // Data to send
+      jobState = 1;
+      return jobReply();
+    }
+
+    case 34: // This has to be hardcoded to 34!
+    {
+      // Version, then the capability bitmap for hosts asking for more than
+      // one byte. Older hosts ask for one byte and get just the version.
+      data[0]=LITTLE_WIRE_VERSION;
+      data[1]=(uint8_t)(LITTLE_WIRE_CAPABILITIES);
+      data[2]=(uint8_t)(LITTLE_WIRE_CAPABILITIES >> 8);
+      data[3]=(uint8_t)(LITTLE_WIRE_CAPABILITIES >> 16);
+      data[4]=(uint8_t)(LITTLE_WIRE_CAPABILITIES >> 24);
+      usbMsgPtr = data;
+      return 5;
+    }
+
+    case 35: /* init ADC */
+    {
+      sbi(ADCSRA,ADEN); // Enable the ADC peripheral
+      ADCSRA |= data[2]; // Least significant three bits are prescale settings
+      switch(data[3])
+      {
+        case 0: // Use VCC as Vref.
+          adcSetting = 0;
+          break;
+        case 1: // 1.1V
+          sbi(adcSetting,REFS1);
+          break;
+        case 2: // 2.56V
+          sbi(adcSetting,REFS1);
+          sbi(adcSetting,REFS2);
+          break;
+      }
+      return 0;
+    }
+
+    case 40: /* read the results */
+    {
+      usbMsgPtr = (uchar*)sendBuffer;
+      return sendBuffer[8];
+    }
+
+    case 41: /* onewire reset pulse */
+    {
+      jobState = 2;
+      return jobReply();
+    }
+
+    case 42: /* onewire send byte */
+    {
+      jobState = 3;
+      rxBuffer[0]=data[2];
+      return jobReply();
+    }
+
+    case 43: /* onewire read byte */
+    {
+      jobState = 4;
+      return jobReply();
+    }
+
+    case 44: /* i2c init */
+    {
+      jobState=8;
+      return jobReply();
+    }
+
+    case 45: /* i2c begin */
+    {
+      jobState=9;
+      rxBuffer[0]=data[2]; // -- address
+      return jobReply();
+    }
+
+    case 46: /* i2c read */
+    {
+      jobState=11;
+      rxBuffer[0]=data[2]; // -- should we end with Nack ?
+      rxBuffer[1]=data[3]; // -- length
+      rxBuffer[2]=data[4]; // -- should we issue a Stop ?
+      return jobReply();
+    }
+
+    case 47: /* init softPWM */
+    {
+      // data[2]: 1 to start, 0 to stop. Bit 1 applies a gamma curve to the compare values.
+      if(data[2] & 1)
+        softPWMStart(data[2] & 2);
+      else
+        softPWMStop();
+      return 0;
+    }
+
+    case 48: /* update softPWM */
+    {
+      compare0=softPWMValue(data[2]);
+      compare1=softPWMValue(data[3]);
+      compare2=softPWMValue(data[4]);
+      softPWM|=4;    // a lost race with the ISR only reloads the same values
+      return 0;
+    }
+
+    case 49: /* i2c update delay */
+    {
+      // data[3]: 0 bit banged with I2C_DELAY, 1 USI standard mode, 2 USI fast mode
+      I2C_DELAY = data[2];
+#if LW_I2C_USI
+      if (data[3] > 2) data[3] = 0;
+      if (data[3] != i2cUSI) {
+        i2cUSI = data[3];
+        USICR = 0;
+        DDRB &= ~((1<<0)|(1<<2)); // release SDA and SCL before the port bits change
+        I2C_Init();
+      }
+#endif
+      return 0;
+    }
+
+    case 50: /* onewire read bit */
+    {
+      jobState=5;
+      return jobReply();
+    }
+
+    case 51: /* onewire write bit */
+    {
+      rxBuffer[0]=data[2];
+      jobState=6;
+      return jobReply();
+    }
+
+    // WS2812 Support - T. Bscke May 26th, 2013
+    case 54: /* WS2812_write */
+    {
+      fxStop();
+#if LW_WS2812_FRAME
+      if ((data[2]&0x20)&&ws2812_mode)  // drop an encoded frame that was not sent
+      {
+        ws2812_mode=0;
+        ws2812_ptr=0;
+      }
+#endif
+      if ((data[2]&0x20)&&(ws2812_ptr<ws2812_maxleds*3))  // bit 5 set = add to buffer
+      {
+        ws2812_grb[ws2812_ptr++]=data[3];
+        ws2812_grb[ws2812_ptr++]=data[4];
+        ws2812_grb[ws2812_ptr++]=data[5];
+      }
+
+      if ((data[2]&0x10)&&(ws2812_ptr>0))  // bit 4 set = send buffer to ws2812
+      {
+        jobState=17;
+        DDRB|=mask;
+        ws2812_mask=mask;
+      }
+      return 0;
+    }
+
+#if LW_WS2812_FRAME
+    case 69: /* WS2812 frame upload */
+    {
+      // data[2]: pin in bits 0-2, bit 4 set = send the frame once uploaded
+      // data[3]: encoding. 0: GRB bytes, up to 64 LEDs.
+      //   1: runs of 4 bytes, LED count followed by GRB.
+      //   2: palette of 16 GRB colours, then two LEDs per byte, low nibble first.
+      //   3: parallel, up to three strips sent at once, see ws2812_sendparallel.
+      // data[4..5]: number of LEDs for encoding 2, pins PB0-PB2 of the strips for encoding 3
+      if (jobState == 17) {return 0;} // previous frame not sent yet
+#if !LW_WS2812_PARALLEL
+      if ((data[3] & 3) == 3) {return 0;} // parallel strips are not built in
+#endif
+      fxStop();
+      ws2812_in = data[6] < sizeof(ws2812_grb) && !data[7] ? data[6] : sizeof(ws2812_grb); // rq->wLength
+      if (!ws2812_in) {return 0;}
+      ws2812_ptr = 0;
+      ws2812_mode = data[3] & 3;
+      ws2812_leds = *((uint16_t*)(data+4));
+      ws2812_mask = ws2812_mode == 3 ? data[4] & 7 : mask;
+      ws2812_flushAfter = data[2] & 0x10;
+      return USB_NO_MSG;
+    }
+
+    case 70: /* WS2812 effect */
+    {
+      // Data stage: the 12 bytes of fxParam, see fxPoll. Without one the effect stops.
+      fxStop();
+      if (data[6] != sizeof(fxParam) || data[7]) {return 0;}
+      fxIn = sizeof(fxParam);
+      return USB_NO_MSG;
+    }
+#endif
+
+    // end ws2812 support
+    /* Change serial number ... */
+    case 55:
+    {
+      eeprom_write_byte((EE_addr+0),data[2]);
+      eeprom_write_byte((EE_addr+1),data[3]);
+      eeprom_write_byte((EE_addr+2),data[4]);
+      eeprom_write_byte((EE_addr+3),0xFF); // end of a longer serial number
+
+      // data[0] = eeprom_read_byte(EE_addr+0);
+      // data[1] = eeprom_read_byte(EE_addr+1);
+      // data[2] = eeprom_read_byte(EE_addr+2);
+      // usbMsgPtr = data;
+      // return 3;
+
+      return 0;
+    }
+
+#if LW_BATCH
+    case 56: // command batch
+    {
+      if (dwState) {return 0;}   // Prior operation has not yet completed
+
+      if (data[0] & 0x80) {
+
+        // IN transfer - device to host: return the replies collected by the batch
+        usbMsgPtr = (uchar*)dwBuf;
+        return dwLen;
+
+      } else {
+
+        // OUT transfer - host to device. The data stage holds the batch.
+        dwLen = *((uint16_t*)(data+6)); // rq->wLength
+        if (dwLen == 0) {return 0;}
+        if (dwLen > sizeof(dwBuf)) dwLen = sizeof(dwBuf);
+        dwState = 0x80;
+        dwJob   = 21;
+        dwIn    = 0;
+        return USB_NO_MSG;       // jobState will be set in usbFunctionWrite
+      }
+    }
+    break;
+#endif
+
+#if LW_SPI_STREAM
+    case 57: // SPI stream, bytes are exchanged in place in dwBuf
+    {
+      if (dwState) {return 0;}   // Prior operation has not yet completed
+
+      if (data[0] & 0x80) {
+
+        // IN transfer - device to host: return the bytes received
+        usbMsgPtr = (uchar*)dwBuf;
+        return dwLen;
+
+      } else {
+
+        // OUT transfer - host to device. The data stage holds the bytes to send.
+        dwLen = *((uint16_t*)(data+6)); // rq->wLength
+        if (dwLen == 0) {return 0;}
+        if (dwLen > sizeof(dwBuf)) dwLen = sizeof(dwBuf);
+        spiCS   = data[2];       // chip select handling
+        dwState = 0x80;
+        dwJob   = 22;
+        dwIn    = 0;
+        return USB_NO_MSG;       // jobState will be set in usbFunctionWrite
+      }
+    }
+    break;
+
+    case 58: // SPI stream read, bytes are clocked in by usbFunctionRead
+    {
+      spiFill = data[2];         // byte to send while reading
+      spiCS   = data[4];         // chip select handling
+      spiStreamLeft = data[6];   // rq->wLength, at most 254
+      if (!spiStreamLeft) {return 0;}
+      usiSetup();
+      if (spiCS & 1) PORT &= ~(1<<5);
+      return USB_NO_MSG;
+    }
+#endif
+
+#if LW_I2C_TRANSFER
+    case 59: // i2c transfer, dwBuf holds address, read length and bytes to write
+    {
+      if (dwState) {return 0;}   // Prior operation has not yet completed
+
+      if (data[0] & 0x80) {
+
+        // IN transfer - device to host: return ack status and bytes read
+        usbMsgPtr = (uchar*)dwBuf;
+        return dwLen;
+
+      } else {
+
+        // OUT transfer - host to device.
+        dwLen = *((uint16_t*)(data+6)); // rq->wLength
+        if (dwLen < 2) {return 0;}
+        if (dwLen > sizeof(dwBuf)) dwLen = sizeof(dwBuf);
+        dwState = 0x80;
+        dwJob   = 23;
+        dwIn    = 0;
+        return USB_NO_MSG;       // jobState will be set in usbFunctionWrite
+      }
+    }
+    break;
+#endif
+
+    case 60: // debugWIRE transfer
+    {
+      if (dwState) {return 0;}   // Prior operation has not yet completed
+
+      if (data[0] & 0x80) {
+
+        // IN transfer - device to host: return buffered data
+        usbMsgPtr = (uchar*)dwBuf; // Operation complete, result is in dwBuf
+        return dwLen;
+
+      } else {
+
+        // OUT transfer - host to device. rq->wValue specifies action to take.
+        dwState = data[2];                // action required, from low byte of rq->wValue
+        dwLen   = *((uint16_t*)(data+6)); // rq->wLength
+#if LW_DW_BREAK
+        dwBreakWatch = (dwState & 0x08) != 0;
+#endif
+        dwReadMax = data[4];              // bytes expected back, low byte of rq->wIndex, 0 for a full dwBuf
+        if (!dwReadMax || dwReadMax > sizeof(dwBuf)) dwReadMax = sizeof(dwBuf);
+        if (dwLen == 0) {
+          jobState = 20; // No out data transfer, go straight to job part
+        } else {
+          if (dwLen > sizeof(dwBuf)) dwLen = sizeof(dwBuf);
+          dwJob = 20;
+          dwIn = 0;
+          return USB_NO_MSG;     // jobState will be set in usbFunctionDwWrite
+        }
+        return 0;
+      }
+    }
+    break;
+
+#if LW_I2C_TRANSFER
+    case 61: /* i2c register read */
+    {
+      if (dwState) {return 0;}   // dwBuf is busy
+      i = data[6];               // rq->wLength: bytes to read
+      if (i > sizeof(dwBuf)) i = sizeof(dwBuf);
+      // data[2]: address, data[3]: number of register address bytes in data[4..5]
+      if (i2cTransfer(data[2], data+4, data[3] & 3, (uchar*)dwBuf, i)) {return 0;}
+      usbMsgPtr = (uchar*)dwBuf;
+      return i;
+    }
+#endif
+
+#if LW_ONEWIRE_BULK
+    case 62: // onewire search step, dwBuf holds the search state
+    {
+      if (dwState) {return 0;}   // Prior operation has not yet completed
+
+      if (data[0] & 0x80) {
+
+        // IN transfer - device to host: return the search result
+        usbMsgPtr = (uchar*)dwBuf;
+        return dwLen;
+
+      } else {
+
+        // OUT transfer - host to device. Last discrepancy and previous ROM.
+        dwLen = *((uint16_t*)(data+6)); // rq->wLength
+        if (dwLen != 9) {return 0;}
+        dwState = 0x80;
+        dwJob   = 24;
+        dwIn    = 0;
+        return USB_NO_MSG;       // jobState will be set in usbFunctionWrite
+      }
+    }
+    break;
+
+    case 63: // onewire block transfer, dwBuf holds flags, read length and bytes to write
+    {
+      if (dwState) {return 0;}   // Prior operation has not yet completed
+
+      if (data[0] & 0x80) {
+
+        // IN transfer - device to host: return presence and bytes read
+        usbMsgPtr = (uchar*)dwBuf;
+        return dwLen;
+
+      } else {
+
+        // OUT transfer - host to device.
+        dwLen = *((uint16_t*)(data+6)); // rq->wLength
+        if (dwLen < 2) {return 0;}
+        if (dwLen > sizeof(dwBuf)) dwLen = sizeof(dwBuf);
+        dwState = 0x80;
+        dwJob   = 25;
+        dwIn    = 0;
+        return USB_NO_MSG;       // jobState will be set in usbFunctionWrite
+      }
+    }
+    break;
+#endif
+
+#if LW_ADC_STREAM
+    case 64: /* ADC stream start/stop */
+    {
+      // data[2]: channel as for request 15, data[3]: bit 7 start, bit 0 8 bit samples
+      // data[4]: Timer1 clock select (0 for free running), data[5]: Timer1 top
+      adcStreamStop();
+      if (!(data[3] & 0x80)) {return 0;}
+      if (dwState) {return 0;}   // dwBuf is busy
+#if LW_ADC_SCAN
+      if (adcScan.running) {return 0;} // the ADC is busy
+#endif
+
+      dwState = 0x40;
+      adcStream = 1 | ((data[3] & 1) << 1);
+      adcHead = 0;
+      adcTail = 0;
+      adcDropped = 0;
+
+      adcSelect(data[2]);
+      if (adcStream & 2) sbi(ADMUX,ADLAR);
+
+      if (data[4]) {             // conversions started by Timer1 compare matches
+        if (TCCR1) {adcStreamStop(); return 0;} // Timer1 is taken
+        TCNT1 = 0;
+        OCR1C = data[5];
+        OCR1A = data[5];
+        TCCR1 = (1<<CTC1) | (data[4] & 0x0F);
+        TIMSK |= (1<<OCIE1A);
+        ADCSRA |= (1<<ADEN)|(1<<ADIE);
+      } else {                   // free running
+        if ((ADCSRA & 7) < 4) ADCSRA |= 4; // keep the interrupt rate manageable
+        ADCSRB &= ~7;
+        ADCSRA |= (1<<ADEN)|(1<<ADATE)|(1<<ADIE)|(1<<ADSC);
+      }
+      return 0;
+    }
+
+    case 65: /* ADC stream read */
+    {
+      // data[2]: maximum number of samples
+      // Reply: sample count, flags (bit 0 running, bit 1 samples dropped,
+      // bit 2 8 bit samples), dropped count, then the samples. 10 bit samples
+      // take 2 bytes, low byte first.
+      i = data[6];               // rq->wLength
+      if (i < sizeof(adcHeader)) {return 0;}
+      i -= sizeof(adcHeader);
+      q = (adcHead - adcTail) & ADC_RING_MASK;
+      if (!(adcStream & 2)) {
+        q >>= 1;
+        i >>= 1;
+      }
+      if (q > i) q = i;
+      if (q > data[2]) q = data[2];
+      adcHeader[0] = q;
+      adcHeader[1] = (adcStream & 1) | (adcDropped ? 2 : 0) | ((adcStream & 2) << 1);
+      adcHeader[2] = adcDropped;
+      adcDropped = 0;
+      if (!(adcStream & 2)) q <<= 1;
+      adcReadLeft = sizeof(adcHeader) + q;
+      adcReadPos = 0;
+      return USB_NO_MSG;
+    }
+#endif
+
+#if LW_PIN_EVENTS
+    case 66: /* pin change events */
+    {
+      // data[2]: mask of the pins to watch (bits 0, 1, 2 and 5), 0 to stop
+      pinEventsStop();
+      data[2] &= 0x27;
+      if (!data[2]) {return 0;}
+      if (TCCR1 && !clockOn) {return 0;} // Timer1 is taken by a timed ADC stream or the sequencer
+      pinEventsStart(data[2]);
+      data[0] = 1;
+      usbMsgPtr = data;
+      return 1;
+    }
+#endif
+
+#if LW_PORT_UPDATE
+    case 67: /* port update */
+    {
+      // data[2]: DDRB mask, data[3]: DDRB bits, data[4]: PORTB mask, data[5]: PORTB bits.
+      // Only the free pins 0, 1, 2 and 5 change. Outputs that become inputs are
+      // released first and inputs that become outputs are driven last, so no pin
+      // shows an intermediate level. Reply: PINB, DDRB, PORTB.
+      bit  = data[2] & 0x27;
+      mask = data[4] & 0x27;
+      DDR  &= ~(bit & ~data[3]);
+      PORT  = (PORT & ~mask) | (data[5] & mask);
+      DDR  |= bit & data[3];
+      data[0] = PIN;
+      data[1] = DDR;
+      data[2] = PORT;
+      usbMsgPtr = data;
+      return 3;
+    }
+#endif
+
+#if LW_SEQUENCER
+    case 68: // pattern sequencer
+    {
+      if (data[0] & 0x80) {
+
+        // IN transfer - device to host: data[2] bit 0 stops the pattern.
+        // Reply: running, loops left, next entry
+        if (data[2] & 1) seqStop();
+        data[0] = seqPos != 0;
+        data[1] = seqLoops;
+        data[2] = seqPos ? (seqPos - 3) / 3 : 0;
+        usbMsgPtr = data;
+        return 3;
+
+      } else {
+
+        // OUT transfer - host to device. The data stage holds the pattern.
+        if (dwState) {return 0;} // dwBuf is busy, or a pattern is playing
+        dwLen = *((uint16_t*)(data+6)); // rq->wLength
+        if (dwLen < 6) {return 0;}
+        if (dwLen > sizeof(dwBuf)) dwLen = sizeof(dwBuf);
+        dwState = 0x80;
+        dwJob   = 26;
+        dwIn    = 0;
+        return USB_NO_MSG;       // jobState will be set in usbFunctionWrite
+      }
+    }
+    break;
+#endif
+
+#if LW_SERVO
+    case 71: // servo mode: data[2] 0 stop, 1 start, 2 status only
+    {
+      // Reply: running and moving channels in bits 1-2, pulse widths of PB0 and PB1 in us
+      if (data[2] == 1 && !servoOn) servoStart();
+      if (data[2] == 0 && servoOn) {
+        seqStop();
+        PORT &= ~0x03;
+      }
+      data[0] = servoOn;
+      if (servoOn == 1) {
+        if (servoDone[0] < servoSteps[0]) data[0] |= 2;
+        if (servoDone[1] < servoSteps[1]) data[0] |= 4;
+      }
+      data[1] = servoNow[0];
+      data[2] = servoNow[0] >> 8;
+      data[3] = servoNow[1];
+      data[4] = servoNow[1] >> 8;
+      usbMsgPtr = data;
+      return 5;
+    }
+
+    case 72: // servo move: value = target in us, data[4] = channel | profile<<4, data[5] = frames of 20 ms
+    {
+      uchar ch = data[4] & 1;
+      if (servoOn != 1) {return 0;}
+      servoFrom[ch]  = servoNow[ch];
+      servoTo[ch]    = *((uint16_t*)(data+2));
+      servoCurve[ch] = data[4] >> 4;
+      servoDone[ch]  = 0;
+      servoSteps[ch] = data[5];
+      if (!data[5]) servoWidth(ch, servoTo[ch]); // no duration, go straight there
+      return 0;
+    }
+#endif
+
+#if SERIAL_MAX_DIGITS > 3
+    case 73: // Change serial number: value and index hold up to 8 BCD digits, most significant in data[5]
+    {
+      uchar i, digit, n = 0;
+      for (i=8; i--; ) {
+        digit = (data[2+i/2] >> ((i&1) ? 4 : 0)) & 0x0F;
+        if (digit > 9) {return 0;}
+        if (!n && !digit && i) continue; // leading zero
+        if (i >= SERIAL_MAX_DIGITS) {return 0;} // more digits than the descriptor holds
+        eeprom_write_byte(EE_addr+n++, '0'+digit);
+      }
+      if (n < SERIAL_MAX_DIGITS) eeprom_write_byte(EE_addr+n, 0xFF);
+      return 0;
+    }
+#endif
+
+    case 74: // job status: jobState, dwState, dwLen, dwBitTime. A job is running while jobState is not 0.
+    {
+      data[0] = jobState;
+      data[1] = dwState;
+      data[2] = dwLen;
+      data[3] = dwLen >> 8;
+      data[4] = dwBitTime;
+      data[5] = dwBitTime >> 8;
+      usbMsgPtr = data;
+      return 6;
+    }
+
+#if LW_DW_STREAM
+    case 75: // debugWIRE stream read: value = target address, index = bytes to read, 0 to stop
+    {
+      if (data[0] & 0x80) {
+        // IN transfer: the chunk captured last, nothing while it is being captured
+        if (!dwStreamOut || jobState) {return 0;}
+        dwStreamRead = 1;
+        return USB_NO_MSG;       // served by usbFunctionRead, the next chunk starts when it is all read
+      }
+      if (!data[4] && !data[5]) { // stop
+        if (dwStreamLeft || dwStreamOut) {
+          if (jobState == 28) {return 0;} // a chunk is being captured, try again
+          dwStreamLeft = 0;
+          dwStreamOut  = 0;
+          dwState      = 0;
+        }
+        return 0;
+      }
+      if (dwState) {return 0;}   // Prior operation has not yet completed
+      dwStreamAddr = *((uint16_t*)(data+2));
+      dwStreamLeft = *((uint16_t*)(data+4));
+      dwStreamOut  = 0;
+      dwState  = 0x80;
+      jobState = 28;
+      return 0;
+    }
+#endif
+
+#if LW_DW_REPEAT
+    case 76: // debugWIRE repeat: value = count | sequence length<<8, index = patch offset | flags<<8
+    {
+      if (dwState) {return 0;}   // Prior operation has not yet completed
+      dwRepeatCount = data[2];
+      dwRepeatLen   = data[3];
+      dwRepeatPatch = data[4];
+      dwRepeatFlags = data[5];
+      dwLen = *((uint16_t*)(data+6)); // rq->wLength: sequence and data bytes
+      if (!dwRepeatCount || !dwRepeatLen || dwLen < dwRepeatLen) {return 0;}
+      if (dwLen > sizeof(dwBuf)) dwLen = sizeof(dwBuf);
+      if (dwRepeatCount > sizeof(dwBuf) - dwRepeatLen) {return 0;} // no room for the data or reply bytes
+      dwState = 0x80;
+      dwJob   = 29;
+      dwIn    = 0;
+      return USB_NO_MSG;         // jobState will be set in usbFunctionWrite
+    }
+#endif
+
+#if LW_DW_TRACE
+    case 77: // debugWIRE trace: value = steps, index = word address of the first instruction
+    {
+      if (dwState) {return 0;}   // Prior operation has not yet completed
+      if (!data[2] || data[2] > (sizeof(dwBuf)-8)/2) {return 0;}
+      dwTraceCount = data[2];
+      dwTracePC    = *((uint16_t*)(data+4));
+      dwState  = 0x80;
+      jobState = 30;
+      return 0;
+    }
+#endif
+
+#if LW_CAPTURE
+    case 78: // logic capture: value = Timer1 clock select | mode<<4 | top<<8, index = trigger | depth<<8
+    {
+      if (data[0] & 0x80) {
+        // IN transfer: the capture, nothing while it is armed or running
+        if (!capOut) {return 0;}
+        capPos  = 0;
+        capRead = 1;
+        return USB_NO_MSG;       // served by usbFunctionRead, dwBuf is released once it is all read
+      }
+      capStop();
+      if (!(data[2] & 0x0F) || !(data[2] & (CAP_SAMPLES|CAP_EDGES))) {return 0;} // stop
+      if (dwState || TCCR1) {return 0;} // dwBuf or Timer1 is taken
+      capFlags   = data[2] & ~CAP_TIMED;
+      capTop     = data[3];
+      capTrigger = data[4];
+      capLen     = (!data[5] || data[5] > sizeof(dwBuf)) ? sizeof(dwBuf) : data[5];
+      if (capFlags & CAP_EDGES) capLen &= ~1;
+      capSeen  = 0;
+      capOut   = 0;
+      dwState  = 0x80;
+      jobState = 31;
+      return 0;
+    }
+#endif
+
+#if LW_MEASURE
+    case 79: // measurement: data[2] mode 1 count rising, 2 count falling, 3 pulses, 0 stop
+    {
+      // Count: index = gate in Timer1 overflows of 16384 cycles, edges on PB2
+      // Pulses: data[3] = pin, data[4] = periods, data[5] = timeout in 10 ms, two windows each
+      if (data[0] & 0x80) {    // IN transfer: the result
+        usbMsgPtr = measResult;
+        return sizeof(measResult);
+      }
+      measStop();
+      if (!data[2] || data[2] > 3) {return 0;}
+      if (TCCR1 || measResult[0] == MEAS_RUNNING) {return 0;} // Timer1 is taken
+      if (data[2] < 3) {
+        if (TCCR0B) {return 0;} // Timer0 is taken by PWM
+        measGate = *((uint16_t*)(data+4));
+        if (!measGate) {return 0;}
+        measCountStart(data[2] == 2);
+        jobState = 32;
+      } else {
+        if (jobState) {return 0;}
+        measPin     = data[3] & 7;
+        measPeriods = data[4] ? data[4] : 1;
+        measGate    = 2 * (data[5] ? data[5] : 1);
+        measPut(2, 0);
+        measPut(6, 0);
+        measResult[1] = 0;
+        jobState = 33;
+      }
+      measResult[0] = MEAS_RUNNING;
+      return 0;
+    }
+#endif
+
+#if LW_DEBUG_FIFO
+    case 80: // debug console: data[2] 1 start, 0 stop, data[3] microseconds before each byte
+    {
+      if (data[0] & 0x80) {
+        // IN transfer: byte count, flags (bit 0 running), then the bytes queued
+        i = data[6];               // rq->wLength
+        if (i < sizeof(debugHeader)) {return 0;}
+        i -= sizeof(debugHeader);
+        q = (debugHead - debugTail) & DEBUG_RING_MASK;
+        if (q > i) q = i;
+        debugHeader[0] = q;
+        debugHeader[1] = debugOn;
+        debugReadLeft = sizeof(debugHeader) + q;
+        debugReadPos = 0;
+        return USB_NO_MSG;
+      }
+      if (debugOn) {
+        debugOn = 0;
+        dwState = 0;
+      }
+      if (!data[2]) {return 0;}
+      if (dwState) {return 0;}   // dwBuf is busy
+      dwState   = 0x40;
+      debugGap  = data[3];
+      debugHead = 0;
+      debugTail = 0;
+      debugOn   = 1;
+      return 0;
+    }
+#endif
+
+#if LW_UART
+    case 81: // serial bridge: value = bit time as dwBitTime, index = bytes to receive, data stage = bytes to send
+    {
+      if (data[0] & 0x80) {
+        // IN transfer: byte count, then the bytes received, nothing while the transfer runs
+        if (jobState == 34) {return 0;}
+        dwBuf[sizeof(dwBuf)-1] = 0; // count, in case there is nothing to collect
+        if (!uartOut) {usbMsgPtr = (uchar*)dwBuf + sizeof(dwBuf)-1; return 1;}
+        // Make room for the count, uartOut is at most sizeof(dwBuf)-1
+        for (i=uartOut; i; i--) dwBuf[i] = dwBuf[i-1];
+        dwBuf[0] = uartOut;
+        usbMsgPtr = (uchar*)dwBuf;
+        i = uartOut + 1;
+        uartOut = 0;
+        dwState = 0;
+        return i;
+      }
+      if (uartOut) {uartOut = 0; dwState = 0;} // drop a reply not collected
+      if (dwState) {return 0;}   // Prior operation has not yet completed
+      if (data[2] || data[3]) uartBitTime = *((uint16_t*)(data+2));
+      if (!uartBitTime) {return 0;}
+      uartReadMax = data[4] < sizeof(dwBuf) ? data[4] : sizeof(dwBuf)-1;
+      dwLen = *((uint16_t*)(data+6)); // rq->wLength
+      dwState = 0x80;
+      if (!dwLen) {
+        jobState = 34;           // nothing to send, go straight to receiving
+        return 0;
+      }
+      if (dwLen > sizeof(dwBuf)) dwLen = sizeof(dwBuf);
+      dwJob = 34;
+      dwIn  = 0;
+      return USB_NO_MSG;         // jobState will be set in usbFunctionWrite
+    }
+#endif
+
+#if LW_MACRO
+    case 82: // macros: data[2] 0 stop, 1 run, 2 store, 3 trigger
+    {
+      // Run: data[3] = macro. Store: index = offset into the macro area, data stage = bytes.
+      // Trigger: data[3] = macro, data[4] = pins, data[5] = their levels that start it.
+      if (data[0] & 0x80) {
+        // IN transfer: running flag, macro number, reply length, then the replies
+        if (!macroPos && dwState) {return 0;} // dwBuf has moved on to something else
+        dwBuf[0] = macroPos != 0;
+        dwBuf[1] = macroNumber;
+        dwBuf[2] = macroOut;
+        usbMsgPtr = (uchar*)dwBuf;
+        return 3 + macroOut;
+      }
+      if (data[2] == 1) {
+        if (!macroStart(data[3])) {return 0;}
+      } else if (data[2] == 2) {
+        if (dwState) {return 0;} // Prior operation has not yet completed
+        dwLen = *((uint16_t*)(data+6)); // rq->wLength
+        if (dwLen == 0) {return 0;}
+        if (dwLen > sizeof(dwBuf)) dwLen = sizeof(dwBuf);
+        macroStoreAt = *((uint16_t*)(data+4));
+        dwState = 0x80;
+        dwJob   = 35;
+        dwIn    = 0;
+        return USB_NO_MSG;       // jobState will be set in usbFunctionWrite
+      } else if (data[2] == 3) {
+        macroPins    = data[4] & 0x27;
+        macroLevels  = data[5] & macroPins;
+        macroTrigger = data[3];
+        macroMatch   = 1;        // only a change to the levels starts the macro
+      } else {
+        macroStop();
+      }
+      return 0;
+    }
+#endif
+
+#if LW_CLOCK
+    case 83: // device clock: data[2] 0 read, 1 start, 2 stop
+    {
+      // Returns the clock in 4 bytes, Timer1 ticks at CK/128 from the low byte.
+      // Its low 24 bits are the pin event timestamps. In a batch or a macro a
+      // read stamps the replies of the commands around it.
+      if (data[2] == 1) {
+        if (!clockStart()) {return 0;}
+      } else if (data[2] == 2) {
+        clockStop();
+        return 0;
+      }
+      if (!clockOn && !pinEventMask) {return 0;}
+      clockRead(data);
+      usbMsgPtr = data;
+      return 4;
+    }
+#endif
+
+#if LW_FAST_PWM
+    case 84: // fast PWM: data[2] clock select | dead time prescaler<<4 | 0x40 inverse on PB0, 0 to stop
+    {
+      // data[3] = top (OCR1C), data[4] = duty (OCR1A), data[5] = dead times, DT1A.
+      // Frequency is 4*F_CPU / (2^(clock select-1) * (top+1)).
+      if (!(data[2] & 0x0F)) {
+        fastPWMStop();
+        return 0;
+      }
+      if (TCCR1 && !(PLLCSR & (1<<PCKE))) {return 0;} // Timer1 is taken
+      softPWMStop();             // it drives PB0 and PB1 too
+      TCCR0A &= ~((1<<COM0A1)|(1<<COM0A0)|(1<<COM0B1)|(1<<COM0B0)); // so does the Timer0 PWM
+      PLLCSR |= (1<<PCKE);       // the PLL runs and is locked, it clocks the CPU
+      OCR1C = data[3];
+      OCR1A = data[4];
+      DT1A  = data[5];
+      DTPS1 = (data[2] >> 4) & 3;
+      DDRB |= (1<<1) | ((data[2] & 0x40) ? (1<<0) : 0);
+      TCCR1 = (1<<PWM1A) | ((data[2] & 0x40) ? (1<<COM1A0) : (1<<COM1A1)) | (data[2] & 0x0F);
+      data[0] = 1;
+      usbMsgPtr = data;
+      return 1;
+    }
+#endif
+
+#if LW_ONEWIRE_SWEEP
+    case 85: // 1-Wire sweep: data[2] 1 convert T on all devices, 2 read the scratchpads of the ROMs sent
+    {
+      if (dwState) {return 0;}   // Prior operation has not yet completed
+
+      if (data[0] & 0x80) {
+
+        // IN transfer - device to host: conversion state, then flags and
+        // the first two scratchpad bytes of each sensor read, see owScanPoll
+        if (owConvert == 1 && owReadBit()) owConvert = 0; // read slots give 1 once done
+        dwBuf[0] = owConvert;
+        usbMsgPtr = (uchar*)dwBuf;
+        return 1 + 3*owResults;
+
+      } else if (data[2] == 1) {
+
+        owConvert = 1;
+        jobState = 36;
+        return 0;
+
+      } else if (data[2] == 2) {
+
+        // OUT transfer - host to device. The ROMs, 8 bytes each.
+        dwLen = *((uint16_t*)(data+6)); // rq->wLength
+        if (dwLen < 8 || dwLen > sizeof(dwBuf)) {return 0;}
+        owResults = 0;
+        dwState = 0x80;
+        dwJob   = 37;
+        dwIn    = 0;
+        return USB_NO_MSG;       // jobState will be set in usbFunctionWrite
+      }
+      return 0;
+    }
+#endif
+
+#if LW_TIMING
+    case 86: // timing counters: data[2] 0 read, 1 start, 2 stop
+    {
+      // Returns timing as it is: flags, slots, offMax, offTotal, missedSof,
+      // loopMax, then per slot job, id, count and max, low bytes first and
+      // times in device clock ticks. Start fails if Timer1 is taken.
+      if (data[2] == 1) {
+        if (!timingStart()) {return 0;}
+      } else if (data[2] == 2) {
+        timingStop();
+      }
+      usbMsgPtr = (uchar*)&timing;
+      return sizeof(timing);
+    }
+#endif
+
+#if LW_ADC_SCAN
+    case 87: // ADC oversampling scan: data[2] channels, bit n for request 15 channel n, 0 to read
+    {
+      // data[3]: n, each channel is converted 4^n times, n up to 6, and the
+      // sum shifted right by n for a 10+n bit result, see adcScanPoll.
+      // Reply: 1 while the scan runs, otherwise 0 and the result of each
+      // channel of the last scan, low byte first. Request 35 sets up the
+      // ADC, and request 15 must not be used while a scan runs.
+      if (data[2]) {
+        if (adcStream || !(ADCSRA & (1<<ADEN))) {return 0;} // busy, or not set up
+        adcScanMask  = data[2];
+        adcScanShift = (data[3] > 6) ? 6 : data[3];
+        adcScanCount = 0;
+        adcScanNext(0);
+      }
+      usbMsgPtr = (uchar*)&adcScan;
+      return adcScan.running ? 1 : 1 + 2*adcScanCount;
+    }
+#endif
+
+#if LW_PIC24
+    case 88: // PIC24F ICSP batch, dwBuf holds the operations, see pic24Batch
+    {
+      if (dwState) {return 0;}   // Prior operation has not yet completed
+
+      if (data[0] & 0x80) {
+
+        // IN transfer - device to host: batch state and the words read
+        usbMsgPtr = (uchar*)dwBuf;
+        return dwLen;
+
+      } else {
+
+        // OUT transfer - host to device.
+        dwLen = *((uint16_t*)(data+6)); // rq->wLength
+        if (dwLen < 1 || dwLen > sizeof(dwBuf)) {return 0;}
+        softPWMStop();           // it drives PGC and PGD
+        dwState = 0x80;
+        dwJob   = 38;
+        dwIn    = 0;
+        return USB_NO_MSG;       // jobState will be set in usbFunctionWrite
+      }
+    }
+#endif
+
+#if LW_SERVO_MUX
+    case 89: // servo multiplexer: data[2] 0 stop, 1 servos on the pins in data[3], 2 data[3] servos on shift registers, 3 status
+    {
+      // OUT with a data stage: pulse widths in us, 2 bytes each low byte
+      // first, for the first servos. They all change together on the next
+      // frame. Reply: bit 0 running, bit 1 widths waiting, then the servos.
+      if (!(data[0] & 0x80)) {
+        i = data[6];             // rq->wLength
+        if (servoOn != 2 || data[7] || !i || i > 2*servoMuxCount) {return 0;}
+        servoMuxPending = 0;
+        servoMuxIn  = i;
+        servoMuxPos = 0;
+        return USB_NO_MSG;       // servoMuxPending will be set in usbFunctionWrite
+      }
+      if (data[2] == 0 && servoOn == 2) {
+        seqStop();
+        PORT &= ~dwBuf[0];
+      } else if ((data[2] == 1 || data[2] == 2) && !servoOn) {
+        servoMuxStart(data[2], data[3]);
+      }
+      data[0] = (servoOn == 2) | (servoMuxPending << 1);
+      data[1] = servoMuxCount;
+      usbMsgPtr = data;
+      return 2;
+    }
+#endif
+
+    default:
+      break;
+  }
+
+  // Requests carrying their length in the low bits of the id
+  // --- experimental --
+  if ((req & 0xF0) == 0xE0) // Special multiple I2C message send function
+  {
+    jobState=10;
+
+    rxBuffer[0]=req&0x07; // length
+    rxBuffer[1]=req&0x08; // should we send a Stop?
+
+    for(i=0;i<rxBuffer[0];i++)
+      rxBuffer[2+i]=data[2+i];
+
+    return jobReply();
+  }
+
+  if ((req & 0xF0) == 0xF0) // Special multiple SPI message send function
+  {
+    jobState=7;
+
+    rxBuffer[0]=req&0x08; // auto chip select ?
+    rxBuffer[1]=req&0x07; // length
+
+    for(i=0;i<rxBuffer[1];i++)
+      rxBuffer[2+i]=data[2+i];
+
+    return jobReply();
+  }
+
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------ Oscillator Calibration ------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/* Calibrate the RC oscillator to 8.25 MHz. The core clock of 16.5 MHz is
+ * derived from the 66 MHz peripheral clock by dividing. Our timing reference
+ * is the Start Of Frame signal (a single SE0 bit) available immediately after
+ * a USB RESET. We first do a binary search for the OSCCAL value and then
+ * optimize this value with a neighboorhod search.
+ * This algorithm may also be used to calibrate the RC oscillator directly to
+ * 12 MHz (no PLL involved, can therefore be used on almost ALL AVRs), but this
+ * is wide outside the spec for the OSCCAL value and the required precision for
+ * the 12 MHz clock! Use the RC oscillator calibrated to 12 MHz for
+ * experimental purposes only!
+ */
+static void calibrateOscillator(void)
+{
+uchar       step = 128;
+uchar       trialValue = 0, optimumValue;
+int         x, optimumDev, targetValue = (unsigned)(1499 * (double)F_CPU / 10.5e6 + 0.5);
+
+  /* fast path: keep the value in use, normally the one stored in EEPROM,
+   * if one frame measures within about 0.8%, well inside the 1.5% low
+   * speed USB allows. A neighbour value is at best a little closer. */
+  x = usbMeasureFrameLength() - targetValue;
+  if(x < 0)
+    x = -x;
+  if(x <= targetValue / 128)
+    return;
+
+  /* do a binary search: */
+  do{
+    OSCCAL = trialValue + step;
+    x = usbMeasureFrameLength();    /* proportional to current real frequency */
+    if(x < targetValue)             /* frequency still too low */
+      trialValue += step;
+    step >>= 1;
+  }while(step > 0);
+  /* We have a precision of +/- 1 for optimum OSCCAL here */
+  /* now do a neighborhood search for optimum value */
+  optimumValue = trialValue;
+  optimumDev = x; /* this is certainly far away from optimum */
+  for(OSCCAL = trialValue - 1; OSCCAL <= trialValue + 1; OSCCAL++){
+    x = usbMeasureFrameLength() - targetValue;
+    if(x < 0)
+      x = -x;
+    if(x < optimumDev){
+      optimumDev = x;
+      optimumValue = OSCCAL;
+    }
+  }
+  OSCCAL = optimumValue;
+}
+
+void usbEventResetReady(void)
+{
+  calibrateOscillator();
+  if(eeprom_read_byte(0) != OSCCAL)
+    eeprom_write_byte(0, OSCCAL); /* store the calibrated value in EEPROM, only when it changed */
+}
+
+
+
+// ----------------------------------------------------------------------------
+//   bitBang i2c routines
+// ----------------------------------------------------------------------------
+
+// Port for the I2C
+#define I2C_DDR DDRB
+#define I2C_PIN PINB
+#define I2C_PORT PORTB
+
+// Pins to be used in the bit banging
+#define I2C_CLK 2
+#define I2C_DAT 0
+
+#define I2C_DATA_HI() I2C_DDR &= ~( 1 << I2C_DAT );
+#define I2C_DATA_LO() I2C_DDR |= ( 1 << I2C_DAT );
+
+#define I2C_CLOCK_HI() I2C_DDR &= ~( 1 << I2C_CLK );
+#define I2C_CLOCK_LO() I2C_DDR |= ( 1 << I2C_CLK );
+
+// Waits while a slave stretches the clock after SCL was released. Gives up
+// after about 10 ms so that USB keeps being served on a stuck bus.
+static void I2C_WaitClock(void)
+{
+  uint16_t i;
+  for (i=0; i<10000 && !(I2C_PIN & (1<<I2C_CLK)); i++) _delay_us(1);
+}
+
+#if LW_I2C_USI
+// ----------------------------------------------------------------------------
+// USI in two wire mode, SDA on DI (PB0) and SCL on USCK (PB2), the pins of
+// the bit banged routines. Both are outputs with the port high; the USI
+// pulls SDA low for a 0 in the MSB of USIDR and holds SCL low between
+// transfers. Timing after AVR310, 4.7/4.0 us low/high for 100 kHz and
+// 1.3/0.6 us for 400 kHz. The fast mode counts cycles, _delay_us here takes
+// whole microseconds and 0 would be 65 ms.
+// ----------------------------------------------------------------------------
+#define USI_TWI_CR ((1<<USIWM1)|(1<<USICS1)|(1<<USICLK))
+#define USI_TWI_8BITS ((1<<USISIF)|(1<<USIOIF)|(1<<USIPF)|(1<<USIDC)|(0x0<<USICNT0))
+#define USI_TWI_1BIT ((1<<USISIF)|(1<<USIOIF)|(1<<USIPF)|(1<<USIDC)|(0xE<<USICNT0))
+
+static void usiTwiLow(void)
+{
+  if (i2cUSI == 2) __builtin_avr_delay_cycles(22); else _delay_us(5);
+}
+
+static void usiTwiHigh(void)
+{
+  if (i2cUSI == 2) __builtin_avr_delay_cycles(10); else _delay_us(4);
+}
+
+static void usiTwiInit(void)
+{
+  I2C_PORT |= (1<<I2C_DAT) | (1<<I2C_CLK);
+  I2C_DDR |= (1<<I2C_DAT) | (1<<I2C_CLK);
+  USIDR = 0xFF;
+  USICR = USI_TWI_CR;
+  USISR = USI_TWI_8BITS;
+}
+
+// Clocks the bits the counter is set up for in status, returns USIDR
+static uchar usiTwiTransfer(uchar status)
+{
+  USISR = status;
+  do {
+    usiTwiLow();
+    USICR = USI_TWI_CR | (1<<USITC); // SCL released
+    I2C_WaitClock();
+    usiTwiHigh();
+    USICR = USI_TWI_CR | (1<<USITC); // SCL low
+  } while (!(USISR & (1<<USIOIF)));
+  usiTwiLow();
+  status = USIDR;
+  USIDR = 0xFF;                      // release SDA
+  I2C_DDR |= (1<<I2C_DAT);
+  return status;
+}
+
+// Start or repeated start
+static void usiTwiStart(void)
+{
+  if (USICR != USI_TWI_CR) usiTwiInit(); // SPI used the USI meanwhile
+  I2C_PORT |= (1<<I2C_CLK);
+  I2C_WaitClock();
+  usiTwiLow();
+  I2C_PORT &= ~(1<<I2C_DAT);
+  usiTwiHigh();
+  I2C_PORT &= ~(1<<I2C_CLK);
+  I2C_PORT |= (1<<I2C_DAT);
+}
+
+static void usiTwiStop(void)
+{
+  I2C_PORT &= ~(1<<I2C_DAT);
+  I2C_PORT |= (1<<I2C_CLK);
+  I2C_WaitClock();
+  usiTwiHigh();
+  I2C_PORT |= (1<<I2C_DAT);
+  usiTwiLow();
+}
+
+// Returns the acknowledge bit, 1 for a nack
+static uchar usiTwiWrite(uchar c)
+{
+  I2C_PORT &= ~(1<<I2C_CLK);
+  USIDR = c;
+  usiTwiTransfer(USI_TWI_8BITS);
+  I2C_DDR &= ~(1<<I2C_DAT);
+  return usiTwiTransfer(USI_TWI_1BIT) & 1;
+}
+
+static uchar usiTwiRead(uchar ack)
+{
+  uchar c;
+
+  I2C_DDR &= ~(1<<I2C_DAT);
+  c = usiTwiTransfer(USI_TWI_8BITS);
+  USIDR = ack ? 0x00 : 0xFF;
+  usiTwiTransfer(USI_TWI_1BIT);
+  return c;
+}
+#else
+#define usiTwiInit()
+#define usiTwiStart()
+#define usiTwiStop()
+#define usiTwiWrite(c) 0
+#define usiTwiRead(ack) 0
+#endif
+
+// ----------------------------------------------------------------------------
+// Bit banged, or through the USI when i2cUSI is set
+// ----------------------------------------------------------------------------
+
+void I2C_WriteBit( unsigned char c )
+{
+  uint8_t i;
+  if ( c > 0 )
+  {
+    I2C_DATA_HI();
+  }
+  else
+  {
+    I2C_DATA_LO();
+  }
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  I2C_CLOCK_HI();
+  I2C_WaitClock();
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  I2C_CLOCK_LO();
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  if ( c > 0 )
+  {
+    I2C_DATA_LO();
+  }
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+}
+
+unsigned char I2C_ReadBit()
+{
+  uint8_t i;
+  I2C_DATA_HI();
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  I2C_CLOCK_HI();
+  I2C_WaitClock();
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  unsigned char c = I2C_PIN;
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  I2C_CLOCK_LO();
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  return ( c >> I2C_DAT ) & 1;
+}
+
+void I2C_Init()
+{
+  uint8_t i;
+  if (i2cUSI) {usiTwiInit(); return;}
+  I2C_PORT &= ~( ( 1 << I2C_DAT ) | ( 1 << I2C_CLK ) );
+
+  I2C_CLOCK_HI();
+  I2C_DATA_HI();
+
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+}
+
+void I2C_Start()
+{
+  uint8_t i;
+  if (i2cUSI) {usiTwiStart(); return;}
+  // set both to high at the same time
+  I2C_DDR &= ~( ( 1 << I2C_DAT ) | ( 1 << I2C_CLK ) );
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  I2C_DATA_LO();
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  I2C_CLOCK_LO();
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+}
+
+void I2C_Stop()
+{
+  uint8_t i;
+  if (i2cUSI) {usiTwiStop(); return;}
+  I2C_DATA_LO();
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  I2C_CLOCK_LO();
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  I2C_CLOCK_HI();
+  I2C_WaitClock();
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  I2C_DATA_HI();
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+}
+
+unsigned char I2C_Write( unsigned char c )
+{
+  uint8_t i;
+  if (i2cUSI) return usiTwiWrite(c);
+  for (i=0;i<8;i++)
+  {
+    I2C_WriteBit( c & 128 );
+
+    c<<=1;
+  }
+
+  return I2C_ReadBit();
+}
+
+unsigned char I2C_Read( unsigned char ack )
+{
+  uint8_t i;
+  unsigned char res = 0;
+  if (i2cUSI) return usiTwiRead(ack);
+
+  for (i=0;i<8;i++)
+  {
+    res <<= 1;
+    res |= I2C_ReadBit();
+  }
+
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  if ( ack > 0)
+  {
+    I2C_WriteBit( 0 );
+  }
+  else
+  {
+    I2C_WriteBit( 1 );
+  }
+
+  for(i=0;i<I2C_DELAY;i++) _delay_us(1); /* Small delay */
+
+  return res;
+}
+
+
+#if LW_I2C_TRANSFER
+// ----------------------------------------------------------------------------
+// Write wlen bytes to an I2C device then, after a repeated start, read rlen
+// bytes from it. Either length may be 0. The bytes read may overwrite the
+// bytes written. Returns 0 if the device acknowledged everything written.
+// ----------------------------------------------------------------------------
+static uchar i2cTransfer(uchar address, uchar *wbuf, uchar wlen, uchar *rbuf, uchar rlen)
+{
+  uchar nack = 0;
+  uchar i;
+
+  if (wlen)
+  {
+    I2C_Start();
+    nack = I2C_Write(address << 1);
+    for (i=0; i<wlen && !nack; i++)
+      nack = I2C_Write(wbuf[i]);
+  }
+  if (rlen && !nack)
+  {
+    I2C_Start();
+    nack = I2C_Write((address << 1) | 1);
+    if (!nack)
+      for (i=0; i<rlen; i++)
+        rbuf[i] = I2C_Read(i < rlen-1); // Nack the last byte
+  }
+  I2C_Stop();
+  return nack;
+}
+#endif
+
+// ----------------------------------------------------------------------------
+// ----------------------------------------------------------------------------
+
+
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------- DebugWIRE ------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+
+// RS232 levels are
+//
+//   5v ttl  =  mark   =  1  =  idle   =  stop-bit   =  -3v..-15v line
+//   0v ttl  =  space  =  0  =  break  =  start-bit  =  +3v..+15v line
+//
+//   Least significant bit sent first.
+
+
+void dwCaptureWidths() {
+  // r18 through r25 free to use without restoring
+  // r27:r26 is 'x', free to use without restoring
+  // r31:r30 is 'z', free to use without restoring
+
+  timingIrqOff();
   asm(
     "                                                                                    \n"
     ";       Measure pulse widths and store in dwBuf                                     \n"
@@ -1350,6 +4395,7 @@ void dwCaptureWidths() {
     "        add   r24,r24         ; Convert word count to byte count                    \n"
     "        sts   dwLen,r24                                                             \n"
   :::"r24","r26","r27","r30","r31");
+  timingIrqOn();
 }
 
 // Sample pulse widths returned by attiny85 with internal clock as supplied
@@ -1371,6 +4417,7 @@ void dwCaptureWidths() {
 
 
 void dwSendBytes() {
+  if (dwLen) timingIrqOff();   // the transfer turns interrupts off
   asm(
     "                                                                    \n"
     ";       Transmit dwLen bytes from dwBuf                             \n"
@@ -1396,180 +4443,1135 @@ void dwSendBytes() {
     "        ldi   r26,lo8(dwBuf)  ; X register addresses dwBuf          \n"
     "        ldi   r27,hi8(dwBuf)                                        \n"
     "                                                                    \n"
-    "        lds   r23,dwLen                                             \n"
-    "        tst   r23                                                   \n"
-    "        breq  dws12           ; If no bytes to transmit             \n"
+    "        lds   r23,dwLen                                             \n"
+    "        tst   r23                                                   \n"
+    "        breq  dws12           ; If no bytes to transmit             \n"
+    "                                                                    \n"
+    ";       Disable interrupts during transmission                      \n"
+    "                                                                    \n"
+    "        cli                                                         \n"
+    "                                                                    \n"
+    ";       Loop for each byte                                          \n"
+    "                                                                    \n"
+    ";       Send start bit (space / 0)                                  \n"
+    "                                                                    \n"
+    "dws2:   movw  r30,r24         ;      Load wait count to r31:r30     \n"
+    "        cbi   0x18,5          ; 1.   Set dwire port low             \n"
+    "                                                                    \n"
+    "        ld    r22,x+          ; 2.   Next byte to send              \n"
+    "        ldi   r21,8           ; 1.   Bit count                      \n"
+    "                                                                    \n"
+    "dws4:   sbiw  r30,1           ; 2.   Decrement wait count           \n"
+    "        brne  dws4            ; 1/2. While more waiting required    \n"
+    "                                                                    \n"
+    ";       Loop for each bit                                           \n"
+    "                                                                    \n"
+    ";       Each bit takes a total of 4*dwBitTime + 8 cycles.           \n"
+    "                                                                    \n"
+    "dws6:   sbrc  r22,0           ; 1/2. Skip if sending zero           \n"
+    "        sbi   0x18,5          ; 1.   Set dwire port high            \n"
+    "        sbrs  r22,0           ; 1/2. Skip if sending one            \n"
+    "        cbi   0x18,5          ; 1.   Set dwire port low             \n"
+    "        movw  r30,r24         ; 1.   Load wait count to r31:r30     \n"
+    "                                                                    \n"
+    ";       5 cycles from dws6 to here.                                 \n"
+    "                                                                    \n"
+    "dws8:   sbiw  r30,1           ; 2.   Decrement wait count           \n"
+    "        brne  dws8            ; 1/2. While more waiting required    \n"
+    "                                                                    \n"
+    ";       4*dwBitTime+4 cycles from dws6 to here.                     \n"
+    "                                                                    \n"
+    "        lsr   r22             ; 1.   Shift next bit to bit 0        \n"
+    "        dec   r21             ; 1.   Count transmitted bit          \n"
+    "        brne  dws6            ; 1/2. While more bits to transmit    \n"
+    "                                                                    \n"
+    ";       Send stop bit (mark / 1)                                    \n"
+    "                                                                    \n"
+    "        movw  r30,r24         ; 1.   Load wait count to r31:r30     \n"
+    "        sbi   0x18,5          ; 1.   Set dwire port high            \n"
+    "        adiw  r30,1           ; 2.   Extra iteration                \n"
+    "                                                                    \n"
+    "dws10:  sbiw  r30,1           ; 2.   Decrement wait count           \n"
+    "        brne  dws10           ; 1/2. While more waiting required    \n"
+    "                                                                    \n"
+    "        dec   r23                                                   \n"
+    "        brne  dws2            ; While more bytes to transmit        \n"
+    "                                                                    \n"
+    "dws12:  cbi   0x17,5          ; DDRB pin5 is input                  \n"
+    "                                                                    \n"
+  :::"r21","r22","r23","r24","r25","r26","r27","r30","r31");
+}
+
+
+
+
+#if LW_DW_BAUD
+// Follows drift of the target clock, e.g. an RC oscillator warming up.
+//
+// When bit 7 of a byte is a zero the line rises exactly at the end of the
+// byte, 9 target bit times after the start bit began. dwReadBytes samples
+// bit 7 about 8.5*T cycles after seeing the start bit, T = 4*dwBitTime+8,
+// then counts n loops of 6 cycles to the rising edge, so the bit time of
+// the target is (8.5*T + 6*n + 5)/9 = T + (12*n + 10 - T)/18. The last
+// such byte of each read moves dwBitTime one step towards that, and a
+// measurement further off than 1/8 is taken as a glitch.
+
+void dwTrackBitTime() {
+  if (!dwStopWait) return;
+  uint16_t n = -dwStopWait;
+  uint16_t t = 4*dwBitTime + 8;
+  uint16_t measured = t + (int16_t)(12*n + 10 - t) / 18;
+  uint16_t bitTime  = (measured - 6) / 4;   // Nearest
+  dwStopWait = 0;
+  if (bitTime > dwBitTime + dwBitTime/8  ||  bitTime + dwBitTime/8 < dwBitTime) return;
+  if (bitTime > dwBitTime) dwBitTime++;
+  else if (bitTime < dwBitTime) dwBitTime--;
+}
+#else
+#define dwTrackBitTime()
+#endif
+
+void dwReadBytes() {
+  asm(
+    "                                                                    \n"
+    ";       Register usage:                                             \n"
+    ";                                                                   \n"
+    ";       r21     - Remaining bit count to be read in this byte       \n"
+    ";       r22     - current byte being received (shifted)             \n"
+    ";       r20     - bytes expected (dwReadMax)                        \n"
+    ";       r23     - total bytes received so far                       \n"
+    ";       r25:r24 - bit time as iteration count                       \n"
+    ";       r27:r26 - current buffer address (x)                        \n"
+    ";       r31:r30 - bit time counter                                  \n"
+    "                                                                    \n"
+    ";       Preload registers                                           \n"
+    "                                                                    \n"
+    "        clr   r23                                                   \n"
+    "        lds   r24,dwBitTime                                         \n"
+    "        lds   r25,dwBitTime+1                                       \n"
+    "        ldi   r26,lo8(dwBuf)  ; X register addresses dwBuf          \n"
+    "        ldi   r27,hi8(dwBuf)                                        \n"
+    "                                                                    \n"
+    ";       Assumes previous dwSendBytes call has left:                 \n"
+    ";         Interrupts already disabled                               \n"
+    ";         DDRB pin5 is input                                        \n"
+    "                                                                    \n"
+    ";       Wait up to 65536*6 cycles = 23.8ms for start bit            \n"
+    "                                                                    \n"
+    "dwr2:   clr   r30                                                   \n"
+    "        clr   r31                                                   \n"
+    "                                                                    \n"
+    "dwr4:   sbiw  r30,1           ; 2.   Check for timeout              \n"
+    "        breq  dwr14           ; 1/2. If no start bit encountered    \n"
+    "                                                                    \n"
+    "        sbic  0x16,5          ; 1/2. Skip if Pin PB5 clear          \n"
+    "        rjmp  dwr4            ; 2.   While no start bit             \n"
+    "                                                                    \n"
+    ";       Wait through half of start bit                              \n"
+    "                                                                    \n"
+    "        movw  r30,r24         ; 1                                   \n"
+    "        lsr   r31             ; 1                                   \n"
+    "        ror   r30             ; 1                                   \n"
+    "                                                                    \n"
+    "dwr6:   sbiw  r30,1           ; 2.                                  \n"
+    "        brne  dwr6            ; 1/2.                                \n"
+    "                                                                    \n"
+    ";       We should be half way through the start bit, check this.    \n"
+    ";       If line not still low, assume it was a glitch and go        \n"
+    ";       back to waiting for a start bit.                            \n"
+    "                                                                    \n"
+    "        sbic  0x16,5          ; 1/2. Skip if Pin PB5 clear          \n"
+    "        rjmp  dwr2            ; 2.   If not a real start bit        \n"
+    "                                                                    \n"
+    ";       Loop for 8 bits sampling the middle of each pulse.          \n"
     "                                                                    \n"
-    ";       Disable interrupts during transmission                      \n"
+    "        clr   r22                                                   \n"
+    "        ldi   r21,8                                                 \n"
     "                                                                    \n"
-    "        cli                                                         \n"
+    ";       Each iteration takes 4*(r25:r24) + 8 cycles.                \n"
     "                                                                    \n"
-    ";       Loop for each byte                                          \n"
+    "dwr8:   movw  r30,r24         ; 1.                                  \n"
     "                                                                    \n"
-    ";       Send start bit (space / 0)                                  \n"
+    "dwr10:  sbiw  r30,1           ; 2.                                  \n"
+    "        brne  dwr10           ; 1/2.                                \n"
     "                                                                    \n"
-    "dws2:   movw  r30,r24         ;      Load wait count to r31:r30     \n"
-    "        cbi   0x18,5          ; 1.   Set dwire port low             \n"
+    ";       4*(r25:r24) cycles to here                                  \n"
     "                                                                    \n"
-    "        ld    r22,x+          ; 2.   Next byte to send              \n"
-    "        ldi   r21,8           ; 1.   Bit count                      \n"
+    ";       Sample one bit to top of r22                                \n"
     "                                                                    \n"
-    "dws4:   sbiw  r30,1           ; 2.   Decrement wait count           \n"
-    "        brne  dws4            ; 1/2. While more waiting required    \n"
+    "        lsr   r22             ; 1.                                  \n"
+    "        sbic  0x16,5          ; 1/2.                                \n"
+    "        sbr   r22,128         ; 1.   Sets top bit of r22            \n"
+    "        rjmp  .               ; 2.   2 cycle noop                   \n"
+    "        dec   r21             ; 1.                                  \n"
+    "        brne  dwr8            ; 1/2. While more bits to sample      \n"
     "                                                                    \n"
-    ";       Loop for each bit                                           \n"
+    ";       Add sampled byte to buffer                                  \n"
     "                                                                    \n"
-    ";       Each bit takes a total of 4*dwBitTime + 8 cycles.           \n"
+    "        st    x+,r22                                                \n"
+    "        inc   r23                                                   \n"
     "                                                                    \n"
-    "dws6:   sbrc  r22,0           ; 1/2. Skip if sending zero           \n"
-    "        sbi   0x18,5          ; 1.   Set dwire port high            \n"
-    "        sbrs  r22,0           ; 1/2. Skip if sending one            \n"
-    "        cbi   0x18,5          ; 1.   Set dwire port low             \n"
-    "        movw  r30,r24         ; 1.   Load wait count to r31:r30     \n"
+    ";       Wait for stop bit / idle line                               \n"
     "                                                                    \n"
-    ";       5 cycles from dws6 to here.                                 \n"
+    "        clr   r30                                                   \n"
+    "        clr   r31                                                   \n"
     "                                                                    \n"
-    "dws8:   sbiw  r30,1           ; 2.   Decrement wait count           \n"
-    "        brne  dws8            ; 1/2. While more waiting required    \n"
+    "dwr12:  sbiw  r30,1           ; 2.   Check for timeout              \n"
+    "        breq  dwr14           ; 1/2. If line stuck low              \n"
     "                                                                    \n"
-    ";       4*dwBitTime+4 cycles from dws6 to here.                     \n"
+    "        sbis  0x16,5          ; 1/2. Skip if Pin PB5 set            \n"
+    "        rjmp  dwr12           ; 2.   While not stop bit             \n"
     "                                                                    \n"
-    "        lsr   r22             ; 1.   Shift next bit to bit 0        \n"
-    "        dec   r21             ; 1.   Count transmitted bit          \n"
-    "        brne  dws6            ; 1/2. While more bits to transmit    \n"
+#if LW_DW_BAUD
+    ";       If bit 7 was a zero the line rose at the end of the byte,   \n"
+    ";       keep the wait count for dwTrackBitTime                      \n"
     "                                                                    \n"
-    ";       Send stop bit (mark / 1)                                    \n"
+    "        sbrs  r22,7                                                 \n"
+    "        sts   dwStopWait,r30                                        \n"
+    "        sbrs  r22,7                                                 \n"
+    "        sts   dwStopWait+1,r31                                      \n"
     "                                                                    \n"
-    "        movw  r30,r24         ; 1.   Load wait count to r31:r30     \n"
-    "        sbi   0x18,5          ; 1.   Set dwire port high            \n"
-    "        adiw  r30,1           ; 2.   Extra iteration                \n"
+#endif
+    ";       Check for all bytes expected and loop back to read next one \n"
     "                                                                    \n"
-    "dws10:  sbiw  r30,1           ; 2.   Decrement wait count           \n"
-    "        brne  dws10           ; 1/2. While more waiting required    \n"
+    "        lds   r20,dwReadMax                                         \n"
+    "        cp    r23,r20                                               \n"
+    "        brlo  dwr2            ; While more bytes expected           \n"
     "                                                                    \n"
-    "        dec   r23                                                   \n"
-    "        brne  dws2            ; While more bytes to transmit        \n"
+    ";       Read complete                                               \n"
     "                                                                    \n"
-    "dws12:  cbi   0x17,5          ; DDRB pin5 is input                  \n"
+    "dwr14:  sei                   ; Re-enable interrupts                \n"
+    "        sts   dwLen,r23                                             \n"
     "                                                                    \n"
-  :::"r21","r22","r23","r24","r25","r26","r27","r30","r31");
+  :::"r20","r21","r22","r23","r24","r25","r26","r27","r30","r31");
+  timingIrqOn();
+  dwTrackBitTime();
+}
+
+
+#if LW_DW_STREAM
+// ----------------------------------------------------------------------
+// Capture the next chunk of a request 75 stream read into dwBuf.
+//
+// Z is set and the data area read started by the same commands the host
+// would send: write r30:r31 (PC 30, BP 32, 66 C2 05 20 lo hi), then read
+// from Z (PC 0, BP 2*count, 66 C2 00 20). dwReadBytes stops as soon as
+// the chunk is in, so only a target that does not answer costs a timeout,
+// which also ends the stream.
+// ----------------------------------------------------------------------
+static void dwStreamChunk(void)
+{
+  uint8_t count = dwStreamLeft > sizeof(dwBuf) ? sizeof(dwBuf) : dwStreamLeft;
+
+  dwBuf[0]  = 0xD0; dwBuf[1]  = 0x10;                    dwBuf[2]  = 30;
+  dwBuf[3]  = 0xD1; dwBuf[4]  = 0x10;                    dwBuf[5]  = 32;
+  dwBuf[6]  = 0x66; dwBuf[7]  = 0xC2;                    dwBuf[8]  = 0x05; dwBuf[9]  = 0x20;
+  dwBuf[10] = dwStreamAddr; dwBuf[11] = dwStreamAddr >> 8;
+  dwBuf[12] = 0xD0; dwBuf[13] = 0x10;                    dwBuf[14] = 0;
+  dwBuf[15] = 0xD1; dwBuf[16] = 0x10 | (count >> 7);     dwBuf[17] = count << 1;
+  dwBuf[18] = 0x66; dwBuf[19] = 0xC2;                    dwBuf[20] = 0x00; dwBuf[21] = 0x20;
+  dwLen = 22;
+  dwSendBytes();
+  dwReadMax = count;
+  dwReadBytes();               // leaves interrupts enabled
+
+  if (dwLen < count) dwStreamLeft = 0; // target stopped answering
+  else dwStreamLeft -= count;
+  dwStreamAddr += count;
+  dwStreamPos = 0;
+  dwStreamOut = dwLen;
+  if (!dwStreamOut) dwState = 0; // nothing to hand over, the stream is over
+}
+#endif
+
+
+#if LW_DW_REPEAT
+// ----------------------------------------------------------------------
+// Send the command sequence of a request 76 repeat dwRepeatCount times.
+//
+// dwBuf holds the sequence followed by one data byte per repeat. Each
+// time round, the next data byte is first written into the sequence at
+// dwRepeatPatch, and after sending, one reply byte is read if asked for
+// and stored over the data byte just used. At the end the reply bytes
+// are moved to the start of dwBuf for request 60 to return.
+// ----------------------------------------------------------------------
+static void dwRepeat(void)
+{
+  uint8_t i, q;
+  uint8_t first = dwBuf[0];    // dwReadBytes stores the reply byte here
+
+  for (i=0; i<dwRepeatCount; i++) {
+    wdt_reset();
+    if (dwRepeatPatch < dwRepeatLen) dwBuf[dwRepeatPatch] = dwBuf[dwRepeatLen+i];
+    dwLen = dwRepeatLen;
+    dwSendBytes();
+    if (dwRepeatFlags & 0x80) {
+      dwReadMax = 1;
+      dwReadBytes();           // leaves interrupts enabled
+      dwBuf[dwRepeatLen+i] = dwLen ? dwBuf[0] : 0;
+      dwBuf[0] = first;
+    } else {
+      sei();
+      timingIrqOn();
+    }
+    for (q = dwRepeatFlags & 0x7F; q; q--) _delay_ms(1);
+  }
+  dwReadMax = sizeof(dwBuf);
+
+  dwLen = 0;
+  if (dwRepeatFlags & 0x80) {
+    for (i=0; i<dwRepeatCount; i++) dwBuf[i] = dwBuf[dwRepeatLen+i];
+    dwLen = dwRepeatCount;
+  }
+}
+#endif
+
+
+
+#if LW_DW_TRACE
+// ----------------------------------------------------------------------
+// Single step the target dwTraceCount times for request 77, from the
+// instruction at dwTracePC. Each step sends the same bytes as the host
+// would (set PC, single step), reads the break and 0x55 the target sends
+// when it stops, then asks for the PC (F0) and reads it. The PC words
+// read are collected, as sent by the target, after the 8 bytes used for
+// the commands and moved to the start of dwBuf at the end, so the host
+// gets every step with one request 60 read. Stops early if the target
+// does not answer.
+// ----------------------------------------------------------------------
+static void dwTrace(void)
+{
+  uint8_t i;
+  uint8_t steps = 0;
+  uint16_t pc = dwTracePC;
+
+  for (i=0; i<dwTraceCount; i++) {
+    wdt_reset();
+    dwBuf[0] = 0xD0; dwBuf[1] = (pc >> 8) | 0x10; dwBuf[2] = pc;
+    dwBuf[3] = 0x60; dwBuf[4] = 0x31;
+    dwLen = 5;
+    dwSendBytes();
+    dwReadMax = 2;             // the break reads as a zero byte, then 0x55
+    dwReadBytes();             // leaves interrupts enabled
+    if (dwLen < 2 || dwBuf[1] != 0x55) break;
+
+    dwBuf[0] = 0xF0;
+    dwLen = 1;
+    dwSendBytes();
+    dwReadBytes();
+    if (dwLen < 2) break;
+    dwBuf[8+2*i] = dwBuf[0];
+    dwBuf[9+2*i] = dwBuf[1];
+    pc = ((dwBuf[0] << 8) | dwBuf[1]) - 1;
+    steps++;
+  }
+  dwReadMax = sizeof(dwBuf);
+
+  for (i=0; i<2*steps; i++) dwBuf[i] = dwBuf[8+i];
+  dwLen = 2*steps;
+}
+#endif
+
+
+#if LW_UART
+// ----------------------------------------------------------------------
+// Send the dwLen bytes in dwBuf at uartBitTime, then receive up to
+// uartReadMax bytes into dwBuf. The frames are the same 8N1 as debugWIRE,
+// and the receive ends after about 24ms without a start bit. dwBitTime
+// is put back afterwards, so the debugWIRE timing and any tracking of it
+// by dwReadBytes are not disturbed.
+// ----------------------------------------------------------------------
+static void uartTransfer(void)
+{
+  uint16_t bitTime = dwBitTime;
+
+  dwBitTime = uartBitTime;
+  dwSendBytes();               // leaves interrupts disabled when it sent anything
+  if (uartReadMax) {
+    cli();
+    dwReadMax = uartReadMax;
+    dwReadBytes();             // leaves interrupts enabled
+    dwReadMax = sizeof(dwBuf);
+  } else {
+    sei();
+    timingIrqOn();
+    dwLen = 0;
+  }
+  dwBitTime = bitTime;
+
+  uartOut = dwLen;
+  if (!uartOut) dwState = 0;   // nothing for the host to collect
+}
+#endif
+
+
+
+
+/* ------------------------------------------------------------------------- */
+/* -------------------------------- 1-Wire --------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+static uchar owReset(void)
+{
+  uchar presence;
+
+  pinMode(B,DATA_PIN,OUTPUT);
+  digitalWrite(B,DATA_PIN,LOW);       // Drive the bus low
+  delayMicroseconds(480);           // delay 480 microsecond (us)
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    digitalWrite(B,DATA_PIN,HIGH);      // Release the bus
+    delayMicroseconds(70);          // delay 70 microsecond (us)
+    pinMode(B,DATA_PIN,INPUT);
+    presence=!(digitalRead(B,DATA_PIN)>>2);// Sample for presence pulse from slave
+  }
+  delayMicroseconds(410);           // delay 410 microsecond (us)
+  pinMode(B,DATA_PIN,OUTPUT);           // Release the bus
+  digitalWrite(B,DATA_PIN,HIGH);
+  return presence;
+}
+
+static void owWriteBit(uchar bit)
+{
+  pinMode(B,DATA_PIN,OUTPUT);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    digitalWrite(B,DATA_PIN,LOW);     // Drive the bus low
+    if ( bit & 0x01)
+    {
+      delayMicroseconds(6);       // delay 6 microsecond (us)
+      digitalWrite(B,DATA_PIN,HIGH);    // Release the bus
+      delayMicroseconds(64);        // delay 64 microsecond (us)
+    }
+    else
+    {
+      delayMicroseconds(60);        // delay 60 microsecond (us)
+      digitalWrite(B,DATA_PIN,HIGH);    // Release the bus
+      delayMicroseconds(10);        // delay 10 microsecond (us)
+    }
+  }
+}
+
+static uchar owReadBit(void)
+{
+  uchar bit;
+
+  pinMode(B,DATA_PIN,OUTPUT);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    digitalWrite(B,DATA_PIN,LOW);     // Drive the bus low
+    delayMicroseconds(6);         // delay 6 microsecond (us)
+    digitalWrite(B,DATA_PIN,HIGH);      // Release the bus
+    delayMicroseconds(10);          // delay 9 microsecond (us)
+    pinMode(B,DATA_PIN,INPUT);
+    bit=(digitalRead(B,DATA_PIN)>>2); // Read the status of OW_PIN
+  }
+  delayMicroseconds(55);          // delay 55 microsecond (us)
+  return bit;
+}
+
+static void owWriteByte(uchar value)
+{
+  uchar i;
+
+  for (i=0;i<8;i++)
+  {
+    owWriteBit(value);
+    value >>= 1;              // shift the data byte for the next bit to send
+  }
+}
+
+#if LW_ONEWIRE_BULK || LW_ONEWIRE_SWEEP
+static uchar owReadByte(void)
+{
+  uchar i, value = 0;
+
+  for (i=0;i<8;i++)
+  {
+    value >>= 1;
+    if (owReadBit()) value |= 0x80;
+  }
+  return value;
+}
+#endif
+
+#if LW_ONEWIRE_BULK
+// ----------------------------------------------------------------------
+// Block transfer, run for request 63.
+//
+// On entry dwBuf[0] holds flags (bit 0: start with a reset pulse),
+// dwBuf[1] the number of bytes to read and dwBuf[2..] the bytes to write.
+// On return dwBuf[0] is 0 if a reset found no presence pulse, in which
+// case nothing is written or read, and dwBuf[1..] holds the bytes read.
+// ----------------------------------------------------------------------
+static void owBlock(void)
+{
+  uchar i;
+  uchar readLen = dwBuf[1];
+
+  if (readLen > sizeof(dwBuf)-1) readLen = sizeof(dwBuf)-1;
+
+  if ((dwBuf[0] & 1) && !owReset())
+  {
+    dwBuf[0] = 0;
+    dwLen = 1;
+    return;
+  }
+  for (i=2; i<dwLen; i++)
+  {
+    wdt_reset();
+    owWriteByte(dwBuf[i]);
+  }
+  for (i=0; i<readLen; i++)
+  {
+    wdt_reset();
+    dwBuf[1+i] = owReadByte();
+  }
+  dwBuf[0] = 1;
+  dwLen = readLen+1;
+}
+
+// ----------------------------------------------------------------------
+// One step of the Maxim ROM search, run for request 62.
+//
+// On entry dwBuf[0] holds the last discrepancy and dwBuf[1..8] the ROM
+// found by the previous step. On return dwBuf[0] holds the new last
+// discrepancy, dwBuf[1..8] the ROM found, dwBuf[9] the last discrepancy
+// within the family code (0 if none) and dwBuf[10] the outcome: 0 for no
+// presence pulse, 1 for a complete ROM, 2 for a search that stopped
+// because no device answered. The host checks the CRC.
+// ----------------------------------------------------------------------
+static void owSearch(void)
+{
+  uchar lastDiscrepancy = dwBuf[0];
+  uchar lastZero = 0, familyZero = 0;
+  uchar bit, idBit, cmpBit, direction, mask;
+  uchar *rom = (uchar*)dwBuf+1;
+
+  dwLen = 11;
+  dwBuf[9] = 0;
+  if (!owReset())
+  {
+    dwBuf[10] = 0;
+    return;
+  }
+  owWriteByte(0xF0);          // search ROM
+
+  for (bit=1; bit<=64; bit++)
+  {
+    wdt_reset();
+    mask = 1<<((bit-1)&7);
+    idBit = owReadBit();
+    cmpBit = owReadBit();
+    if (idBit && cmpBit) break; // no device answered
+
+    if (idBit != cmpBit)
+      direction = idBit;      // all devices agree on this bit
+    else
+    {
+      if (bit < lastDiscrepancy)
+        direction = (rom[(bit-1)>>3] & mask) != 0; // same branch as last time
+      else
+        direction = (bit == lastDiscrepancy);
+
+      if (!direction)
+      {
+        lastZero = bit;
+        if (bit < 9) familyZero = bit;
+      }
+    }
+
+    if (direction)
+      rom[(bit-1)>>3] |= mask;
+    else
+      rom[(bit-1)>>3] &= ~mask;
+    owWriteBit(direction);
+  }
+
+  dwBuf[0] = lastZero;
+  dwBuf[9] = familyZero;
+  dwBuf[10] = (bit > 64) ? 1 : 2;
+}
+#endif
+
+#if LW_ONEWIRE_SWEEP
+// ----------------------------------------------------------------------
+// Read the scratchpad of the next sensor of a sweep, request 85, called
+// from the main loop. A sensor takes about 12 ms, so USB is served in
+// between. dwBuf holds the ROMs, 8 bytes each. The result of sensor n
+// goes to dwBuf[1+3n], behind the ROMs still to read: flags, bit 0 set
+// for a presence pulse and bit 1 for a valid CRC, then scratchpad bytes
+// 0 and 1, the temperature.
+// ----------------------------------------------------------------------
+static void owScanPoll(void)
+{
+  uchar rom[8];
+  uchar i, value, crc = 0;
+  uchar *result;
+
+  if (!owScanLeft) return;
+
+  for (i=0; i<8; i++) rom[i] = dwBuf[8*owScanPos+i];
+  result = (uchar*)dwBuf + 1 + 3*owScanPos;
+  result[0] = result[1] = result[2] = 0;
+  if (owReset())
+  {
+    owWriteByte(0x55);        // match ROM
+    for (i=0; i<8; i++) owWriteByte(rom[i]);
+    owWriteByte(0xBE);        // read scratchpad
+    for (i=0; i<9; i++)
+    {
+      wdt_reset();
+      value = owReadByte();
+      if (i < 2) result[1+i] = value;
+      crc = _crc_ibutton_update(crc, value);
+    }
+    result[0] = crc ? 1 : 3;  // the last byte is the CRC of the others
+  }
+  owScanPos++;
+  if (!--owScanLeft)
+  {
+    owResults = owScanPos;
+    dwState = 0;
+  }
+}
+#else
+#define owScanPoll()
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------- Job runner ------------------------------ */
+/* ------------------------------------------------------------------------- */
+
+#if LW_BATCH
+// ----------------------------------------------------------------------
+// Run the command batch received into dwBuf by request 56.
+//
+// Each command is 6 bytes: request id, lo8(Value), hi8(Value), lo8(Index),
+// hi8(Index) and the number of reply bytes the host expects. Commands are
+// executed exactly as if they had arrived as individual control requests
+// without a data stage, including any job they start, and their replies
+// are packed back into dwBuf in order, truncated or zero padded to the
+// expected length. A command with reply bytes is an IN request, one
+// without an OUT request, for the requests that tell the two apart. The
+// host ensures the replies never overtake commands not yet executed.
+// ----------------------------------------------------------------------
+
+// Runs one command of a batch or a macro, the request 56 format in cmd[1]
+// to cmd[5], returns its reply length. Nested batches and debugWIRE are
+// refused, as are the logic capture and the serial bridge, which would
+// take over dwBuf or usbFunctionRead with their replies.
+static uchar batchCommand(uchar *cmd, uchar replyLen)
+{
+  uchar len;
+
+  cmd[0] = replyLen ? 0xC0 : 0x40; // vendor request, IN if a reply is expected
+  cmd[6] = 0;
+  cmd[7] = 0;
+  switch (cmd[1]) {
+    case 56: case 60: case 78: case 81:
+      return 0;
+  }
+  len = usbFunctionSetup(cmd);
+  if (len > 8) len = 0;        // requests with a data stage have no reply here
+  runJob();
+  return len;
+}
+
+static void runBatch(void)
+{
+  uchar   cmd[8];
+  uint8_t in = 0, out = 0;
+  uint8_t i, len, replyLen;
+
+  while (in + 6 <= dwLen)
+  {
+    wdt_reset();
+    for (i=0; i<5; i++) cmd[1+i] = dwBuf[in+i];
+    replyLen = dwBuf[in+5];
+    in += 6;
+
+    len = batchCommand(cmd, replyLen);
+    for (i=0; i<replyLen; i++) dwBuf[out++] = i < len ? usbMsgPtr[i] : 0;
+  }
+  dwLen = out;
+}
+#endif
+
+#if LW_MACRO
+// ----------------------------------------------------------------------
+// Stored macros. The macro area of EEPROM from MACRO_EE_START holds the
+// macros one after another, each a count of commands and then the
+// commands in request 56 format. A count of 0 or 0xFF ends the area. A
+// macro runs one command per pass of the main loop, so USB is served
+// between them, and MACRO_WAIT commands are waited out a millisecond per
+// pass. Replies are collected in dwBuf after a 3 byte header for request
+// 82 to return: running flag, macro number and reply length.
+// ----------------------------------------------------------------------
+static uint16_t macroFind(uchar n)
+{
+  uint16_t a = MACRO_EE_START;
+  uchar len;
+
+  for (;;) {
+    len = eeprom_read_byte((uint8_t*)a);
+    if (!len || len == 0xFF || a + 1 + 6*len > MACRO_EE_END) return 0;
+    if (!n--) return a;
+    a += 1 + 6*len;
+  }
+}
+
+static uchar macroStart(uchar n)
+{
+  uint16_t a;
+
+  if (dwState) return 0;       // dwBuf is busy
+  a = macroFind(n);
+  if (!a) return 0;
+  macroLeft   = eeprom_read_byte((uint8_t*)a);
+  macroPos    = a + 1;
+  macroNumber = n;
+  macroWait   = 0;
+  macroOut    = 0;
+  dwState     = 0x80;
+  return 1;
+}
+
+static void macroStop(void)
+{
+  macroPins = 0;
+  if (!macroPos) return;
+  macroPos = 0;
+  dwState  = 0;
+}
+
+static void macroPoll(void)
+{
+  uchar cmd[8];
+  uchar i, len, replyLen, match;
+
+  if (macroPins) {
+    match = (PINB & macroPins) == macroLevels;
+    if (match && !macroMatch && !macroPos) macroStart(macroTrigger);
+    macroMatch = match;
+  }
+  if (!macroPos) return;
+  if (macroWait) {
+    _delay_ms(1);
+    macroWait--;
+    return;
+  }
+  if (!macroLeft) {
+    macroPos = 0;
+    dwState  = 0;
+    return;
+  }
+
+  for (i=0; i<5; i++) cmd[1+i] = eeprom_read_byte((uint8_t*)macroPos+i);
+  replyLen = eeprom_read_byte((uint8_t*)macroPos+5);
+  macroPos += 6;
+  macroLeft--;
+
+  len = 0;
+  if (cmd[1] == MACRO_WAIT) {
+    macroWait = cmd[2] | (cmd[3] << 8);
+  } else {
+    len = batchCommand(cmd, replyLen);
+  }
+  for (i=0; i<replyLen && macroOut < sizeof(dwBuf)-3; i++) dwBuf[3 + macroOut++] = i < len ? usbMsgPtr[i] : 0;
 }
 
+// Write the bytes received into dwBuf to the macro area at macroStoreAt.
+static void macroStore(void)
+{
+  uint8_t i;
+  uint8_t* a = (uint8_t*)MACRO_EE_START + macroStoreAt;
 
+  for (i=0; i<dwLen && a < (uint8_t*)MACRO_EE_END; i++, a++) {
+    wdt_reset();
+    if (eeprom_read_byte(a) != dwBuf[i]) eeprom_write_byte(a, dwBuf[i]);
+  }
+}
+#else
+#define macroPoll()
+#endif
 
+static void runJob(void)
+{
+  uchar i, q;
 
-void dwReadBytes() {
-  asm(
-    "                                                                    \n"
-    ";       Register usage:                                             \n"
-    ";                                                                   \n"
-    ";       r21     - Remaining bit count to be read in this byte       \n"
-    ";       r22     - current byte being received (shifted)             \n"
-    ";       r23     - total bytes received so far                       \n"
-    ";       r25:r24 - bit time as iteration count                       \n"
-    ";       r27:r26 - current buffer address (x)                        \n"
-    ";       r31:r30 - bit time counter                                  \n"
-    "                                                                    \n"
-    ";       Preload registers                                           \n"
-    "                                                                    \n"
-    "        clr   r23                                                   \n"
-    "        lds   r24,dwBitTime                                         \n"
-    "        lds   r25,dwBitTime+1                                       \n"
-    "        ldi   r26,lo8(dwBuf)  ; X register addresses dwBuf          \n"
-    "        ldi   r27,hi8(dwBuf)                                        \n"
-    "                                                                    \n"
-    ";       Assumes previous dwSendBytes call has left:                 \n"
-    ";         Interrupts already disabled                               \n"
-    ";         DDRB pin5 is input                                        \n"
-    "                                                                    \n"
-    ";       Wait up to 65536*6 cycles = 23.8ms for start bit            \n"
-    "                                                                    \n"
-    "dwr2:   clr   r30                                                   \n"
-    "        clr   r31                                                   \n"
-    "                                                                    \n"
-    "dwr4:   sbiw  r30,1           ; 2.   Check for timeout              \n"
-    "        breq  dwr14           ; 1/2. If no start bit encountered    \n"
-    "                                                                    \n"
-    "        sbic  0x16,5          ; 1/2. Skip if Pin PB5 clear          \n"
-    "        rjmp  dwr4            ; 2.   While no start bit             \n"
-    "                                                                    \n"
-    ";       Wait through half of start bit                              \n"
-    "                                                                    \n"
-    "        movw  r30,r24         ; 1                                   \n"
-    "        lsr   r31             ; 1                                   \n"
-    "        ror   r30             ; 1                                   \n"
-    "                                                                    \n"
-    "dwr6:   sbiw  r30,1           ; 2.                                  \n"
-    "        brne  dwr6            ; 1/2.                                \n"
-    "                                                                    \n"
-    ";       We should be half way through the start bit, check this.    \n"
-    ";       If line not still low, assume it was a glitch and go        \n"
-    ";       back to waiting for a start bit.                            \n"
-    "                                                                    \n"
-    "        sbic  0x16,5          ; 1/2. Skip if Pin PB5 clear          \n"
-    "        rjmp  dwr2            ; 2.   If not a real start bit        \n"
-    "                                                                    \n"
-    ";       Loop for 8 bits sampling the middle of each pulse.          \n"
-    "                                                                    \n"
-    "        clr   r22                                                   \n"
-    "        ldi   r21,8                                                 \n"
-    "                                                                    \n"
-    ";       Each iteration takes 4*(r25:r24) + 8 cycles.                \n"
-    "                                                                    \n"
-    "dwr8:   movw  r30,r24         ; 1.                                  \n"
-    "                                                                    \n"
-    "dwr10:  sbiw  r30,1           ; 2.                                  \n"
-    "        brne  dwr10           ; 1/2.                                \n"
-    "                                                                    \n"
-    ";       4*(r25:r24) cycles to here                                  \n"
-    "                                                                    \n"
-    ";       Sample one bit to top of r22                                \n"
-    "                                                                    \n"
-    "        lsr   r22             ; 1.                                  \n"
-    "        sbic  0x16,5          ; 1/2.                                \n"
-    "        sbr   r22,128         ; 1.   Sets top bit of r22            \n"
-    "        rjmp  .               ; 2.   2 cycle noop                   \n"
-    "        dec   r21             ; 1.                                  \n"
-    "        brne  dwr8            ; 1/2. While more bits to sample      \n"
-    "                                                                    \n"
-    ";       Add sampled byte to buffer                                  \n"
-    "                                                                    \n"
-    "        st    x+,r22                                                \n"
-    "        inc   r23                                                   \n"
-    "                                                                    \n"
-    ";       Wait for stop bit / idle line                               \n"
-    "                                                                    \n"
-    "        clr   r30                                                   \n"
-    "        clr   r31                                                   \n"
-    "                                                                    \n"
-    "dwr12:  sbiw  r30,1           ; 2.   Check for timeout              \n"
-    "        breq  dwr14           ; 1/2. If line stuck low              \n"
-    "                                                                    \n"
-    "        sbis  0x16,5          ; 1/2. Skip if Pin PB5 set            \n"
-    "        rjmp  dwr12           ; 2.   While not stop bit             \n"
-    "                                                                    \n"
-    ";       Check for buffer full and loop back to read next byte       \n"
-    "                                                                    \n"
-    "        cpi   r23,128                                               \n"
-    "        brlo  dwr2            ; While buffer not full               \n"
-    "                                                                    \n"
-    ";       Read complete                                               \n"
-    "                                                                    \n"
-    "dwr14:  sei                   ; Re-enable interrupts                \n"
-    "        sts   dwLen,r23                                             \n"
-    "                                                                    \n"
-  :::"r21","r22","r23","r24","r25","r26","r27","r30","r31");
-}
+  //-----------------------------------------------------------------------------
+  // parse rxBuffer and store the result in the sendBuffer
+  // sendBuffer[8] represents the length of the buffer
+  //-----------------------------------------------------------------------------
+  switch(jobState)
+  {
+    case 0: /* idle ... */
+    break;
+
+    case 1: /* debug spi */
+      // --------------------------------------------------------------------
+      // -- idle clock state: high
+      // -- spiMode = 3
+      // rxBuffer[0] = message to send
+      // sendBuffer[0] = reply
+      // ---------------------------------
+      // Data out:  MOSI
+      // Data in:   MISO
+      // Clock:   SCK -> max ~300 kHz
+      // --------------------------------------------------------------------
+      sendBuffer[0]=debugSpiByte(rxBuffer[0]);
+      sendBuffer[8]=1; // length
+      // --------------------------------------------------------------------
+      jobState=0;
+    break;
+
+    case 2: /* onewire reset pulse */
+      sendBuffer[0]=owReset();
+      sendBuffer[8]=1;
+      jobState=0;
+    break;
+
+    case 3: /* onewire send byte */
+      owWriteByte(rxBuffer[0]);
+      jobState=0;
+    break;
+
+    case 4: /* onewire read byte */
+      sendBuffer[0]=0;
+      for(i=0;i<8;i++)
+      {
+        sendBuffer[0] >>= 1;          // shift the result to get it ready for the next bit to receive
+        if (owReadBit()) sendBuffer[0] |= 0x80; // if result is one, then set MS-bit
+      }
+      sendBuffer[8]=1;
+      jobState=0;
+    break;
+
+    case 5: /* onewire read bit */
+      sendBuffer[0]=owReadBit();
+      sendBuffer[8]=1;
+      jobState=0;
+    break;
+
+    case 6: /* onewire write bit */
+      owWriteBit(rxBuffer[0]);
+      jobState=0;
+    break;
+
+    case 7:  /* multiple spi send and receive */
+      // --------------------------------------------------------------------
+      // -- idle clock state: low
+      // -- spiMode = 0
+      // rxBuffer[0] = message to send
+      // sendBuffer[0] = reply
+      // ---------------------------------
+      // Data out:  MISO
+      // Data in:   MOSI
+      // Clock:   SCK -> max ~650 kHz
+      // --------------------------------------------------------------------
+      usiSetup();
+      if(rxBuffer[0]) PORT &= ~(1<<5); // auto chip select?
+      for(q=0;q<rxBuffer[1];q++)
+        sendBuffer[q]=usiTransfer(rxBuffer[2+q]);
+      if(rxBuffer[0]) PORT |= (1<<5); // auto chip select?
+      sendBuffer[8]=q;
+      jobState=0;
+    break;
+
+    case 8: /* init i2c */
+      I2C_Init();
+      jobState=0;
+    break;
+
+    case 9: /* i2c send address */
+      I2C_Start(0);
+      q=I2C_Write(rxBuffer[0]);
+      sendBuffer[0]=q;
+      sendBuffer[8]=1;
+      jobState=0;
+    break;
+
+    case 10: /* i2c send byte(s) */
+      // ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      // {
+        for(i=0;i<rxBuffer[0];i++)
+          q=I2C_Write(rxBuffer[i+2]);
+      // }
+      if(rxBuffer[1])
+        I2C_Stop();
+      sendBuffer[0]=q;
+      sendBuffer[8]=1;
+      jobState=0;
+    break;
+
+    case 11: /* i2c read byte(s) */
+      // ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      // {
+        if(rxBuffer[0]) // -- end with Nack?
+        {
+          for(i=0;i<(rxBuffer[1]-1);i++)
+            sendBuffer[i]=I2C_Read(1);
+          sendBuffer[i]=I2C_Read(0);
+        }
+        else // -- always issue an Ack?
+        {
+          for(i=0;i<rxBuffer[1];i++)
+            sendBuffer[i]=I2C_Read(1);
+        }
+      // }
+      if(rxBuffer[2]) // -- should we issue a Stop?
+        I2C_Stop();
+      sendBuffer[8]=rxBuffer[1];
+      jobState=0;
+    break;
+
+    case 17: /* write ws2812 */
+      _delay_ms(1); // Hack: Make sure USB communication has finished before atomic block.
+      timingIrqOff();
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        ws2812_send();
+        ws2812_ptr=0;
+#if LW_WS2812_FRAME
+        ws2812_mode=0;
+#endif
+      }
+      timingIrqOn();
+      jobState=0;
+    break;
+
+
+
+
+    case 20: // DebugWIRE. dwState determines action:
+      // dwState flag bits:
+      //
+      //     00000001   0x01     Send break
+      //     00000010   0x02     Set timing parameter
+      //     00000100   0x04     Send bytes
+      //     00001000   0x08     Wait for start bit
+      //     00010000   0x10     Read bytes
+      //     00100000   0x20     Read pulse widths
+      //
+      // Supported combinations
+      //    $21 - Send break and read pulse widths
+      //    $02 - Set timing parameters
+      //    $04 - Send bytes
+      //    $0C - Send bytes and wait for dWIRE line state change
+      //    $14 - Send bytes and read response (normal command)
+      //    $24 - Send bytes and receive 0x55 pulse widths
+      //
+      // Note that the wait for start bit loop also monitors the dwState wait for start
+      // bit flag, and is arranged so that sending a 33 (send break and read pulse widths)
+      // will abort a pending wait.
+
+      if (dwState & 0x34) {_delay_ms(2);} // Allow USB transfer to complete before
+                                          // any action that may disable interrupts
+
+      if (dwState & 0x01) {cbi(PORTB, 5); sbi(DDRB, 5); _delay_ms(100);}
+      if (dwState & 0x02) {((char*)&dwBitTime)[0] = dwBuf[0]; ((char*)&dwBitTime)[1] = dwBuf[1];}
+      if (dwState & 0x04) {dwSendBytes();}
+      if (dwState & 0x08) {dwBuf[0]=0; dwLen=1; cbi(DDRB,5); sbi(PCMSK,5); sei();} // Capture dWIRE pin change
+      if (dwState & 0x10) {dwReadBytes();}
+      if (dwState & 0x20) {dwCaptureWidths();}
+
+      jobState = 0;
+      dwState  = 0;
+      sei();
+      timingIrqOn();
+    break;
+
+#if LW_BATCH
+    case 21: /* command batch */
+      jobState = 0;
+      runBatch();
+      dwState = 0;
+    break;
+#endif
+
+#if LW_SPI_STREAM
+    case 22: /* spi stream */
+      usiSetup();
+      if(spiCS & 1) PORT &= ~(1<<5);
+      for(q=0;q<dwLen;q++)
+        dwBuf[q]=usiTransfer(dwBuf[q]);
+      if(spiCS & 2) PORT |= (1<<5);
+      jobState = 0;
+      dwState = 0;
+    break;
+#endif
 
+#if LW_I2C_TRANSFER
+    case 23: /* i2c transfer */
+      // dwBuf[0] = address, dwBuf[1] = bytes to read, dwBuf[2..] = bytes to write
+      // result: dwBuf[0] = 0 if acknowledged, dwBuf[1..] = bytes read
+      q = dwBuf[1];
+      if(q > sizeof(dwBuf)-1) q = sizeof(dwBuf)-1;
+      dwBuf[0] = i2cTransfer(dwBuf[0], (uchar*)dwBuf+2, dwLen-2, (uchar*)dwBuf+1, q);
+      dwLen = q+1;
+      jobState = 0;
+      dwState = 0;
+    break;
+#endif
+
+#if LW_ONEWIRE_BULK
+    case 24: /* onewire search */
+      owSearch();
+      jobState = 0;
+      dwState = 0;
+    break;
+
+    case 25: /* onewire block transfer */
+      owBlock();
+      jobState = 0;
+      dwState = 0;
+    break;
+#endif
+
+#if LW_SEQUENCER
+    case 26: /* pattern sequencer start */
+      jobState = 0;
+      seqStart();
+    break;
+#endif
+
+#if LW_WS2812_FRAME
+    case 27: /* ws2812 effect start */
+      jobState = 0;
+      fxStart();
+    break;
+#endif
+
+#if LW_DW_STREAM
+    case 28: /* debugWIRE stream read, next chunk */
+      _delay_ms(2); // Let the last packet of the previous chunk go out
+      dwStreamChunk();
+      jobState = 0;
+    break;
+#endif
+
+#if LW_DW_REPEAT
+    case 29: /* debugWIRE repeat */
+      _delay_ms(2); // Allow USB transfer to complete before disabling interrupts
+      dwRepeat();
+      jobState = 0;
+      dwState  = 0;
+    break;
+#endif
+
+#if LW_DW_TRACE
+    case 30: /* debugWIRE trace */
+      _delay_ms(2); // Allow USB transfer to complete before disabling interrupts
+      dwTrace();
+      jobState = 0;
+      dwState  = 0;
+    break;
+#endif
+
+#if LW_CAPTURE
+    case 31: /* logic capture, armed */
+      capArmed();              // leaves jobState set until triggered
+    break;
+#endif
+
+#if LW_MEASURE
+    case 32: /* edge count */
+      measCountPoll();         // leaves jobState set until the gate has passed
+    break;
 
+    case 33: /* pulse measurement */
+      _delay_ms(1); // Allow USB transfer to complete before disabling interrupts
+      if (measPulses()) jobState = 0; // else time the next window on the next pass
+    break;
+#endif
+
+#if LW_UART
+    case 34: /* serial bridge */
+      _delay_ms(2); // Allow USB transfer to complete before disabling interrupts
+      uartTransfer();
+      jobState = 0;
+    break;
+#endif
+
+#if LW_MACRO
+    case 35: /* macro store */
+      macroStore();
+      jobState = 0;
+      dwState  = 0;
+    break;
+#endif
+
+#if LW_ONEWIRE_SWEEP
+    case 36: /* onewire convert T on all devices */
+      if (owReset())
+      {
+        owWriteByte(0xCC);      // skip ROM
+        owWriteByte(0x44);      // convert T
+      }
+      else
+        owConvert = 2;
+      jobState = 0;
+    break;
+
+    case 37: /* onewire sweep, scratchpads read by owScanPoll */
+      owScanPos = 0;
+      owScanLeft = dwLen / 8;
+      if (!owScanLeft) dwState = 0;
+      jobState = 0;
+    break;
+#endif
+
+#if LW_PIC24
+    case 38: /* pic24f ICSP batch */
+      pic24Batch();
+      jobState = 0;
+      dwState = 0;
+    break;
+#endif
 
 
+    default:
+      jobState=0;
+    break;
+  }
+}
+
 /* ------------------------------------------------------------------------- */
 /* --------------------------------- main ---------------------------------- */
 /* ------------------------------------------------------------------------- */
+
+#if LW_TIMING
+// usbPoll, timing the request it handles
+static void timingPoll(void)
+{
+  uint16_t start = timingNow();
+
+  usbPoll();
+  if (timingReq != 0xFF) {
+    timingRecord(0, timingReq, start);
+    timingReq = 0xFF;
+  }
+}
+
+// runJob, timing the job it runs
+static void timingJob(void)
+{
+  uchar job = jobState;
+  uint16_t start = timingNow();
+
+  runJob();
+  if (job) timingRecord(1, job, start);
+}
+#else
+#define timingPoll() usbPoll()
+#define timingJob() runJob()
+#endif
+
 int main(void) {
   uchar   i;
   uchar   calibrationValue;
+  uchar   resetCause;
 
   DDRB  = RESET_MASK;
   PORTB = RESET_MASK;
@@ -1581,11 +5583,19 @@ int main(void) {
 
   initSerialNumber();
 
-  usbDeviceDisconnect();
-  for(i=0;i<20;i++){  /* 300 ms disconnect */
-    _delay_ms(15);
+  /* After a power-on reset the host has not seen the device yet. After any
+   * other reset, the watchdog's in particular, it may still have it
+   * enumerated, so disconnect long enough for the host to notice. A reset
+   * cause cleared by a bootloader also takes the slow path. */
+  resetCause = MCUSR;
+  MCUSR = 0;
+  if(!(resetCause & (1<<PORF)) || (resetCause & (1<<WDRF))){
+    usbDeviceDisconnect();
+    for(i=0;i<20;i++){  /* 300 ms disconnect */
+      _delay_ms(15);
+    }
+    usbDeviceConnect();
   }
-  usbDeviceConnect();
 
   I2C_DELAY = 5;
   SPI_DELAY = 0;
@@ -1615,391 +5625,53 @@ int main(void) {
   for(;;)
   {
     wdt_reset();
-    usbPoll();
-
-    //-----------------------------------------------------------------------------
-    // parse rxBuffer and store the result in the sendBuffer
-    // sendBuffer[8] represents the length of the buffer
-    //-----------------------------------------------------------------------------
-    switch(jobState)
-    {
-      case 0: /* idle ... */
-      break;
-
-      case 1: /* debug spi */
-        // --------------------------------------------------------------------
-        // -- idle clock state: high
-        // -- spiMode = 3
-        // rxBuffer[0] = message to send
-        // sendBuffer[0] = reply
-        // ---------------------------------
-        // Data out:  MOSI
-        // Data in:   MISO
-        // Clock:   SCK -> max ~300 kHz
-        // --------------------------------------------------------------------
-        DDRB |= MOSI_MASK;
-        DDRB &= ~MISO_MASK;
-        DDRB |= SCK_MASK;
-        PORTB |= SCK_MASK;
-        sendBuffer[0]=0;
-        t = rxBuffer[0];
-        for ( q = 0x80; q; q >>= 1 )
-        {
-          PORT &= ~MOSI_MASK; /* Clear send data */
-          for(i=0;i<SPI_DELAY;i++) _delay_us(1); /* Small delay */
-          if  ( t & q ) { PORTB |= MOSI_MASK; } /* Send the data */
-          PORT &= ~SCK_MASK; /* High to low edge */
-          sendBuffer[0]<<=1; /* Shift the register */
-          sendBuffer[0]+=((PINB&(MISO_MASK))>>1); /* Sample the data */
-          for(i=0;i<SPI_DELAY;i++) _delay_us(1); /* Small delay */
-          PORT |= SCK_MASK; /* Low to high edge */
-        }
-        sendBuffer[8]=1; // length
-        // --------------------------------------------------------------------
-        jobState=0;
-      break;
-
-      case 2: /* onewire reset pulse */
-        pinMode(B,DATA_PIN,OUTPUT);
-        digitalWrite(B,DATA_PIN,LOW);       // Drive the bus low
-        delayMicroseconds(480);           // delay 480 microsecond (us)
-        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-        {
-          digitalWrite(B,DATA_PIN,HIGH);      // Release the bus
-          delayMicroseconds(70);          // delay 70 microsecond (us)
-          pinMode(B,DATA_PIN,INPUT);
-          sendBuffer[0]=!(digitalRead(B,DATA_PIN)>>2);// Sample for presence pulse from slave
-        }
-        delayMicroseconds(410);           // delay 410 microsecond (us)
-        pinMode(B,DATA_PIN,OUTPUT);           // Release the bus
-        digitalWrite(B,DATA_PIN,HIGH);
-        sendBuffer[8]=1;
-        jobState=0;
-      break;
-
-      case 3: /* onewire send byte */
-        q=rxBuffer[0];
-        pinMode(B,DATA_PIN,OUTPUT);
-        for (i=0;i<8;i++)
-        {
-          ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-          {
-            digitalWrite(B,DATA_PIN,LOW);   // Drive the bus low
-
-            if ( q & 0x01)
-            {
-              delayMicroseconds(6);     // delay 6 microsecond (us)
-              digitalWrite(B,DATA_PIN,HIGH);  // Release the bus
-              delayMicroseconds(64);      // delay 64 microsecond (us)
-            }
-            else
-            {
-              delayMicroseconds(60);      // delay 60 microsecond (us)
-              digitalWrite(B,DATA_PIN,HIGH);  // Release the bus
-              delayMicroseconds(10);      // delay 10 microsecond (us)
-            }
-            q >>= 1;              // shift the data byte for the next bit to send
-          }
-        }
-        jobState=0;
-      break;
-
-      case 4: /* onewire read byte */
-        sendBuffer[0]=0;
-        for(i=0;i<8;i++)
-        {
-          sendBuffer[0] >>= 1;          // shift the result to get it ready for the next bit to receive
-          pinMode(B,DATA_PIN,OUTPUT);
-          ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-          {
-            digitalWrite(B,DATA_PIN,LOW);   // Drive the bus low
-            delayMicroseconds(6);       // delay 6 microsecond (us)
-            digitalWrite(B,DATA_PIN,HIGH);    // Release the bus
-            delayMicroseconds(10);        // delay 9 microsecond (us)
-            pinMode(B,DATA_PIN,INPUT);
-            q = (digitalRead(B,DATA_PIN)>>2); // Read the status of OW_PIN
-          }
-          delayMicroseconds(55);          // delay 55 microsecond (us)
-          if (q)  sendBuffer[0] |= 0x80;      // if result is one, then set MS-bit
-        }
-        sendBuffer[8]=1;
-        jobState=0;
-      break;
-
-      case 5: /* onewire read bit */
-        pinMode(B,DATA_PIN,OUTPUT);
-        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-        {
-          digitalWrite(B,DATA_PIN,LOW);     // Drive the bus low
-          delayMicroseconds(6);         // delay 6 microsecond (us)
-          digitalWrite(B,DATA_PIN,HIGH);      // Release the bus
-          delayMicroseconds(10);          // delay 9 microsecond (us)
-          pinMode(B,DATA_PIN,INPUT);
-          sendBuffer[0]=(digitalRead(B,DATA_PIN)>>2); // Read the status of OW_PIN
-        }
-        sendBuffer[8]=1;
-        jobState=0;
-      break;
-
-      case 6: /* onewire write bit */
-        pinMode(B,DATA_PIN,OUTPUT);
-        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-        {
-          digitalWrite(B,DATA_PIN,LOW);     // Drive the bus low
-          if ( rxBuffer[0] & 0x01)
-          {
-            delayMicroseconds(6);       // delay 6 microsecond (us)
-            digitalWrite(B,DATA_PIN,HIGH);    // Release the bus
-            delayMicroseconds(64);        // delay 64 microsecond (us)
-          }
-          else
-          {
-            delayMicroseconds(60);        // delay 60 microsecond (us)
-            digitalWrite(B,DATA_PIN,HIGH);    // Release the bus
-            delayMicroseconds(10);        // delay 10 microsecond (us)
-          }
-        }
-        jobState=0;
-      break;
-
-      case 7:  /* multiple spi send and receive */
-        // --------------------------------------------------------------------
-        // -- idle clock state: low
-        // -- spiMode = 0
-        // rxBuffer[0] = message to send
-        // sendBuffer[0] = reply
-        // ---------------------------------
-        // Data out:  MISO
-        // Data in:   MOSI
-        // Clock:   SCK -> max ~650 kHz
-        // --------------------------------------------------------------------
-        DDRB |= MISO_MASK;
-        DDRB &= ~MOSI_MASK;
-        DDRB |= SCK_MASK;
-        PORTB &= ~SCK_MASK;
-        t=(1<<USIWM0)|(1<<USICS1)|(1<<USICLK)|(1<<USITC);
-        USICR = (1<<USIWM0)|(1<<USICS1)|(1<<USICLK);
-        if(rxBuffer[0]) PORT &= ~(1<<5); // auto chip select?
-        for(q=0;q<rxBuffer[1];q++)
-        {
-          USIDR=rxBuffer[2+q];
-          USISR=(1<<USIOIF);
-          do {
-            USICR = t;
-            for(i=0;i<SPI_DELAY;i++)  _delay_us(1);
-          } while ((USISR & (1<<USIOIF))==0);
-          sendBuffer[q]=USIDR;
-        }
-        if(rxBuffer[0]) PORT |= (1<<5); // auto chip select?
-        sendBuffer[8]=q;
-        jobState=0;
-      break;
-
-      case 8: /* init i2c */
-        I2C_Init();
-        jobState=0;
-      break;
-
-      case 9: /* i2c send address */
-        I2C_Start(0);
-        q=I2C_Write(rxBuffer[0]);
-        sendBuffer[0]=q;
-        sendBuffer[8]=1;
-        jobState=0;
-      break;
-
-      case 10: /* i2c send byte(s) */
-        // ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-        // {
-          for(i=0;i<rxBuffer[0];i++)
-            q=I2C_Write(rxBuffer[i+2]);
-        // }
-        if(rxBuffer[1])
-          I2C_Stop();
-        sendBuffer[0]=q;
-        sendBuffer[8]=1;
-        jobState=0;
-      break;
-
-      case 11: /* i2c read byte(s) */
-        // ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-        // {
-          if(rxBuffer[0]) // -- end with Nack?
-          {
-            for(i=0;i<(rxBuffer[1]-1);i++)
-              sendBuffer[i]=I2C_Read(1);
-            sendBuffer[i]=I2C_Read(0);
-          }
-          else // -- always issue an Ack?
-          {
-            for(i=0;i<rxBuffer[1];i++)
-              sendBuffer[i]=I2C_Read(1);
-          }
-        // }
-        if(rxBuffer[2]) // -- should we issue a Stop?
-          I2C_Stop();
-        sendBuffer[8]=rxBuffer[1];
-        jobState=0;
-      break;
-
-    #if 0
-      case 12: /* pic24f - Clock Control Bits */
-        ClockControlBits(rxBuffer[1]);
-        jobState=0;
-      break;
-      case 13: /* pic24f - Clock Low x Times */
-        ClockLowXTimes(rxBuffer[1]);
-        jobState=0;
-      break;
-      case 14: /* pic24f - Clock Byte */
-        for(i=0;i<rxBuffer[0];i++)
-          ClockByte(rxBuffer[i+1]);
-        jobState=0;
-      break;
-      case 15: /* pic24f - Pin Byte */
-        for(i=0;i<rxBuffer[1];i++)
-        {
-          PinByte(&q);
-          sendBuffer[i]=q;
-        }
-        sendBuffer[8]=rxBuffer[1];
-        jobState=0;
-      break;
-      case 16: /* pic24f - sendSix */
-        ClockControlBits(0x00);
-        ClockByte(rxBuffer[1]);
-        ClockByte(rxBuffer[2]);
-        ClockByte(rxBuffer[3]);
-        for(q=0;q<rxBuffer[0];q++)
-        {
-          ClockControlBits(0x00);
-          ClockByte(0x00);
-          ClockByte(0x00);
-          ClockByte(0x00);
-        }
-        jobState=0;
-      break;
-    #endif
-
-      case 17: /* write ws2812 */
-        _delay_ms(1); // Hack: Make sure USB communication has finished before atomic block.
-        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-        {
-          ws2812_sendarray_mask(ws2812_grb,ws2812_ptr,ws2812_mask);   //mask=1<<(data[2]&7)
-          ws2812_ptr=0;
-        }
-        jobState=0;
-      break;
-
-
-
-
-      case 20: // DebugWIRE. dwState determines action:
-        // dwState flag bits:
-        //
-        //     00000001   0x01     Send break
-        //     00000010   0x02     Set timing parameter
-        //     00000100   0x04     Send bytes
-        //     00001000   0x08     Wait for start bit
-        //     00010000   0x10     Read bytes
-        //     00100000   0x20     Read pulse widths
-        //
-        // Supported combinations
-        //    $21 - Send break and read pulse widths
-        //    $02 - Set timing parameters
-        //    $04 - Send bytes
-        //    $0C - Send bytes and wait for dWIRE line state change
-        //    $14 - Send bytes and read response (normal command)
-        //    $24 - Send bytes and receive 0x55 pulse widths
-        //
-        // Note that the wait for start bit loop also monitors the dwState wait for start
-        // bit flag, and is arranged so that sending a 33 (send break and read pulse widths)
-        // will abort a pending wait.
-
-        if (dwState & 0x34) {_delay_ms(2);} // Allow USB transfer to complete before
-                                            // any action that may disable interrupts
-
-        if (dwState & 0x01) {cbi(PORTB, 5); sbi(DDRB, 5); _delay_ms(100);}
-        if (dwState & 0x02) {((char*)&dwBitTime)[0] = dwBuf[0]; ((char*)&dwBitTime)[1] = dwBuf[1];}
-        if (dwState & 0x04) {dwSendBytes();}
-        if (dwState & 0x08) {dwBuf[0]=0; dwLen=1; cbi(DDRB,5); sbi(PCMSK,5); sei();} // Capture dWIRE pin change
-        if (dwState & 0x10) {dwReadBytes();}
-        if (dwState & 0x20) {dwCaptureWidths();}
-
-        jobState = 0;
-        dwState  = 0;
-        sei();
-      break;
-
-
-      default:
-        jobState=0;
-      break;
-    }
-
-
-    if(softPWM)
-    {
-      if(counter==0)
-      {
-        cmp0=compare0;
-        cmp1=compare1;
-        cmp2=compare2;
-      }
-      else
-      {
-        if(counter>cmp0)
-          digitalWrite(B,0,LOW);
-        else
-          digitalWrite(B,0,HIGH);
-        if(counter>cmp1)
-          digitalWrite(B,1,LOW);
-        else
-          digitalWrite(B,1,HIGH);
-        if(counter>cmp2)
-          digitalWrite(B,2,LOW);
-        else
-          digitalWrite(B,2,HIGH);
-      }
-      counter++;
-    }
-
+    timingLoop();
+    timingPoll();
+    timingJob();
+    pinEventPoll();
+    dwBreakPoll();
+    fxPoll();
+    servoPoll();
+    debugPoll();
+    macroPoll();
+    owScanPoll();
+    adcScanPoll();
+    softPWMPoll();
   }
   return 0;
 }
 
 static inline void initSerialNumber()
 {
-  uint8_t eepromProblem = 0;
-
-  char val1 = eeprom_read_byte(EE_addr+0);
-  char val2 = eeprom_read_byte(EE_addr+1);
-  char val3 = eeprom_read_byte(EE_addr+2);
+  uint8_t n;
+  char val;
 
   // ascii 48 -> '0' , 57 -> '9'
-
-  if((val1 < 48) || (val1 > 57))
-  {
-    eepromProblem = 1;
-  }
-  else if((val2 < 48) || (val2 > 57))
-  {
-    eepromProblem = 1;
-  }
-  else if((val3 < 48) || (val3 > 57))
-  {
-    eepromProblem = 1;
+  for (n=0; n<SERIAL_MAX_DIGITS; n++) {
+    val = eeprom_read_byte(EE_addr+n);
+    if((val < 48) || (val > 57)) break;
+    usbDescriptorStringSerialNumber[1+n] = val;
   }
 
   /* default serial number ... */
-  if(eepromProblem != 0)
+  if(n == 0)
   {
     eeprom_write_byte((EE_addr+0),'5');
     eeprom_write_byte((EE_addr+1),'1');
     eeprom_write_byte((EE_addr+2),'2');
+    eeprom_write_byte((EE_addr+3),0xFF);
+    usbDescriptorStringSerialNumber[1] = '5';
+    usbDescriptorStringSerialNumber[2] = '1';
+    usbDescriptorStringSerialNumber[3] = '2';
+    n = 3;
   }
 
-  usbDescriptorStringSerialNumber[1] = eeprom_read_byte(EE_addr+0);
-  usbDescriptorStringSerialNumber[2] = eeprom_read_byte(EE_addr+1);
-  usbDescriptorStringSerialNumber[3] = eeprom_read_byte(EE_addr+2);
+  usbDescriptorStringSerialNumber[0] = USB_STRING_DESCRIPTOR_HEADER(n);
+}
+
+// Only the serial number string is dynamic, its length depends on the EEPROM
+usbMsgLen_t usbFunctionDescriptor(struct usbRequest *rq)
+{
+  usbMsgPtr = (uchar*)usbDescriptorStringSerialNumber;
+  return usbDescriptorStringSerialNumber[0] & 0xFF;
 }
@@ -65,7 +65,7 @@
  * it is required by the standard. We have made it a config option because it
  * bloats the code considerably.
  */
-#define USB_CFG_INTR_POLL_INTERVAL      100
+#define USB_CFG_INTR_POLL_INTERVAL      10
 /* If you compile a version with endpoint 1 (interrupt-in), this is the poll
  * interval. The value is in milliseconds and must not be less than 10 ms for
  * low speed devices.
@@ -244,7 +244,7 @@ extern void usbEventResetReady(void);
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
 #define USB_CFG_DESCR_PROPS_STRING_PRODUCT          0
 // #define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    0
-#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    (USB_PROP_IS_RAM | (2 * USB_PROP_LENGTH(3)+2))
+#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    (USB_PROP_IS_RAM | USB_PROP_IS_DYNAMIC) // 1 to 8 digits, see usbFunctionDescriptor
 #define USB_CFG_DESCR_PROPS_HID                     0
 #define USB_CFG_DESCR_PROPS_HID_REPORT              0
 #define USB_CFG_DESCR_PROPS_UNKNOWN                 0
@@ -321,12 +321,49 @@ extern void usbEventResetReady(void);
    low at end of usb token handling.
 
    On detecting a non-idle dwdebugWIRE line, set dwBuf[0] to 1 and disable
-   further interrupts from the debugWIRE pin changing.
+   further interrupts from the debugWIRE pin changing. This is only done
+   while the debugWIRE pin change is enabled in PCMSK, as dwBuf and pin 5
+   are used for other things the rest of the time.
+
+   When pin change events are on (bit 6 of pinEventLatch, see main.c) the
+   debugWIRE capture is skipped. Instead the port is sampled into bits 0-5
+   of pinEventLatch and bit 7 is set, unless the main loop has not taken
+   the previous sample yet. That way a pulse shorter than the main loop
+   latency still produces both of its edges. TCNT1, pinEventTimeHi and
+   TIFR are stored in pinEventStamp alongside, so that the event is stamped
+   with the time of the edge rather than the time the main loop took it.
+   This part is only assembled in a PIN_EVENTS=1 build.
 */
 
 #ifdef __ASSEMBLER__
 macro nonUsbPinChange
     .global dwBuf
+#if LW_PIN_EVENTS
+    .global pinEventLatch
+    .global pinEventStamp
+    .global pinEventTimeHi
+    lds   YL,pinEventLatch
+    sbrs  YL,6
+    rjmp  pinEventsOff
+    sbrc  YL,7
+    rjmp  dWirePinIdle  ; previous sample not taken yet
+    in    YL,PINB
+    ori   YL,0xC0
+    sts   pinEventLatch,YL
+    in    YL,TCNT1
+    sts   pinEventStamp,YL
+    lds   YL,pinEventTimeHi
+    sts   pinEventStamp+1,YL
+    lds   YL,pinEventTimeHi+1
+    sts   pinEventStamp+2,YL
+    in    YL,TIFR       ; an overflow not counted yet, see pinEventPoll
+    sts   pinEventStamp+3,YL
+    rjmp  dWirePinIdle
+
+pinEventsOff:
+#endif
+    sbis  PCMSK,5
+    rjmp  dWirePinIdle  ; debugWIRE pin change capture is off
     sbic  PINB,5
     rjmp  dWirePinIdle
 
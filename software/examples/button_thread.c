@@ -28,6 +28,22 @@ unsigned char version;
 void *buttonHandler(void *arg)
 {
 	int buttonPin = (int)arg;
+	lwPinEvent events[PIN_EVENTS_PER_READ];
+	unsigned long lastPress = 0;
+	int i, count;
+
+	// Newer firmware reports pin changes itself, no polling needed
+	if(pinEvents_enable(lw, 1<<buttonPin) > 0){
+		for(;;){
+			count = pinEvents_read(lw, events, 1000);
+			for(i=0;i<count;i++){
+				if(!(events[i].pins & (1<<buttonPin)) && (events[i].time - lastPress > DEBOUNCE*1000UL)){
+					lastPress = events[i].time;
+					printf("\n> Button pressed at %lu us.\n", events[i].time);
+				}
+			}
+		}
+	}
 
 	for(;;){
 		if ( digitalRead(lw, buttonPin) == LOW ){
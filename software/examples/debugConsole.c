@@ -32,6 +32,34 @@ int main(int argc, char **argv)
 		
 	char input;
 
+	if(lw_hasCapability(lw, LW_CAP_DEBUG_FIFO) && debugSpi_start(lw, 20) == 1)
+	{
+		// The device polls the target and queues its output, read it in blocks.
+		// Poll quickly while the target talks, back off to 50 ms while it is quiet.
+		unsigned char buffer[DEBUG_CONSOLE_SIZE];
+		int wait = 1;
+		int count;
+
+		while(1)
+		{
+			count = debugSpi_read(lw, buffer, sizeof(buffer));
+			if(count < 0)
+			{
+				printf("> lwStatus: %d\n",lwStatus);
+				printf("> Connection error!\n");
+				return 0;
+			}
+			fwrite(buffer, 1, count, stdout);
+			fflush(stdout);
+			if(count > DEBUG_CONSOLE_SIZE/2)
+				wait = 1;
+			else if(!count && wait < 50)
+				wait *= 2;
+			if(count < DEBUG_CONSOLE_SIZE/2)
+				delay(wait);
+		}
+	}
+
 	while(1)
 	{
 		input=debugSpi(lw,0x00);
@@ -3,19 +3,27 @@
 
 // LittleWire connection
 
-usb_dev_handle *Port = 0;
+PerTarget usb_dev_handle *Port = 0;
+
+
+// FT232 connection, used in place of the LittleWire while SerialPort is open
+
+PerTarget FileHandle SerialPort = 0;
+PerTarget char       UsbSerialPortName[256] = "";  // e.g. ttyUSB0 or COM4, empty to scan
+PerTarget int        SerialBaud  = 0;
+PerTarget int        BreakLength = 0;              // ms
 
 
 
 
 // Current device state
 
-int PC  = 0;  // PC as a flash address, twice the value used over the dwire interface
-int BP  =-1;  // BP as a flash address, twice the value used over the dwire interface
-u8  R[32];    // r28-r31 cached at break, others loaded on demand
+PerTarget int PC  = 0;  // PC as a flash address, twice the value used over the dwire interface
+PerTarget int BP  =-1;  // BP as a flash address, twice the value used over the dwire interface
+PerTarget u8  R[32];    // r28-r31 cached at break, others loaded on demand
 
 
-int TimerEnable = 0;
+PerTarget int TimerEnable = 0;
 
 
 // Device specific characteristics
@@ -64,7 +72,7 @@ struct {
   {0,                  0,   0,    0,    0,     0,    0,   0,      0, 0,    0}
 };
 
-int DeviceType = -1;
+PerTarget int DeviceType = -1;
 
 void CheckDevice() {if (DeviceType<0) {Fail("Device not recognised.");}}
 
@@ -86,6 +94,13 @@ char *Name()       {CheckDevice(); return Characteristics[DeviceType].name;}
 int  SPMCSR()      {return 0x37;} // SPMCSR is at the same address on all devices
 
 enum {MaxFlashPageSize = 128, MaxFlashSize = 32768, MaxSRamSize = 2048};
+enum {MinFlashPageSize = 16};
+
+
+// Host copy of target flash, filled a page at a time by DwReadFlash
+
+PerTarget u8 FlashCache[MaxFlashSize]                     = {0};
+PerTarget u8 FlashCached[MaxFlashSize/MinFlashPageSize]   = {0};  // Non zero where the page in FlashCache is valid
 
 
 // Current loaded file
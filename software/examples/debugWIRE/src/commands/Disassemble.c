@@ -1,478 +1,350 @@
 // Disassembler
 
-
-int next; // Next instruction word value, for 2 word instructions.
-
-/// AVR disassembly
-
-//  0000 0000 0000 0000  N0P
-//  0000 0001 dddd rrrr  M0VW
-//  0000 0010 dddd rrrr  MULS
-//  0000 0011 0ddd 0rrr  MULSU
-//  0000 0011 0ddd 1rrr  FMUL
-//  0000 0011 1ddd 0rrr  FMULS
-//  0000 0011 1ddd 1rrr  FMULSU
-//  0000 01rd dddd rrrr  CPC
-//  0000 10rd dddd rrrr  SBC
-//  0000 11rd dddd rrrr  ADD
-
-void Wreg(int n) {
-  Wc('r'); Wd(n, 1);
-}
-
-void WregPair(int n) {
-  Wreg(n+1); Wc(':'); Wreg(n);
-}
-
-void WSramAddr(int addr) {
-  if (SramSymbol[addr]) {
-    Ws(SramSymbol[addr]);
-    Ws(" ($"); Wx(addr,1); Wc(')');
-  } else {
-    Wc('$'); Wx(addr,1);
-  }
-}
-
-int Winst0(int i, int code) {
-  u8 rrrrr = ((code & 0x200) >> 5) | (code & 0xF);
-  u8 ddddd = (code >> 4) & 0x1F;
-  switch ((code>>8) & 0xF) {
-    case 0: Ws("nop   "); return 0; break;
-    case 1: Ws("movw  "); WregPair((code>>3) & 0x1e);   Wc(','); WregPair((code<<1) & 0x1e); return 0; break;
-    case 2: Ws("muls  "); Wreg(((code>>4) & 0xf) + 16); Wc(','); Wreg((code & 0xf) + 16);    return 0; break;
-    case 3: Ws("mulsu/fmul/fmuls/fmulsu?"); break;
-    default:
-      switch ((code>>10) & 3) {
-        case 1: Ws("cpc   "); break;
-        case 2: Ws("sbc   "); break;
-        case 3: Ws("add   "); break;
-      }
-      Wreg(ddddd); Ws(", "); Wreg(rrrrr);
-    break;
-  }
-  return 0;
-}
-
-int Winst8(int i, int code) {Ws("Inst 8xxx"); return 0;}
-int WinstA(int i, int code) {Ws("Inst Axxx"); return 0;}
-
-//  0001 00rd dddd rrrr  CPSE
-//  0001 01rd dddd rrrr  CP
-//  0001 10rd dddd rrrr  SUB
-//  0001 11rd dddd rrrr  ADC
-
-//  0010 00rd dddd rrrr  AND
-//  0010 01rd dddd rrrr  E0R
-//  0010 10rd dddd rrrr  0R
-//  0010 11rd dddd rrrr  M0V
-
-void wrdddddrrrr(int code) {
-  int d = (code >> 4) & 0x1f;
-  int r = ((code >> 5) & 0x10) | (code & 0x0f);
-  Wreg(d); Ws(", "); Wreg(r);
-}
-
-int Winst1(int i, int code) {
-  switch ((code>>10) & 3) {
-    case 0: Ws("cpse  "); break;
-    case 1: Ws("cp    "); break;
-    case 2: Ws("sub   "); break;
-    case 3: Ws("adc   "); break;
+// Instructions are decoded by matching the first word against the table
+// below into an AvrInstruction record, which is then written out. Records
+// are cached by flash address, so listing the same code again, as when
+// viewing a long trace, only decodes it once. A cached record is used
+// only while the instruction words at its address are those it was
+// decoded from, so changes to flash are picked up automatically.
+
+
+/// Operand formats
+
+enum {
+  OpNone,     //
+  OpRdRr,     // 0000 11rd dddd rrrr  r0-r31, r0-r31
+  OpRd,       // 1001 010d dddd 0000  r0-r31
+  OpRdText,   // 1001 000d dddd 0001  r0-r31 then fixed text, e.g. ", Z+"
+  OpMovw,     // 0000 0001 dddd rrrr  register pairs
+  OpMuls,     // 0000 0010 dddd rrrr  r16-r31, r16-r31
+  OpMulsu,    // 0000 0011 0ddd 0rrr  r16-r23, r16-r23
+  OpRdK,      // 0011 KKKK dddd KKKK  r16-r31, 8 bit immediate
+  OpLdi,      // 1110 KKKK dddd KKKK  r16-r31, 8 bit immediate shown as a data address
+  OpLdd,      // 10q0 qq0d dddd yqqq  r0-r31, Y or Z plus 6 bit displacement
+  OpLds,      // 1001 000d dddd 0000  r0-r31, 16 bit data address in the next word
+  OpAdiw,     // 1001 0110 KKdd KKKK  r24-r31 pair, 6 bit immediate
+  OpIoBit,    // 1001 1000 AAAA Abbb  io 0-31, bit
+  OpIn,       // 1011 0AAd dddd AAAA  r0-r31, io 0-63
+  OpOut,      // 1011 1AAr rrrr AAAA  io 0-63, r0-r31
+  OpRdBit,    // 1111 100d dddd 0bbb  r0-r31, bit
+  OpJmp,      // 1001 010k kkkk 110k  22 bit flash word address, low 16 bits in the next word
+  OpRel12,    // 1100 kkkk kkkk kkkk  12 bit signed relative word address
+  OpRel7      // 1111 00kk kkkk ksss  7 bit signed relative word address
+};
+
+
+/// Effect on the flow of control
+
+enum {FlowNext, FlowJump, FlowCall, FlowBranch, FlowSkip, FlowReturn, FlowIndirect, FlowBreak};
+
+
+typedef struct {
+  u16   mask;
+  u16   match;     // First instruction word & mask == match
+  char *mnemonic;
+  u8    format;
+  u8    flow;
+  char *alias;     // Short form: for OpRdRr when Rd = Rr, for OpLdd when there is no displacement
+  char *operand;   // OpRdText text, OpLdd pointer register
+} AvrOpcode;
+
+
+// Searched in order, the first match wins.
+
+AvrOpcode AvrOpcodes[] = {
+  {0xFFFF, 0x0000, "nop",    OpNone,   FlowNext},
+  {0xFF00, 0x0100, "movw",   OpMovw,   FlowNext},
+  {0xFF00, 0x0200, "muls",   OpMuls,   FlowNext},
+  {0xFF88, 0x0300, "mulsu",  OpMulsu,  FlowNext},
+  {0xFF88, 0x0308, "fmul",   OpMulsu,  FlowNext},
+  {0xFF88, 0x0380, "fmuls",  OpMulsu,  FlowNext},
+  {0xFF88, 0x0388, "fmulsu", OpMulsu,  FlowNext},
+  {0xFC00, 0x0400, "cpc",    OpRdRr,   FlowNext},
+  {0xFC00, 0x0800, "sbc",    OpRdRr,   FlowNext},
+  {0xFC00, 0x0C00, "add",    OpRdRr,   FlowNext},
+  {0xFC00, 0x1000, "cpse",   OpRdRr,   FlowSkip},
+  {0xFC00, 0x1400, "cp",     OpRdRr,   FlowNext},
+  {0xFC00, 0x1800, "sub",    OpRdRr,   FlowNext},
+  {0xFC00, 0x1C00, "adc",    OpRdRr,   FlowNext},
+  {0xFC00, 0x2000, "and",    OpRdRr,   FlowNext, "tst"},
+  {0xFC00, 0x2400, "eor",    OpRdRr,   FlowNext, "clr"},
+  {0xFC00, 0x2800, "or",     OpRdRr,   FlowNext},
+  {0xFC00, 0x2C00, "mov",    OpRdRr,   FlowNext},
+  {0xF000, 0x3000, "cpi",    OpRdK,    FlowNext},
+  {0xF000, 0x4000, "sbci",   OpRdK,    FlowNext},
+  {0xF000, 0x5000, "subi",   OpRdK,    FlowNext},
+  {0xF000, 0x6000, "ori",    OpRdK,    FlowNext},
+  {0xF000, 0x7000, "andi",   OpRdK,    FlowNext},
+  {0xD208, 0x8000, "ldd",    OpLdd,    FlowNext, "ld", "Z"},
+  {0xD208, 0x8008, "ldd",    OpLdd,    FlowNext, "ld", "Y"},
+  {0xD208, 0x8200, "std",    OpLdd,    FlowNext, "st", "Z"},
+  {0xD208, 0x8208, "std",    OpLdd,    FlowNext, "st", "Y"},
+
+  {0xFE0F, 0x9000, "lds",    OpLds,    FlowNext},
+  {0xFE0F, 0x9001, "ld",     OpRdText, FlowNext, 0, ", Z+"},
+  {0xFE0F, 0x9002, "ld",     OpRdText, FlowNext, 0, ", -Z"},
+  {0xFE0F, 0x9004, "lpm",    OpRdText, FlowNext, 0, ", Z"},
+  {0xFE0F, 0x9005, "lpm",    OpRdText, FlowNext, 0, ", Z+"},
+  {0xFE0F, 0x9006, "elpm",   OpRdText, FlowNext, 0, ", Z"},
+  {0xFE0F, 0x9007, "elpm",   OpRdText, FlowNext, 0, ", Z+"},
+  {0xFE0F, 0x9009, "ld",     OpRdText, FlowNext, 0, ", Y+"},
+  {0xFE0F, 0x900A, "ld",     OpRdText, FlowNext, 0, ", -Y"},
+  {0xFE0F, 0x900C, "ld",     OpRdText, FlowNext, 0, ", X"},
+  {0xFE0F, 0x900D, "ld",     OpRdText, FlowNext, 0, ", X+"},
+  {0xFE0F, 0x900E, "ld",     OpRdText, FlowNext, 0, ", -X"},
+  {0xFE0F, 0x900F, "pop",    OpRd,     FlowNext},
+
+  {0xFE0F, 0x9200, "sts",    OpLds,    FlowNext},
+  {0xFE0F, 0x9201, "st",     OpRdText, FlowNext, 0, ", Z+"},
+  {0xFE0F, 0x9202, "st",     OpRdText, FlowNext, 0, ", -Z"},
+  {0xFE0F, 0x9209, "st",     OpRdText, FlowNext, 0, ", Y+"},
+  {0xFE0F, 0x920A, "st",     OpRdText, FlowNext, 0, ", -Y"},
+  {0xFE0F, 0x920C, "st",     OpRdText, FlowNext, 0, ", X"},
+  {0xFE0F, 0x920D, "st",     OpRdText, FlowNext, 0, ", X+"},
+  {0xFE0F, 0x920E, "st",     OpRdText, FlowNext, 0, ", -X"},
+  {0xFE0F, 0x920F, "push",   OpRd,     FlowNext},
+
+  {0xFFFF, 0x9508, "ret",    OpNone,   FlowReturn},
+  {0xFFFF, 0x9509, "icall",  OpNone,   FlowIndirect},
+  {0xFFFF, 0x9518, "reti",   OpNone,   FlowReturn},
+  {0xFFFF, 0x9519, "eicall", OpNone,   FlowIndirect},
+  {0xFFFF, 0x9588, "sleep",  OpNone,   FlowNext},
+  {0xFFFF, 0x9598, "break",  OpNone,   FlowBreak},
+  {0xFFFF, 0x95A8, "wdr",    OpNone,   FlowNext},
+  {0xFFFF, 0x95C8, "lpm",    OpNone,   FlowNext},
+  {0xFFFF, 0x95D8, "elpm",   OpNone,   FlowNext},
+  {0xFFFF, 0x95E8, "spm",    OpNone,   FlowNext},
+  {0xFFFF, 0x95F8, "espm",   OpNone,   FlowNext},
+  {0xFFFF, 0x9409, "ijmp",   OpNone,   FlowIndirect},
+  {0xFFFF, 0x9419, "eijmp",  OpNone,   FlowIndirect},
+
+  // bset and bclr by the flag they set or clear
+  {0xFFFF, 0x9408, "sec",    OpNone,   FlowNext},
+  {0xFFFF, 0x9418, "sez",    OpNone,   FlowNext},
+  {0xFFFF, 0x9428, "sen",    OpNone,   FlowNext},
+  {0xFFFF, 0x9438, "sev",    OpNone,   FlowNext},
+  {0xFFFF, 0x9448, "ses",    OpNone,   FlowNext},
+  {0xFFFF, 0x9458, "seh",    OpNone,   FlowNext},
+  {0xFFFF, 0x9468, "set",    OpNone,   FlowNext},
+  {0xFFFF, 0x9478, "sei",    OpNone,   FlowNext},
+  {0xFFFF, 0x9488, "clc",    OpNone,   FlowNext},
+  {0xFFFF, 0x9498, "clz",    OpNone,   FlowNext},
+  {0xFFFF, 0x94A8, "cln",    OpNone,   FlowNext},
+  {0xFFFF, 0x94B8, "clv",    OpNone,   FlowNext},
+  {0xFFFF, 0x94C8, "cls",    OpNone,   FlowNext},
+  {0xFFFF, 0x94D8, "clh",    OpNone,   FlowNext},
+  {0xFFFF, 0x94E8, "clt",    OpNone,   FlowNext},
+  {0xFFFF, 0x94F8, "cli",    OpNone,   FlowNext},
+
+  {0xFE0F, 0x9400, "com",    OpRd,     FlowNext},
+  {0xFE0F, 0x9401, "neg",    OpRd,     FlowNext},
+  {0xFE0F, 0x9402, "swap",   OpRd,     FlowNext},
+  {0xFE0F, 0x9403, "inc",    OpRd,     FlowNext},
+  {0xFE0F, 0x9405, "asr",    OpRd,     FlowNext},
+  {0xFE0F, 0x9406, "lsr",    OpRd,     FlowNext},
+  {0xFE0F, 0x9407, "ror",    OpRd,     FlowNext},
+  {0xFE0F, 0x940A, "dec",    OpRd,     FlowNext},
+  {0xFE0E, 0x940C, "jmp",    OpJmp,    FlowJump},
+  {0xFE0E, 0x940E, "call",   OpJmp,    FlowCall},
+  {0xFF00, 0x9600, "adiw",   OpAdiw,   FlowNext},
+  {0xFF00, 0x9700, "sbiw",   OpAdiw,   FlowNext},
+  {0xFF00, 0x9800, "cbi",    OpIoBit,  FlowNext},
+  {0xFF00, 0x9900, "sbic",   OpIoBit,  FlowSkip},
+  {0xFF00, 0x9A00, "sbi",    OpIoBit,  FlowNext},
+  {0xFF00, 0x9B00, "sbis",   OpIoBit,  FlowSkip},
+  {0xFC00, 0x9C00, "mul",    OpRdRr,   FlowNext},
+
+  {0xF800, 0xB000, "in",     OpIn,     FlowNext},
+  {0xF800, 0xB800, "out",    OpOut,    FlowNext},
+  {0xF000, 0xC000, "rjmp",   OpRel12,  FlowJump},
+  {0xF000, 0xD000, "rcall",  OpRel12,  FlowCall},
+  {0xF000, 0xE000, "ldi",    OpLdi,    FlowNext},
+
+  // brbs and brbc by the flag they test
+  {0xFC07, 0xF000, "brlo",   OpRel7,   FlowBranch},  // aka brcs
+  {0xFC07, 0xF001, "breq",   OpRel7,   FlowBranch},
+  {0xFC07, 0xF002, "brmi",   OpRel7,   FlowBranch},
+  {0xFC07, 0xF003, "brvs",   OpRel7,   FlowBranch},
+  {0xFC07, 0xF004, "brlt",   OpRel7,   FlowBranch},
+  {0xFC07, 0xF005, "brhs",   OpRel7,   FlowBranch},
+  {0xFC07, 0xF006, "brts",   OpRel7,   FlowBranch},
+  {0xFC07, 0xF007, "brie",   OpRel7,   FlowBranch},
+  {0xFC07, 0xF400, "brsh",   OpRel7,   FlowBranch},  // aka brcc
+  {0xFC07, 0xF401, "brne",   OpRel7,   FlowBranch},
+  {0xFC07, 0xF402, "brpl",   OpRel7,   FlowBranch},
+  {0xFC07, 0xF403, "brvc",   OpRel7,   FlowBranch},
+  {0xFC07, 0xF404, "brge",   OpRel7,   FlowBranch},
+  {0xFC07, 0xF405, "brhc",   OpRel7,   FlowBranch},
+  {0xFC07, 0xF406, "brtc",   OpRel7,   FlowBranch},
+  {0xFC07, 0xF407, "brid",   OpRel7,   FlowBranch},
+
+  {0xFE08, 0xF800, "bld",    OpRdBit,  FlowNext},
+  {0xFE08, 0xFA00, "bst",    OpRdBit,  FlowNext},
+  {0xFE08, 0xFC00, "sbrc",   OpRdBit,  FlowSkip},
+  {0xFE08, 0xFE00, "sbrs",   OpRdBit,  FlowSkip},
+};
+
+
+
+
+/// Decoded instructions
+
+typedef struct {
+  u16        code;      // First instruction word
+  u16        next;      // Second word, significant when length is 2
+  AvrOpcode *op;        // 0 if not a recognised instruction
+  u8         length;    // In words
+  u8         valid;     // Non zero once decoded, see CachedInstruction
+  int        a, b;      // Operands, by op->format in the order written
+  int        target;    // Byte address jumped, branched or called to, -1 if none
+} AvrInstruction;
+
+
+AvrInstruction InstructionCache[MaxFlashSize/2];  // By word address
+
+
+void DecodeInstruction(int addr, u16 code, u16 next, AvrInstruction *inst) {
+  AvrOpcode *op = 0;
+  for (int i=0; i<countof(AvrOpcodes); i++) {
+    if ((code & AvrOpcodes[i].mask) == AvrOpcodes[i].match) {op = &AvrOpcodes[i]; break;}
   }
-  wrdddddrrrr(code);
-  return 0;
-}
 
-int Winst2(int i, int code) {
   int d = (code >> 4) & 0x1f;
   int r = ((code >> 5) & 0x10) | (code & 0x0f);
-  u8  c = (code >> 10) & 3;
-  if (d == r  &&  c < 2) {
-    switch (c) {
-      case 0: Ws("tst   "); Wreg(d); break;
-      case 1: Ws("clr   "); Wreg(d); break;
-    }
-  } else {
-    switch ((code>>10) & 3) {
-      case 0: Ws("and   "); break;
-      case 1: Ws("eor   "); break;
-      case 2: Ws("or    "); break;
-      case 3: Ws("mov   "); break;
-    }
-    wrdddddrrrr(code);
-  }
-  return 0;
-}
-
-
-
-//  0011 kkkk dddd kkkk  CPI
-//  0100 kkkk dddd kkkk  SBCI
-//  0101 kkkk dddd kkkk  SUBI
-//  0110 kkkk dddd kkkk  ORI  (aka SBR)
-//  0111 kkkk dddd kkkk  ANDI
-
-int Winst3(int i, int code) {Ws("cpi   "); Wreg(((code >> 4) & 0xF) + 16); Ws(", $"); Wx(((code >> 4) & 0xF0) | (code & 0x0F),1); return 0;}
-int Winst4(int i, int code) {Ws("sbci  "); Wreg(((code >> 4) & 0xF) + 16); Ws(", $"); Wx(((code >> 4) & 0xF0) | (code & 0x0F),1); return 0;}
-int Winst5(int i, int code) {Ws("subi  "); Wreg(((code >> 4) & 0xF) + 16); Ws(", $"); Wx(((code >> 4) & 0xF0) | (code & 0x0F),1); return 0;}
-int Winst6(int i, int code) {Ws("ori   "); Wreg(((code >> 4) & 0xF) + 16); Ws(", $"); Wx(((code >> 4) & 0xF0) | (code & 0x0F),1); return 0;}
-int Winst7(int i, int code) {Ws("andi  "); Wreg(((code >> 4) & 0xF) + 16); Ws(", $"); Wx(((code >> 4) & 0xF0) | (code & 0x0F),1); return 0;}
-
-
-
-//  1000 000d dddd 0000  LD Z
-//  1000 000d dddd 1000  LD Y
-
-//  10q0 qq0d dddd 0qqq  LDD Z
-//  10q0 qq0d dddd 1qqq  LDD Y
-//  10q0 qq1d dddd 0qqq  STD Z
-//  10q0 qq1d dddd 1qqq  STD Y
-
-
-
-//  1001 000d dddd 0000  LDS *
-//  1001 000d dddd 00-+  LD –Z+
-//  1001 000d dddd 010+  LPM Z
-//  1001 000d dddd 011+  ELPM Z
-//  1001 000d dddd 10-+  LD –Y+
-//  1001 000d dddd 11-+  LD X
-//  1001 000d dddd 1111  P0P
-int Winst90(int i, int code) { // 90xx and 91xx
-  int dst = (code >> 4) & 0x1f;
-  switch (code & 0xf) {
-    case 0x0: Ws("lds   "); Wreg(dst); Ws(", $");  Wx(next,4); return 1; break;
-    case 0x1: Ws("ld    "); Wreg(dst); Ws(", Z+");             return 0; break;
-    case 0x2: Ws("ld    "); Wreg(dst); Ws(", -Z");             return 0; break;
-    case 0x4: Ws("lpm   "); Wreg(dst); Ws(", Z");              return 0; break;
-    case 0x5: Ws("lpm   "); Wreg(dst); Ws(", Z+");             return 0; break;
-    case 0x6: Ws("elpm  "); Wreg(dst); Ws(", Z");              return 0; break;
-    case 0x7: Ws("elpm  "); Wreg(dst); Ws(", Z+");             return 0; break;
-    case 0x9: Ws("ld    "); Wreg(dst); Ws(", Y+");             return 0; break;
-    case 0xA: Ws("ld    "); Wreg(dst); Ws(", -Y");             return 0; break;
-    case 0xC: Ws("ld    "); Wreg(dst); Ws(", X");              return 0; break;
-    case 0xD: Ws("ld    "); Wreg(dst); Ws(", X+");             return 0; break;
-    case 0xE: Ws("ld    "); Wreg(dst); Ws(", -X");             return 0; break;
-    case 0xF: Ws("pop   "); Wreg(dst);                         return 0; break;
-    default:  Ws("???   ");                                    return 0; break;
+  int k;
+
+  inst->code   = code;
+  inst->next   = next;
+  inst->op     = op;
+  inst->length = 1;
+  inst->valid  = 1;
+  inst->a      = 0;
+  inst->b      = 0;
+  inst->target = -1;
+  if (!op) {return;}
+
+  switch (op->format) {
+    case OpRdRr:   inst->a = d;                    inst->b = r;                                     break;
+    case OpRd:
+    case OpRdText: inst->a = d;                                                                     break;
+    case OpMovw:   inst->a = (code >> 3) & 0x1e;   inst->b = (code << 1) & 0x1e;                    break;
+    case OpMuls:   inst->a = ((code>>4)&0xf) + 16; inst->b = (code & 0xf) + 16;                     break;
+    case OpMulsu:  inst->a = ((code>>4)&7) + 16;   inst->b = (code & 7) + 16;                       break;
+    case OpRdK:
+    case OpLdi:    inst->a = ((code>>4)&0xf) + 16; inst->b = ((code >> 4) & 0xF0) | (code & 0x0F);  break;
+    case OpLdd:    inst->a = d;                    inst->b = ((code>>8)&0x20) | ((code>>7)&0x18) | (code&7); break;
+    case OpLds:    inst->a = d;                    inst->b = next;                 inst->length = 2; break;
+    case OpAdiw:   inst->a = ((code>>3)&6) + 24;   inst->b = ((code >> 2) & 0x30) | (code & 0xf);   break;
+    case OpIoBit:  inst->a = (code >> 3) & 0x1f;   inst->b = code & 7;                              break;
+    case OpIn:     inst->a = d;                    inst->b = ((code >> 5) & 0x30) | (code & 0xf);   break;
+    case OpOut:    inst->a = ((code >> 5) & 0x30) | (code & 0xf);  inst->b = d;                     break;
+    case OpRdBit:  inst->a = d;                    inst->b = code & 7;                              break;
+    case OpJmp:
+      inst->target = (((((code >> 3) & 0x3E) | (code & 1)) << 16) + next) * 2;
+      inst->length = 2;
+      break;
+    case OpRel12:
+      k = code & 0x7ff;  if (code & 0x800) {k -= 0x800;}
+      inst->b      = k + 1;
+      inst->target = addr + inst->b*2;
+      break;
+    case OpRel7:
+      k = (code >> 3) & 0x3f;  if (code & 0x200) {k -= 0x40;}
+      inst->b      = k + 1;
+      inst->target = addr + inst->b*2;
+      break;
   }
-  return 0;
 }
 
-//  1001 001r rrrr 0000  STS *
-//  1001 001r rrrr 00-+  ST –Z+
-//  1001 001r rrrr 01xx  ???
-//  1001 001r rrrr 10-+  ST –Y+
-//  1001 001r rrrr 11-+  ST X
-//  1001 001d dddd 1111  PUSH
-int Winst92(int i, int code) { // 92xx and 93xx
-  int dst = (code >> 4) & 0x1f;
-  switch (code & 0xf) {
-    case 0x0: Ws("sts   "); Wreg(dst); Ws(", $");  Wx(next,4); return 1; break;
-    case 0x1: Ws("st    "); Wreg(dst); Ws(", Z+");             return 0; break;
-    case 0x2: Ws("st    "); Wreg(dst); Ws(", -Z");             return 0; break;
-    case 0x9: Ws("st    "); Wreg(dst); Ws(", Y+");             return 0; break;
-    case 0xA: Ws("st    "); Wreg(dst); Ws(", -Y");             return 0; break;
-    case 0xC: Ws("st    "); Wreg(dst); Ws(", X");              return 0; break;
-    case 0xD: Ws("st    "); Wreg(dst); Ws(", X+");             return 0; break;
-    case 0xE: Ws("st    "); Wreg(dst); Ws(", -X");             return 0; break;
-    case 0xF: Ws("push  "); Wreg(dst);                         return 0; break;
-    default:  Ws("???   ");                                    return 0; break;
-  }
-  return 0;
-}
 
+// Returns the decoded instruction at addr whose words are code and next,
+// decoding it only if the cache holds something else for addr.
 
-int Winst94(int i, int code) { // 94xx and 95xx
-  if ((code & 0xE) == 8) {
-    if (code & 0x100) {
-      //  1001 0101 0000 1000  RET
-      //  1001 0101 0000 1001  ICALL
-      //  1001 0101 0001 1000  RETI
-      //  1001 0101 0001 1001  EICALL
-      //  1001 0101 1000 1000  SLEEP
-      //  1001 0101 1001 1000  BREAK
-      //  1001 0101 1010 1000  WDR
-      //  1001 0101 1100 1000  LPM
-      //  1001 0101 1101 1000  ELPM
-      //  1001 0101 1110 1000  SPM
-      //  1001 0101 1111 1000  ESPM
-      switch (code & 0xFF) {
-        case 0x08: Ws("ret   "); break;
-        case 0x09: Ws("icall "); break;
-        case 0x18: Ws("reti  "); break;
-        case 0x19: Ws("eicall"); break;
-        case 0x88: Ws("sleep "); break;
-        case 0x98: Ws("break "); break;
-        case 0xA8: Ws("wdr   "); break;
-        case 0xC8: Ws("lpm   "); break;
-        case 0xD8: Ws("elpm  "); break;
-        case 0xE8: Ws("spm   "); break;
-        case 0xF8: Ws("espm  "); break;
-      }
-    } else {
-        if (code & 1) {
-        //  1001 0100 0000 1001  IJMP
-        //  1001 0100 0001 1001  EIJMP
-        if (code & 0x10) {Ws("eijmp ");} else {Ws("ijmp  ");}
-      } else { // bset, blcr
-        //  1001 0100 0sss 1000  BSET
-        //  1001 0100 1sss 1000  BCLR
-        switch((code>>4) & 0xF) {
-          case 0x0: Ws("sec   "); break;
-          case 0x1: Ws("sez   "); break;
-          case 0x2: Ws("sen   "); break;
-          case 0x3: Ws("sev   "); break;
-          case 0x4: Ws("ses   "); break;
-          case 0x5: Ws("seh   "); break;
-          case 0x6: Ws("set   "); break;
-          case 0x7: Ws("sei   "); break;
-          case 0x8: Ws("clc   "); break;
-          case 0x9: Ws("clz   "); break;
-          case 0xA: Ws("cln   "); break;
-          case 0xB: Ws("clv   "); break;
-          case 0xC: Ws("cls   "); break;
-          case 0xD: Ws("clh   "); break;
-          case 0xE: Ws("clt   "); break;
-          case 0xF: Ws("cli   "); break;
-        }
-      }
-    }
-  } else {
-    if ((code & 0xC) != 0xC) {
-      //  1001 010d dddd 0000  COM
-      //  1001 010d dddd 0001  NEG
-      //  1001 010d dddd 0010  SWAP
-      //  1001 010d dddd 0011  INC
-      //  1001 010d dddd 0100  ???
-      //  1001 010d dddd 0101  ASR
-      //  1001 010d dddd 0110  LSR
-      //  1001 010d dddd 0111  ROR
-      //  1001 010d dddd 1010  DEC
-      switch (code & 0xf) {
-        case 0x0: Ws("com   "); break;
-        case 0x1: Ws("neg   "); break;
-        case 0x2: Ws("swap  "); break;
-        case 0x3: Ws("inc   "); break;
-        case 0x5: Ws("asr   "); break;
-        case 0x6: Ws("lsr   "); break;
-        case 0x7: Ws("ror   "); break;
-        case 0xA: Ws("dec   "); break;
-        default:  Ws("???   "); break;
-      }
-      Wreg((code >> 4) & 0x1f);
-    } else { // jmp, call
-      //  1001 010k kkkk 110k    kkkk kkkk kkkk kkkk  JMP *
-      //  1001 010k kkkk 111k    kkkk kkkk kkkk kkkk  CALL *
-      Ws((code & 2) ? "call  $" : "jmp   $");
-      int addrhi = ((code >> 3) & 0x3E) | (code & 1);
-      Wx(((addrhi<<16)+next)*2,6); return 1;
-    }
+AvrInstruction *CachedInstruction(int addr, u16 code, u16 next) {
+  Assert((addr & 1) == 0  &&  addr < MaxFlashSize);
+  AvrInstruction *inst = &InstructionCache[addr/2];
+  if (!inst->valid  ||  inst->code != code  ||  (inst->length == 2  &&  inst->next != next)) {
+    DecodeInstruction(addr, code, next, inst);
   }
-  return 0;
-}
-
-
-
-
-//  1001 0110 kkdd kkkk  ADIW
-int Winst96(int i, int code) {
-  int regpair = ((code >> 3) & 6) + 24;
-  int value  = ((code >> 2) & 0x30) | (code & 0xf);
-  Ws("adiw  "); WregPair(regpair); Ws(", $"); Wx(value,2);
-  return 0;
-}
-
-//  1001 0111 kkdd kkkk  SBIW
-int Winst97(int i, int code) {
-  int regpair = ((code >> 3) & 6) + 24;
-  int value  = ((code >> 2) & 0x30) | (code & 0xf);
-  Ws("sbiw  "); WregPair(regpair); Ws(", $"); Wx(value,2);
-  return 0;
+  return inst;
 }
 
-//  1001 1000 AAAA Abbb  CBI
-int Winst98(int i, int code) {Ws("cbi   "); WSramAddr((code >> 3) & 0x1F); Ws(", "); Wd(code & 7,1); return 0;}
 
-//  1001 1001 AAAA Abbb  SBIC
-int Winst99(int i, int code) {Ws("sbic  "); WSramAddr((code >> 3) & 0x1F); Ws(", "); Wd(code & 7,1); return 0;}
 
-//  1001 1010 AAAA Abbb  SBI
-int Winst9A(int i, int code) {Ws("sbi   "); WSramAddr((code >> 3) & 0x1F); Ws(", "); Wd(code & 7,1); return 0;}
 
-//  1001 1011 AAAA Abbb  SBIS
-int Winst9B(int i, int code) {Ws("sbis  "); WSramAddr((code >> 3) & 0x1F); Ws(", "); Wd(code & 7,1); return 0;}
+/// Output
 
-//  1001 11rd dddd rrrr  MUL
-int Winst9C(int i, int code) {
-  u8 rrrrr = ((code & 0x200) >> 5) | (code & 0xF);
-  u8 ddddd = (code >> 4) & 0x1F;
-  Ws("mul   "); Wreg(ddddd); Wc(','); Wreg(rrrrr);
-  return 0;
+void Wreg(int n) {
+  Wc('r'); Wd(n, 1);
 }
 
-
-int Winst9(int i, int code) {
-  switch ((code >> 8) & 0xf) {
-    case 0x0:
-    case 0x1: return Winst90(i, code); break;
-    case 0x2:
-    case 0x3: return Winst92(i, code); break;
-    case 0x4:
-    case 0x5: return Winst94(i, code); break;
-    case 0x6: return Winst96(i, code); break;
-    case 0x7: return Winst97(i, code); break;
-    case 0x8: return Winst98(i, code); break;
-    case 0x9: return Winst99(i, code); break;
-    case 0xA: return Winst9A(i, code); break;
-    case 0xB: return Winst9B(i, code); break;
-    case 0xC:
-    case 0xD:
-    case 0xE:
-    case 0xF: return Winst9C(i, code); break;  }
-  return 0;
+void WregPair(int n) {
+  Wreg(n+1); Wc(':'); Wreg(n);
 }
 
-
-//  1011 0AAd dddd AAAA  IN
-//  1011 1AAr rrrr AAAA  0UT
-int WinstB(int i, int code) {
-  int reg = (code >> 4) & 0x1f;
-  int adr = ((code >> 5) & 0x30) | (code & 0xf);
-  if (code & 0x800) {
-    Ws("out   "); WSramAddr(adr); Ws(", "); Wreg(reg);
+void WSramAddr(int addr) {
+  if (SramSymbol[addr]) {
+    Ws(SramSymbol[addr]);
+    Ws(" ($"); Wx(addr,1); Wc(')');
   } else {
-    Ws("in    "); Wreg(reg); Ws(", "); WSramAddr(adr);
+    Wc('$'); Wx(addr,1);
   }
-  return 0;
 }
 
-
-void wRelative(int i, int delta) {
-  if (CodeSymbol[i + delta*2]) {Ws(CodeSymbol[i + delta*2]);}
-  else                         {Wx(i + delta*2, 4);}
+void wRelative(int target, int delta) {
+  if (target >= 0  &&  target < MaxFlashSize  &&  CodeSymbol[target]) {Ws(CodeSymbol[target]);}
+  else                                                                 {Wx(target, 4);}
   Ws(" (");
   if (delta >= 0) {Wc('+');}
   Wd(delta, 1);
   Wc(')');
 }
 
-void wRelative12(int i, int code) {
-  if (code & 0x0800) {
-    wRelative(i, ((code & 0x7ff) - 0x800) + 1);
-  } else {
-    wRelative(i, (code & 0x7ff) + 1);
-  }
-}
-
-//  1100 kkkk kkkk kkkk  RJMP
-int WinstC(int i, int code) {
-  Ws("rjmp  ");
-  wRelative12(i, code);
-  return 0;
-}
-
-
-//  1101 kkkk kkkk kkkk  RCALL
-int WinstD(int i, int code) {
-  Ws("rcall ");
-  wRelative12(i, code);
-  return 0;
-}
-
-
-//  1110 kkkk dddd kkkk  LDI
-int WinstE(int i, int code) {
-  int reg = ((code >> 4) & 0xf) + 16;
-  int val = ((code >> 4) & 0xf0) | (code & 0xf);
-  Ws("ldi   ");
-  Wreg(reg); Ws(", "); WSramAddr(val);
-  return 0;
-}
-
 
+void WriteInstruction(const AvrInstruction *inst) {
+  const AvrOpcode *op = inst->op;
 
-void wRelative7(int i, int code) {
-  if (code & 0x40) {
-    wRelative(i, ((code & 0x3f) - 0x40) + 1);
-  } else {
-    wRelative(i, (code & 0x3f) + 1);
+  if (!op) {
+    if (inst->code != 0xffff) {Ws("???");}  // Special case - show nothing for uninitialised memory
+    return;
   }
-}
-
 
-int WinstF(int i, int code) {
-  if (!(code & 0x800)) {
-    //  1111 00kk kkkk ksss  BRBS
-    //  1111 01kk kkkk ksss  BRBC
-    int s = code & 7;
-    int k = (code >> 3) & 0x7f;
-
-    if (code & 0x400) { // brbc
-      switch (s) {
-        case 0: Ws("brsh  "); break; // aka brcc
-        case 1: Ws("brne  "); break;
-        case 2: Ws("brpl  "); break;
-        case 3: Ws("brvc  "); break;
-        case 4: Ws("brge  "); break;
-        case 5: Ws("brhc  "); break;
-        case 6: Ws("brtc  "); break;
-        case 7: Ws("brid  "); break;
-      }
-    } else { // brbs
-      switch (s) {
-        case 0: Ws("brlo  "); break; // aka brcs
-        case 1: Ws("breq  "); break;
-        case 2: Ws("brmi  "); break;
-        case 3: Ws("brvs  "); break;
-        case 4: Ws("brlt  "); break;
-        case 5: Ws("brhs  "); break;
-        case 6: Ws("brts  "); break;
-        case 7: Ws("brie  "); break;
-      }
-    }
-    wRelative7(i, k);
-  } else if ((code & 8) == 0) {
-    //  1111 100d dddd 0bbb  BLD
-    //  1111 101d dddd 0bbb  BST
-    //  1111 110r rrrr 0bbb  SBRC
-    //  1111 111r rrrr 0bbb  SBRS
-    int bit = code & 7;
-    int reg = (code >> 4) & 0x1f;
-    switch ((code >> 9) & 3) {
-      case 0: Ws("bld   "); break;
-      case 1: Ws("bst   "); break;
-      case 2: Ws("sbrc  "); break;
-      case 3: Ws("sbrs  "); break;
-    }
-    Wreg(reg); Ws(", "); Wd(bit,1);
-  } else {
-    if (code != 0xffff) {Ws("???");}  // Special casse - show nothing for uninitialised memory
+  const char *mnemonic = op->mnemonic;
+  if (op->alias  &&  op->format == OpRdRr  &&  inst->a == inst->b) {mnemonic = op->alias;}
+  if (op->alias  &&  op->format == OpLdd   &&  inst->b == 0)       {mnemonic = op->alias;}
+  Ws(mnemonic);
+  if (op->format == OpNone) {return;}
+  int n = strlen(mnemonic);
+  do {Wc(' '); n++;} while (n < 6);
+
+  switch (op->format) {
+    case OpRdRr:   Wreg(inst->a); if (mnemonic == op->mnemonic) {Ws(", "); Wreg(inst->b);}  break;
+    case OpRd:     Wreg(inst->a);                                                          break;
+    case OpRdText: Wreg(inst->a); Ws(op->operand);                                         break;
+    case OpMovw:   WregPair(inst->a); Ws(", "); WregPair(inst->b);                         break;
+    case OpMuls:
+    case OpMulsu:  Wreg(inst->a); Ws(", "); Wreg(inst->b);                                 break;
+    case OpRdK:    Wreg(inst->a); Ws(", $"); Wx(inst->b, 1);                               break;
+    case OpLdi:    Wreg(inst->a); Ws(", "); WSramAddr(inst->b);                            break;
+    case OpLdd:
+      Wreg(inst->a); Ws(", "); Ws(op->operand);
+      if (inst->b) {Wc('+'); Wd(inst->b, 1);}
+      break;
+    case OpLds:    Wreg(inst->a); Ws(", $"); Wx(inst->b, 4);                               break;
+    case OpAdiw:   WregPair(inst->a); Ws(", $"); Wx(inst->b, 2);                           break;
+    case OpIoBit:
+    case OpRdBit:  if (op->format == OpIoBit) {WSramAddr(inst->a);} else {Wreg(inst->a);}
+                   Ws(", "); Wd(inst->b, 1);                                               break;
+    case OpIn:     Wreg(inst->a); Ws(", "); WSramAddr(inst->b);                            break;
+    case OpOut:    WSramAddr(inst->a); Ws(", "); Wreg(inst->b);                            break;
+    case OpJmp:    Wc('$'); Wx(inst->target, 6);                                           break;
+    case OpRel12:
+    case OpRel7:   wRelative(inst->target, inst->b);                                       break;
   }
-  return 0;
 }
 
 
-int Winstruction(int i, int code) {
-  switch (code>>12) {
-    case 0x0:  return Winst0(i, code); break;
-    case 0x1:  return Winst1(i, code); break;
-    case 0x2:  return Winst2(i, code); break;
-    case 0x3:  return Winst3(i, code); break;
-    case 0x4:  return Winst4(i, code); break;
-    case 0x5:  return Winst5(i, code); break;
-    case 0x6:  return Winst6(i, code); break;
-    case 0x7:  return Winst7(i, code); break;
-    case 0x8:  return Winst8(i, code); break;
-    case 0x9:  return Winst9(i, code); break;
-    case 0xA:  return WinstA(i, code); break;
-    case 0xB:  return WinstB(i, code); break;
-    case 0xC:  return WinstC(i, code); break;
-    case 0xD:  return WinstD(i, code); break;
-    case 0xE:  return WinstE(i, code); break;
-    case 0xF:  return WinstF(i, code); break;
-  }
-  return 0;
-}
+
 
 char *SkipPath(char *name) { // Return pointer to name with any leading path skipped
   char *p     = name;
@@ -484,7 +356,7 @@ char *SkipPath(char *name) { // Return pointer to name with any leading path ski
   return start;
 }
 
-int DisassembleInstruction(int addr, u8 *buf) { // Returns instruction length in words
+int DisassembleInstruction(int addr, u8 *buf) { // Returns instruction length in bytes
   Assert((addr & 1) == 0);
   if (CodeSymbol[addr]) {Wl(); Ws(CodeSymbol[addr]); Wsl(":");}
   if (HasLineNumbers) {
@@ -495,8 +367,7 @@ int DisassembleInstruction(int addr, u8 *buf) { // Returns instruction length in
   Wx(addr, 4); Ws(": ");
   int code = (buf[1] << 8) | buf[0];
   Wx(code, 4); Ws("  ");     // Instruction code
-  next = (buf[3] << 8) | buf[2];
-  if (Winstruction(addr, code)) return 4;
-  return 2;
+  AvrInstruction *inst = CachedInstruction(addr, code, (buf[3] << 8) | buf[2]);
+  WriteInstruction(inst);
+  return inst->length * 2;
 }
-
@@ -0,0 +1,133 @@
+/// Gang.c
+
+// Gang programming: the gang command reads and prepares a file once, then
+// programs it into several LittleWire/debugWIRE targets in parallel, one
+// session thread per target (see Sessions.c). Each page is erased and
+// written without comparing it to the target first, pages that are all
+// 0xFF are only checked, and every page used is read back in a verify pass.
+
+
+
+
+enum {GangUnused = 0, GangBlank = 1, GangData = 2};
+
+u8  GangBlock[MaxFlashSize/MinFlashPageSize];  // Of each MinFlashPageSize block of FlashBuffer
+int GangLimit = 0;                             // End of the highest segment
+
+
+// Classifies the blocks of FlashBuffer once for all targets. Bytes in a
+// used block but outside the segments are 0xFF so they end up erased.
+
+void PrepareGangBlocks() {
+  memset(GangBlock, GangUnused, sizeof(GangBlock));
+  GangLimit = 0;
+  for (int i=0; i<FlashSegments; i++) {
+    int first = FlashSegment[i].addr;
+    int limit = FlashSegment[i].addr + FlashSegment[i].length;
+    if (limit > MaxFlashSize) {Fail("File extends beyond the largest supported flash.");}
+    for (int b = first/MinFlashPageSize; b*MinFlashPageSize < limit; b++) {GangBlock[b] = GangBlank;}
+    GangLimit = max(GangLimit, limit);
+  }
+  u8 blank[MinFlashPageSize];
+  memset(blank, 0xFF, sizeof(blank));
+  for (int b=0; b<countof(GangBlock); b++) {
+    if (GangBlock[b]  &&  memcmp(FlashBuffer + b*MinFlashPageSize, blank, MinFlashPageSize)) {GangBlock[b] = GangData;}
+  }
+}
+
+
+// Returns the highest class of the blocks making up the page at a.
+
+int GangPage(int a) {
+  int page = GangUnused;
+  for (int b = a/MinFlashPageSize; b < (a+PageSize())/MinFlashPageSize; b++) {page = max(page, GangBlock[b]);}
+  return page;
+}
+
+
+// Session work: programs and verifies FlashBuffer on the connected target.
+
+void GangProgram() {
+  int pageSize = PageSize();
+  int written  = 0;
+  int blank    = 0;
+  int erased   = 0;
+  int failed   = 0;
+  u8  page[MaxFlashPageSize];
+
+  if (GangLimit > FlashSize()) {Fail("File is larger than the flash of this device.");}
+
+  DwGetRegs(0, R, 28); // Cache R0 through R27
+  int top = (FlashSize() - sizeof(SpmStubCode)) & ~(pageSize-1);
+  PrepareSpmStub(GangPage(top) == GangUnused);
+
+  unsigned long started = lw_micros();
+  for (int base = 0; base < GangLimit; base += pageSize) {
+    switch (GangPage(base)) {
+      case GangUnused: break;
+      case GangBlank:  blank++; break;
+      case GangData:   ProgramFlashPage(base, FlashBuffer+base, 1); written++; break;
+    }
+  }
+  unsigned long programmed = lw_micros();
+
+  // Verify: read back every page used, erasing blank pages that are not
+
+  ReadFlashManifest();
+  for (int base = 0; base < GangLimit; base += pageSize) {
+    if (GangPage(base) == GangUnused) {continue;}
+    DwFetchFlash(base, pageSize, page);
+    if (memcmp(page, FlashBuffer+base, pageSize)  &&  GangPage(base) == GangBlank) {
+      EraseFlashPage(base);
+      erased++;
+      DwFetchFlash(base, pageSize, page);
+    }
+    int p = base / pageSize;
+    if (memcmp(page, FlashBuffer+base, pageSize)) {
+      Ws("$"); Wx(base,4); Ws(" - $"); Wx(base+pageSize-1,4); Wsl(" verify failed.");
+      FlashManifest.known[p] = 0;
+      FlashCached[p] = 0;
+      failed++;
+    } else {
+      FlashManifest.known[p] = 1;
+      FlashManifest.crc[p]   = Crc32(page, pageSize);
+      memcpy(FlashCache+base, page, pageSize);
+      FlashCached[p] = 1;
+    }
+  }
+  WriteFlashManifest();
+  unsigned long verified = lw_micros();
+
+  DwSetRegs(0, R, 28); // Restore cached registers R0 through R27
+  PC = FlashEntry;
+
+  snprintf(CurrentSession->summary, sizeof(CurrentSession->summary),
+           "%s, %d pages written, %d blank, %d erased, program %lums, verify %lums",
+           Name(), written, blank, erased, (programmed-started)/1000, (verified-programmed)/1000);
+  if (failed) {Fail("Flash verify failed.");}
+}
+
+
+
+
+void GangCommand() {
+  ReadLoadFile("Loading ");
+  PrepareGangBlocks();
+
+  int chosen = SessionCount;
+  if (!chosen) {  // Default to every LittleWire present
+    int found = littlewire_search();
+    for (int i=0; i<found; i++) {AddSession(lwResults[i].serialNumber);}
+    if (!SessionCount) {Fail("No LittleWire found.");}
+  }
+  if (Transport) {Transport->close(); DeviceType = -1;}  // Leave them to the sessions
+
+  unsigned long started = lw_micros();
+  int failed = RunSessions(GangProgram);
+  int total  = SessionCount;
+  if (!chosen) {SessionCount = 0;}
+
+  Wd(total-failed, 1); Ws(" of "); Wd(total, 1); Ws(" targets programmed in ");
+  Wd((lw_micros() - started) / 1000, 1); Wsl("ms.");
+  if (failed) {Fail("Gang programming failed on some targets.");}
+}
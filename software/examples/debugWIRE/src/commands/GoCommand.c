@@ -2,11 +2,10 @@
 
 
 
-//void DeviceBreak() {
-//  Wsl("\rDevice reached breakpoint.                                        ");
-//  DwSync();
-//  DwReconnect();
-//}
+void DeviceBreak() {
+  Wsl("\rDevice reached breakpoint.                                        ");
+  DwReconnect();
+}
 
 void KeyboardBreak() {
   Ws("Keyboard requested break. "); SkipEoln();
@@ -30,11 +29,7 @@ void KeyboardBreak() {
       //    break;
       //  }
 
-      if (dwReachedBreakpoint()) {
-        Wsl("\rDevice reached breakpoint.                                        ");
-        DwReconnect();
-        break;
-      }
+      if (DwWaitForBreak(20)) {DeviceBreak(); break;}
 
       // See if there's a user pressing a key
       if (Interactive(Input)) {
@@ -58,19 +53,22 @@ void KeyboardBreak() {
     fd_set readfds;
     fd_set excpfds;
     struct timeval timeout;
+    int waits = 0;
     while (1) {
+      // The device reports a break on its interrupt-in endpoint, there is
+      // no file descriptor for it, so wait on it and check fd in between.
+      if (DwWaitForBreak(20)) {DeviceBreak(); break;}
       FD_ZERO(&readfds);
       FD_ZERO(&excpfds);
       FD_SET(fd, &readfds);  // either stdin or GDB command socket
-      FD_SET(SerialPort, &readfds);
-      timeout = (struct timeval){10,0}; // 10 seconds
-      if(select(max(fd, SerialPort)+1, &readfds, 0, &excpfds, &timeout) > 0) {
+      FD_SET(fd, &excpfds);
+      timeout = (struct timeval){0,0};
+      if(select(fd+1, &readfds, 0, &excpfds, &timeout) > 0) {
         // Something became available
-        //if (FD_ISSET(SerialPort, &readfds)) {DeviceBreak();   break;}
         if (FD_ISSET(fd,         &readfds)) {KeyboardBreak(); break;}
         if (FD_ISSET(fd,         &excpfds)) {KeyboardBreak(); break;}
-      } else {
-        Ws("."); Flush();
+      } else if (++waits % 500 == 0) {
+        Ws("."); Flush(); // every 10 seconds or so
       }
     }
   }
@@ -306,38 +306,54 @@ int IsLoadableElf() {
 
 
 
-u8 FlashBuffer[MaxFlashSize] = {0};
+// Flash image of the current file, read once and then loaded into the
+// target, or into every target chosen with the targets command.
 
+u8  FlashBuffer[MaxFlashSize] = {0};  // At flash addresses
+struct {int addr; int length;} FlashSegment[16];
+int FlashSegments = 0;
+int FlashEntry    = 0;
 
-void LoadElfSegments() {
+char *LoadVerb     = "Loading ";
+
+void AddFlashSegment(int addr, int length) {
+  if (FlashSegments >= countof(FlashSegment)) {Fail("Too many flash segments in file.");}
+  FlashSegment[FlashSegments].addr   = addr;
+  FlashSegment[FlashSegments].length = length;
+  FlashSegments++;
+}
+
+
+void ReadElfSegments() {
+  FlashSegments = 0;
   for (int i=0; i<ElfHeader.phnum; i++) {
     struct ElfProgramHeader *header = (struct ElfProgramHeader *) (ElfProgramHeaders + (i*ElfHeader.phentsize));
     if (header->type == 1  &&  header->paddr < 0x800000) { // >= 0x800000 is avr trick for non-flash areas
 
-      if (!header->offset)                               {Fail("Flash memory image missing in ELF file.");}
-      if (header->filesize > header->memsize)            {Fail("ELF file error: filesize>memsize.");}
-      if (header->paddr + header->memsize > FlashSize()) {Fail("Flash segment extends beyond available flash on this device.");}
+      if (!header->offset)                                  {Fail("Flash memory image missing in ELF file.");}
+      if (header->filesize > header->memsize)               {Fail("ELF file error: filesize>memsize.");}
+      if (header->paddr + header->memsize > MaxFlashSize)   {Fail("Flash segment extends beyond the largest flash supported.");}
 
       Seek(CurrentFile, header->offset);
-      int length = Read(CurrentFile, FlashBuffer, header->filesize);
+      int length = Read(CurrentFile, FlashBuffer+header->paddr, header->filesize);
       if (length < header->filesize) {Fail("Failed to read memory image from ELF.");}
 
       if (header->memsize > header->filesize) {
-        memset(FlashBuffer+header->filesize, 0, header->memsize-header->filesize);
+        memset(FlashBuffer+header->paddr+header->filesize, 0, header->memsize-header->filesize);
       }
 
       if (header->memsize > 0) {
-        Ws("Loading "); Wd(header->memsize,1);
+        Ws(LoadVerb); Wd(header->memsize,1);
         Ws(" flash bytes from ELF text segment "); Wd(i,1);
         Ws(" to addresses $"); Wx(header->paddr,1);
         Ws(" through $"); Wx(header->paddr+header->memsize-1,1); Wsl(".");
-        WriteFlash(header->paddr, FlashBuffer, header->memsize);
+        AddFlashSegment(header->paddr, header->memsize);
       }
     }
   }
 
   // Set PC to entry point defined in ELF header.
-  PC = ElfHeader.entry;
+  FlashEntry = ElfHeader.entry;
 }
 
 
@@ -345,22 +361,45 @@ void LoadElfSegments() {
 
 
 
-void LoadBinary() {
+void ReadBinary() {
   Seek(CurrentFile, 0);
   int length = Read(CurrentFile, FlashBuffer, sizeof(FlashBuffer));
   if (length <= 0) {Fail("File is empty.");}
 
-  Ws("Loading "); Wd(length,1); Wsl(" flash bytes from binary image file.");
-  WriteFlash(0, FlashBuffer, length);
-  PC = 0;
+  Ws(LoadVerb); Wd(length,1); Wsl(" flash bytes from binary image file.");
+  FlashSegments = 0;
+  AddFlashSegment(0, length);
+  FlashEntry = 0;
 }
 
 
+// Loads the image read by ReadElfSegments or ReadBinary into the connected
+// target.
 
+void LoadFlashSegments() {
+  for (int i=0; i<FlashSegments; i++) {
+    if (FlashSegment[i].addr + FlashSegment[i].length > FlashSize()) {
+      Fail("Flash segment extends beyond available flash on this device.");
+    }
+  }
+  for (int i=0; i<FlashSegments; i++) {
+    LoadFlashImage(FlashSegment[i].addr, FlashBuffer+FlashSegment[i].addr, FlashSegment[i].length); // Also seeds FlashCache
+  }
+  PC = FlashEntry;
+}
 
 
 
-void LoadFileCommand() {
+
+
+
+// Reads the file named next on the command line, or chosen with the file
+// dialog, into FlashBuffer and FlashSegment. Bytes outside the segments
+// are left 0xFF, as in erased flash. verb starts the line shown for each
+// segment.
+
+void ReadLoadFile(char *verb) {
+  LoadVerb = verb;
   if (CurrentFile) {Close(CurrentFile);}
   CurrentFilename[0] = 0;
 
@@ -377,5 +416,52 @@ void LoadFileCommand() {
 
   if (!CurrentFile) {Fail("Could not open specified file.");}
 
-  if (IsLoadableElf()) {LoadElfSegments();} else {LoadBinary();}
+  memset(FlashBuffer, 0xFF, sizeof(FlashBuffer));
+  if (IsLoadableElf()) {ReadElfSegments();} else {ReadBinary();}
+}
+
+
+// Compares the image read by ReadElfSegments or ReadBinary with the flash
+// of the connected target, using the CRC stub where LoadFlashImage left one.
+
+void VerifyFlashSegments() {
+  for (int i=0; i<FlashSegments; i++) {
+    if (FlashSegment[i].addr + FlashSegment[i].length > FlashSize()) {
+      Fail("Flash segment extends beyond available flash on this device.");
+    }
+  }
+  ReadFlashManifest();
+  DwGetRegs(0, R, 28); // Cache R0 through R27
+  PrepareCrcStub(0);
+  int failed = 0;
+  for (int i=0; i<FlashSegments; i++) {
+    failed += VerifyFlashRange(FlashSegment[i].addr, FlashSegment[i].length, FlashBuffer+FlashSegment[i].addr);
+  }
+  DwSetRegs(0, R, 28); // Restore cached registers R0 through R27
+  if (failed) {WriteFlashManifest(); Fail("Flash verify failed.");}
+  Wsl("Flash matches the file.");
+}
+
+
+void VerifyFileCommand() {
+  ReadLoadFile("Verifying ");
+
+  if (SessionCount) {
+    if (RunSessions(VerifyFlashSegments)) {Fail("Verify failed on some targets.");}
+  } else {
+    if (DeviceType < 0) {DwConnect();}
+    VerifyFlashSegments();
+  }
+}
+
+
+void LoadFileCommand() {
+  ReadLoadFile("Loading ");
+
+  if (SessionCount) {
+    if (RunSessions(LoadFlashSegments)) {Fail("Loading failed on some targets.");}
+  } else {
+    if (DeviceType < 0) {DwConnect();}
+    LoadFlashSegments();
+  }
 }
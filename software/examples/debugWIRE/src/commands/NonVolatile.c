@@ -24,6 +24,15 @@ void RenableRWW() {
 }
 
 
+void ClearPageBuffer() {
+  // RWWSRE on the ATmegas is CTPB on the ATtinys, both clear the page buffer
+  DwSetPC(BootSect());  // Set PC that allows access to all of flash
+  DwSetReg(29, RWWSRE); // r29 := RWWSRE
+  DwOut(SPMCSR(), 29);  // out SPMCSR,r29
+  DwInst(0x95E8);       // spm
+}
+
+
 //void ReadConfigBits(u8 pmc, u8 index, u8 *dest) {
 //  u16 outr0 = 0xB800 | ((DWDRreg() & 0x30) << 5) | (DWDRreg() & 0xF);
 //  DwSend(Bytes(
@@ -94,9 +103,8 @@ void DumpConfig() {
 // Smallest boot size is 128 words on atmega 88 and 168.
 // Smallest boot size on atmega328 is 256 words.
 
-void DwReadFlash(int addr, int len, u8 *buf) {
+void DwFetchFlash(int addr, int len, u8 *buf) {
   int limit = addr + len;
-  if (limit > FlashSize()) {Fail("Attempt to read beyond end of flash.");}
   while (addr < limit) {
     int length = min(limit-addr, 64);      // Read no more than 64 bytes at a time so PC remains in valid address space.
     DwSetZ(addr);                          // Z := First address to read
@@ -110,8 +118,98 @@ void DwReadFlash(int addr, int len, u8 *buf) {
 }
 
 
+// Flash reads go through FlashCache: a page is fetched from the target the
+// first time any of it is read, and is then served from the host until it
+// is erased or written. Pages written by WriteFlashPage, so all of a loaded
+// ELF or binary image, go into the cache as they are programmed.
+//
+// Code on the target that rewrites its own flash with spm is not seen.
+
+void DwReadFlash(int addr, int len, u8 *buf) {
+  int limit = addr + len;
+  if (limit > FlashSize()) {Fail("Attempt to read beyond end of flash.");}
+  while (addr < limit) {
+    int base   = addr & ~(PageSize()-1);
+    int length = min(limit-addr, base+PageSize()-addr);
+    if (!FlashCached[base/PageSize()]) {
+      DwFetchFlash(base, PageSize(), FlashCache+base);
+      FlashCached[base/PageSize()] = 1;
+    }
+    memcpy(buf, FlashCache+addr, length);
+    addr += length;
+    buf  += length;
+  }
+}
+
+
+// SPM helper stub.
+//
+// Loading the page buffer with injected instructions costs about 25
+// debugWIRE bytes per flash word. Where the top 16 bytes of flash are
+// unused, LoadFlashImage keeps a small loop there instead. The page goes
+// into r2..r23 with one register block write, 11 words at a time, and the
+// loop copies the words into the page buffer, reading them back through
+// the data area where the register file is mapped at 0..31. That is
+// about 5 debugWIRE bytes per word.
+//
+// loop: ld   r0,X+          ; X starts at r2
+//       ld   r1,X+
+//       out  SPMCSR,r24     ; r24 = SPMEN
+//       spm
+//       adiw Z,2
+//       dec  r25            ; r25 = words
+//       brne loop
+//       break               ; the hardware breakpoint here returns control
+//
+// Uses r0 through r31.
+
+const u8 SpmStubCode[16] = {
+  0x0D, 0x90,  0x1D, 0x90,  0x87, 0xBF,  0xE8, 0x95,
+  0x32, 0x96,  0x9A, 0x95,  0xC9, 0xF7,  0x98, 0x95
+};
+
+PerTarget int SpmStub        = 0; // Byte address of the stub in flash, 0 if none, -1 if it failed this session
+PerTarget int SpmStubChecked = 0; // Non zero once a page loaded by the stub has read back correctly
+
+
+// CRC helper stub.
+//
+// Reading flash back costs an exchange per 64 bytes. LoadFlashImage keeps a
+// second loop just below the SPM stub that runs a CRC-16/MODBUS over a range
+// of flash on the target, so a range is verified with one exchange each way
+// whatever its length. The AVR cannot run code from RAM, and injecting the
+// CRC one instruction at a time would send more than the flash itself.
+//
+// loop: lpm  r0,Z+           ; Z = first byte address
+//       eor  r24,r0          ; r25:r24 = crc
+//       ldi  r21,8
+// bit:  lsr  r25
+//       ror  r24
+//       brcc next
+//       eor  r24,r22         ; r23:r22 = $A001
+//       eor  r25,r23
+// next: dec  r21
+//       brne bit
+//       sbiw X,1             ; X = length
+//       brne loop
+//       break                ; the hardware breakpoint here returns control
+//
+// Uses r0 and r21 through r31.
+
+const u8 CrcStubCode[26] = {
+  0x05, 0x90,  0x80, 0x25,  0x58, 0xE0,  0x96, 0x95,  0x87, 0x95,
+  0x10, 0xF4,  0x86, 0x27,  0x97, 0x27,  0x5A, 0x95,  0xC9, 0xF7,
+  0x11, 0x97,  0xA1, 0xF7,  0x98, 0x95
+};
+
+PerTarget int CrcStub = 0; // Byte address of the stub in flash, 0 if none, -1 if it failed this session
+
+
 void EraseFlashPage(u16 a) { // a = byte address of first word of page
   Assert((a & (PageSize()-1)) == 0);
+  FlashCached[a/PageSize()] = 0;
+  if (SpmStub > 0  &&  (a ^ SpmStub) < PageSize()) {SpmStub = 0;} // Erasing the stub
+  if (CrcStub > 0  &&  (a ^ CrcStub) < PageSize()) {CrcStub = 0;}
   DwSetRegs(29, Bytes(PGERS, lo(a), hi(a))); // r29 := op (erase page), Z = first byte address of page
   DwSetPC(BootSect());                       // Set PC that allows access to all of flash
   DwSend(Bytes(0x64));                       // Set up for single step mode
@@ -122,7 +220,43 @@ void EraseFlashPage(u16 a) { // a = byte address of first word of page
 
 
 
+int LoadPageBufferStub(u16 a, const u8 *buf) { // Returns 0 if the stub did not come back
+  int words = PageSize()/2;
+  u8 regs[30];
+
+  for (int w=0; w<words; w+=11) {
+    int n = min(11, words-w);
+    memcpy(regs, buf+2*w, 2*n);  // r2..r23 := page words
+    regs[22] = SPMEN;            // r24
+    regs[23] = n;                // r25
+    regs[24] = 2;  regs[25] = 0; // X  := address of r2
+    regs[26] = R[28];            // Y  (cached)
+    regs[27] = R[29];
+    regs[28] = lo(a);            // Z  := first byte address of page
+    regs[29] = hi(a);
+    DwSetRegs(2, regs, w ? 26 : 30); // Z carries on from the previous run
+    DwSetPC(SpmStub/2);
+    DwSetBP(SpmStub/2 + 7);      // The break instruction
+    DwSend(Bytes(0x61, 0x30));   // Go with breakpoint enabled, timers stopped
+    DwWait();
+    int tries = 0;
+    while (!DwWaitForBreak(20)) {
+      if (++tries > 50) {
+        Wsl("\rSPM stub did not return, loading flash without it.");
+        DwBreakAndSync();
+        SpmStub = -1;
+        ClearPageBuffer();
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+
 void LoadPageBuffer(u16 a, const u8 *buf) {
+  if (SpmStub > 0  &&  (a ^ SpmStub) >= PageSize()  &&  LoadPageBufferStub(a, buf)) {return;}
+
   DwSetRegs(29, Bytes(SPMEN, lo(a), hi(a))); // r29 := op (write next page buffer word), Z = first byte address of page
   DwSend(Bytes(0x64));                       // Set up for single step mode
   const u8 *limit = buf + PageSize();
@@ -143,15 +277,70 @@ void ProgramPage(u16 a) {
   DwSend(Bytes(0x64));                       // Set up for single step mode
   DwOut(SPMCSR(), 29);                       // out SPMCSR,r29 (PGWRT)
   DwInst(0x95E8);                            // spm
-  while ((ReadSPMCSR() & 0x1F) != 0) {Wc('.'); Flush();} // Wait while programming busy
+  while ((ReadSPMCSR() & 0x1F) != 0) {if (Redraw) {Wc('.'); Flush();}} // Wait while programming busy
 }
 
 
 
 
-void ShowPageStatus(u16 a, char *msg) {
+void WritePageStatus(u16 a, char *msg) {
   Ws("$"); Wx(a,4); Ws(" - $"); Wx(a+PageSize()-1,4);
-  Wc(' '); Ws(msg); Ws(".                "); Wr();
+  Wc(' '); Ws(msg); Ws(".                ");
+}
+
+void ShowPageStatus(u16 a, char *msg) {
+  if (CurrentSession) {return;}  // Progress of parallel sessions would overwrite itself
+  WritePageStatus(a, msg); Wr();
+}
+
+
+
+
+void ProgramFlashPage(u16 a, const u8 *buf, int erase) {
+  // Uses r0, r1, r29, r30, r31
+
+  u8 page[MaxFlashPageSize];
+  Assert(PageSize() <= sizeof(page));
+
+  if (erase) {
+    ShowPageStatus(a, "erasing");
+    EraseFlashPage(a);
+  }
+
+  memset(page, 0xff, PageSize());
+  if (memcmp(buf, page, PageSize()) == 0) {
+    memcpy(FlashCache+a, page, PageSize()); // Erased
+    FlashCached[a/PageSize()] = 1;
+    return;
+  }
+
+  ShowPageStatus(a, "loading page buffer");
+  int stub = SpmStub > 0  &&  (a ^ SpmStub) >= PageSize();
+  LoadPageBuffer(a, buf);
+  stub = stub  &&  SpmStub > 0;
+
+  ShowPageStatus(a, "programming");
+  FlashCached[a/PageSize()] = 0;
+  ProgramPage(a);
+
+  RenableRWW();
+
+  if (stub  &&  !SpmStubChecked) { // Make sure spm works from flash on this part
+    DwFetchFlash(a, PageSize(), page);
+    if (memcmp(buf, page, PageSize())) {
+      Wsl("\rPage loaded by the SPM stub did not verify, loading flash without it.");
+      SpmStub = -1;
+      ProgramFlashPage(a, buf, 1);
+      return;
+    }
+    SpmStubChecked = 1;
+  }
+
+  if (SpmStub > 0  &&  (a ^ SpmStub) < PageSize()) {SpmStub = 0;} // This page held the stub
+  if (CrcStub > 0  &&  (a ^ CrcStub) < PageSize()) {CrcStub = 0;}
+
+  memcpy(FlashCache+a, buf, PageSize());
+  FlashCached[a/PageSize()] = 1;
 }
 
 
@@ -177,29 +366,75 @@ void WriteFlashPage(u16 a, const u8 *buf) {
     if (~page[i] & buf[i]) {erase=1; break;}
   }
 
-  if (erase) {
-    ShowPageStatus(a, "erasing");
-    EraseFlashPage(a);
-  }
+  ProgramFlashPage(a, buf, erase);
+}
 
-  memset(page, 0xff, PageSize());
-  if (memcmp(buf, page, PageSize()) == 0) {
-    return;
-  }
 
-  ShowPageStatus(a, "loading page buffer");
-  LoadPageBuffer(a, buf);
 
-  ShowPageStatus(a, "programming");
-  ProgramPage(a);
 
+// Finds the SPM stub at the top of flash, installing it there first if
+// install is set and those bytes are unused. Returns 1 if it installed it.
+
+int PrepareSpmStub(int install) {
+  int top = FlashSize() - sizeof(SpmStubCode);
+  u8  page[MaxFlashPageSize];
+
+  if (SpmStub < 0) {return 0;} // Failed earlier this session
+  SpmStub = 0;
   RenableRWW();
+
+  int base = top & ~(PageSize()-1);
+  DwReadFlash(base, PageSize(), page);
+  if (memcmp(page+top-base, SpmStubCode, sizeof(SpmStubCode)) == 0) {SpmStub = top; return 0;}
+  if (!install) {return 0;}
+  for (int i=top-base; i<PageSize(); i++) {if (page[i] != 0xFF) {return 0;}} // Top of flash is in use
+
+  memcpy(page+top-base, SpmStubCode, sizeof(SpmStubCode));
+  ShowPageStatus(base, "installing SPM stub");
+  ProgramFlashPage(base, page, 0); // Only clears bits of erased flash
+  SpmStub = top;
+  return 1;
 }
 
 
 
+// Finds the CRC stub below the SPM stub, installing it first if install is
+// set and those bytes are unused. Returns 1 if it installed it. Not used
+// where the two stubs would not share the top page of flash.
 
-u8 pageBuffer[MaxFlashPageSize] = {0};
+int PrepareCrcStub(int install) {
+  int top = FlashSize() - sizeof(SpmStubCode);
+  int at  = top - sizeof(CrcStubCode);
+  u8  page[MaxFlashPageSize];
+
+  if (CrcStub < 0) {return 0;} // Failed earlier this session
+  CrcStub = 0;
+  int base = at & ~(PageSize()-1);
+  if (base != (top & ~(PageSize()-1))) {return 0;}
+  RenableRWW();
+
+  DwReadFlash(base, PageSize(), page);
+  if (memcmp(page+at-base, CrcStubCode, sizeof(CrcStubCode)) == 0) {CrcStub = at; return 0;}
+  if (!install) {return 0;}
+  for (int i=at-base; i<top-base; i++) {if (page[i] != 0xFF) {return 0;}} // In use
+  if (memcmp(page+top-base, SpmStubCode, sizeof(SpmStubCode))) {
+    for (int i=top-base; i<PageSize(); i++) {if (page[i] != 0xFF) {return 0;}} // Top of flash is in use
+  }
+
+  memcpy(page+at-base, CrcStubCode, sizeof(CrcStubCode));
+  ShowPageStatus(base, "installing CRC stub");
+  ProgramFlashPage(base, page, 0); // Only clears bits of erased flash
+  CrcStub = at;
+  PrepareSpmStub(0);               // Programming the page forgot the SPM stub
+  return 1;
+}
+
+
+
+
+PerTarget u8 pageBuffer[MaxFlashPageSize] = {0};
+
+void ForgetFlashManifest(u16 addr, int length);
 
 void WriteFlash(u16 addr, const u8 *buf, int length) {
 
@@ -207,7 +442,10 @@ void WriteFlash(u16 addr, const u8 *buf, int length) {
   Assert(length >= 0);
   if (length == 0) return;
 
-  DwGetRegs(0, R, 2); // Cache R0 and R1
+  ForgetFlashManifest(addr, length);
+
+  DwGetRegs(0, R, 28); // Cache R0 through R27
+  PrepareSpmStub(0);
 
   int pageOffsetMask = PageSize()-1;
   int pageBaseMask   = ~ pageOffsetMask;
@@ -253,8 +491,258 @@ void WriteFlash(u16 addr, const u8 *buf, int length) {
 
   Ws("                                       \r");
 
-  // Restore cached registers R0 and R1
-  DwSetRegs(0, R, 2);
+  // Restore cached registers R0 through R27
+  DwSetRegs(0, R, 28);
+}
+
+
+
+
+// Incremental image loading.
+//
+// The manifest records a CRC of every flash page as last written by
+// LoadFlashImage. It is kept in the home directory, one file per device
+// signature and LittleWire serial number. Pages whose CRC matches are
+// skipped without being read, and the pages that changed are erased and
+// programmed without being read first. Afterwards the programmed pages,
+// plus one of the skipped pages as a check that the manifest still
+// describes this chip, are read back and their CRCs compared. If the
+// skipped page does not match, the manifest is dropped and the image is
+// loaded again comparing every page.
+
+PerTarget struct {
+  char magic[4];   // "dwfm"
+  u32  signature;
+  u32  pageSize;
+  u32  crc[MaxFlashSize/MinFlashPageSize];
+  u8   known[MaxFlashSize/MinFlashPageSize];  // Non zero where crc is valid
+} FlashManifest;
+
+
+u32 Crc32(const u8 *buf, int len) {
+  u32 crc = 0xFFFFFFFF;
+  while (len-- > 0) {
+    crc ^= *buf++;
+    for (int i=0; i<8; i++) {crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));}
+  }
+  return ~crc;
+}
+
+
+u16 Crc16(const u8 *buf, int len) { // CRC-16/MODBUS, as the CRC stub computes it
+  u16 crc = 0xFFFF;
+  while (len-- > 0) {
+    crc ^= *buf++;
+    for (int i=0; i<8; i++) {crc = (crc >> 1) ^ (0xA001 & -(crc & 1));}
+  }
+  return crc;
+}
+
+
+void FlashManifestPath(char *path, int size) {
+  const char *home = getenv("HOME");
+  #ifdef windows
+    if (!home) {home = getenv("USERPROFILE");}
+  #endif
+  if (!home) {home = ".";}
+  snprintf(path, size, "%s/.dwdebug-%04x-%s.flash", home, Characteristics[DeviceType].signature, DwSerial[0] ? DwSerial : "0");
+}
+
+
+void ReadFlashManifest() {
+  char path[500];
+  FlashManifestPath(path, sizeof(path));
+  FILE *file = fopen(path, "rb");
+  int ok = file  &&  fread(&FlashManifest, sizeof(FlashManifest), 1, file) == 1;
+  if (file) {fclose(file);}
+  if (!ok
+  ||  memcmp(FlashManifest.magic, "dwfm", 4)
+  ||  FlashManifest.signature != Characteristics[DeviceType].signature
+  ||  FlashManifest.pageSize  != PageSize()) {
+    memset(&FlashManifest, 0, sizeof(FlashManifest));
+    memcpy(FlashManifest.magic, "dwfm", 4);
+    FlashManifest.signature = Characteristics[DeviceType].signature;
+    FlashManifest.pageSize  = PageSize();
+  }
+}
+
+
+void WriteFlashManifest() {
+  char path[500];
+  FlashManifestPath(path, sizeof(path));
+  FILE *file = fopen(path, "wb");
+  if (!file) {Ws("Could not write flash manifest "); Wsl(path); return;}
+  fwrite(&FlashManifest, sizeof(FlashManifest), 1, file);
+  fclose(file);
+}
+
+
+// Pages written other than by LoadFlashImage no longer match the manifest.
+
+void ForgetFlashManifest(u16 addr, int length) {
+  ReadFlashManifest();
+  for (int p = addr/PageSize(); p <= (addr+length-1)/PageSize(); p++) {FlashManifest.known[p] = 0;}
+  WriteFlashManifest();
+}
+
+
+// Runs the CRC stub over len bytes of flash from addr. Returns 0 if the stub
+// did not come back. Uses r0 and r21 through r31: the caller caches R0
+// through R27.
+
+int TargetCrc16(int addr, int len, u16 *crc) {
+  u8 regs[11] = {
+    0, 0x01, 0xA0,      // r21, r23:r22 := $A001
+    0xFF, 0xFF,         // r25:r24 := $FFFF
+    lo(len), hi(len),   // X  := length
+    R[28], R[29],       // Y  (cached)
+    lo(addr), hi(addr)  // Z  := first byte address
+  };
+  Assert(len > 0  &&  len <= 0xFFFF);
+  DwSetRegs(21, regs, sizeof(regs));
+  DwSetPC(CrcStub/2);
+  DwSetBP(CrcStub/2 + 12);     // The break instruction
+  DwSend(Bytes(0x61, 0x30));   // Go with breakpoint enabled, timers stopped
+  DwWait();
+  int tries = 0;
+  while (!DwWaitForBreak(20)) {
+    if (++tries > 50 + len/16) { // About 70 cycles a byte
+      Ws("                                       \r");
+      Wsl("CRC stub did not return, verifying flash by reading it back.");
+      DwBreakAndSync();
+      CrcStub = -1;
+      return 0;
+    }
+  }
+  u8 result[2];
+  DwGetRegs(24, result, 2);
+  *crc = result[0] | (result[1] << 8);
+  return 1;
+}
+
+
+void FlashPageFailed(int base) {
+  WritePageStatus(base, "verify failed"); Wl();
+  FlashManifest.known[base/PageSize()] = 0;
+  FlashCached[base/PageSize()] = 0;
+}
+
+
+// Compares len bytes of flash from addr with want, reporting each page that
+// differs. Returns the number of pages that failed.
+//
+// With the CRC stub a range costs one CRC on the target, and one that does
+// not match is split in half at a page boundary down to single pages, which
+// are read back. Without the stub every page is read back.
+
+int VerifyFlashRange(int addr, int len, const u8 *want) {
+  int pageSize = PageSize();
+  int first    = addr / pageSize;
+  int last     = (addr+len-1) / pageSize;
+  u16 crc;
+
+  if (len <= 0) {return 0;}
+
+  if (CrcStub > 0  &&  TargetCrc16(addr, len, &crc)) {
+    if (crc == Crc16(want, len)) {return 0;}
+    if (first < last) {
+      int middle = ((first+last+1)/2) * pageSize;
+      return VerifyFlashRange(addr,   middle-addr,     want)
+           + VerifyFlashRange(middle, addr+len-middle, want+middle-addr);
+    }
+    // A single page is read back, to report it only if it really differs
+  }
+
+  u8  page[MaxFlashPageSize];
+  int failed = 0;
+  for (int p=first; p<=last; p++) {
+    int from  = max(p*pageSize, addr);
+    int limit = min((p+1)*pageSize, addr+len);
+    DwFetchFlash(from, limit-from, page);
+    if (memcmp(page, want+from-addr, limit-from)) {FlashPageFailed(p*pageSize); failed++;}
+  }
+  return failed;
+}
+
+
+PerTarget u16 ChangedPage[MaxFlashSize/MinFlashPageSize];
+
+void LoadFlashImage(u16 addr, const u8 *buf, int length) {
+
+  Assert(addr + length <= FlashSize());
+  Assert(length >= 0);
+  if (length == 0) return;
+
+  ReadFlashManifest();
+  DwGetRegs(0, R, 28); // Cache R0 through R27
+  if (PrepareSpmStub(1)) {FlashManifest.known[(FlashSize()-1)/PageSize()] = 0;}
+  if (PrepareCrcStub(1)) {FlashManifest.known[(FlashSize()-1)/PageSize()] = 0;}
+
+  int pageSize = PageSize();
+  int changed  = 0;
+  int skipped  = 0;
+  int checked  = -1;  // Skipped page read back to check the manifest
+
+  for (int base = addr & ~(pageSize-1); base < addr+length; base += pageSize) {
+    int p     = base / pageSize;
+    int first = max(base, addr);
+    int limit = min(base+pageSize, addr+length);
+
+    if (first > base  ||  limit < base+pageSize) {
+      DwReadFlash(base, pageSize, pageBuffer); // Partial page: keep the rest of its contents
+    }
+    memcpy(pageBuffer+first-base, buf+first-addr, limit-first);
+
+    u32 crc = Crc32(pageBuffer, pageSize);
+    if (FlashManifest.known[p]  &&  FlashManifest.crc[p] == crc) {
+      if (checked < 0) {checked = base;}
+      skipped++;
+      continue;
+    }
+
+    if (FlashCached[p]  ||  !FlashManifest.known[p]) {
+      WriteFlashPage(base, pageBuffer);      // Compare with current contents first
+    } else {
+      ProgramFlashPage(base, pageBuffer, 1); // Known to differ, no need to read it
+    }
+    FlashManifest.known[p] = 1;
+    FlashManifest.crc[p]   = crc;
+    ChangedPage[changed++] = p;
+  }
+
+  // Verify: the check page is read back, the pages programmed are compared
+  // with FlashCache a run of consecutive pages at a time
+
+  int failed = 0;
+  if (checked >= 0) {
+    DwFetchFlash(checked, pageSize, pageBuffer);
+    if (Crc32(pageBuffer, pageSize) != FlashManifest.crc[checked/pageSize]) {
+      Ws("                                       \r");
+      Wsl("Flash does not match the manifest of the last image loaded, comparing every page.");
+      memset(FlashManifest.known, 0, sizeof(FlashManifest.known));
+      WriteFlashManifest();
+      DwSetRegs(0, R, 28);
+      LoadFlashImage(addr, buf, length);
+      return;
+    }
+    memcpy(FlashCache+checked, pageBuffer, pageSize);
+    FlashCached[checked/pageSize] = 1;
+  }
+  for (int i=0; i<changed;) {
+    int first = ChangedPage[i];
+    int limit = first;
+    while (i < changed  &&  ChangedPage[i] == limit) {i++; limit++;}
+    failed += VerifyFlashRange(first*pageSize, (limit-first)*pageSize, FlashCache+first*pageSize);
+  }
+
+  Ws("                                       \r");
+  Wd(changed,1); Ws(" pages written, "); Wd(skipped,1); Wsl(" unchanged.");
+
+  // Restore cached registers R0 through R27
+  DwSetRegs(0, R, 28);
+
+  WriteFlashManifest();
+  if (failed) {Fail("Flash verify failed.");}
 }
 
 
@@ -300,11 +788,92 @@ void WriteFlashBytesCommand() {
 
 
 
+// Bulk EEPROM access, with the transport repeat, which needs firmware built
+// with DW_REPEAT=1.
+//
+// The instructions for one byte are sent as a request 76 sequence which
+// the device repeats for up to EepromBlock bytes. Reads end with
+// out DWDR,r0 so each byte comes straight back rather than through the
+// scratch registers, writes have the device patch in the next byte and
+// wait out the EEPROM write time between bytes.
+
+int EepromBlock = 96; // EEPROM bytes per USB transaction, set with the eb command
+
+void DwReadEEPROMBulk(int addr, int len, u8 *buf)
+{
+  u8  seq[24];
+  int seqlen = 0;
+
+  DwGetRegs(0, R, 1); // Cache r0
+  DwSetRegs(29, Bytes(1, lo(addr), hi(addr))); // r29 := 1, r31:r30 := address
+  DwSend(Bytes(0x64));                         // Set up for single step mode
+
+  seqlen += SeqInst(seq+seqlen, OutInst(EEARL(), 30));              // out  EEARL,r30
+  if (EEARH()) seqlen += SeqInst(seq+seqlen, OutInst(EEARH(), 31)); // out  EEARH,r31
+  seqlen += SeqInst(seq+seqlen, OutInst(EECR(), 29));               // out  EECR,r29
+  seqlen += SeqInst(seq+seqlen, 0x9631);                            // adiw Z,1
+  seqlen += SeqInst(seq+seqlen, InInst(0, EEDR()));                 // in   r0,EEDR
+  seqlen += SeqInst(seq+seqlen, OutInst(DWDRreg(), 0));             // out  DWDR,r0
+
+  int block = max(1, min(EepromBlock, 128-seqlen));
+  while (len > 0) {
+    int count = min(len, block);
+    if (DwRepeat(seq, seqlen, count, -1, 0, 0, buf) < count) {Fail("EEPROM read failed.");}
+    buf += count;
+    len -= count;
+  }
+
+  DwSetRegs(0, R, 1); // Restore r0
+}
+
+
+void DwWriteEEPROMBulk(int addr, int len, u8 *buf)
+{
+  u8  seq[32];
+  int seqlen = 0;
+
+  DwGetRegs(0, R, 1); // Cache r0
+  DwSetRegs(28, Bytes(4, 2, lo(addr), hi(addr))); // r28 := 4, r29 := 2, r31:r30 := address
+  DwSend(Bytes(0x64));                            // Set up for single step mode
+
+  seqlen += SeqInst(seq+seqlen, InInst(0, DWDRreg()));              // in   r0,DWDR
+  int patch = seqlen++;                                             // ... the next byte
+  seqlen += SeqInst(seq+seqlen, OutInst(EEARL(), 30));              // out  EEARL,r30
+  if (EEARH()) seqlen += SeqInst(seq+seqlen, OutInst(EEARH(), 31)); // out  EEARH,r31
+  seqlen += SeqInst(seq+seqlen, OutInst(EEDR(), 0));                // out  EEDR,r0
+  seqlen += SeqInst(seq+seqlen, 0x9631);                            // adiw Z,1
+  seqlen += SeqInst(seq+seqlen, OutInst(EECR(), 28));               // out  EECR,r28
+  seqlen += SeqInst(seq+seqlen, OutInst(EECR(), 29));               // out  EECR,r29
+
+  int block = max(1, min(EepromBlock, 128-seqlen));
+  while (len > 0) {
+    int count = min(len, block);
+    DwRepeat(seq, seqlen, count, patch, buf, 5, 0); // 5ms for each eeprom write to complete
+    buf += count;
+    len -= count;
+  }
+
+  DwSetRegs(0, R, 1); // Restore r0
+}
+
+
+void EepromBlockCommand() {
+  Sb(); if (IsDwDebugNumeric(NextCh())) {
+    int block = ReadNumber(0);
+    if (block < 1) {Fail("EEPROM block size should be at least 1");}
+    EepromBlock = block;
+  } else {
+    Ws("EEPROM block size "); Wd(EepromBlock,1); Wsl(" bytes.");
+  }
+}
+
+
 void DwReadEEPROM(int addr, int len, u8 *buf)
 {
   u8 quint[5];
   int limit = addr + len;
   if (limit > EepromSize()) {Fail("Attempt to read beyond end of EEPROM.");}
+  if (Transport  &&  Transport->repeat) {DwReadEEPROMBulk(addr, len, buf); return;}
 
   DwGetRegs(0, R, 5); // Cache r0..r4
 
@@ -340,6 +909,7 @@ void DwWriteEEPROM(int addr, int len, u8 *buf)
 {
   int limit = addr + len;
   if (limit > EepromSize()) {Fail("Attempt to write beyond end of EEPROM.");}
+  if (Transport  &&  Transport->repeat) {DwWriteEEPROMBulk(addr, len, buf); return;}
 
   DwGetRegs(0, R, 1); // Cache r0
 
@@ -0,0 +1,88 @@
+/// Profile.c
+
+// Statistical profiling: the profile command runs the target, breaks it
+// every few milliseconds, records the PC and lets it run on again. The
+// samples are listed against the symbols of the file loaded, or by address
+// when there are none, showing where the target spends its time.
+
+
+
+
+enum {ProfileListed = 16};  // Lines listed of each table
+
+int ProfileSamples[MaxFlashSize/2];   // By word address
+int ProfileFunction[MaxFlashSize/2];  // By word address of the symbol at or below
+
+
+// Returns the byte address of the symbol at or below a, -1 if none.
+
+int ProfileSymbol(int a) {
+  while (a >= 0  &&  !CodeSymbol[a]) {a -= 2;}
+  return a;
+}
+
+
+void ProfileSymbolName(int a) {
+  int s = ProfileSymbol(a);
+  if (s < 0) {Ws("$"); Wx(a,4); return;}
+  Ws(CodeSymbol[s]);
+  if (a > s) {Ws("+$"); Wx(a-s,1);}
+}
+
+
+// Lists the largest entries of counts, each word address and its share of total.
+
+void ProfileList(int *counts, int total) {
+  for (int i=0; i<ProfileListed; i++) {
+    int top = 0;
+    for (int w=1; w<FlashSize()/2; w++) {if (counts[w] > counts[top]) {top = w;}}
+    if (!counts[top]) {break;}
+    Wd(counts[top], 7); Wd((counts[top]*100 + total/2) / total, 5); Ws("%  $"); Wx(top*2, 4);
+    Ws("  "); ProfileSymbolName(top*2); Wl();
+    counts[top] = 0;
+  }
+}
+
+
+void ProfileCommand() {
+  int samples = 1000;
+  Sb(); if (IsDwDebugNumeric(NextCh())) {samples = ReadNumber(0);}
+  if (samples <= 0) {Fail("Number of samples must be positive.");}
+
+  memset(ProfileSamples,  0, sizeof(ProfileSamples));
+  memset(ProfileFunction, 0, sizeof(ProfileFunction));
+
+  Ws("Profiling "); Wd(samples, 1); Ws(" samples "); Flush();
+  unsigned long started = lw_micros();
+  int taken = 0;
+  while (taken < samples) {
+    DwGo();
+    // Vary the time between samples so they don't keep step with a periodic loop
+    if (DwWaitForBreak(1 + taken % 4)) {DeviceBreak(); break;}
+    DwBreakAndSync();
+    DwReconnect();
+    ProfileSamples[PC/2]++;
+    taken++;
+    if (taken % 100 == 0) {Wc('.'); Flush();}
+  }
+  unsigned long elapsed = lw_micros() - started;
+  Wl();
+  if (!taken) {return;}
+
+  Wd(taken, 1); Ws(" samples in "); Wd(elapsed/1000, 1); Ws("ms, ");
+  Wd(elapsed/taken, 1); Wsl("us per sample.");
+
+  int symbols = 0;
+  for (int w=0; w<FlashSize()/2; w++) {
+    if (!ProfileSamples[w]) {continue;}
+    int s = ProfileSymbol(w*2);
+    if (s >= 0) {ProfileFunction[s/2] += ProfileSamples[w]; symbols = 1;}
+  }
+
+  if (symbols) {
+    Wsl("By symbol:\nSamples Share  Addr   Symbol");
+    ProfileList(ProfileFunction, taken);
+  }
+  Wsl("By address:\nSamples Share  Addr   Symbol");
+  ProfileList(ProfileSamples, taken);
+}
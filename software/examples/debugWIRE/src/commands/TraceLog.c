@@ -0,0 +1,108 @@
+/// TraceLog.c
+
+// Instruction trace: the trace command single steps many instructions
+// through DwStep, which leaves r28 through r31 alone and, on a LittleWire,
+// reads back the PC of up to 60 steps in one transfer. Each instruction
+// executed is listed, or written to a compact binary file which traceview
+// lists later without a target.
+
+
+
+
+typedef struct {
+  char magic[4];   // "dwtr"
+  u32  signature;  // Of the device traced
+  u32  count;      // Entries following
+} TraceHeader;
+
+typedef struct {
+  u16 pc;          // Byte address of the instruction executed
+  u8  code[4];     // Its instruction words, enough for a 2 word instruction
+} TraceEntry;
+
+enum {TraceChunk = 1024};  // Steps taken between register restores
+
+u16 TracePCs[TraceChunk];
+
+
+void TraceShow(const TraceEntry *entry, int index) {
+  DisassembleInstruction(entry->pc, (u8*)entry->code);
+  Wt(HasLineNumbers ? 76 : 56); Wc('#'); Wd(index, 1); Wl();
+}
+
+
+void TraceLogCommand() {
+  char        path[500] = "";
+  FILE       *file      = 0;
+  TraceHeader header    = {"dwtr", Characteristics[DeviceType].signature, 0};
+  TraceEntry  entry;
+
+  Sb(); if (!IsDwDebugNumeric(NextCh())) {Fail("Expected number of instructions to trace.");}
+  int count = ReadNumber(0);
+  if (count < 1) {Fail("Trace count should be at least 1");}
+  Sb(); if (!DwEoln()) {ReadWhile(NotDwEoln, path, sizeof(path)); TrimTrailingSpace(path);}
+
+  if (path[0]) {
+    file = fopen(path, "wb");
+    if (!file) {Ws("Could not create "); Fail(path);}
+    fwrite(&header, sizeof(header), 1, file);
+  }
+
+  unsigned long started = lw_micros();
+  unsigned long stepping = 0;
+  int done = 0;
+  while (done < count) {
+    int first = PC;
+    int n     = min(count-done, TraceChunk);
+
+    DwSetRegs(28, R+28, 4);  // Restore cached registers once per chunk
+    unsigned long chunk = lw_micros();
+    int steps = DwStep(n, TracePCs);
+    stepping += lw_micros() - chunk;
+    DwGetRegs(28, R+28, 4);  // Before reading flash, which uses Z
+
+    for (int i=0; i<steps; i++) {
+      entry.pc = i ? TracePCs[i-1] : first;
+      DwReadFlash(entry.pc, 4, entry.code);
+      if (file) {fwrite(&entry, sizeof(entry), 1, file);}
+      else      {TraceShow(&entry, done+i);}
+    }
+    done += steps;
+    if (steps < n) {Wsl("Target stopped answering."); break;}
+  }
+  unsigned long elapsed = lw_micros() - started;
+
+  if (file) {
+    header.count = done;
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    fclose(file);
+  }
+
+  Wd(done, 1); Ws(" instructions traced in "); Wd(elapsed/1000, 1); Ws("ms");
+  if (done) {Ws(", "); Wd(stepping/done, 1); Ws("us per step");}
+  Wsl(".");
+}
+
+
+void TraceViewCommand() {
+  char        path[500] = "";
+  TraceHeader header;
+  TraceEntry  entry;
+
+  Sb(); ReadWhile(NotDwEoln, path, sizeof(path)); TrimTrailingSpace(path);
+  if (!path[0]) {Fail("Expected the name of a trace file.");}
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {Ws("Could not open "); Fail(path);}
+  if (fread(&header, sizeof(header), 1, file) != 1  ||  memcmp(header.magic, "dwtr", 4)) {
+    fclose(file); Ws(path); Fail(" is not a dwdebug trace file.");
+  }
+
+  int i = 0;
+  while (i < header.count  &&  fread(&entry, sizeof(entry), 1, file) == 1) {
+    TraceShow(&entry, i++);
+  }
+  fclose(file);
+  Wd(i, 1); Ws(" instructions traced on a device with signature $"); Wx(header.signature, 4); Wsl(".");
+}
@@ -6,5 +6,8 @@
 #include "NonVolatile.c"
 #include "UnassembleCommand.c"
 #include "GoCommand.c"
+#include "Profile.c"
+#include "TraceLog.c"
 #include "OpenFile.c"
 #include "LoadFile.c"
+#include "Gang.c"
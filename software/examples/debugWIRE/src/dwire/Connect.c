@@ -1,6 +1,18 @@
-#if 0
+// Connect.c - debugWIRE through an FT232 USB serial adapter, used when
+// no LittleWire is found or a port is given with the device command.
+// The port is opened once and kept open while the baud rate is found.
+// SerialTransport at the end is the transport, see DwTransport.c.
+
 #ifdef windows
 
+  int ComPortNumber = 0;
+
+  void NextUsbSerialPort() {
+    UsbSerialPortName[0] = 0;
+    if (ComPortNumber >= 32) {ComPortNumber = 0; return;}
+    snprintf(UsbSerialPortName, sizeof(UsbSerialPortName), "COM%d", ++ComPortNumber);
+  }
+
 #else
 
   DIR *DeviceDir = 0;
@@ -142,17 +154,13 @@ int TryBaudRate(int baudrate) {
     Wc('.');
   }
   Flush();
-  MakeSerialPort(UsbSerialPortName, baudrate, &SerialPort);
-  if (!SerialPort) {
+  if (!SetSerialBaud(SerialPort, baudrate)) {
     Vsl(". Cannot set this baud rate, probably not an FT232.");
     return 0;
   }
 
   int byte = GetBreakResponseByte(Verbose);
 
-  Close(SerialPort);
-  SerialPort = 0;
-
   if (byte < 0) {
     Wsl(", No response, giving up."); return 0;
   } else if (Verbose) {
@@ -223,27 +231,108 @@ int FindBaudRate() {
 
 
 
+// FT232 transport: the adapter's TX and RX are both wired to the debugWIRE
+// line, so every byte sent comes back as an echo ahead of any reply. The
+// buffered bytes go out in one write, and echo and reply are read back in
+// one go.
+
+lwStats SerialStats;  // Transfer counters of the FT232
+
+void dwSerialTransfer(const u8 *out, int outlen, u8 *in, int inlen) {
+  u8 buf[256];
+  Assert(outlen <= 128  &&  inlen <= 128);
+  if (outlen + inlen == 0) {return;}
+  unsigned long started = lw_micros();
+  if (outlen) {
+    SerialWrite(SerialPort, out, outlen);
+    lw_stats_count(&SerialStats, USB_ENDPOINT_OUT, outlen, lw_micros() - started);
+    started = lw_micros();
+  }
+  SerialRead(SerialPort, buf, outlen + inlen);
+  lw_stats_count(&SerialStats, USB_ENDPOINT_IN, outlen + inlen, lw_micros() - started);
+  if (memcmp(buf, out, outlen)) {PortFail("debugWIRE echo did not match the bytes sent.");}
+  memcpy(in, buf+outlen, inlen);
+}
+
+// Reads the response after the target has sent a break, skipping the
+// zero and 0xFF bytes the break itself produces.
+int dwSerialSyncByte() {
+  u8 byte = 0;
+  for (int i=0; i<8  &&  (byte == 0  ||  byte == 0xFF); i++) {SerialRead(SerialPort, &byte, 1);}
+  return byte;
+}
+
+void dwSerialSend(const u8 *out, int outlen) {dwSerialTransfer(out, outlen, 0, 0);}
+
+int dwSerialReceive(const u8 *out, int outlen, u8 *in, int inlen) {
+  dwSerialTransfer(out, outlen, in, inlen);
+  return inlen;
+}
+
+void dwSerialBreak() {
+  for (int tries=0; tries<25; tries++) {
+    if (tries) SerialStats.retries++;
+    if (GetBreakResponseByte(0) == 0x55) {return;}
+    Wc('.'); Flush();
+  }
+  Wl(); PortFail("No response from the target to 25 breaks.");
+}
+
+int dwSerialCapture(const u8 *out, int outlen) {
+  dwSerialTransfer(out, outlen, 0, 0);
+  return dwSerialSyncByte() == 0x55;
+}
+
+void dwSerialWait(const u8 *out, int outlen) {dwSerialTransfer(out, outlen, 0, 0);}
+
+int dwSerialWaitForBreak(int timeout) {  // The target sends a break and 0x55
+  if (!SerialReady(SerialPort, timeout)) {return 0;}
+  dwSerialSyncByte();
+  return 1;
+}
+
+int dwSerialBaud() {return SerialBaud;}
+
+void dwSerialClose() {
+  if (SerialPort) {Close(SerialPort); SerialPort = 0;}
+  Transport = 0;
+}
+
+DwTransport SerialTransport = {
+  "FT232", dwSerialSend, dwSerialReceive, dwSerialBreak, dwSerialCapture, dwSerialWait,
+  dwSerialWaitForBreak, dwSerialBaud, dwSerialClose, 0, 0, 0, &SerialStats
+};
+
+
+
+
 void TryConnectSerialPort(int baud) {
   jmp_buf oldFailPoint;
   memcpy(oldFailPoint, FailPoint, sizeof(FailPoint));
 
   if (setjmp(FailPoint)) {
+    if (SerialPort) {Close(SerialPort);}
     SerialPort = 0;
   } else {
-    if (baud == 0) {
+    MakeSerialPort(UsbSerialPortName, baud ? baud : 150000, &SerialPort);
+    if (SerialPort) {SerialLowLatency(UsbSerialPortName, SerialPort);}
+    if (SerialPort  &&  baud == 0) {
       if (!Verbose) {Ws(UsbSerialPortName); Wc(' ');}
       baud = FindBaudRate();
       Wl();}
-    if (baud) {
+    if (SerialPort  &&  baud) {
       BreakLength = 100000 / baud;
-      MakeSerialPort(UsbSerialPortName, baud, &SerialPort);
+      if (BreakLength < 2) BreakLength = 2;
+      SetSerialBaud(SerialPort, baud);
       int byte = GetBreakResponseByte(0);
       if (byte != 0x55) {Close(SerialPort); SerialPort = 0;}
+    } else if (SerialPort) {
+      Close(SerialPort); SerialPort = 0;
     }
     if (SerialPort) {
+      SerialBaud = baud;
       Ws("Connected to DebugWIRE device on USB serial port "); Ws(UsbSerialPortName);
       Ws(" at baud rate "); Wd(baud, 1); Wl();
-      DwConnect();
     }
   }
 
@@ -266,5 +355,6 @@ void ConnectSerialPort(int baud) {
       TryConnectSerialPort(0);
     }
   }
+  Transport = &SerialTransport;
 }
-#endif
\ No newline at end of file
+
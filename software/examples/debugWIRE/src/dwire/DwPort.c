@@ -31,10 +31,33 @@
 #define IN_FROM_LW  USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN
 
 
-void PortFail(char *msg) {usb_close(Port); Port = 0; Fail(msg);}
+PerTarget lwStats DwStats; // transfer counters of the debugWIRE port, see lw_control_msg
+PerTarget int DwFirmware;  // firmware version of the digispark/LittleWire
+PerTarget unsigned long DwCapabilities;  // requests the firmware was built with, see LW_CAP_DW_STREAM and on
+PerTarget char DwSerial[16] = "";  // USB serial number of the digispark/LittleWire, names the flash manifest
 
 
-static uint32_t cyclesPerPulse;
+void PortFail(char *msg) {
+  if (Transport) {Transport->close();}
+  Fail(msg);
+}
+
+
+// FT232 connection, see Connect.c
+
+void ConnectSerialPort(int baud);
+
+
+static PerTarget uint32_t cyclesPerPulse;
+
+
+// Spacing of repeated polls of the device: the first two go straight away,
+// so a short operation completes as soon as the device has finished it,
+// then the gap doubles from 1ms up to 20ms.
+
+void DwBackoff(int tries) {
+  if (tries >= 2) delay(tries < 7 ? 1 << (tries-2) : 20);
+}
 
 int SetDwireBaud() { // returns 1 iff success
   int status;
@@ -43,11 +66,11 @@ int SetDwireBaud() { // returns 1 iff success
   uint16_t times[64];
 
   tries = 0;  status = 0;
-  while ((tries < 5)  &&  (status <= 0)) {
-    tries++;
-    delay(20);
+  while ((tries < 20)  &&  (status <= 0)) {  // about 300ms, the break alone takes 100ms
+    if (tries) DwStats.retries++;
+    DwBackoff(tries++);
     // Read back timings
-    status = usb_control_msg(Port, IN_FROM_LW, 60, 0, 0, (char*)times, sizeof(times), USB_TIMEOUT);
+    status = lw_control_msg(&DwStats, Port, IN_FROM_LW, 60, 0, 0, (char*)times, sizeof(times), USB_TIMEOUT);
     //Ws("Read back timimgs status: "); Wd(status,1); Wsl(".");
   }
   if (status < 18) {return 0;}
@@ -70,7 +93,7 @@ int SetDwireBaud() { // returns 1 iff success
   times[0] = (cyclesPerPulse-8)/4;  // dwBitTime
 
   // Send timing parameters to digispark
-  status = usb_control_msg(Port, OUT_TO_LW, 60, 2, 0, (char*)times, 2, USB_TIMEOUT);
+  status = lw_control_msg(&DwStats, Port, OUT_TO_LW, 60, 2, 0, (char*)times, 2, USB_TIMEOUT);
   if (status < 0) {PortFail("Failed to set debugWIRE port baud rate");}
 
   return 1;
@@ -79,14 +102,15 @@ int SetDwireBaud() { // returns 1 iff success
 
 
 
-void DwBreakAndSync() {
+void dwUsbBreak() {
   for (int tries=0; tries<25; tries++) {
+    if (tries) DwStats.retries++;
     // Tell digispark to send a break and capture any returned pulse timings
     //Wsl("Commanding digispark break and capture.");
-    int status = usb_control_msg(Port, OUT_TO_LW, 60, 33, 0, 0, 0, USB_TIMEOUT);
+    int status = lw_control_msg(&DwStats, Port, OUT_TO_LW, 60, 33, 0, 0, 0, USB_TIMEOUT);
     if (status >= 0) {
-      delay(120); // Wait while digispark sends break and reads back pulse timings
-      // Get any pulse timings back from digispark
+      // Get any pulse timings back from digispark, SetDwireBaud polls until
+      // the break has been sent and the timings read back.
       if (SetDwireBaud()) {
         Ws("Connected at "); Wd(16500000 / cyclesPerPulse, 1); Wsl(" baud.");
         return;
@@ -100,23 +124,115 @@ void DwBreakAndSync() {
 
 
 
-void ConnectPort() {
-  usb_init();
-  usbOpenDevice(&Port, VENDOR_ID, "*", PRODUCT_ID, "*", "*", NULL, NULL );
-  if (!Port) {Fail("Couldn't connect to digispark.");}
-  DwBreakAndSync();
+// Timing last found for this digispark/LittleWire, so that a target left
+// stopped in debugWIRE can be reconnected without a break. Kept in the home
+// directory, one file per LittleWire serial number, next to the flash
+// manifest.
+
+PerTarget struct {
+  char     magic[4];        // "dwbt"
+  u32      signature;       // Target signature read with the timing
+  u32      cyclesPerPulse;
+} DwTiming;
+
+void DwTimingPath(char *path, int size) {
+  const char *home = getenv("HOME");
+  #ifdef windows
+    if (!home) {home = getenv("USERPROFILE");}
+  #endif
+  if (!home) {home = ".";}
+  snprintf(path, size, "%s/.dwdebug-%s.baud", home, DwSerial[0] ? DwSerial : "0");
 }
 
+int ReadDwTiming() {
+  char path[500];
+  DwTimingPath(path, sizeof(path));
+  FILE *file = fopen(path, "rb");
+  int ok = file  &&  fread(&DwTiming, sizeof(DwTiming), 1, file) == 1;
+  if (file) {fclose(file);}
+  return ok  &&  memcmp(DwTiming.magic, "dwbt", 4) == 0  &&  DwTiming.cyclesPerPulse > 8;
+}
+
+void WriteDwTiming(int signature) {
+  char path[500];
+  if (DwTiming.signature == signature  &&  DwTiming.cyclesPerPulse == cyclesPerPulse) return;
+  memcpy(DwTiming.magic, "dwbt", 4);
+  DwTiming.signature      = signature;
+  DwTiming.cyclesPerPulse = cyclesPerPulse;
+  DwTimingPath(path, sizeof(path));
+  FILE *file = fopen(path, "wb");
+  if (!file) return;
+  fwrite(&DwTiming, sizeof(DwTiming), 1, file);
+  fclose(file);
+}
+
+
+// Tries the saved timing with a signature read, returns 1 iff the target
+// answered with the signature saved with it. Fails quickly when the target
+// is running, or was clocked differently, and a break is needed.
+
+int DwResync() {
+  if (!ReadDwTiming()) {return 0;}
+  uint16_t bitTime = (DwTiming.cyclesPerPulse-8)/4;
+  if (lw_control_msg(&DwStats, Port, OUT_TO_LW, 60, 2, 0, (char*)&bitTime, 2, USB_TIMEOUT) < 0) {return 0;}
+  char command = 0xF3;  // Request signature
+  if (lw_control_msg(&DwStats, Port, OUT_TO_LW, 60, 0x14, 2, &command, 1, USB_TIMEOUT) < 1) {return 0;}
+  u8 reply[2];
+  int status = 0;
+  for (int tries=0; tries<8 && status <= 0; tries++) {
+    DwBackoff(tries);
+    status = lw_control_msg(&DwStats, Port, IN_FROM_LW, 60, 0, 0, (char*)reply, sizeof(reply), USB_TIMEOUT);
+  }
+  if (status != 2  ||  ((reply[0] << 8) | reply[1]) != DwTiming.signature) {return 0;}
+  cyclesPerPulse = DwTiming.cyclesPerPulse;
+  Ws("Reconnected at "); Wd(16500000 / cyclesPerPulse, 1); Wsl(" baud.");
+  return 1;
+}
+
+
+
+
+// Baud rate the firmware is using now. Firmware 0x14 and up reports its
+// bit time with the job status, that is then also saved for the next
+// connect. Firmware built with DW_BAUD=1 follows drift of the target clock.
+
+int dwUsbBaud() {
+  u8 job[6];
+  if (DwFirmware >= 0x14
+  &&  lw_control_msg(&DwStats, Port, IN_FROM_LW, 74, 0, 0, (char*)job, sizeof(job), USB_TIMEOUT) == sizeof(job)) {
+    cyclesPerPulse = 4*(job[4] | job[5] << 8) + 8;
+    if (DwTiming.signature) {WriteDwTiming(DwTiming.signature);}
+  }
+  return 16500000 / cyclesPerPulse;
+}
+
+
 
 
 int dwReachedBreakpoint() {
   char dwBuf[10];
-  int status = usb_control_msg(Port, IN_FROM_LW, 60, 0, 0, dwBuf, sizeof(dwBuf), USB_TIMEOUT);
+  int status = lw_control_msg(&DwStats, Port, IN_FROM_LW, 60, 0, 0, dwBuf, sizeof(dwBuf), USB_TIMEOUT);
   //if (status < 0) {
   //  Ws("dwReachedBreakpoint: dwBuf read returned "); Wd(status,1);
   //  Ws(", dwBuf[0] = $"); Wx(dwBuf[0],2); Wsl(".");
   //}
-  return status >= 0  &&  dwBuf[0] != 0;
+  return status > 0  &&  dwBuf[0] != 0;
+}
+
+
+// Waits up to timeout ms for the target to break after DwWait. Firmware
+// built with DW_BREAK=1 reports the break on the interrupt-in endpoint,
+// other firmware is polled. Returns 1 once the target has broken.
+
+int dwUsbWaitForBreak(int timeout) {
+  char report[8];
+  if (!(DwCapabilities & LW_CAP_DW_BREAK)) {
+    if (dwReachedBreakpoint()) {return 1;}
+    delay(timeout);
+    return 0;
+  }
+  int status = usb_interrupt_read(Port, USB_ENDPOINT_IN | 1, report, sizeof(report), timeout);
+  return status > 0  &&  report[0] == 0x20;
 }
 
 
@@ -125,36 +241,215 @@ int dwReachedBreakpoint() {
 // state = 0x04 - Just send the bytes
 // state = 0x14 - Send bytes and read response bytes
 // state = 0x24 - Send bytes and record response pulse widths
+//
+// expect - number of response bytes, the device stops reading as soon as
+//          they are in rather than waiting out a timeout. 0 for up to 128.
 
-void dwUSBSendBytes(u8 state, char *out, int outlen) {
-
-  if (!Port) ConnectPort();
-
+void dwUSBSendBytes(u8 state, const u8 *out, int outlen, int expect) {
   int tries  = 0;
-  int status = usb_control_msg(Port, OUT_TO_LW, 60, state, 0, out, outlen, USB_TIMEOUT);
+  int status = lw_control_msg(&DwStats, Port, OUT_TO_LW, 60, state, expect, (char*)out, outlen, USB_TIMEOUT);
 
   while ((tries < 50) && (status <= 0)) {
     // Wait for previous operation to complete
-    tries++;
-    delay(20);
-    status = usb_control_msg(Port, OUT_TO_LW, 60, state, 0, out, outlen, USB_TIMEOUT);
+    DwStats.retries++;
+    DwBackoff(tries++);
+    status = lw_control_msg(&DwStats, Port, OUT_TO_LW, 60, state, expect, (char*)out, outlen, USB_TIMEOUT);
   }
   if (status < outlen) {Ws("Failed to send bytes to AVR, status "); Wd(status,1); PortFail("");}
   delay(3); // Wait at least until digispark starts to send the data.
 }
 
 
+void dwUsbSend(const u8 *out, int outlen) {
+  if (outlen > 0) {dwUSBSendBytes(0x04, out, outlen, 0);}
+}
+
+int dwUsbReceive(const u8 *out, int outlen, u8 *in, int inlen) {
+  int tries  = 0;
+  int status = 0;
+
+  if (outlen > 0) {dwUSBSendBytes(0x14, out, outlen, inlen);}
+
+  while ((tries < 50) && (status <= 0)) {
+    if (tries) DwStats.retries++;
+    DwBackoff(tries++);
+    // Read back dWIRE bytes
+    status = lw_control_msg(&DwStats, Port, IN_FROM_LW, 60, 0, 0, (char*)in, inlen, USB_TIMEOUT);
+  }
+  return status;
+}
+
+int dwUsbCapture(const u8 *out, int outlen) {
+  if (outlen > 0) {dwUSBSendBytes(0x24, out, outlen, 0);}
+  return SetDwireBaud();
+}
+
+void dwUsbWait(const u8 *out, int outlen) {
+  char report[8];
+  // Drop a break report left over from an earlier wait
+  if (DwCapabilities & LW_CAP_DW_BREAK) {usb_interrupt_read(Port, USB_ENDPOINT_IN | 1, report, sizeof(report), 1);}
+  if (outlen > 0) {dwUSBSendBytes(0x0C, out, outlen, 0);}  // Send bytes and wait for dWIRE line state change
+}
+
+// Has the device send a command sequence count times, see request 76 in
+// the firmware. Before each send the byte at offset patch (-1 for none) is
+// replaced by the next of data. When in is not 0, one reply byte is read
+// after each send and the replies are returned in it. wait is the time
+// in ms the device waits after each send.
+// Returns the number of reply bytes.
+
+int dwUsbRepeat(const u8 *seq, int seqlen, int count, int patch, const u8 *data, int wait, u8 *in) {
+  char out[128];
+  int  outlen = seqlen + (data ? count : 0);
+  int  tries  = 0;
+  int  status = 0;
+  int  limit  = 50 + 2*count; // Each repeat takes a few ms, much more on slow targets
+
+  Assert(seqlen + count <= sizeof(out)  &&  wait < 128);
+  memcpy(out, seq, seqlen);
+  if (data) {memcpy(out+seqlen, data, count);}
+
+  while ((tries < limit) && (status <= 0)) { // Wait for previous operation to complete
+    if (tries) DwStats.retries++;
+    DwBackoff(tries++);
+    status = lw_control_msg(&DwStats, Port, OUT_TO_LW, 76, count | (seqlen << 8),
+                            (patch & 0xFF) | ((wait | (in ? 0x80 : 0)) << 8), out, outlen, USB_TIMEOUT);
+  }
+  if (status < outlen) {Ws("Failed to send repeat to AVR, status "); Wd(status,1); PortFail("");}
+  if (!in) {return 0;}
+
+  tries = 0; status = 0;
+  while ((tries < limit) && (status <= 0)) {
+    if (tries) DwStats.retries++;
+    DwBackoff(tries++);
+    status = lw_control_msg(&DwStats, Port, IN_FROM_LW, 60, 0, 0, (char*)in, count, USB_TIMEOUT);
+  }
+  return status;
+}
+
+// Reads len bytes from the data area with request 75: the device sets Z
+// and captures one 128 byte chunk after another, each as soon as the
+// previous one has been read, so there is no command upload per chunk.
+// Returns the number of bytes read.
+
+// Waits for the device to finish the previous operation, polling the job
+// status (request 74), before a request that carries no data and so is
+// not retried when the device is busy.
+
+void dwUsbIdle() {
+  for (int tries=0; tries<50; tries++) {
+    u8 job[4] = {1, 1};
+    if (tries) DwStats.retries++;
+    DwBackoff(tries);
+    int status = lw_control_msg(&DwStats, Port, IN_FROM_LW, 74, 0, 0, (char*)job, sizeof(job), USB_TIMEOUT);
+    if (status == sizeof(job)  &&  !job[0]  &&  !job[1]) break;
+  }
+}
+
+int dwUsbStreamRead(int addr, int len, u8 *buf) {
+  int done = 0;
+  int tries;
+  int status;
+
+  dwUsbIdle();
+  if (lw_control_msg(&DwStats, Port, OUT_TO_LW, 75, addr, len, 0, 0, USB_TIMEOUT) < 0) {return 0;}
+  while (done < len) {
+    status = 0;
+    for (tries=0; tries<50 && status == 0; tries++) {
+      if (tries) DwStats.retries++;
+      DwBackoff(tries);
+      status = lw_control_msg(&DwStats, Port, IN_FROM_LW, 75, 0, 0, (char*)buf+done, min(len-done, 128), USB_TIMEOUT);
+    }
+    if (status <= 0) break;
+    done += status;
+  }
+  if (done < len) {lw_control_msg(&DwStats, Port, OUT_TO_LW, 75, 0, 0, 0, 0, USB_TIMEOUT);} // stop
+  return done;
+}
+
+// Single steps count instructions from word address pc with request 77,
+// the device reading the PC after each step. pcs receives the PC words
+// as the target sends them, high byte first. Returns the number of steps
+// taken, fewer if the target stopped answering.
+
+int dwUsbStep(int pc, int count, u8 *pcs) {
+  int tries  = 0;
+  int status = 0;
+  int limit  = 50 + count; // Each step takes a few ms
+
+  Assert(count > 0  &&  count <= 60);
+  dwUsbIdle();
+  if (lw_control_msg(&DwStats, Port, OUT_TO_LW, 77, count, pc, 0, 0, USB_TIMEOUT) < 0) {PortFail("Failed to send trace to AVR.");}
+  while ((tries < limit) && (status <= 0)) {
+    if (tries) DwStats.retries++;
+    DwBackoff(tries++);
+    status = lw_control_msg(&DwStats, Port, IN_FROM_LW, 60, 0, 0, (char*)pcs, 2*count, USB_TIMEOUT);
+  }
+  return max(status, 0) / 2;
+}
+
+void dwUsbClose() {
+  if (Port) {usb_close(Port); Port = 0;}
+  Transport = 0;
+}
+
+PerTarget DwTransport LittleWireTransport = {
+  "LittleWire", dwUsbSend, dwUsbReceive, dwUsbBreak, dwUsbCapture, dwUsbWait,
+  dwUsbWaitForBreak, dwUsbBaud, dwUsbClose, dwUsbRepeat, dwUsbStreamRead, dwUsbStep, 0
+};
+
+
+
+
+// LittleWire to connect to, 0 for the first one found, see Sessions.c
+
+PerTarget struct usb_device *TargetDevice = 0;
+
+void ConnectPort() {
+  if (TargetDevice) {  // Already found by littlewire_search
+    Port = usb_open(TargetDevice);
+    if (!Port) {Fail("Could not open the selected LittleWire.");}
+  } else {
+    usb_init();
+    usbOpenDevice(&Port, VENDOR_ID, "*", PRODUCT_ID, "*", "*", NULL, NULL );
+    if (!Port) {ConnectSerialPort(0); return;}  // No digispark, look for an FT232
+  }
+  Transport = &LittleWireTransport;
+  LittleWireTransport.stats      = &DwStats;
+  LittleWireTransport.repeat     = 0;
+  LittleWireTransport.streamRead = 0;
+  LittleWireTransport.step       = 0;
+  u8 version[5] = {0};
+  int got = lw_control_msg(&DwStats, Port, IN_FROM_LW, 34, 0, 0, (char*)version, sizeof(version), USB_TIMEOUT);
+  if (got >= 1) {DwFirmware = version[0];}
+  DwCapabilities = got < 5 ? 0 : version[1] | version[2] << 8 | (unsigned long)version[3] << 16 | (unsigned long)version[4] << 24;
+  if (DwFirmware == 0x14) {DwCapabilities = LW_CAP_DW_STREAM | LW_CAP_DW_REPEAT | LW_CAP_DW_BREAK;}  // from before capabilities were reported
+  if (DwCapabilities & LW_CAP_DW_REPEAT) {LittleWireTransport.repeat     = dwUsbRepeat;}      // Request 76
+  if (DwCapabilities & LW_CAP_DW_STREAM) {LittleWireTransport.streamRead = dwUsbStreamRead;}  // Request 75
+  if (DwCapabilities & LW_CAP_DW_TRACE)  {LittleWireTransport.step       = dwUsbStep;}        // Request 77
+  struct usb_device *device = usb_device(Port);
+  if (usb_get_string_simple(Port, device->descriptor.iSerialNumber, DwSerial, sizeof(DwSerial)) < 0) {DwSerial[0] = 0;}
+  if (!DwResync()) {dwUsbBreak();}
+}
+
+
+
+
 // Buffer accumulating debugWIRE data to be sent to the device.
-// We buffer data in order to minimise the number of USB transactions used,
+// We buffer data in order to minimise the number of transfers used,
 // but we also guarantee that a debugWIRE read transaction includes at leasr
 // one byte of data to be sent first.
 
-char OutBufBytes[128];
-int  OutBufLength = 0;
+PerTarget char OutBufBytes[128];
+PerTarget int  OutBufLength = 0;
+
+
+void dwConnected() {if (!Transport) ConnectPort();}
 
-void dwBufferFlush(u8 state) {
+void dwBufferFlush() {
+  dwConnected();
   if (OutBufLength > 0) {
-    dwUSBSendBytes(state, OutBufBytes, OutBufLength);
+    Transport->send((u8*)OutBufBytes, OutBufLength);
     OutBufLength = 0;
   }
 }
@@ -173,8 +468,8 @@ void DwSend(const u8 *out, int outlen) {
     // between 1 and 128 bytes still to send in the buffer.
     int lenToCopy = sizeof(OutBufBytes)-OutBufLength;
     memcpy(OutBufBytes+OutBufLength, out, lenToCopy);
-    dwUSBSendBytes(0x04, OutBufBytes, sizeof(OutBufBytes));
-    OutBufLength = 0;
+    OutBufLength = sizeof(OutBufBytes);
+    dwBufferFlush();
     out += lenToCopy;
     outlen -= lenToCopy;
   }
@@ -187,24 +482,34 @@ void DwSend(const u8 *out, int outlen) {
 
 
 void DwFlush() {
-  dwBufferFlush(0x14);
+  dwBufferFlush();
 }
 
 
 int DwReceive(u8 *in, int inlen) {
   Assert(inlen <= 128);
-  int tries  = 0;
-  int status = 0;
+  dwConnected();
+  int status = Transport->receive((u8*)OutBufBytes, OutBufLength, in, inlen);
+  OutBufLength = 0;
+  return status;
+}
 
-  dwBufferFlush(0x14);
+// Has the device send a command sequence count times, see dwUsbRepeat.
+// Only where Transport->repeat is set.
 
-  while ((tries < 50) && (status <= 0)) {
-    tries++;
-    delay(20);
-    // Read back dWIRE bytes
-    status = usb_control_msg(Port, IN_FROM_LW, 60, 0, 0, (char*)in, inlen, USB_TIMEOUT);
-  }
-  return status;
+int DwRepeat(const u8 *seq, int seqlen, int count, int patch, const u8 *data, int wait, u8 *in) {
+  dwBufferFlush();
+  Assert(Transport->repeat);
+  return Transport->repeat(seq, seqlen, count, patch, data, wait, in);
+}
+
+// Reads len bytes from the data area in one go, see dwUsbStreamRead.
+// Only where Transport->streamRead is set. Returns the number of bytes read.
+
+int DwStreamReadAddr(int addr, int len, u8 *buf) {
+  dwBufferFlush();
+  Assert(Transport->streamRead);
+  return Transport->streamRead(addr, len, buf);
 }
 
 int DwReadByte() {u8 byte = 0; DwReceive(&byte, 1); return byte;}
@@ -212,14 +517,22 @@ int DwReadWord() {u8 buf[2] = {0}; DwReceive(buf, 2); return (buf[0] << 8) | buf
 
 
 void DwSync() {
-  dwBufferFlush(0x24);
-  if (!SetDwireBaud()) {PortFail("Could not read back timings following transfer and sync command");}
+  dwConnected();
+  int ok = Transport->capture((u8*)OutBufBytes, OutBufLength);
+  OutBufLength = 0;
+  if (!ok) {PortFail("Could not resynchronise following transfer and sync command");}
 }
 
-void DwWait() {
-  dwBufferFlush(0x0C);  // Send bytes and wait for dWIRE line state change
+void DwWait() {  // Send bytes and wait for dWIRE line state change
+  dwConnected();
+  Transport->wait((u8*)OutBufBytes, OutBufLength);
+  OutBufLength = 0;
 }
 
+int  DwWaitForBreak(int timeout) {dwConnected(); return Transport->waitForBreak(timeout);}
+void DwBreakAndSync()            {dwConnected(); Transport->brk();}
+int  DwBaud()                    {dwConnected(); return Transport->baud();}
+
 
 
 
@@ -236,6 +549,7 @@ void SetSizes(int signature) {
 
   if (Characteristics[i].signature) {
     DeviceType = i;
+    memset(FlashCached, 0, sizeof(FlashCached));
     Ws("Device recognised as "); Wsl(Characteristics[DeviceType].name);
   } else {
     DeviceType = -1;
@@ -251,8 +565,86 @@ void DwSetBP(u16 bp) {DwSend(Bytes(0xD1, hi(bp)|0x10, lo(bp)));}
 
 void DwInst(u16 inst) {DwSend(Bytes(0xD2, hi(inst), lo(inst), 0x23));}
 
-void DwIn(u8 reg, u16 ioreg)  {DwInst(0xB000 | ((ioreg << 5) & 0x600) | ((reg << 4) & 0x01F0) | (ioreg & 0x000F));}
-void DwOut(u16 ioreg, u8 reg) {DwInst(0xB800 | ((ioreg << 5) & 0x600) | ((reg << 4) & 0x01F0) | (ioreg & 0x000F));}
+u16 InInst(u8 reg, u16 ioreg)  {return 0xB000 | ((ioreg << 5) & 0x600) | ((reg << 4) & 0x01F0) | (ioreg & 0x000F);}
+u16 OutInst(u16 ioreg, u8 reg) {return 0xB800 | ((ioreg << 5) & 0x600) | ((reg << 4) & 0x01F0) | (ioreg & 0x000F);}
+
+void DwIn(u8 reg, u16 ioreg)  {DwInst(InInst(reg, ioreg));}
+void DwOut(u16 ioreg, u8 reg) {DwInst(OutInst(ioreg, reg));}
+
+// Appends the debugWIRE bytes executing inst to a command sequence
+int SeqInst(u8 *seq, u16 inst) {seq[0] = 0xD2; seq[1] = hi(inst); seq[2] = lo(inst); seq[3] = 0x23; return 4;}
+
+
+
+// Data area reads planned ahead, see ui/Script.c. While DwPlanning is
+// set, DwReadAddr and DwGetRegs only note the areas they would read.
+// DwPrefetch then reads each run of noted areas in one go, and reads that
+// fall inside what it read are answered from it until DwPrefetchClear.
+//
+
+enum {MaxPrefetch = 16, PrefetchGap = 16}; // Spare SRAM bytes worth reading to save an exchange
+
+PerTarget int DwPlanning = 0;
+PerTarget int PrefetchCount = 0;
+PerTarget struct {int addr; int len; u8 *data;} Prefetched[MaxPrefetch];
+
+void dwNoteRead(int addr, int len) {
+  if (PrefetchCount >= MaxPrefetch  ||  len <= 0) {return;}  // The rest is read as usual
+  Prefetched[PrefetchCount].addr = addr;
+  Prefetched[PrefetchCount].len  = len;
+  Prefetched[PrefetchCount].data = 0;
+  PrefetchCount++;
+}
+
+int dwPrefetched(int addr, int len, u8 *buf) {
+  for (int i=0; i<PrefetchCount; i++) {
+    if (Prefetched[i].data  &&  addr >= Prefetched[i].addr
+    &&  addr + len <= Prefetched[i].addr + Prefetched[i].len) {
+      memcpy(buf, Prefetched[i].data + addr - Prefetched[i].addr, len);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void DwPrefetchClear() {
+  for (int i=0; i<PrefetchCount; i++) {if (Prefetched[i].data) {Free(Prefetched[i].data);}}
+  PrefetchCount = 0;
+}
+
+void DwReadAddr(int addr, int len, u8 *buf);
+
+void DwPrefetch() {
+  int sram = 32 + IoregSize();  // Reading SRAM has no side effects, unlike some io registers
+  int n    = 0;
+
+  // Sort by address, then join areas that overlap, touch, or are a few
+  // bytes of SRAM apart.
+  for (int i=1; i<PrefetchCount; i++) {
+    for (int j=i; j>0  &&  Prefetched[j].addr < Prefetched[j-1].addr; j--) {
+      int addr = Prefetched[j].addr, len = Prefetched[j].len;
+      Prefetched[j] = Prefetched[j-1];
+      Prefetched[j-1].addr = addr;  Prefetched[j-1].len = len;
+    }
+  }
+  for (int i=0; i<PrefetchCount; i++) {
+    if (n) {
+      int end = Prefetched[n-1].addr + Prefetched[n-1].len;
+      if (Prefetched[i].addr <= end  ||  (end >= sram  &&  Prefetched[i].addr - end <= PrefetchGap)) {
+        Prefetched[n-1].len = max(end, Prefetched[i].addr + Prefetched[i].len) - Prefetched[n-1].addr;
+        continue;
+      }
+    }
+    Prefetched[n++] = Prefetched[i];
+  }
+  PrefetchCount = n;
+
+  for (int i=0; i<PrefetchCount; i++) {
+    u8 *data = Allocate(Prefetched[i].len);
+    DwReadAddr(Prefetched[i].addr, Prefetched[i].len, data);
+    Prefetched[i].data = data;
+  }
+}
 
 
 
@@ -261,6 +653,11 @@ void DwOut(u16 ioreg, u8 reg) {DwInst(0xB800 | ((ioreg << 5) & 0x600) | ((reg <<
 
 
 void DwGetRegs(int first, u8 *regs, int count) {
+  if (first + count <= 28) {  // Registers below r28 are at the same data area addresses
+    if (DwPlanning) {dwNoteRead(first, count); return;}
+    if (dwPrefetched(first, count, regs)) {return;}
+  }
+  if (DwPlanning) {return;}
   if (count == 1) {
     DwOut(DWDRreg(), first);
   } else {
@@ -302,6 +699,9 @@ void DwUnsafeReadAddr(int addr, int len, u8 *buf) {
 }
 
 void DwReadAddr(int addr, int len, u8 *buf) {
+  if (DwPlanning) {dwNoteRead(addr, len); return;}
+  if (dwPrefetched(addr, len, buf)) {return;}
+
   // Read range before r28
   int len1 = min(len, 28-addr);
   if (len1 > 0) {DwUnsafeReadAddr(addr, len1, buf); addr+=len1; len-=len1; buf+=len1;}
@@ -318,7 +718,13 @@ void DwReadAddr(int addr, int len, u8 *buf) {
   // Provide dummy 0 value for DWDR
   if (addr == DWDRaddr()  &&  len > 0) {buf[0] = 0; addr++; len--; buf++;}
 
-  // Read anything beyond DWDR no more than 128 bytes at a time
+  // Stream anything beyond DWDR when the firmware can
+  if (len > 128  &&  Transport  &&  Transport->streamRead) {
+    int done = DwStreamReadAddr(addr, len, buf);
+    addr+=done; len-=done; buf+=done;
+  }
+
+  // Read anything else no more than 128 bytes at a time
   while (len > 128) {DwUnsafeReadAddr(addr, 128, buf); addr+=128; len -=128; buf+=128;}
   if (len > 0) {DwUnsafeReadAddr(addr, len, buf);}
 }
@@ -356,7 +762,9 @@ void DwReconnect() {
 
 void DwConnect() {
   DwSend(Bytes(0xF3));  // Request signature
-  SetSizes(DwReadWord());
+  int signature = DwReadWord();
+  SetSizes(signature);
+  if (Port) {WriteDwTiming(signature);}
   DwReconnect();
 }
 
@@ -373,7 +781,7 @@ void DwDisable() {
 
 
 void DwTrace() { // Execute one instruction
-  DwSetRegs(28, R, 4);       // Restore cached registers
+  DwSetRegs(28, R+28, 4);    // Restore cached registers
   DwSetPC(PC/2);             // Trace start address
   DwSend(Bytes(0x60, 0x31)); // Single step
   DwSync();
@@ -381,8 +789,41 @@ void DwTrace() { // Execute one instruction
 }
 
 
+// Single steps count instructions from PC, leaving r28 through r31 alone
+// so that a run of steps costs no register traffic; the caller restores
+// and re-reads them around the run. Stores the byte address of the next
+// instruction after each step in pcs, updates PC and returns the steps
+// taken.
+
+int DwStep(int count, u16 *pcs) {
+  u8  replies[120];
+  int done = 0;
+
+  while (done < count) {
+    if (Transport->step) {
+      dwBufferFlush();
+      int n     = min(count-done, sizeof(replies)/2);
+      int steps = Transport->step(PC/2, n, replies);
+      for (int i=0; i<steps; i++) {
+        PC = 2 * (((replies[2*i] << 8) | replies[2*i+1]) - 1) % FlashSize();
+        pcs[done++] = PC;
+      }
+      if (steps < n) {break;}
+    } else {
+      DwSetPC(PC/2);             // Trace start address
+      DwSend(Bytes(0x60, 0x31)); // Single step
+      DwSync();
+      DwSend(Bytes(0xF0));       // Request current PC
+      PC = 2 * (DwReadWord() - 1) % FlashSize();
+      pcs[done++] = PC;
+    }
+  }
+  return done;
+}
+
+
 void DwGo() { // Begin executing.
-  DwSetRegs(28, R, 4);  // Restore cached registers
+  DwSetRegs(28, R+28, 4); // Restore cached registers
   DwSetPC(PC/2);        // Execution start address
   if (BP < 0) {         // Prepare to start execution with no breakpoint set
     DwSend(Bytes(TimerEnable ? 0x40 : 0x60)); // Set execution context
@@ -0,0 +1,351 @@
+/// DwTransport.c
+
+// A transport carries debugWIRE bytes between dwdebug and the target. The
+// LittleWire (DwPort.c) and the FT232 (Connect.c) are the hardware
+// backends; a session on either can be recorded to a file, and a recording
+// replayed later without any hardware, so that the effect of a protocol
+// change on the number of transfers can be measured.
+//
+// DwSend, DwReceive, DwSync and the rest of DwPort.c sit on top of
+// whichever transport is current, and buffer bytes so that each call
+// below carries as many bytes as possible.
+
+typedef struct {
+  char    *name;
+  // Sends bytes
+  void   (*send)(const u8 *out, int outlen);
+  // Sends bytes, then reads inlen reply bytes. Returns the number read.
+  int    (*receive)(const u8 *out, int outlen, u8 *in, int inlen);
+  // Breaks into the target and synchronises to the 0x55 it sends back
+  void   (*brk)();
+  // Sends bytes and synchronises to the 0x55 the target sends after them.
+  // Returns 1 iff it came.
+  int    (*capture)(const u8 *out, int outlen);
+  // Sends bytes that start the target, then watches for its break
+  void   (*wait)(const u8 *out, int outlen);
+  // Returns 1 iff the target broke within timeout ms after wait
+  int    (*waitForBreak)(int timeout);
+  // debugWIRE baud rate in use
+  int    (*baud)();
+  // Closes the port
+  void   (*close)();
+  // Optional, 0 where the backend has no such shortcut, see DwRepeat,
+  // DwStreamReadAddr and DwStep.
+  int    (*repeat)(const u8 *seq, int seqlen, int count, int patch, const u8 *data, int wait, u8 *in);
+  int    (*streamRead)(int addr, int len, u8 *buf);
+  int    (*step)(int pc, int count, u8 *pcs);
+  lwStats *stats;  // Transfer counters
+} DwTransport;
+
+PerTarget DwTransport *Transport = 0;  // Current backend, 0 until connected
+
+void PortFail(char *msg);
+
+
+
+
+// Recording - one line per transport call, with the bytes in hex:
+//
+//   > bytes          sent
+//   < bytes          received
+//   B                break and sync
+//   C ok             sync on 0x55 after the preceding bytes
+//   W                target started by the preceding bytes
+//   K broke          wait for break result
+//   U baud           baud rate query result
+//   P count patch wait read replies
+//                    repeat, followed by the sequence and data sent
+//                    and the replies received
+//   A addr len read  stream read, followed by the bytes read
+//   S pc count steps trace steps, followed by the PC words read
+
+DwTransport *RecordInner = 0;  // Transport being recorded
+FILE        *RecordFile  = 0;
+
+void recordBytes(char type, const u8 *bytes, int len) {
+  if (len <= 0) {return;}
+  fputc(type, RecordFile);
+  for (int i=0; i<len; i++) {fprintf(RecordFile, " %02x", bytes[i]);}
+  fputc('\n', RecordFile);
+}
+
+void recordSend(const u8 *out, int outlen) {
+  RecordInner->send(out, outlen);
+  recordBytes('>', out, outlen);
+}
+
+int recordReceive(const u8 *out, int outlen, u8 *in, int inlen) {
+  int status = RecordInner->receive(out, outlen, in, inlen);
+  recordBytes('>', out, outlen);
+  recordBytes('<', in, status);
+  return status;
+}
+
+void recordBreak() {
+  RecordInner->brk();
+  fprintf(RecordFile, "B\n");
+}
+
+int recordCapture(const u8 *out, int outlen) {
+  int ok = RecordInner->capture(out, outlen);
+  recordBytes('>', out, outlen);
+  fprintf(RecordFile, "C %d\n", ok);
+  return ok;
+}
+
+void recordWait(const u8 *out, int outlen) {
+  RecordInner->wait(out, outlen);
+  recordBytes('>', out, outlen);
+  fprintf(RecordFile, "W\n");
+}
+
+int recordWaitForBreak(int timeout) {
+  int broke = RecordInner->waitForBreak(timeout);
+  fprintf(RecordFile, "K %d\n", broke);
+  return broke;
+}
+
+int recordBaud() {
+  int baud = RecordInner->baud();
+  fprintf(RecordFile, "U %d\n", baud);
+  return baud;
+}
+
+void recordStop() {
+  if (!RecordFile) {return;}
+  fclose(RecordFile);
+  RecordFile = 0;
+  if (Transport != RecordInner) {Transport = RecordInner;}
+}
+
+void recordClose() {
+  DwTransport *inner = RecordInner;
+  recordStop();
+  Transport = 0;
+  inner->close();
+}
+
+int recordRepeat(const u8 *seq, int seqlen, int count, int patch, const u8 *data, int wait, u8 *in) {
+  int status = RecordInner->repeat(seq, seqlen, count, patch, data, wait, in);
+  fprintf(RecordFile, "P %d %d %d %d %d\n", count, patch, wait, in != 0, status);
+  recordBytes('>', seq, seqlen);
+  if (data) {recordBytes('>', data, count);}
+  if (in)   {recordBytes('<', in, status);}
+  return status;
+}
+
+int recordStreamRead(int addr, int len, u8 *buf) {
+  int done = RecordInner->streamRead(addr, len, buf);
+  fprintf(RecordFile, "A %d %d %d\n", addr, len, done);
+  recordBytes('<', buf, done);
+  return done;
+}
+
+int recordStep(int pc, int count, u8 *pcs) {
+  int steps = RecordInner->step(pc, count, pcs);
+  fprintf(RecordFile, "S %d %d %d\n", pc, count, steps);
+  recordBytes('<', pcs, 2*steps);
+  return steps;
+}
+
+DwTransport RecordTransport = {
+  "record", recordSend, recordReceive, recordBreak, recordCapture,
+  recordWait, recordWaitForBreak, recordBaud, recordClose, 0, 0, 0, 0
+};
+
+// Starts recording the current transport to the file at path, or stops
+// recording when path is empty.
+
+void DwRecord(const char *path) {
+  recordStop();
+  if (!path[0]) {return;}
+  RecordFile = fopen(path, "w");
+  if (!RecordFile) {Ws("Could not create "); Fail(path);}
+  fprintf(RecordFile, "# dwdebug %s transport recording\n", Transport->name);
+  RecordInner                = Transport;
+  RecordTransport.repeat     = Transport->repeat     ? recordRepeat     : 0;
+  RecordTransport.streamRead = Transport->streamRead ? recordStreamRead : 0;
+  RecordTransport.step       = Transport->step       ? recordStep       : 0;
+  RecordTransport.stats      = Transport->stats;
+  Transport                  = &RecordTransport;
+}
+
+
+
+
+// Replay - answers from a recording. Bytes sent must match those recorded,
+// but may be split differently between calls, so a change to the way
+// bytes are buffered replays without complaint while its transfers are
+// counted.
+
+typedef struct {
+  char  type;
+  int   line;
+  int   value[5];
+  int   len;
+  u8   *bytes;
+} ReplayEvent;
+
+ReplayEvent *ReplayEvents = 0;
+int          ReplayCount  = 0;
+int          ReplayNext   = 0;  // Index of the next event
+int          ReplayOffset = 0;  // Bytes of the next event already used
+lwStats      ReplayStats;
+
+void replayFree() {
+  for (int i=0; i<ReplayCount; i++) {if (ReplayEvents[i].bytes) {Free(ReplayEvents[i].bytes);}}
+  if (ReplayEvents) {Free(ReplayEvents);}
+  ReplayEvents = 0;
+  ReplayCount  = 0;
+}
+
+void replayDiverged(char type) {
+  ReplayStats.errors++;
+  Ws("Replay expected '"); Wc(type); Ws("'");
+  if (ReplayNext < ReplayCount) {
+    Ws(", recording has '"); Wc(ReplayEvents[ReplayNext].type);
+    Ws("' at line "); Wd(ReplayEvents[ReplayNext].line, 1);
+  } else {
+    Ws(" past the end of the recording");
+  }
+  PortFail(".");
+}
+
+// Returns the next event, which must be of the given type. Byte events
+// already used up are skipped, so that consecutive byte lines join up.
+ReplayEvent *replayPeek(char type) {
+  while (ReplayNext < ReplayCount
+  &&     ReplayEvents[ReplayNext].len > 0
+  &&     ReplayOffset >= ReplayEvents[ReplayNext].len) {ReplayNext++; ReplayOffset = 0;}
+  if (ReplayNext >= ReplayCount  ||  ReplayEvents[ReplayNext].type != type) {replayDiverged(type);}
+  return &ReplayEvents[ReplayNext];
+}
+
+ReplayEvent *replayEvent(char type) {
+  ReplayEvent *event = replayPeek(type);
+  ReplayNext++; ReplayOffset = 0;
+  return event;
+}
+
+void replayOut(const u8 *out, int outlen) {
+  for (int i=0; i<outlen; i++) {
+    ReplayEvent *event = replayPeek('>');
+    if (event->bytes[ReplayOffset] != out[i]) {
+      ReplayStats.errors++;
+      Ws("Replay sent $"); Wx(out[i],2); Ws(" where the recording has $");
+      Wx(event->bytes[ReplayOffset],2); Ws(" at line "); Wd(event->line, 1);
+      PortFail(".");
+    }
+    ReplayOffset++;
+  }
+  if (outlen) {lw_stats_count(&ReplayStats, USB_ENDPOINT_OUT, outlen, 0);}
+}
+
+void replayIn(u8 *in, int inlen) {
+  for (int i=0; i<inlen; i++) {
+    ReplayEvent *event = replayPeek('<');
+    in[i] = event->bytes[ReplayOffset++];
+  }
+  lw_stats_count(&ReplayStats, USB_ENDPOINT_IN, inlen, 0);
+}
+
+void replaySend(const u8 *out, int outlen) {replayOut(out, outlen);}
+
+int replayReceive(const u8 *out, int outlen, u8 *in, int inlen) {
+  replayOut(out, outlen);
+  replayIn(in, inlen);
+  return inlen;
+}
+
+void replayBreak()                           {replayEvent('B');}
+int  replayCapture(const u8 *out, int outlen) {replayOut(out, outlen); return replayEvent('C')->value[0];}
+void replayWait(const u8 *out, int outlen)    {replayOut(out, outlen); replayEvent('W');}
+int  replayWaitForBreak(int timeout)          {return replayEvent('K')->value[0];}
+int  replayBaud()                             {return replayEvent('U')->value[0];}
+
+int replayRepeat(const u8 *seq, int seqlen, int count, int patch, const u8 *data, int wait, u8 *in) {
+  ReplayEvent *event = replayEvent('P');
+  if (event->value[0] != count  ||  event->value[1] != patch
+  ||  event->value[2] != wait   ||  event->value[3] != (in != 0)) {ReplayNext--; replayDiverged('P');}
+  replayOut(seq, seqlen);
+  if (data) {replayOut(data, count);}
+  if (in)   {replayIn(in, event->value[4]);}
+  return event->value[4];
+}
+
+int replayStreamRead(int addr, int len, u8 *buf) {
+  ReplayEvent *event = replayEvent('A');
+  if (event->value[0] != addr  ||  event->value[1] != len) {ReplayNext--; replayDiverged('A');}
+  replayIn(buf, event->value[2]);
+  return event->value[2];
+}
+
+int replayStep(int pc, int count, u8 *pcs) {
+  ReplayEvent *event = replayEvent('S');
+  if (event->value[0] != pc  ||  event->value[1] != count) {ReplayNext--; replayDiverged('S');}
+  replayIn(pcs, 2*event->value[2]);
+  return event->value[2];
+}
+
+void replayClose() {replayFree(); Transport = 0;}
+
+DwTransport ReplayTransport = {
+  "replay", replaySend, replayReceive, replayBreak, replayCapture,
+  replayWait, replayWaitForBreak, replayBaud, replayClose, 0, 0, 0, &ReplayStats
+};
+
+// Makes the recording at path the current transport. The shortcuts the
+// recorded backend had are offered only when the recording uses them.
+
+void DwReplay(const char *path) {
+  char line[1024];
+  int  capacity = 0;
+
+  FILE *file = fopen(path, "r");
+  if (!file) {Ws("Could not open "); Fail(path);}
+  if (Transport) {Transport->close();}
+  replayFree();
+  ReplayTransport.repeat     = 0;
+  ReplayTransport.streamRead = 0;
+  ReplayTransport.step       = 0;
+
+  for (int number=1; fgets(line, sizeof(line), file); number++) {
+    if (line[0] == '#'  ||  line[0] == '\n') {continue;}
+    if (ReplayCount >= capacity) {
+      capacity = capacity ? 2*capacity : 1024;
+      ReplayEvent *events = Allocate(capacity * sizeof(ReplayEvent));
+      if (ReplayCount) {memcpy(events, ReplayEvents, ReplayCount * sizeof(ReplayEvent));}
+      if (ReplayEvents) {Free(ReplayEvents);}
+      ReplayEvents = events;
+    }
+    ReplayEvent *event = &ReplayEvents[ReplayCount++];
+    memset(event, 0, sizeof(*event));
+    event->type = line[0];
+    event->line = number;
+    if (line[0] == '>'  ||  line[0] == '<') {
+      u8 bytes[128];
+      char *p = line+1;
+      int  n  = 0;
+      unsigned int byte;
+      int  used;
+      while (n < sizeof(bytes)  &&  sscanf(p, " %x%n", &byte, &used) == 1) {bytes[n++] = byte; p += used;}
+      if (!n) {ReplayCount--; continue;}
+      event->len   = n;
+      event->bytes = Allocate(max(n, 1));
+      memcpy(event->bytes, bytes, n);
+    } else {
+      sscanf(line+1, "%d %d %d %d %d", event->value, event->value+1, event->value+2,
+             event->value+3, event->value+4);
+      if (line[0] == 'P') {ReplayTransport.repeat     = replayRepeat;}
+      if (line[0] == 'A') {ReplayTransport.streamRead = replayStreamRead;}
+      if (line[0] == 'S') {ReplayTransport.step       = replayStep;}
+    }
+  }
+  fclose(file);
+
+  ReplayNext   = 0;
+  ReplayOffset = 0;
+  lw_stats_reset(&ReplayStats);
+  Transport = &ReplayTransport;
+  Ws("Replaying "); Wd(ReplayCount, 1); Ws(" transport events from "); Wsl(path);
+}
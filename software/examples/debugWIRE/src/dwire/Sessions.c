@@ -0,0 +1,207 @@
+/// Sessions.c
+
+// Several LittleWires driven by one dwdebug. The interactive session uses
+// the LittleWire chosen with the target command. Commands that support it,
+// such as l, run on every LittleWire chosen with the targets command, each
+// in its own thread. All debugWIRE state of a target - port, register
+// cache, PC, flash cache and so on - is declared PerTarget, so each session
+// thread starts with its own fresh copy and the targets proceed in
+// parallel.
+
+typedef struct {
+  int                serial;
+  struct usb_device *device;
+  int                started;  // Thread running
+  int                failed;
+  unsigned long      micros;   // Time the session took
+  char               summary[100];  // Set by the work, or the failure message
+  #ifdef windows
+    HANDLE           thread;
+  #else
+    pthread_t        thread;
+  #endif
+} DwSession;
+
+enum {MaxSessions = 32};
+
+DwSession Sessions[MaxSessions];
+int       SessionCount = 0;
+void    (*SessionWork)();  // Run by each session thread once connected
+
+PerTarget DwSession *CurrentSession = 0;  // Session of this thread, 0 for the interactive one
+
+
+// Returns the LittleWire with the given serial number as found by the
+// last littlewire_search.
+
+struct usb_device *FindTarget(int serial) {
+  int i = lw_registry_find(serial);
+  if (i < 0) {Ws("No LittleWire with serial number "); Wd(serial,1); Fail(".");}
+  return lwResults[i].lw_device;
+}
+
+
+// Where target last found the LittleWire with a serial number, so that
+// next time it is opened first and no other LittleWire is asked for its
+// serial number.
+
+void TargetPathFile(int serial, char *path, int size) {
+  const char *home = getenv("HOME");
+  #ifdef windows
+    if (!home) {home = getenv("USERPROFILE");}
+  #endif
+  if (!home) {home = ".";}
+  snprintf(path, size, "%s/.dwdebug-%d.usb", home, serial);
+}
+
+void ReadTargetPath(int serial, char *usbPath, int size) {
+  char path[500];
+  TargetPathFile(serial, path, sizeof(path));
+  usbPath[0] = 0;
+  FILE *file = fopen(path, "r");
+  if (!file) return;
+  if (!fgets(usbPath, size, file)) {usbPath[0] = 0;}
+  fclose(file);
+  TrimTrailingSpace(usbPath);
+}
+
+void WriteTargetPath(int serial, const char *usbPath) {
+  char path[500];
+  TargetPathFile(serial, path, sizeof(path));
+  FILE *file = fopen(path, "w");
+  if (!file) return;
+  fprintf(file, "%s\n", usbPath);
+  fclose(file);
+}
+
+
+void UseTarget(usb_dev_handle *handle) {
+  struct usb_device *device = usb_device(handle);
+  usb_close(handle);
+  if (Transport) {Transport->close();}
+  TargetDevice = device;
+  DeviceType   = -1;
+}
+
+
+// Chooses the LittleWire of the interactive session, serial -1 for the
+// first one found. Connects when next needed.
+
+void SelectTarget(int serial) {
+  if (serial < 0) {
+    if (Transport) {Transport->close();}
+    TargetDevice = 0;
+    DeviceType   = -1;
+    return;
+  }
+  char cached[USBOPEN_PATH_SIZE];
+  char found[USBOPEN_PATH_SIZE];
+  char pattern[16];
+  usb_dev_handle *handle = 0;
+  ReadTargetPath(serial, cached, sizeof(cached));
+  strcpy(found, cached);
+  snprintf(pattern, sizeof(pattern), "%d", serial);
+  usb_init();
+  usbOpenDeviceSerial(&handle, VENDOR_ID, PRODUCT_ID, pattern, found, sizeof(found), NULL);
+  if (!handle) {Ws("No LittleWire with serial number "); Wd(serial,1); Fail(".");}
+  if (strcmp(found, cached)) {WriteTargetPath(serial, found);}
+  UseTarget(handle);
+}
+
+
+// Chooses the LittleWire of the interactive session by its USB bus path,
+// as listed by targets.
+
+void SelectTargetPath(char *path) {
+  usb_dev_handle *handle = 0;
+  usb_init();
+  usbOpenDevicePath(&handle, VENDOR_ID, PRODUCT_ID, path, NULL);
+  if (!handle) {Ws("No LittleWire at "); Ws(path); Fail(".");}
+  UseTarget(handle);
+}
+
+
+void AddSession(int serial) {
+  struct usb_device *device = FindTarget(serial);
+  for (int i=0; i<SessionCount; i++) {if (Sessions[i].serial == serial) {return;}}
+  if (SessionCount >= MaxSessions) {Fail("Too many targets.");}
+  memset(&Sessions[SessionCount], 0, sizeof(DwSession));
+  Sessions[SessionCount].serial = serial;
+  Sessions[SessionCount].device = device;
+  SessionCount++;
+}
+
+
+
+
+void RunSession(DwSession *session) {
+  unsigned long started = lw_micros();
+  snprintf(OutputPrefix, sizeof(OutputPrefix), "%d: ", session->serial);
+  TargetDevice   = session->device;
+  CurrentSession = session;
+  if (setjmp(FailPoint)) {
+    session->failed = 1;
+    snprintf(session->summary, sizeof(session->summary), "%s", FailMessage);
+    int len = strlen(session->summary);
+    if (len  &&  session->summary[len-1] == '.') {session->summary[len-1] = 0;}
+  } else {
+    DwConnect();
+    SessionWork();
+  }
+  if (Transport) {Transport->close();}
+  Flush();
+  session->micros = lw_micros() - started;
+}
+
+#ifdef windows
+  DWORD WINAPI SessionThread(LPVOID session) {RunSession(session); return 0;}
+#else
+  void *SessionThread(void *session) {RunSession(session); return 0;}
+#endif
+
+
+// Runs work on every target chosen with the targets command at the same
+// time, each in its own thread, then lists how each went. Returns the
+// number of targets that failed.
+
+int RunSessions(void (*work)()) {
+  int failed = 0;
+
+  SessionWork = work;
+  Flush();
+  for (int i=0; i<SessionCount; i++) {
+    DwSession *session = &Sessions[i];
+    session->failed     = 0;
+    session->summary[0] = 0;
+    #ifdef windows
+      session->thread  = CreateThread(0, 0, SessionThread, session, 0, 0);
+      session->started = session->thread != 0;
+    #else
+      session->started = pthread_create(&session->thread, 0, SessionThread, session) == 0;
+    #endif
+    if (!session->started) {session->failed = 1;}
+  }
+
+  for (int i=0; i<SessionCount; i++) {
+    DwSession *session = &Sessions[i];
+    if (session->started) {
+      #ifdef windows
+        WaitForSingleObject(session->thread, INFINITE);
+        CloseHandle(session->thread);
+      #else
+        pthread_join(session->thread, 0);
+      #endif
+      session->started = 0;
+    }
+  }
+
+  for (int i=0; i<SessionCount; i++) {
+    DwSession *session = &Sessions[i];
+    Wd(session->serial, 1); Ws(session->failed ? ": failed" : ": done");
+    if (!session->failed) {Ws(" in "); Wd(session->micros / 1000, 1); Ws("ms");}
+    if (session->summary[0]) {Ws(", "); Ws(session->summary);}
+    Wsl(".");
+    failed += session->failed;
+  }
+  return failed;
+}
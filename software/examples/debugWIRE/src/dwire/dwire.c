@@ -1,2 +1,4 @@
+#include "DwTransport.c"
 #include "DwPort.c"
 #include "Connect.c"
+#include "Sessions.c"
@@ -2,7 +2,7 @@
 
 void GdbserverCommand()
 {
-    int connfd;
+    int listenfd, connfd;
 
 #ifdef windows
     WSADATA WinSocketData = {0};
@@ -17,10 +17,17 @@ void GdbserverCommand()
     Wsl("Target ready, waiting for GDB connection.");
     Ws("Use 'target remote :"); Wd(LISTEN_PORT,1); Wsl("'");
 
-    connfd = listen_sock(LISTEN_PORT);
-    if (connfd < 0) Fail("Listen failed.");
+    listenfd = listen_sock(LISTEN_PORT);
+    if (listenfd < 0) Fail("Listen failed.");
+
+    connfd = accept(listenfd, (struct sockaddr *)NULL, NULL);
+    if (connfd < 0) {
+        Close((FileHandle)listenfd);
+        Fail("Accept failed.");
+    }
 
     Wsl("Connection accepted.");
 
-    handle_client(connfd);
+    handle_clients(listenfd, connfd);
+    Close((FileHandle)listenfd);
 }
@@ -1,5 +1,3 @@
-#define BUFSZ 1024
-
 int listen_sock(int port)
 {
     int listenfd;
@@ -33,28 +31,134 @@ int listen_sock(int port)
         return -1;
     }
 
-    return accept(listenfd, (struct sockaddr *)NULL, NULL);
+    return listenfd;
+}
+
+#define MAX_CLIENTS 4              // GDB, then read only clients
+
+// Commands a read only client may send: reads and queries.
+static int readonly_command(const char *cmd)
+{
+    return strchr("?gmpq", cmd[0]) != NULL;
+}
+
+static void close_client(GdbClient *client)
+{
+    Close((FileHandle)client->fd);
+    client->fd = -1;
 }
 
-void handle_client(int connfd)
+static void handle_packet(GdbClient *client)
 {
-    char cmd[BUFSZ];
-    ssize_t r;
+    const char *cmd = client->cmd;
 
-    while (1) {
-        r = read_command(connfd, cmd, sizeof(cmd));
-        if (r < 1) {
-            Ws("Error reading command. Error code: "); Wd(r,1); Fail("!");
+    if (client->readonly) {
+        if (cmd[0] == 'k' || cmd[0] == 'D') {
+            if (cmd[0] == 'D') write_resp(client->fd, "OK");
+            close_client(client);
+            Wsl("Read only client disconnected.");
+        } else if (!readonly_command(cmd) || GdbRunning) {
+            write_resp(client->fd, "E01");
+        } else {
+            handle_command(client->fd, cmd, client->length);
         }
-        Ws("Got: "); Ws(cmd); Wl();
+        return;
+    }
 
-        if (cmd[0] == 'k') break;  // gdb quitting
+    // Show the command, but not the binary data of X and vFlashWrite
+    int binary = cmd[0] == 'X' ? 0 : !strncmp(cmd, "vFlashWrite:", 12) ? 12 : -1;
+    Ws("Got: ");
+    for (int i = 0; i < client->length; i++) {
+        if (binary >= 0 && i > binary && cmd[i] == ':') {Ws(":..."); break;}
+        Wc(cmd[i]);
+    }
+    Wl();
 
-        handle_command(connfd, cmd);
+    if (cmd[0] == 'k') {           // gdb quitting
+        close_client(client);
+    } else if (cmd[0] == 'D') {    // gdb detaching
+        write_resp(client->fd, "OK");
+        close_client(client);
+    } else if (GdbRunning) {
+        write_resp(client->fd, "E01");  // Only an interrupt is expected, see GDB_INTERRUPT
+    } else {
+        handle_command(client->fd, cmd, client->length);
     }
+}
 
-    Close((FileHandle)connfd);
+static void accept_client(int listenfd, GdbClient *clients)
+{
+    int fd = accept(listenfd, (struct sockaddr *)NULL, NULL);
 
-    return;
+    if (fd < 0) return;
+    for (int i = 1; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd < 0) {
+            memset(&clients[i], 0, sizeof(clients[i]));
+            clients[i].fd       = fd;
+            clients[i].readonly = 1;
+            Wsl("Read only client connected.");
+            return;
+        }
+    }
+    Close((FileHandle)fd);
 }
 
+// Event loop of a GDB session, until GDB goes away. A running target is
+// polled for its break between looks at the sockets, so GDB's interrupt is
+// taken as soon as it arrives and the stop is sent when it happens. Further
+// connections are read only clients, served while the target is stopped.
+void handle_clients(int listenfd, int connfd)
+{
+    GdbClient clients[MAX_CLIENTS];
+    char buf[256];
+
+    for (int i = 0; i < MAX_CLIENTS; i++) clients[i].fd = -1;
+    memset(&clients[0], 0, sizeof(clients[0]));
+    clients[0].fd = connfd;
+
+    while (clients[0].fd >= 0) {
+        if (GdbRunning && target_poll(20)) {
+            cmd_stop_reply(clients[0].fd);
+        }
+
+        fd_set readfds;
+        int maxfd = listenfd;
+        FD_ZERO(&readfds);
+        FD_SET(listenfd, &readfds);
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].fd < 0) continue;
+            FD_SET(clients[i].fd, &readfds);
+            if (clients[i].fd > maxfd) maxfd = clients[i].fd;
+        }
+        struct timeval timeout = {0, 0};
+        if (select(maxfd+1, &readfds, 0, 0, GdbRunning ? &timeout : NULL) <= 0) continue;
+
+        if (FD_ISSET(listenfd, &readfds)) accept_client(listenfd, clients);
+
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].fd < 0 || !FD_ISSET(clients[i].fd, &readfds)) continue;
+            int r = Read((FileHandle)clients[i].fd, buf, sizeof(buf));
+            if (r < 1) {
+                Ws(i ? "Read only client" : "GDB"); Wsl(" connection closed.");
+                close_client(&clients[i]);
+                continue;
+            }
+            for (int j = 0; j < r && clients[i].fd >= 0; j++) {
+                if (buf[j] == GDB_INTERRUPT && clients[i].state == 0) {
+                    if (!clients[i].readonly && GdbRunning) {
+                        target_interrupt();
+                        cmd_stop_reply(clients[i].fd);
+                    }
+                } else if (rsp_feed(&clients[i], buf[j])) {
+                    handle_packet(&clients[i]);
+                }
+            }
+        }
+    }
+
+    for (int i = 1; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0) close_client(&clients[i]);
+    }
+    if (GdbRunning) target_interrupt();  // BREAKs can only come out of a stopped target
+    target_detach();
+}
@@ -1,39 +1,56 @@
-ssize_t read_command(int fd, char *buf, size_t size)
+// Largest packet we accept, advertised to GDB in the qSupported reply.
+// Binary data in X and vFlashWrite packets arrives escaped: '}' followed
+// by the byte xor 0x20. rsp_feed removes the escapes, so the command it
+// collects may contain zero bytes and its length is kept with it.
+#define PACKET_SIZE 4096
+#define BUFSZ (PACKET_SIZE+1)
+
+#define GDB_INTERRUPT 0x03         // Sent on its own, outside any packet
+
+// A connection to GDB, or to a client that only reads while the target
+// is stopped, such as a live variable viewer.
+typedef struct {
+    int    fd;                     // -1 for a free slot
+    int    readonly;
+    int    state;                  // 0 between packets, 1 in one, 2 and 3 at the checksum
+    int    escape;
+    size_t length;
+    char   cmd[BUFSZ];
+} GdbClient;
+
+// Takes the next byte from a client, returns 1 once a whole packet is in
+// cmd, and acknowledges it.
+int rsp_feed(GdbClient *client, char c)
 {
-    ssize_t r;
-    size_t i = 0;
-    char c;
-
-    while (1) {
-        r = Read((FileHandle)fd, &c, 1);
-        if (r < 1) {
-            return r;
-        }
-        if (c == '$') {
-            break;
-        }
-    }
-
-    while (1) {
-        r = Read((FileHandle)fd, &c, 1);
-        if (r < 1) {
-            return r;
-        }
-        if (c == '#') {
-            break;
-        }
-        buf[i++] = c;
+    switch (client->state) {
+        case 0:
+            if (c == '$') {
+                client->state  = 1;
+                client->escape = 0;
+                client->length = 0;
+            }
+            return 0;                  // Acks and anything else between packets
+        case 1:
+            if (c == '#') {
+                client->state = 2;
+            } else if (c == '}') {
+                client->escape = 1;
+            } else {
+                if (client->length < sizeof(client->cmd)-1) {
+                    client->cmd[client->length++] = client->escape ? c ^ 0x20 : c;
+                }
+                client->escape = 0;
+            }
+            return 0;
+        case 2:
+            client->state = 3;         // TODO: check crc
+            return 0;
+        default:
+            client->state = 0;
+            client->cmd[client->length] = '\0';
+            Write((FileHandle)client->fd, "+", 1);
+            return 1;
     }
-
-    // TODO: check crc
-    r = Read((FileHandle)fd, &c, 1);
-    r = Read((FileHandle)fd, &c, 1);
-    buf[i] = '\0';
-
-    // send ack
-    Write((FileHandle)fd, "+", 1);
-
-    return i;
 }
 
 static size_t write_all(int fd, const char *buf, size_t len)
@@ -113,15 +130,59 @@ void cmd_read_registers(int fd)
     write_resp(fd, buf);
 }
 
+void cmd_read_register(int fd, const char *cmd)
+{
+    u8   reg[4];
+    char buf[2*sizeof(reg) + 1];
+    int  len = target_read_register(strtol(cmd, NULL, 16), reg);
+
+    if (len < 0) {
+        write_resp(fd, "E01");
+        return;
+    }
+    for (int i=0; i<len; i++) {
+        buf[2*i]   = HexChar(reg[i] / 16);
+        buf[2*i+1] = HexChar(reg[i] % 16);
+    }
+    buf[2*len] = 0;
+
+    write_resp(fd, buf);
+}
+
+void cmd_write_register(int fd, const char *cmd)
+{
+    u8   reg[4];
+    int  len = 0;
+    char *value;
+    int  n = strtol(cmd, &value, 16);
+
+    if (*value++ != '=') {
+        write_resp(fd, "E01");
+        return;
+    }
+    while (len < sizeof(reg) && value[0] && value[1]) {
+        reg[len++] = hex_to_byte(value);
+        value += 2;
+    }
+    if (target_write_register(n, reg, len)) {
+        write_resp(fd, "E01");
+        return;
+    }
+
+    write_resp(fd, "OK");
+}
+
 void cmd_memory_read(int fd, const char *cmd)
 {
     int addr, len;
-    uint_fast8_t i;
+    int i;
+    static uint8_t buf[PACKET_SIZE/2];
+    static char out[PACKET_SIZE+1];
 
     sscanf(cmd, "%x,%x", &addr, &len);
-
-    uint8_t buf[len];
-    char out[len*2+1];
+    if (len > sizeof(buf)) {
+        len = sizeof(buf);   // GDB asks again for the rest
+    }
 
     target_read_addr(addr, buf, len);
 
@@ -155,6 +216,163 @@ void cmd_memory_write(int fd, const char *cmd)
     write_resp(fd, "OK");
 }
 
+// X addr,length:binary data
+void cmd_memory_write_binary(int fd, const char *cmd, size_t size)
+{
+    int addr, len;
+    const char *b = memchr(cmd, ':', size);
+
+    if (!b || sscanf(cmd, "%x,%x", &addr, &len) != 2) {
+        write_resp(fd, "E01");
+        return;
+    }
+    b++;
+    if (len > cmd + size - b) {
+        len = cmd + size - b;
+    }
+    if (len > 0) {
+        target_write_addr(addr, (u8*)b, len);
+    }
+
+    write_resp(fd, "OK");
+}
+
+
+// Memory map, so that GDB knows which addresses are flash and loads them
+// with vFlashErase, vFlashWrite and vFlashDone.
+
+void cmd_memory_map(int fd, const char *cmd)
+{
+    int offset, len;
+    static char map[400];
+    static char out[PACKET_SIZE];
+
+    snprintf(map, sizeof(map),
+        "<memory-map>"
+        "<memory type=\"flash\" start=\"0x0\" length=\"0x%x\">"
+        "<property name=\"blocksize\">0x%x</property>"
+        "</memory>"
+        "<memory type=\"ram\" start=\"0x800000\" length=\"0x10000\"/>"
+        "</memory-map>",
+        FlashSize(), PageSize());
+
+    if (sscanf(cmd, "%x,%x", &offset, &len) != 2) {
+        write_resp(fd, "E01");
+        return;
+    }
+    int maplen = strlen(map);
+    if (offset > maplen) {
+        offset = maplen;
+    }
+    if (len > sizeof(out)-2) {
+        len = sizeof(out)-2;
+    }
+    out[0] = offset + len < maplen ? 'm' : 'l';
+    snprintf(out+1, len+1, "%s", map+offset);
+
+    write_resp(fd, out);
+}
+
+void cmd_query(int fd, const char *cmd)
+{
+    char reply[64];
+
+    if (!strncmp(cmd, "qSupported", 10)) {
+        snprintf(reply, sizeof(reply), "PacketSize=%x;qXfer:memory-map:read+", PACKET_SIZE);
+        write_resp(fd, reply);
+    } else if (!strncmp(cmd, "qXfer:memory-map:read::", 23)) {
+        cmd_memory_map(fd, cmd+23);
+    } else {
+        write_resp(fd, "");
+    }
+}
+
+// vFlashErase:addr,length  vFlashWrite:addr:binary data  vFlashDone
+//
+// Erased and written data is collected in target_flash_* until
+// vFlashDone, which loads it a page at a time, so unchanged pages are
+// neither erased nor written.
+
+void cmd_flash(int fd, const char *cmd, size_t size)
+{
+    int addr, len;
+
+    if (!strncmp(cmd, "vFlashErase:", 12)) {
+        if (sscanf(cmd+12, "%x,%x", &addr, &len) != 2 || target_flash_erase(addr, len)) {
+            write_resp(fd, "E01");
+            return;
+        }
+    } else if (!strncmp(cmd, "vFlashWrite:", 12)) {
+        const char *b = memchr(cmd+12, ':', size-12);
+        if (!b || sscanf(cmd+12, "%x", &addr) != 1) {
+            write_resp(fd, "E01");
+            return;
+        }
+        b++;
+        if (target_flash_write(addr, (u8*)b, cmd + size - b)) {
+            write_resp(fd, "E03");
+            return;
+        }
+    } else if (!strncmp(cmd, "vFlashDone", 10)) {
+        target_flash_done();
+    } else {
+        write_resp(fd, "");
+        return;
+    }
+
+    write_resp(fd, "OK");
+}
+
+// Why the target last stopped.
+void cmd_stop_reply(int fd)
+{
+    char reply[24];
+
+    if (GdbWatchHit >= 0) {
+        snprintf(reply, sizeof(reply), "T%02xwatch:%x;", GdbStopSignal, 0x800000 | GdbWatchHit);
+    } else {
+        snprintf(reply, sizeof(reply), "S%02x", GdbStopSignal);
+    }
+    write_resp(fd, reply);
+}
+
+// vCont?  vCont;c  vCont;s  vCont;r start,end
+//
+// An action may be followed by a thread id, there is only the one thread
+// so the first action is the one that applies. Range stepping ('r') runs
+// straight line code to the hardware breakpoint rather than tracing each
+// instruction.
+
+void cmd_vcont(int fd, const char *cmd)
+{
+    unsigned int start, end;
+
+    if (!strcmp(cmd, "vCont?")) {
+        write_resp(fd, "vCont;c;s;r");
+        return;
+    }
+    switch (cmd[5] == ';' ? cmd[6] : 0) {
+        case 'c':
+            target_continue();
+            return;                    // The stop is reported when it comes
+        case 's':
+            target_step();
+            break;
+        case 'r':
+            if (sscanf(cmd+7, "%x,%x", &start, &end) != 2) {
+                write_resp(fd, "E01");
+                return;
+            }
+            target_range_step(fd, start, end);
+            break;
+        default:
+            write_resp(fd, "");
+            return;
+    }
+
+    cmd_stop_reply(fd);
+}
+
 
 void cmd_write_registers(int fd, const char *cmd)
 {
@@ -181,6 +399,34 @@ void cmd_set_breakpoint(int fd, const char *cmd)
     write_resp(fd, "OK");
 }
 
+// Z0,addr,kind and z0,addr,kind: software breakpoints
+void cmd_software_breakpoint(int fd, const char *cmd)
+{
+    unsigned int addr;
+
+    if (sscanf(cmd+3, "%x", &addr) != 1
+    ||  (cmd[0] == 'Z' ? target_insert_breakpoint(addr) : target_remove_breakpoint(addr))) {
+        write_resp(fd, "E01");
+        return;
+    }
+
+    write_resp(fd, "OK");
+}
+
+// Z2,addr,length and z2,addr,length: write watchpoints, see target_insert_watchpoint
+void cmd_watchpoint(int fd, const char *cmd)
+{
+    unsigned int addr, len;
+
+    if (sscanf(cmd+3, "%x,%x", &addr, &len) != 2
+    ||  (cmd[0] == 'Z' ? target_insert_watchpoint(addr, len) : target_remove_watchpoint(addr, len))) {
+        write_resp(fd, "E01");
+        return;
+    }
+
+    write_resp(fd, "OK");
+}
+
 void cmd_clear_breakpoint(int fd, const char *cmd)
 {
     target_clear_breakpoint();
@@ -188,19 +434,18 @@ void cmd_clear_breakpoint(int fd, const char *cmd)
     write_resp(fd, "OK");
 }
 
-void handle_command(int fd, const char *cmd)
+void handle_command(int fd, const char *cmd, size_t size)
 {
     switch (cmd[0]) {
         case '?':
-            write_resp(fd, "S00");
+            cmd_stop_reply(fd);
             break;
         case 'c':
-            target_continue(fd);
-            write_resp(fd, "S00");
+            target_continue();     // The stop is reported when it comes
             break;
         case 's':
             target_step();
-            write_resp(fd, "S00");
+            cmd_stop_reply(fd);
             break;
         case 'g':
             cmd_read_registers(fd);
@@ -208,22 +453,57 @@ void handle_command(int fd, const char *cmd)
         case 'G':
             cmd_write_registers(fd, cmd+1);
             break;
+        case 'p':
+            cmd_read_register(fd, cmd+1);
+            break;
+        case 'P':
+            cmd_write_register(fd, cmd+1);
+            break;
         case 'm':
             cmd_memory_read(fd, cmd+1);
             break;
         case 'M':
             cmd_memory_write(fd, cmd+1);
             break;
+        case 'X':
+            cmd_memory_write_binary(fd, cmd+1, size-1);
+            break;
+        case 'q':
+            cmd_query(fd, cmd);
+            break;
+        case 'v':
+            if (!strncmp(cmd, "vCont", 5)) {
+                cmd_vcont(fd, cmd);
+            } else {
+                cmd_flash(fd, cmd, size);
+            }
+            break;
         case 'Z':
+            if (cmd[1] == '0') {
+                cmd_software_breakpoint(fd, cmd);
+                break;
+            }
             if (cmd[1] == '1') {
                 cmd_set_breakpoint(fd, cmd+2);
                 break;
             }
+            if (cmd[1] == '2') {
+                cmd_watchpoint(fd, cmd);
+                break;
+            }
         case 'z':
+            if (cmd[1] == '0') {
+                cmd_software_breakpoint(fd, cmd);
+                break;
+            }
             if (cmd[1] == '1') {
                 cmd_clear_breakpoint(fd, cmd+2);
                 break;
             }
+            if (cmd[1] == '2') {
+                cmd_watchpoint(fd, cmd);
+                break;
+            }
         default:
             write_resp(fd, "");
             break;
@@ -1,44 +1,482 @@
 typedef u8 Registers[39];
 
 
-int target_write_registers(Registers regs, int len)
+// Register file as GDB sees it. r0..r27, SREG and SP are read from the
+// target at most once per stop; r28..r31 and PC are already kept on the
+// host by DwReconnect. Registers GDB changes are written back just before
+// the target runs again, or before anything else touches the target.
+
+Registers GdbRegs;
+int       GdbRegsValid = 0;        // GdbRegs holds r0..r27, SREG and SP of this stop
+u8        GdbRegsDirty[35];        // Non zero for r0..r27, SREG and SP bytes changed by GDB
+
+static void target_host_registers(void) // r28..r31 and PC, no target access needed
+{
+    memcpy(GdbRegs+28, R+28, 4);
+    GdbRegs[35] = PC % 256;        // PC 0..7
+    GdbRegs[36] = PC / 256;        // PC 8..15
+    GdbRegs[37] = 0;               // PC 16..23
+    GdbRegs[38] = 0;               // PC 24..31
+}
+
+static void target_fetch_registers(void)
 {
-    DwSetRegs(0, regs, len <= 28 ? len : 28);
-    if (len > 28) {
-        int l = len - 28; if (l>4) l=4;
-        memcpy(R+28, regs+28, l);
+    if (!GdbRegsValid) {
+        u8 io[3];
+        DwGetRegs(0, GdbRegs, 28);
+        DwReadAddr(0x5D, 3, io);   // SPL, SPH, SREG
+        GdbRegs[32] = io[2];
+        GdbRegs[33] = io[0];
+        GdbRegs[34] = io[1];
+        GdbRegsValid = 1;
+    }
+    target_host_registers();
+}
+
+static void target_flush_registers(void)
+{
+    int first = -1, limit = 0;
+
+    for (int i = 0; i < 28; i++) {
+        if (GdbRegsDirty[i]) {
+            if (first < 0) first = i;
+            limit = i + 1;
+        }
     }
-    if (len > 32) DwWriteAddr(0x5E, 1, regs+32); // sreg
-    if (len > 34) DwWriteAddr(0x5D, 2, regs+33); // spl, sph
-    if (len > 36) PC = regs[35] + 256*regs[36];
+    if (first >= 0) DwSetRegs(first, GdbRegs+first, limit-first);
+    if (GdbRegsDirty[32]) DwWriteAddr(0x5F, 1, GdbRegs+32);                     // SREG
+    if (GdbRegsDirty[33] || GdbRegsDirty[34]) DwWriteAddr(0x5D, 2, GdbRegs+33); // SPL, SPH
+    memset(GdbRegsDirty, 0, sizeof(GdbRegsDirty));
+}
+
+// Called before the target runs: the next stop has a new register file.
+static void target_release_registers(void)
+{
+    target_flush_registers();
+    GdbRegsValid = 0;
+}
+
+static void target_store_registers(int first, const u8 *regs, int len)
+{
+    target_fetch_registers();
+    for (int i = first; i < first + len  &&  i < countof(GdbRegs); i++) {
+        if (GdbRegs[i] == regs[i-first]) continue;
+        GdbRegs[i] = regs[i-first];
+        if (i >= 28 && i <= 31) {
+            R[i] = GdbRegs[i];     // Restored by DwGo and DwTrace
+        } else if (i < 35) {
+            GdbRegsDirty[i] = 1;
+        }
+    }
+    PC = GdbRegs[35] + 256*GdbRegs[36];
+}
+
+// Offset and size in Registers of a GDB register number: r0..r31 are 0..31,
+// SREG is 32, SP is 33 and PC is 34.
+static int target_register_span(int n, int *len)
+{
+    if (n <= 32) {*len = 1; return n;}
+    if (n == 33) {*len = 2; return 33;}
+    if (n == 34) {*len = 4; return 35;}
+    return -1;
+}
+
+int target_write_registers(Registers regs, int len)
+{
+    target_store_registers(0, regs, len);
     return 0;
 }
 
 int target_read_registers(Registers regs) // retuns r0..r1, sreg, spl, sph, pcl, pc2l, pcum, pch
 {
-    DwGetRegs(0, regs, 28);
-    memcpy(regs+28, R+28, 4);
-    DwReadAddr(0x5E, 1, regs+32); // SREG
-    DwReadAddr(0x5D, 2, regs+33); // SPL, SPH
-    regs[35] = PC % 256;          // PC 0..7
-    regs[36] = PC / 256;          // PC 8..15
-    regs[37] = 0;                 // PC 16..23
-    regs[38] = 0;                 // PC 24..31
+    target_fetch_registers();
+    memcpy(regs, GdbRegs, sizeof(Registers));
     return 0;
 }
 
-int target_step(void)
+int target_read_register(int n, u8 *buf) // returns the size of register n, -1 if there is none
+{
+    int len;
+    int offset = target_register_span(n, &len);
+
+    if (offset < 0) return -1;
+    if (n < 28 || n == 32 || n == 33) {
+        target_fetch_registers();
+    } else {
+        target_host_registers();
+    }
+    memcpy(buf, GdbRegs+offset, len);
+    return len;
+}
+
+int target_write_register(int n, const u8 *buf, int len)
+{
+    int size;
+    int offset = target_register_span(n, &size);
+
+    if (offset < 0 || len != size) return -1;
+    target_store_registers(offset, buf, len);
+    return 0;
+}
+
+// Software breakpoints: a BREAK instruction written over the instruction
+// through the flash page path. GDB removes and inserts all breakpoints at
+// every stop, so Z0 and z0 only update this table and flash is brought in
+// line when the target next runs. Breakpoints on the same page are written
+// together, and if there is just one and the hardware breakpoint is free it
+// uses that and flash is left alone.
+
+#define MAX_BREAKPOINTS 32
+#define BREAK_INSTRUCTION 0x9598
+
+struct {
+    u16 addr;
+    u8  orig[2];    // Instruction under the BREAK, while inserted
+    u8  wanted;     // GDB has the breakpoint set
+    u8  inserted;   // A BREAK is in flash at addr
+} GdbBreakpoints[MAX_BREAKPOINTS];
+int GdbBreakpointCount = 0;
+
+static int target_find_breakpoint(u32 addr)
+{
+    for (int i = 0; i < GdbBreakpointCount; i++) {
+        if (GdbBreakpoints[i].addr == addr) return i;
+    }
+    return -1;
+}
+
+static int target_breakpoint_inserted(u32 addr)
+{
+    int i = target_find_breakpoint(addr);
+    return i >= 0 && GdbBreakpoints[i].inserted;
+}
+
+// Whether breakpoint i should have a BREAK in flash. None goes at avoid;
+// with insert zero, BREAKs are only taken out.
+static int target_breakpoint_due(int i, int avoid, int insert)
 {
+    int due = GdbBreakpoints[i].wanted && GdbBreakpoints[i].addr != avoid;
+    return insert ? due : due && GdbBreakpoints[i].inserted;
+}
+
+static void target_write_breakpoints(int avoid, int insert)
+{
+    u8 page[MaxFlashPageSize];
+
+    for (int i = 0; i < GdbBreakpointCount; i++) {
+        if (target_breakpoint_due(i, avoid, insert) == GdbBreakpoints[i].inserted) continue;
+
+        // Patch every breakpoint on this page, then write it once
+        int base = GdbBreakpoints[i].addr & ~(PageSize()-1);
+        DwReadFlash(base, PageSize(), page);
+        for (int j = i; j < GdbBreakpointCount; j++) {
+            int offset = GdbBreakpoints[j].addr - base;
+            int due    = target_breakpoint_due(j, avoid, insert);
+            if (offset < 0 || offset >= PageSize() || due == GdbBreakpoints[j].inserted) continue;
+            if (due) {
+                memcpy(GdbBreakpoints[j].orig, page+offset, 2);
+                page[offset]   = BREAK_INSTRUCTION % 256;
+                page[offset+1] = BREAK_INSTRUCTION / 256;
+            } else {
+                memcpy(page+offset, GdbBreakpoints[j].orig, 2);
+            }
+            GdbBreakpoints[j].inserted = due;
+        }
+        WriteFlash(base, page, PageSize());
+    }
+
+    // Drop breakpoints GDB has removed and that are out of flash
+    int count = 0;
+    for (int i = 0; i < GdbBreakpointCount; i++) {
+        if (GdbBreakpoints[i].wanted || GdbBreakpoints[i].inserted) {
+            GdbBreakpoints[count++] = GdbBreakpoints[i];
+        }
+    }
+    GdbBreakpointCount = count;
+}
+
+// The software breakpoint to put in the hardware breakpoint for the next
+// go, or -1 to use BREAKs for all of them.
+static int target_hardware_breakpoint(void)
+{
+    int found = -1;
+
+    if (BP >= 0) return -1;
+    for (int i = 0; i < GdbBreakpointCount; i++) {
+        if (GdbBreakpoints[i].wanted) {
+            if (found >= 0) return -1;
+            found = i;
+        }
+    }
+    return found >= 0 && !GdbBreakpoints[found].inserted ? GdbBreakpoints[found].addr : -1;
+}
+
+// Flash in the range has been rewritten, so BREAKs there are gone.
+static void target_forget_breakpoints(u32 addr, u32 len)
+{
+    for (int i = 0; i < GdbBreakpointCount; i++) {
+        if (GdbBreakpoints[i].addr >= addr && GdbBreakpoints[i].addr < addr + len) {
+            GdbBreakpoints[i].inserted = 0;
+        }
+    }
+}
+
+int target_insert_breakpoint(u32 addr)
+{
+    int i = target_find_breakpoint(addr);
+
+    if (addr >= FlashSize() || addr & 1) return -1;
+    if (i < 0) {
+        if (GdbBreakpointCount >= MAX_BREAKPOINTS) return -1;
+        i = GdbBreakpointCount++;
+        GdbBreakpoints[i].addr     = addr;
+        GdbBreakpoints[i].inserted = 0;
+    }
+    GdbBreakpoints[i].wanted = 1;
+    return 0;
+}
+
+int target_remove_breakpoint(u32 addr)
+{
+    int i = target_find_breakpoint(addr);
+
+    if (i >= 0) GdbBreakpoints[i].wanted = 0;
+    return 0;
+}
+
+// Takes every BREAK out of flash, when GDB goes away.
+int target_detach(void)
+{
+    for (int i = 0; i < GdbBreakpointCount; i++) {
+        GdbBreakpoints[i].wanted = 0;
+    }
+    target_flush_registers();
+    target_write_breakpoints(-1, 0);
+    return 0;
+}
+
+// Single step, taking the BREAK out first if one is at PC.
+static void target_trace(void)
+{
+    if (target_breakpoint_inserted(PC)) target_write_breakpoints(PC, 0);
     DwTrace();
+}
+
+// Data watchpoints, emulated: debugWIRE has none. While any are set, a
+// continue runs the target in bursts of WATCH_BURST_POLLS target_poll
+// calls, then breaks in, reads the watched bytes and runs on unless one
+// has changed. The reads of all watchpoints go through DwPrefetch, so a
+// sample costs one exchange per run of nearby watched bytes. The stop
+// comes after the write, up to a burst later.
+
+#define MAX_WATCHPOINTS   8
+#define MAX_WATCH_LENGTH  32
+#define WATCH_BURST_POLLS 5        // About 100ms of running between samples
+
+struct {
+    u16 addr;                      // Data area address
+    u16 len;
+    u8  value[MAX_WATCH_LENGTH];   // Contents at the last sample
+} GdbWatchpoints[MAX_WATCHPOINTS];
+int GdbWatchpointCount = 0;
+int GdbWatchHit = -1;              // Data address of the watchpoint that stopped the target, -1 for none
+static int GdbWatchPolls;
+
+int target_insert_watchpoint(u32 addr, u32 len)
+{
+    if (addr < 0x800000 || len < 1 || len > MAX_WATCH_LENGTH || addr - 0x800000 + len > DataLimit()) return -1;
+    addr -= 0x800000;
+    for (int i = 0; i < GdbWatchpointCount; i++) {
+        if (GdbWatchpoints[i].addr == addr && GdbWatchpoints[i].len == len) return 0;
+    }
+    if (GdbWatchpointCount >= MAX_WATCHPOINTS) return -1;
+    GdbWatchpoints[GdbWatchpointCount].addr = addr;
+    GdbWatchpoints[GdbWatchpointCount].len  = len;
+    GdbWatchpointCount++;
+    return 0;
+}
+
+int target_remove_watchpoint(u32 addr, u32 len)
+{
+    for (int i = 0; i < GdbWatchpointCount; i++) {
+        if (GdbWatchpoints[i].addr == addr - 0x800000 && GdbWatchpoints[i].len == len) {
+            GdbWatchpoints[i] = GdbWatchpoints[--GdbWatchpointCount];
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Reads every watched byte, returns the address of the first watchpoint
+// whose bytes differ from the last sample, -1 if none do.
+static int target_sample_watchpoints(void)
+{
+    u8  now[MAX_WATCH_LENGTH];
+    int hit = -1;
+
+    DwPlanning = 1;
+    for (int i = 0; i < GdbWatchpointCount; i++) DwReadAddr(GdbWatchpoints[i].addr, GdbWatchpoints[i].len, now);
+    DwPlanning = 0;
+    DwPrefetch();
+    for (int i = 0; i < GdbWatchpointCount; i++) {
+        DwReadAddr(GdbWatchpoints[i].addr, GdbWatchpoints[i].len, now);
+        if (memcmp(now, GdbWatchpoints[i].value, GdbWatchpoints[i].len) && hit < 0) hit = GdbWatchpoints[i].addr;
+        memcpy(GdbWatchpoints[i].value, now, GdbWatchpoints[i].len);
+    }
+    DwPrefetchClear();
+    return hit;
+}
+
+int GdbRunning = 0;                // The target was started by target_continue and has not stopped
+int GdbStopSignal = 5;             // Reported for the last stop: 5 SIGTRAP, 2 SIGINT for an interrupt
+static int GdbSavedBP;             // BP of the user while target_start borrows it
+
+// Starts the target from PC, to run until a breakpoint, the hardware
+// breakpoint at stop if it is not negative, or a break from the user.
+static void target_start(int stop)
+{
+    if (target_breakpoint_inserted(PC)) target_trace();  // Step off the BREAK
+
+    int hw = stop >= 0 ? stop : target_hardware_breakpoint();
+    target_write_breakpoints(stop >= 0 ? -1 : hw, 1);
+
+    GdbSavedBP = BP;
+    if (hw >= 0) BP = hw;
+    GdbWatchHit = -1;
+    DwGo();
+}
+
+static void target_stopped(int signal)
+{
+    BP = GdbSavedBP;
+    GdbRunning = 0;
+    GdbStopSignal = signal;
+}
+
+// Runs to the next stop, GDB input counting as a break from the user.
+static void target_go(int fd, int stop)
+{
+    target_start(stop);
+    GoWaitLoop((FileHandle)fd);
+    target_stopped(5);
+}
+
+int target_step(void)
+{
+    target_release_registers();
+    target_trace();
+    GdbStopSignal = 5;
+    GdbWatchHit   = -1;
+    return 0;
+}
+
+// Whether an instruction can be followed by one other than the next:
+// jumps, calls, returns, branches, skips and BREAK.
+static int target_changes_flow(u16 op)
+{
+    return (op & 0xE000) == 0xC000                                  // rjmp, rcall
+        || ((op & 0xF000) == 0xF000 && (op & 0xFC00) != 0xF800)     // brbs, brbc, sbrc, sbrs
+        || (op & 0xFC00) == 0x1000                                  // cpse
+        || (op & 0xFD00) == 0x9900                                  // sbic, sbis
+        || (op & 0xFE0C) == 0x940C                                  // jmp, call
+        || (op & 0xFEEF) == 0x9409                                  // ijmp, eijmp, icall, eicall
+        || (op & 0xFFEF) == 0x9508                                  // ret, reti
+        || op == BREAK_INSTRUCTION;
+}
+
+// Range stepping: runs while PC is in [start, end). Straight line code
+// up to the next instruction that can change the flow of control is run
+// in one go to the hardware breakpoint, and only that instruction is
+// traced. Returns 0 if the range was left, 1 if something else stopped
+// the target first.
+int target_range_step(int fd, u32 start, u32 end)
+{
+    target_release_registers();
+    do {
+        int stop = end;
+        for (u32 a = PC; a < end; a += 2) {
+            u8 op[2];
+            DwReadFlash(a, 2, op);
+            if (target_changes_flow(op[0] | op[1] << 8) || target_breakpoint_inserted(a)) {stop = a; break;}
+            if (((op[0] | op[1] << 8) & 0xFC0F) == 0x9000) a += 2;     // lds, sts
+        }
+        if (stop > PC && BP < 0) {
+            target_go(fd, stop);
+            int i = target_find_breakpoint(PC);
+            if (PC != stop || (i >= 0 && GdbBreakpoints[i].wanted)) return 1;
+        }
+        if (PC >= start && PC < end) target_trace();
+    } while (PC >= start && PC < end);
     return 0;
 }
 
 int target_write_addr(u32 addr, u8 *buf, u16 len)
 {
+    target_flush_registers();
     if (addr < 0x800000) {
         WriteFlash(addr, buf, len);
+        target_forget_breakpoints(addr, len);
     } else {
         DwWriteAddr(addr % 65536, len, buf);
+        if (addr % 65536 < 0x60) GdbRegsValid = 0;  // Registers or SREG/SP written as data
+    }
+
+    return 0;
+}
+
+// Flash loaded by GDB with vFlashErase, vFlashWrite and vFlashDone. The
+// pages erased are collected in GdbFlash, starting from their current
+// contents, until vFlashDone loads them with LoadFlashImage.
+
+u8 GdbFlash[MaxFlashSize];
+u8 GdbFlashPending[MaxFlashSize/MinFlashPageSize]; // Non zero for pages waiting for vFlashDone
+
+int target_flash_erase(u32 addr, u32 len)
+{
+    if (addr + len > FlashSize()) {
+        return -1;
+    }
+    for (u32 base = addr & ~(PageSize()-1); base < addr + len; base += PageSize()) {
+        if (!GdbFlashPending[base/PageSize()]) {
+            DwReadFlash(base, PageSize(), GdbFlash+base);
+            GdbFlashPending[base/PageSize()] = 1;
+        }
+    }
+    memset(GdbFlash+addr, 0xFF, len);
+
+    return 0;
+}
+
+int target_flash_write(u32 addr, const u8 *buf, int len)
+{
+    if (addr + len > FlashSize()) {
+        return -1;
+    }
+    for (u32 base = addr & ~(PageSize()-1); base < addr + len; base += PageSize()) {
+        if (!GdbFlashPending[base/PageSize()]) {
+            return -1;   // Not erased first
+        }
+    }
+    memcpy(GdbFlash+addr, buf, len);
+
+    return 0;
+}
+
+int target_flash_done(void)
+{
+    target_flush_registers();
+    int pages = FlashSize() / PageSize();
+
+    for (int first = 0; first < pages; first++) {
+        if (GdbFlashPending[first]) {
+            int limit = first;
+            while (limit < pages && GdbFlashPending[limit]) {
+                GdbFlashPending[limit++] = 0;
+            }
+            LoadFlashImage(first*PageSize(), GdbFlash+first*PageSize(), (limit-first)*PageSize());
+            target_forget_breakpoints(first*PageSize(), (limit-first)*PageSize());
+            first = limit;
+        }
     }
 
     return 0;
@@ -46,8 +484,15 @@ int target_write_addr(u32 addr, u8 *buf, u16 len)
 
 int target_read_addr(u32 addr, u8 *buf, u16 len)
 {
+    target_flush_registers();
     if (addr < 0x800000) {
         DwReadFlash(addr, len, buf);
+        for (int i = 0; i < GdbBreakpointCount; i++) {  // Show what is under any BREAK
+            for (int j = 0; j < 2; j++) {
+                u32 a = GdbBreakpoints[i].addr + j;
+                if (GdbBreakpoints[i].inserted && a >= addr && a < addr + len) buf[a-addr] = GdbBreakpoints[i].orig[j];
+            }
+        }
     } else {
         DwReadAddr(addr % 65536, len, buf);
     }
@@ -55,16 +500,64 @@ int target_read_addr(u32 addr, u8 *buf, u16 len)
     return 0;
 }
 
-int target_continue(int fd)
+// Starts the target and returns, target_poll then waits for it to stop.
+int target_continue(void)
 {
-    DwGo();
-    GoWaitLoop((FileHandle)fd);
+    target_release_registers();
+    if (GdbWatchpointCount) target_sample_watchpoints();  // What later samples are compared with
+    GdbWatchPolls = 0;
+    target_start(-1);
+    GdbRunning = 1;
+
+    return 0;
+}
+
+// Waits up to timeout ms for the running target to stop, returns 1 once it has.
+int target_poll(int timeout)
+{
+    if (DwWaitForBreak(timeout)) {
+        DeviceBreak();
+        target_stopped(5);
+        return 1;
+    }
+    if (!GdbWatchpointCount || ++GdbWatchPolls < WATCH_BURST_POLLS) return 0;
+
+    Muted = 1;                     // Break in to sample, without the baud rate line each time
+    DwBreakAndSync();
+    Muted = 0;
+    DwReconnect();
+    int i = target_find_breakpoint(PC);
+    int atBreakpoint = PC == BP || (i >= 0 && GdbBreakpoints[i].wanted);  // Reached just before the break
+    GdbWatchHit = target_sample_watchpoints();
+    if (GdbWatchHit >= 0 || atBreakpoint) {
+        if (GdbWatchHit >= 0) {Ws("Watched data at $"); Wx(GdbWatchHit, 4); Wsl(" changed.");}
+        else                  {Wsl("Device reached breakpoint.");}
+        int hit = GdbWatchHit;
+        target_stopped(5);
+        GdbWatchHit = hit;
+        return 1;
+    }
+    GdbWatchPolls = 0;
+    BP = GdbSavedBP;
+    target_start(-1);
+    return 0;
+}
+
+// Breaks into the running target, for GDB's interrupt.
+int target_interrupt(void)
+{
+    Wsl("GDB requested break.");
+    DwBreakAndSync();
+    DwReconnect();
+    target_stopped(2);
 
     return 0;
 }
 
 int target_reset(void)
 {
+    memset(GdbRegsDirty, 0, sizeof(GdbRegsDirty));
+    GdbRegsValid = 0;
     DwReset();
 
     return 0;
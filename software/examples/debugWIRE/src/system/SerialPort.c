@@ -11,6 +11,18 @@
 #if windows
   char portfilename[] = "//./COMnnn";
 
+  int SetSerialBaud(FileHandle port, int baudrate) { // returns 1 iff the port accepts the rate
+    DCB dcb = {sizeof dcb, 0};
+    dcb.fBinary  = TRUE;
+    dcb.BaudRate = baudrate;
+    dcb.ByteSize = 8;
+    dcb.Parity   = NOPARITY;
+    dcb.StopBits = ONESTOPBIT;
+    if (!SetCommState(port, &dcb)) {return 0;}  // This is probably not an FT232
+    PurgeComm(port, PURGE_RXCLEAR | PURGE_TXCLEAR);
+    return 1;
+  }
+
   void MakeSerialPort(char *portname, int baudrate, FileHandle *SerialPort) {
     strncpy(portfilename+4, portname, sizeof(portfilename)-5);
     portfilename[sizeof(portfilename)-1] = 0;
@@ -26,42 +38,73 @@
       Fail("");
     }
 
-    DCB dcb = {sizeof dcb, 0};
-    dcb.fBinary  = TRUE;
-    dcb.BaudRate = baudrate;
-    dcb.ByteSize = 8;
-    dcb.Parity   = NOPARITY;
-    dcb.StopBits = ONESTOPBIT;
-
-    if (!SetCommState(*SerialPort, &dcb)) {
-      // This is probably not an FT232
+    if (!SetSerialBaud(*SerialPort, baudrate)) {
       CloseHandle(*SerialPort); *SerialPort = 0; return;
     }
 
     WinOK(SetCommTimeouts(*SerialPort, &(COMMTIMEOUTS){300,300,1,300,1}));
   }
+
+  // The FTDI driver takes its latency timer from the registry, set
+  // 'Latency Timer' to 1ms in the port's advanced settings.
+  void SerialLowLatency(char *portname, FileHandle port) {}
 #else
-  void MakeSerialPort(char *portname, int baudrate, FileHandle *SerialPort) {
-    char fullname[256] = "/dev/";
-    strncat(fullname, portname, 250); fullname[255] = 0;
-    if ((*SerialPort = open(fullname, O_RDWR/*|O_NONBLOCK|O_NDELAY*/)) < 0) {Fail("Couldn't open serial port.");}
+  int SetSerialBaud(FileHandle port, int baudrate) { // returns 1 iff the port accepts the rate
     struct termios2 config = {0};
-    if (ioctl(*SerialPort, TCGETS2, &config)) {Close(*SerialPort); *SerialPort = 0; return;}
-    config.c_cflag     = CS8 | BOTHER | CLOCAL;
+    if (ioctl(port, TCGETS2, &config)) {return 0;}
+    config.c_cflag     = CS8 | BOTHER | CLOCAL | CREAD;
     config.c_iflag     = IGNPAR | IGNBRK;
     config.c_oflag     = 0;
     config.c_lflag     = 0;
     config.c_ispeed    = baudrate;
     config.c_ospeed    = baudrate;
-    config.c_cc[VMIN]  = 200;         // Nonblocking read of up to 255 bytes
-    config.c_cc[VTIME] = 5;           // 0.5 seconds timeout
-    if (ioctl(*SerialPort, TCSETS2, &config)) {Close(*SerialPort); *SerialPort = 0; return;}
+    config.c_cc[VMIN]  = 0;           // Return whatever has arrived, a block read
+    config.c_cc[VTIME] = 5;           // is not held up waiting for more, 0.5s timeout
+    if (ioctl(port, TCSETS2, &config)) {return 0;}
+    ioctl(port, TCFLSH, TCIOFLUSH);
+    return 1;
+  }
+
+  void MakeSerialPort(char *portname, int baudrate, FileHandle *SerialPort) {
+    char fullname[256] = "/dev/";
+    strncat(fullname, portname, 250); fullname[255] = 0;
+    if ((*SerialPort = open(fullname, O_RDWR/*|O_NONBLOCK|O_NDELAY*/)) < 0) {Fail("Couldn't open serial port.");}
     usleep(10000); // Allow 10ms for USB to settle.
-    ioctl(*SerialPort, TCFLSH, TCIOFLUSH);
+    if (!SetSerialBaud(*SerialPort, baudrate)) {Close(*SerialPort); *SerialPort = 0; return;}
+  }
+
+  // The FT232 holds received bytes for up to its latency timer, 16ms by
+  // default, before passing them over USB. Every debugWIRE transaction
+  // waits for a reply, so set it to 1ms.
+  void SerialLowLatency(char *portname, FileHandle port) {
+    char path[300];
+    snprintf(path, sizeof(path), "/sys/bus/usb-serial/devices/%s/latency_timer", portname);
+    FILE *file = fopen(path, "w");
+    if (file) {fputs("1", file); fclose(file);}
   }
 #endif
 
 
+// Waits up to timeout ms for a byte to arrive, returns 1 iff one is ready.
+
+int SerialReady(FileHandle port, int timeout) {
+#ifdef windows
+  COMSTAT status; DWORD errors;
+  for (int waited = 0; ; waited += 5) {
+    if (ClearCommError(port, &errors, &status)  &&  status.cbInQue) {return 1;}
+    if (waited >= timeout) {return 0;}
+    Sleep(5);
+  }
+#else
+  fd_set readfds;
+  FD_ZERO(&readfds);
+  FD_SET(port, &readfds);
+  struct timeval wait = {timeout / 1000, (timeout % 1000) * 1000};
+  return select(port+1, &readfds, 0, 0, &wait) > 0;
+#endif
+}
+
+
 void SerialWrite(FileHandle port, const u8 *bytes, int length) {
   Write(port, bytes, length);
 }
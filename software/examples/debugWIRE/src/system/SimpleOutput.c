@@ -6,12 +6,16 @@
 
 int Verbose = 0;  // Set the verbose flag to flush all outputs, and to enable
                   // the Vc, Vs, Vl etc. versions of the output functions.
+int Redraw  = 1;  // Clear to drop lines ended by '\r', progress that would be
+                  // redrawn in place, when output goes to a log.
+int Muted   = 0;  // Set to discard all output.
 
 /// Simple standard output text writing and buffering.
 
-char OutputBuffer[100]  = {0};
-int  OutputPosition     = 0;
-int  HorizontalPosition = 0;
+PerTarget char OutputBuffer[100]  = {0};
+PerTarget int  OutputPosition     = 0;
+PerTarget int  HorizontalPosition = 0;
+PerTarget char OutputPrefix[20]   = "";  // Starts each line, names the target of a session thread
 
 void Flush() {
   if (OutputPosition) {
@@ -21,6 +25,15 @@ void Flush() {
 }
 
 void Wc(char c) {
+  if (Muted) {return;}
+  if (c == '\r'  &&  !Redraw) {OutputPosition = 0; HorizontalPosition = 0; return;}
+  if (HorizontalPosition == 0  &&  OutputPrefix[0]  &&  c != '\n'  &&  c != '\r') {
+    for (char *p = OutputPrefix; *p; p++) {
+      if (OutputPosition >= sizeof OutputBuffer) {Flush();}
+      OutputBuffer[OutputPosition++] = *p;
+      HorizontalPosition++;
+    }
+  }
   if (OutputPosition >= sizeof OutputBuffer) {Flush();}
   OutputBuffer[OutputPosition++] = c;
   if (c == '\n'  ||  c == '\r') {
@@ -34,6 +47,7 @@ void Wc(char c) {
 
 
 void Wt(int tab) {
+  if (Muted) {return;}
   tab = min(max(tab, HorizontalPosition), countof(OutputBuffer));
   while (HorizontalPosition < tab) {
     OutputBuffer[OutputPosition++] = ' ';
@@ -35,6 +35,7 @@
     #include <gtk/gtk.h>
   #endif
   #include <setjmp.h>
+  #include <pthread.h>
   #include <usb.h>
   void delay(unsigned int ms) {usleep(ms*1000);}
 #endif
@@ -52,6 +53,11 @@ typedef signed   int       s32;
 typedef signed   long long s64;
 
 
+// State of one debugWIRE target. Each session thread driving a target has
+// its own copy, see dwire/Sessions.c.
+#define PerTarget __thread
+
+
 #define countof(array) (sizeof(array)/(sizeof(array)[0]))
 #define ArrayAddressAndLength(array) array, sizeof(array)
 #define Bytes(...) (u8[]){__VA_ARGS__}, sizeof((u8[]){__VA_ARGS__})
@@ -205,9 +211,11 @@ void StackTrace() {
 
 /// Simple error handling.
 
-static jmp_buf FailPoint;
+static PerTarget jmp_buf FailPoint;
+PerTarget char FailMessage[100] = "";  // Message of the last failure
 
 void Fail(const char *message) {
+  snprintf(FailMessage, sizeof(FailMessage), "%s", message);
   Wsl(message);
   StackTrace();
   longjmp(FailPoint,1);
@@ -0,0 +1,96 @@
+/// Script.c
+
+//        Script mode
+//
+//        script file - runs the commands in file, as a test station would,
+//        then ends the session as the end of piped input does.
+//
+//        Each line of the file is echoed after "> ", its output follows
+//        and a line "= ok" ends it. A failure ends the script with a line
+//        "= error " and the message, and dwdebug exits with status 3.
+//        Progress that is redrawn in place on a console is left out.
+//        Blank lines and lines starting with '#' are skipped.
+//
+//        A line of nothing but data and register displays (d, dw, and r
+//        without parameters) is run twice: first muted and without touching
+//        the target, to note the data areas it reads, then for real with
+//        those areas read in as few exchanges as they allow, see DwPrefetch.
+
+
+
+
+
+// Does the line only display data and registers?
+
+int ScriptLineOnlyReads(const char *line) {
+  const char *p = line;
+  while (1) {
+    while (IsBlank(*p)  ||  IsCommandSeparator(*p)) {p++;}
+    if (!*p) {return 1;}
+    const char *command = p;
+    while (IsAlpha(*p)) {p++;}
+    int length = p - command;
+    int bare   = 1;
+    while (*p  &&  !IsCommandSeparator(*p)) {if (!IsBlank(*p)) {bare = 0;} p++;}
+    if (length == 1  &&  command[0] == 'd')                 {continue;}
+    if (length == 2  &&  !strncmp(command, "dw", 2))        {continue;}
+    if (length == 1  &&  command[0] == 'r'  &&  bare)       {continue;}
+    return 0;
+  }
+}
+
+
+void RunCommandLine(char *line) {
+  PreloadInput(line);
+  // The line ends in a line feed, so nothing is read from Input
+  while (BufferTotalContent()  &&  !QuitRequested) {ParseAndHandleCommand();}
+}
+
+
+void RunScriptLine(char *line) {
+  Ws("> "); Wsl(line);
+  if (ScriptLineOnlyReads(line)) {
+    int dbaddr = DBaddr;
+    int dwaddr = DWaddr;
+    if (DeviceType < 0) {DwConnect();}
+    Muted = 1;  DwPlanning = 1;
+    RunCommandLine(line);
+    Muted = 0;  DwPlanning = 0;
+    DBaddr = dbaddr;
+    DWaddr = dwaddr;
+    DwPrefetch();
+  }
+  RunCommandLine(line);
+  DwPrefetchClear();
+  Wsl("= ok");
+}
+
+
+void ScriptCommand() {
+  char path[500] = "";
+  char line[250];
+  Sb(); ReadWhile(NotDwEoln, path, sizeof(path)); TrimTrailingSpace(path);
+  if (!path[0]) {Fail("Expected the name of a script.");}
+  FILE *file = fopen(path, "r");
+  if (!file) {Ws("Couldn't open "); Fail(path);}
+
+  if (setjmp(FailPoint)) {
+    Muted = 0;  DwPlanning = 0;
+    Ws("= error "); Wsl(FailMessage);
+    Exit(3);
+  }
+  Redraw = 0;
+
+  while (fgets(line, sizeof(line), file)) {
+    int length = strlen(line);
+    if (length  &&  line[length-1] != '\n'  &&  !feof(file)) {Fail("Script line too long.");}
+    TrimTrailingSpace(line);
+    char *p = line; while (IsBlank(*p)) {p++;}
+    if (*p  &&  *p != '#') {RunScriptLine(p);}
+    if (QuitRequested) {break;}
+  }
+  fclose(file);
+
+  DwGo();
+  Exit(0);
+}
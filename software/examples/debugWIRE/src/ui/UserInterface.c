@@ -10,6 +10,7 @@
 
 
 void HelpCommand();
+void ScriptCommand();
 
 void PCommand()            {PC = ReadInstructionAddress("PC");}
 void BPCommand()           {BP = ReadInstructionAddress("BP");}
@@ -22,6 +23,115 @@ void EmptyCommand()        {Sb(); if (!DwEoln()) {HelpCommand();}}
 void VerboseCommand()      {Verbose = 1;}
 void TimerEnableCommand()  {TimerEnable = 1;}
 void TimerDisableCommand() {TimerEnable = 0;}
+// device [port [baud]] - debugWIRE through an FT232 on port, such as
+// ttyUSB0 or COM4, where a number alone n is ttyUSBn or COMn. With no
+// port the serial ports are scanned, with no baud rate it is found.
+
+void DeviceCommand() {
+  char name[250] = "";
+  int  baud = 0;
+  Sb(); if (!DwEoln()) {Ran(name, sizeof(name));}
+  Sb(); if (IsDwDebugNumeric(NextCh())) {baud = ReadNumber(0);}
+  #ifdef windows
+    char *prefix = "COM";
+  #else
+    char *prefix = "ttyUSB";
+  #endif
+  snprintf(UsbSerialPortName, sizeof(UsbSerialPortName), "%s%s", IsNumeric(name[0]) ? prefix : "", name);
+  if (Transport) {Transport->close();}
+  DwFirmware = 0;
+  DwCapabilities = 0;
+  ConnectSerialPort(baud);
+  DwConnect();
+}
+
+void BaudCommand()         {Ws("debugWIRE at "); Wd(DwBaud(), 1); Wsl(" baud.");}
+
+
+// record [file] - records the transport calls to file, no file stops.
+// replay file   - replays a recording in place of the hardware.
+// To replay a whole session, start recording from the command line, as in
+// "dwdebug record session.dwr, l prog.elf, qs", then replay it the same way.
+
+void RecordCommand() {
+  char path[500] = "";
+  Sb(); if (!DwEoln()) {ReadWhile(NotDwEoln, path, sizeof(path)); TrimTrailingSpace(path);}
+  if (path[0]  &&  !Transport) {ConnectPort();}
+  DwRecord(path);
+}
+
+void ReplayCommand() {
+  char path[500] = "";
+  Sb(); ReadWhile(NotDwEoln, path, sizeof(path)); TrimTrailingSpace(path);
+  if (!path[0]) {Fail("Expected the name of a recording.");}
+  DwReplay(path);
+  DeviceType = -1;  // Connect from the recording
+}
+
+void WriteTransportStats(DwTransport *transport) {
+  lwStats *stats = transport->stats;
+  if (!stats->transfers) {return;}
+  Ws("  "); Ws(transport->name); Wt(14);
+  Wd(stats->transfers, 1);                   Ws(" transfers, ");
+  Wd(stats->bytesOut, 1);                    Ws(" bytes out, ");
+  Wd(stats->bytesIn, 1);                     Ws(" in, ");
+  Wd(stats->retries, 1);                     Ws(" retries, ");
+  Wd(stats->errors, 1);                      Ws(" errors, ");
+  Wd(stats->totalMicros / 1000, 1);          Ws("ms, longest ");
+  Wd(stats->maxMicros, 1);                   Wsl("us.");
+}
+
+// target [serial|path]      - LittleWire of the interactive session, by
+//                             serial number or USB path, none for the
+//                             first one found
+// targets [serial ...|all]  - LittleWires that l loads, in parallel, none
+//                             to list the LittleWires connected
+
+void TargetCommand() {
+  char word[USBOPEN_PATH_SIZE] = "";
+  Sb(); ReadWhile(NotDwEoln, word, sizeof(word)); TrimTrailingSpace(word);
+  if      (!word[0])           {SelectTarget(-1);}
+  else if (strchr(word, '/'))  {SelectTargetPath(word);}
+  else if (word[0] == '$')     {SelectTarget(strtol(word+1, 0, 16));}
+  else                         {SelectTarget(atoi(word));}
+}
+
+void TargetsCommand() {
+  char word[10] = "";
+  int  found = littlewire_search();
+  Sb();
+  if (DwEoln()) {
+    for (int i=0; i<found; i++) {
+      int chosen = 0;
+      for (int j=0; j<SessionCount; j++) {if (Sessions[j].serial == lwResults[i].serialNumber) {chosen = 1;}}
+      Ws("  LittleWire "); Wd(lwResults[i].serialNumber, 1);
+      Ws(" at "); Ws(lwResults[i].path); Wsl(chosen ? ", chosen." : ".");
+    }
+    return;
+  }
+  if (IsAlpha(NextCh())) {Ra(word, sizeof(word));}
+  SessionCount = 0;
+  if (!strcmp(word, "all")) {
+    for (int i=0; i<found; i++) {AddSession(lwResults[i].serialNumber);}
+  } else if (strcmp(word, "none")) {
+    while (IsDwDebugNumeric(NextCh())) {AddSession(ReadNumber(0)); Sb();}
+  }
+  if (SessionCount  &&  Transport) {Transport->close(); DeviceType = -1;}  // Leave them to the sessions
+  if (SessionCount) {Ws("l loads "); Wd(SessionCount, 1); Wsl(" targets in parallel.");}
+  else              {Wsl("l loads the target of this session.");}
+}
+
+// transport [reset] - transfer counters of each backend used
+void TransportCommand() {
+  DwTransport *transports[] = {&LittleWireTransport, &SerialTransport, &ReplayTransport};
+  char word[10] = "";
+  Sb(); if (!DwEoln()) {Ra(word, sizeof(word));}
+  for (int i=0; i<countof(transports); i++) {
+    if (!strcmp(word, "reset")) {lw_stats_reset(transports[i]->stats);}
+    else                        {WriteTransportStats(transports[i]);}
+  }
+  if (Transport) {Ws("Current transport "); Ws(Transport->name); Wsl(RecordFile ? ", recording." : ".");}
+}
 
 
 void DisassemblyPrompt() {
@@ -50,11 +160,15 @@ struct {char *name; char *help; int requiresConnection; void (*handler)();} Comm
   {"e",           "Dump EEPROM bytes",                             1, DumpEEPROMBytesCommand},
   {"ew",          "Dump EEPROM words",                             1, DumpEEPROMWordsCommand},
   {"we",          "Write EEPROM bytes",                            1, WriteEEPROMBytesCommand},
+  {"eb",          "EEPROM transfer block size set / query",        0, EepromBlockCommand},
   {"f",           "Dump flash bytes",                              1, DumpFlashBytesCommand},
   {"fw",          "Dump flash words",                              1, DumpFlashWordsCommand},
   {"wf",          "Write flash bytes",                             1, WriteFlashBytesCommand},
-  {"l",           "Load file",                                     1, LoadFileCommand},
+  {"l",           "Load file",                                     0, LoadFileCommand},
+  {"vf",          "Verify flash against file",                     0, VerifyFileCommand},
+  {"gang",        "Program file into many targets",                0, GangCommand},
   {"g",           "Go",                                            1, GoCommand},
+  {"profile",     "Sample the PC of the running target",           1, ProfileCommand},
   {"p",           "PC set / query",                                1, PCommand},
   {"qr",          "Quit with device running",                      1, QuitCommand},
   {"qs",          "Quit with device stopped",                      0, QuitPauseCommand},
@@ -62,12 +176,22 @@ struct {char *name; char *help; int requiresConnection; void (*handler)();} Comm
   {"r",           "Display registers",                             1, RegistersCommand},
   {"s",           "Stack",                                         1, StackCommand},
   {"t",           "Trace",                                         1, TraceCommand},
+  {"trace",       "Trace many instructions, to a file if given",   1, TraceLogCommand},
+  {"traceview",   "List a trace file",                             0, TraceViewCommand},
   {"te",          "Timer enable",                                  1, TimerEnableCommand},
   {"td",          "Timer disable",                                 1, TimerDisableCommand},
   {"u",           "Unassemble",                                    1, UnassembleCommand},
   {"h",           "Help",                                          0, HelpCommand},
   {"reset",       "Reset processor",                               1, DwReset},
   {"config",      "Display fuses and lock bits",                   1, DumpConfig},
+  {"baud",        "debugWIRE baud rate query",                     1, BaudCommand},
+  {"device",      "Connect through an FT232 serial port",          0, DeviceCommand},
+  {"record",      "Record debugWIRE transfers to a file",          0, RecordCommand},
+  {"replay",      "Replay recorded debugWIRE transfers",           0, ReplayCommand},
+  {"transport",   "debugWIRE transfer counters",                   0, TransportCommand},
+  {"script",      "Run commands from a file, for test stations",   0, ScriptCommand},
+  {"target",      "Choose the LittleWire by serial number",        0, TargetCommand},
+  {"targets",     "Choose LittleWires to load in parallel",        0, TargetsCommand},
   {"help",        "Help",                                          0, HelpCommand},
   {"verbose",     "Set verbose mode",                              0, VerboseCommand},
   {"gdbserver",   "Start server for GDB",                          1, GdbserverCommand},
@@ -88,6 +212,7 @@ void HelpCommand() {
 void HandleCommand(const char *cmd) {
   for (int i=0; i<countof(Commands); i++) {
     if (!strcmp(cmd, Commands[i].name)) {
+      if (Commands[i].requiresConnection  &&  DeviceType < 0) {DwConnect();}
       Commands[i].handler();
       return;
     }
@@ -110,7 +235,7 @@ void ParseAndHandleCommand() {
 
 void Prompt() {
   if (BufferTotalContent() == 0  &&  IsInteractive) {
-    if (OutputPosition == 0) {DisassemblyPrompt();}
+    if (OutputPosition == 0  &&  DeviceType >= 0) {DisassemblyPrompt();}
     Wt(HasLineNumbers ? 60 : 40); Ws("> "); Flush();
     HorizontalPosition = 0;  // Let SimpleOutput know user returned to column 1
   } else {
@@ -120,8 +245,9 @@ void Prompt() {
 
 
 void UI() {
-  DwConnect();
   PreloadInput(GetCommandParameters());
+  // Interactively connect straight away, commands connect when they need to
+  if (BufferTotalContent() == 0) {DwConnect();}
   while (1) {
     if (QuitRequested) {DwGo(); /*usb_close(Port); Port = 0; */ return;}
     if (BufferTotalContent() == 0) {IsInteractive = Interactive(Input);}
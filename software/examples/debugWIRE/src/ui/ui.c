@@ -1 +1,2 @@
 #include "UserInterface.c"
+#include "Script.c"
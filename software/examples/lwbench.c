@@ -0,0 +1,322 @@
+/*
+	Times the primitives of the library against a connected Little Wire.
+
+	Every operation is run a number of times and its latency is reported as
+	percentiles together with the sustained rate. Output is one tab separated
+	line per operation after a '#' header, so it can be kept and compared
+	between firmware versions and host USB stacks:
+
+		# firmware <version> iterations <n>
+		# op	n	errors	min_us	p50_us	p90_us	p99_us	max_us	ops_per_s
+
+	Usage: lwbench [-n iterations] [-s serialNumber] [-m] [-t] [-w] [op ...]
+		-n	iterations per operation, 1000 by default
+		-s	connect to the device with this serial number
+		-m	time an emulated device instead, on its own clock, see
+			littleWire_mock.h: the numbers are the same on every run
+		-t	after each operation, show what the device timed of its
+			requests and jobs, see lw_timingRead: needs firmware built
+			with TIMING=1
+		-w	also time debugWIRE, needs a debugWIRE target on PIN3
+		op	only run the named operations
+
+	The pins are driven as outputs, SPI, I2C and 1-Wire, so nothing should be
+	connected that minds. The I2C and 1-Wire operations are timed the same with
+	or without a device on the bus.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "littleWire.h"
+#include "littleWire_util.h"
+#include "littleWire_mock.h"
+
+#ifdef LINUX
+	#include <time.h>
+#endif
+
+#define DEFAULT_ITERATIONS	1000
+#define WARMUP_ITERATIONS	10
+
+#define OUT_TO_LW	(USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_OUT)
+#define IN_FROM_LW	(USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN)
+
+typedef struct benchOp
+{
+	const char* name;
+	void (*setup)(littleWire* lw);
+	int (*run)(littleWire* lw);
+	int debugWire;           /* needs -w */
+} benchOp;
+
+static unsigned char spiBuffer[4];
+static unsigned char spiReply[4];
+static littleWire* mockDevice;   /* -m, times are read from its clock */
+
+/* Monotonic time in microseconds */
+static double now_us()
+{
+	if(mockDevice)
+		return lw_mock_elapsed(mockDevice);
+#ifdef LINUX
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#else
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (double)count.QuadPart * 1e6 / (double)frequency.QuadPart;
+#endif
+}
+
+/********************************************************************************
+* Operations
+********************************************************************************/
+static void setupGpio(littleWire* lw) { pinMode(lw, PIN1, OUTPUT); }
+static int runDigitalWrite(littleWire* lw) { digitalWrite(lw, PIN1, HIGH); return lw_error(lw); }
+static int runDigitalRead(littleWire* lw) { digitalRead(lw, PIN2); return lw_error(lw); }
+
+static void setupAdc(littleWire* lw) { analog_init(lw, VREF_VCC); }
+static int runAnalogRead(littleWire* lw) { analogRead(lw, ADC_TEMP_SENS); return lw_error(lw); }
+static int runAnalogScan(littleWire* lw)
+{
+	unsigned int results[3];
+	return analog_scan(lw, ADC_SCAN_PIN3 | ADC_SCAN_PIN2 | ADC_SCAN_TEMP_SENS, 2, results);
+}
+
+static void setupPwm(littleWire* lw) { pwm_init(lw); }
+static int runPwmUpdate(littleWire* lw) { pwm_updateCompare(lw, 64, 192); return lw_error(lw); }
+
+static void setupSpi(littleWire* lw) { pwm_stop(lw); spi_init(lw); }
+static int runSpi(littleWire* lw, int length)
+{
+	spi_sendMessage(lw, spiBuffer, spiReply, length, AUTO_CS);
+	return lw_error(lw);
+}
+static int runSpi1(littleWire* lw) { return runSpi(lw, 1); }
+static int runSpi2(littleWire* lw) { return runSpi(lw, 2); }
+static int runSpi3(littleWire* lw) { return runSpi(lw, 3); }
+static int runSpi4(littleWire* lw) { return runSpi(lw, 4); }
+
+static void setupI2c(littleWire* lw) { i2c_init(lw); i2c_updateDelay(lw, 0); }
+static int runI2cStart(littleWire* lw) { i2c_start(lw, 0x50, WRITE); return lw_error(lw); }
+
+static int runOnewireWrite(littleWire* lw) { onewire_writeByte(lw, 0xCC); return lw_error(lw); }
+static int runOnewireRead(littleWire* lw) { onewire_readByte(lw); return lw_error(lw); }
+
+static int runWs2812Write(littleWire* lw) { ws2812_write(lw, PIN4, 0, 0, 0); return lw_error(lw); }
+static int runWs2812Flush(littleWire* lw)
+{
+	ws2812_preload(lw, 0, 0, 0);
+	ws2812_flush(lw, PIN4);
+	return lw_error(lw);
+}
+
+/* Breaks into the debugWIRE target and sets the baud rate, as dwdebug does */
+static void setupDebugWire(littleWire* lw)
+{
+	unsigned short times[64];
+	unsigned long cyclesPerPulse = 0;
+	int status, i, tries;
+
+	for(tries=0;tries<25;tries++)
+	{
+		if(usb_control_msg(lw->handle, OUT_TO_LW, 60, 33, 0, 0, 0, USB_TIMEOUT) < 0)
+			continue;
+		delay(120);
+		status = usb_control_msg(lw->handle, IN_FROM_LW, 60, 0, 0, (char*)times, sizeof(times), USB_TIMEOUT);
+		if(status >= 18)
+		{
+			for(i=status/2-9;i<status/2;i++)
+				cyclesPerPulse += times[i];
+			cyclesPerPulse = (6*cyclesPerPulse)/9 + 8;
+			times[0] = (cyclesPerPulse-8)/4;
+			usb_control_msg(lw->handle, OUT_TO_LW, 60, 2, 0, (char*)times, 2, USB_TIMEOUT);
+			return;
+		}
+	}
+	fprintf(stderr, "> debugWIRE target did not answer the break\n");
+}
+
+/* Reads the device signature: one byte out, two bytes back */
+static int runDebugWireByte(littleWire* lw)
+{
+	char command = 0xF3;
+	char reply[2];
+	int status, tries;
+
+	status = usb_control_msg(lw->handle, OUT_TO_LW, 60, 20, 0, &command, 1, USB_TIMEOUT);
+	if(status < 1)
+		return status < 0 ? status : -1;
+	for(tries=0;tries<1000;tries++)
+	{
+		status = usb_control_msg(lw->handle, IN_FROM_LW, 60, 0, 0, reply, sizeof(reply), USB_TIMEOUT);
+		if(status != 0)
+			return status < 0 ? status : 0;
+	}
+	return -1;
+}
+
+static benchOp ops[] =
+{
+	{ "digitalWrite",      setupGpio,      runDigitalWrite,  0 },
+	{ "digitalRead",       NULL,           runDigitalRead,   0 },
+	{ "analogRead",        setupAdc,       runAnalogRead,    0 },
+	{ "analog_scan",       setupAdc,       runAnalogScan,    0 },
+	{ "pwm_updateCompare", setupPwm,       runPwmUpdate,     0 },
+	{ "spi_1",             setupSpi,       runSpi1,          0 },
+	{ "spi_2",             setupSpi,       runSpi2,          0 },
+	{ "spi_3",             setupSpi,       runSpi3,          0 },
+	{ "spi_4",             setupSpi,       runSpi4,          0 },
+	{ "i2c_start",         setupI2c,       runI2cStart,      0 },
+	{ "onewire_writeByte", NULL,           runOnewireWrite,  0 },
+	{ "onewire_readByte",  NULL,           runOnewireRead,   0 },
+	{ "ws2812_write",      NULL,           runWs2812Write,   0 },
+	{ "ws2812_flush",      NULL,           runWs2812Flush,   0 },
+	{ "debugWIRE_byte",    setupDebugWire, runDebugWireByte, 1 },
+};
+/*******************************************************************************/
+
+static int compareTimes(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(double* sorted, int n, int p)
+{
+	int i = (n * p + 99) / 100 - 1;
+	return sorted[i < 0 ? 0 : i];
+}
+
+static void showTiming(littleWire* lw)
+{
+	lwTiming timing;
+	int i;
+
+	if(lw_timingRead(lw, &timing) < 0)
+	{
+		printf("#\tno device timing\n");
+		return;
+	}
+	printf("#\tloop_max %lu\toff_max %lu\toff_total %lu\tmissed_frames %d%s\n", timing.loopMax,
+		timing.offMax, timing.offTotal, timing.missedFrames, timing.timerTaken ? "\ttimer_taken" : "");
+	for(i=0;i<timing.count;i++)
+		printf("#\t%s %d\tn %d\tmax_cycles %lu\n", timing.slowest[i].job ? "job" : "request",
+			timing.slowest[i].id, timing.slowest[i].count, timing.slowest[i].max);
+}
+
+static void bench(littleWire* lw, benchOp* op, int iterations, double* times, int timing)
+{
+	double start, total;
+	int i, errors = 0;
+
+	if(op->setup)
+		op->setup(lw);
+	for(i=0;i<WARMUP_ITERATIONS;i++)
+		op->run(lw);
+	if(timing && lw_timingStart(lw) < 0)
+		timing = 0;
+
+	total = now_us();
+	for(i=0;i<iterations;i++)
+	{
+		start = now_us();
+		if(op->run(lw) < 0)
+			errors++;
+		times[i] = now_us() - start;
+	}
+	total = now_us() - total;
+
+	qsort(times, iterations, sizeof(double), compareTimes);
+	printf("%s\t%d\t%d\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\t%.1f\n", op->name, iterations, errors,
+		times[0], percentile(times, iterations, 50), percentile(times, iterations, 90),
+		percentile(times, iterations, 99), times[iterations-1], iterations * 1e6 / total);
+	if(timing)
+	{
+		showTiming(lw);
+		lw_timingStop(lw);
+	}
+	fflush(stdout);
+}
+
+static int selected(benchOp* op, int argc, char** argv, int first, int debugWire)
+{
+	int i;
+
+	if(first >= argc)
+		return !op->debugWire || debugWire;
+	for(i=first;i<argc;i++)
+	{
+		if(strcmp(argv[i], op->name) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	littleWire* lw = NULL;
+	double* times;
+	int iterations = DEFAULT_ITERATIONS;
+	int serialNumber = -1;
+	int debugWire = 0;
+	int mock = 0;
+	int timing = 0;
+	int first, i;
+
+	for(i=1;i<argc && argv[i][0]=='-';i++)
+	{
+		if((strcmp(argv[i], "-n") == 0) && (i+1 < argc))
+			iterations = atoi(argv[++i]);
+		else if((strcmp(argv[i], "-s") == 0) && (i+1 < argc))
+			serialNumber = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-m") == 0)
+			mock = 1;
+		else if(strcmp(argv[i], "-t") == 0)
+			timing = 1;
+		else if(strcmp(argv[i], "-w") == 0)
+			debugWire = 1;
+		else
+		{
+			fprintf(stderr, "Usage: %s [-n iterations] [-s serialNumber] [-m] [-t] [-w] [op ...]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	first = i;
+	if(iterations < 1)
+		iterations = 1;
+
+	if(mock)
+		lw = mockDevice = lw_mock_connect(NULL);
+	else if(serialNumber >= 0)
+		lw = littlewire_connect_bySerialNum(serialNumber);
+	else
+		lw = littleWire_connect();
+
+	if(lw == NULL)
+	{
+		fprintf(stderr, "> Little Wire could not be found!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	times = malloc(iterations * sizeof(double));
+	if(times == NULL)
+		exit(EXIT_FAILURE);
+
+	printf("# firmware %d.%d iterations %d\n", (lw->firmwareVersion & 0xF0) >> 4, lw->firmwareVersion & 0x0F, iterations);
+	printf("# op\tn\terrors\tmin_us\tp50_us\tp90_us\tp99_us\tmax_us\tops_per_s\n");
+
+	for(i=0;i<(int)(sizeof(ops)/sizeof(ops[0]));i++)
+	{
+		if(selected(&ops[i], argc, argv, first, debugWire))
+			bench(lw, &ops[i], iterations, times, timing);
+	}
+
+	free(times);
+	littleWire_disconnect(lw);
+	return 0;
+}
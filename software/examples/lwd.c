@@ -0,0 +1,614 @@
+/*
+	Little Wire daemon: owns the attached Little Wires and shares them.
+
+	Programs reach the devices through a Unix socket with lw_daemon_connect of
+	littleWire_remote.h, and can then use the whole library at the same time
+	as each other. lwd runs the requests of all clients in arrival order. The
+	short fixed-size requests (pin mode, digital read and write, ADC read, PWM)
+	waiting for one device are merged into a single command batch, so a burst
+	from several clients takes one USB round trip. Pin change events of a
+	device go to every client that reads them.
+
+	With -p lwd also takes clients over TCP, lw_remote_connect. Clients may
+	send many requests without waiting for the replies, which come back in
+	order; requests read together are merged as above. TCP clients are not
+	authenticated, so lwd listens on the loopback address unless -b is given,
+	-b 0.0.0.0 for all interfaces.
+
+	Usage: lwd [-d] [-v] [-s socket] [-p port [-b address]]
+		-d	debug, stay in the foreground
+		-v	verbose, print the clients and requests
+		-s	socket, LWD_SOCKET from the environment or /tmp/lwd.sock by default
+		-p	also listen on this TCP port, on 127.0.0.1
+		-b	listen on this IPv4 address instead, 0.0.0.0 for all interfaces
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "littleWire.h"
+#include "littleWire_util.h"
+#include "littleWire_remote.h"
+
+#define MAX_CLIENTS 32
+#define MAX_DEVICES 16
+#define MAX_PENDING 128		// requests read in one pass
+#define MAX_MERGE 16		// requests merged into one batch
+#define EVENT_POLL 2		// miliseconds between interrupt reads while someone listens
+
+typedef struct lwdClient
+{
+	int fd;				// -1 if the slot is free
+	int device;			// index into devices, -1 before LWD_OPEN
+	int subscribed;
+	unsigned char in[LWD_HEADER_SIZE + 8 + LWD_MAX_DATA];
+	int have;
+} lwdClient;
+
+typedef struct lwdDevice
+{
+	littleWire* lw;
+	int serialNumber;
+	int subscribers;
+} lwdDevice;
+
+typedef struct lwdPending
+{
+	int client;
+	int tag;
+	unsigned char setup[8];		// bmRequestType, bRequest, wValue, wIndex, wLength
+	unsigned char data[LWD_MAX_DATA];
+} lwdPending;
+
+static lwdClient clients[MAX_CLIENTS];
+static lwdDevice devices[MAX_DEVICES];
+static lwdPending pending[MAX_PENDING];
+static int deviceCount = 0;
+static int pendingCount = 0;
+static int debug = 0;
+static int verbose = 0;
+
+static void usage()
+{
+	printf("Usage: lwd [-d] [-v] [-s socket] [-p port [-b address]]\n");
+	printf("       -d         debug, stay in the foreground\n");
+	printf("       -v         verbose, print the clients and requests\n");
+	printf("       -s socket  socket to listen on, default %s\n", LWD_SOCKET);
+	printf("       -p port    also listen on this TCP port, on 127.0.0.1\n");
+	printf("       -b address listen for TCP on this IPv4 address instead,\n");
+	printf("                  0.0.0.0 for all interfaces, clients are not authenticated\n");
+}
+
+static void background()
+{
+	int fd;
+
+	fd = open("/dev/null", O_WRONLY|O_APPEND);
+	dup2(fd, 0);
+	dup2(fd, 1);
+	dup2(fd, 2);
+	close(fd);
+
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGTTOU, SIG_IGN);
+	signal(SIGTTIN, SIG_IGN);
+	signal(SIGTSTP, SIG_IGN);
+
+	if(fork())
+		exit(0);
+}
+
+/* Opens the devices not open yet */
+static void scanDevices()
+{
+	littleWire* lw;
+	int i, j, count;
+
+	count = littlewire_search();
+	for(i=0;i<count && deviceCount<MAX_DEVICES;i++)
+	{
+		for(j=0;j<deviceCount;j++)
+		{
+			if(devices[j].serialNumber == lwResults[i].serialNumber)
+				break;
+		}
+		if(j < deviceCount)
+			continue;
+		lw = littlewire_connect_byID(i);
+		if(lw == NULL)
+			continue;
+		devices[deviceCount].lw = lw;
+		devices[deviceCount].serialNumber = lwResults[i].serialNumber;
+		devices[deviceCount].subscribers = 0;
+		deviceCount++;
+		syslog(LOG_INFO, "Device %d, firmware %d.%d\n", lwResults[i].serialNumber, (lw->firmwareVersion & 0xF0) >> 4, lw->firmwareVersion & 0x0F);
+		if(verbose)
+			printf("lwd: device %d, firmware %d.%d\n", lwResults[i].serialNumber, (lw->firmwareVersion & 0xF0) >> 4, lw->firmwareVersion & 0x0F);
+	}
+}
+
+static int findDevice(int serialNumber)
+{
+	int i;
+
+	if(serialNumber < 0)
+		return deviceCount ? 0 : -1;
+	for(i=0;i<deviceCount;i++)
+	{
+		if(devices[i].serialNumber == serialNumber)
+			return i;
+	}
+	return -1;
+}
+
+static void dropClient(int c)
+{
+	if(verbose)
+		printf("lwd: client %d gone\n", c);
+	if(clients[c].subscribed)
+		devices[clients[c].device].subscribers--;
+	close(clients[c].fd);
+	clients[c].fd = -1;
+}
+
+/* Sends a frame to a client, a reply starts with the status */
+static void sendFrame(int c, int type, int tag, int status, const unsigned char* data, int length)
+{
+	unsigned char frame[LWD_HEADER_SIZE + 2 + LWD_MAX_DATA];
+	int size = 0, n;
+
+	if(clients[c].fd < 0)
+		return;
+	frame[size++] = type;
+	frame[size++] = 0;
+	frame[size++] = tag & 0xFF;
+	frame[size++] = tag >> 8;
+	frame[size++] = (length + ((type & LWD_REPLY) ? 2 : 0)) & 0xFF;
+	frame[size++] = (length + ((type & LWD_REPLY) ? 2 : 0)) >> 8;
+	if(type & LWD_REPLY)
+	{
+		frame[size++] = status & 0xFF;
+		frame[size++] = (status >> 8) & 0xFF;
+	}
+	memcpy(frame + size, data, length);
+	size += length;
+
+	for(n=0;n<size;)
+	{
+		int sent = send(clients[c].fd, frame + n, size - n, MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent <= 0)
+		{
+			dropClient(c);
+			return;
+		}
+		n += sent;
+	}
+}
+
+/* Reply bytes of the requests that can go into a batch, -1 for the others */
+static int mergedReplyLength(const unsigned char* setup)
+{
+	if(setup[0] != 0xC0 || setup[7] || setup[6] > 8)
+		return -1;
+	switch(setup[1])
+	{
+		case 13: case 14:	// pin mode
+		case 16: case 17:	// hardware PWM
+		case 18: case 19:	// digital write
+		case 22: case 31: case 32:
+			return 0;
+		case 20:		// digital read
+			return 1;
+		case 15:		// ADC read
+			return 2;
+		default:
+			return -1;
+	}
+}
+
+static void runOne(lwdDevice* dev, lwdPending* p)
+{
+	unsigned char buffer[LWD_MAX_DATA];
+	int size = p->setup[6] | (p->setup[7] << 8);
+	int in = p->setup[0] & USB_ENDPOINT_IN;
+	int status;
+
+	if(!in)
+		memcpy(buffer, p->data, size);
+	status = lw_control_msg(&dev->lw->stats, dev->lw->handle, p->setup[0], p->setup[1],
+		p->setup[2] | (p->setup[3] << 8), p->setup[4] | (p->setup[5] << 8), (char*)buffer, size, USB_TIMEOUT);
+	sendFrame(p->client, LWD_CONTROL | LWD_REPLY, p->tag, status, buffer, (in && status > 0) ? status : 0);
+}
+
+/* Runs count mergeable requests as one batch, returns how many it took */
+static int runMerged(lwdDevice* dev, lwdPending** run, int count)
+{
+	lwBatch batch;
+	int offset[MAX_MERGE];
+	int length[MAX_MERGE];
+	int i, n, check;
+
+	lw_batch_begin(&batch);
+	for(n=0;n<count;n++)
+	{
+		length[n] = mergedReplyLength(run[n]->setup);
+		offset[n] = lw_batch_add(&batch, run[n]->setup[1], run[n]->setup[2] | (run[n]->setup[3] << 8),
+			run[n]->setup[4] | (run[n]->setup[5] << 8), length[n]);
+		if(offset[n] < 0)
+			break;
+	}
+	// The version last: a device too busy to run the batch sends no replies
+	check = lw_batch_add(&batch, 34, 0, 0, 1);
+	while(check < 0 && n > 1)
+	{
+		n--;
+		lw_batch_begin(&batch);
+		for(i=0;i<n;i++)
+			offset[i] = lw_batch_add(&batch, run[i]->setup[1], run[i]->setup[2] | (run[i]->setup[3] << 8),
+				run[i]->setup[4] | (run[i]->setup[5] << 8), length[i]);
+		check = lw_batch_add(&batch, 34, 0, 0, 1);
+	}
+
+	if(check < 0 || lw_batch_submit(dev->lw, &batch) != batch.resultLength || !batch.results[check])
+	{
+		runOne(dev, run[0]);
+		return 1;
+	}
+	if(verbose)
+		printf("lwd: device %d, %d requests in one batch\n", dev->serialNumber, n);
+	for(i=0;i<n;i++)
+		sendFrame(run[i]->client, LWD_CONTROL | LWD_REPLY, run[i]->tag, length[i], batch.results + offset[i], length[i]);
+	return n;
+}
+
+/* A request read in this pass for device d that has not run yet */
+static int isPending(int i, int d)
+{
+	int c = pending[i].client;
+
+	return (c >= 0) && (clients[c].fd >= 0) && (clients[c].device == d);
+}
+
+/* Runs the requests read in this pass, device by device, each in order */
+static void runPending()
+{
+	lwdPending* run[MAX_MERGE];
+	int d, i, j, n, count;
+
+	for(d=0;d<deviceCount;d++)
+	{
+		for(i=0;i<pendingCount;i++)
+		{
+			if(!isPending(i, d))
+				continue;
+			// Gather this request and the mergeable ones that follow for the device
+			count = 0;
+			for(j=i;j<pendingCount && count<MAX_MERGE;j++)
+			{
+				if(!isPending(j, d))
+					continue;
+				if(mergedReplyLength(pending[j].setup) < 0)
+					break;
+				run[count++] = &pending[j];
+			}
+			if(count >= 2)
+			{
+				n = runMerged(&devices[d], run, count);
+				for(j=0;j<n;j++)
+					run[j]->client = -1;
+			}
+			else
+			{
+				runOne(&devices[d], &pending[i]);
+				pending[i].client = -1;
+			}
+		}
+	}
+	pendingCount = 0;
+}
+
+/* Handles a complete frame of a client */
+static void handleFrame(int c, const unsigned char* frame, int length)
+{
+	int type = frame[0];
+	int tag = frame[2] | (frame[3] << 8);
+	const unsigned char* payload = frame + LWD_HEADER_SIZE;
+	lwdPending* p;
+	int serialNumber, size, d;
+
+	switch(type)
+	{
+		case LWD_OPEN:
+			if(length < 4 || clients[c].device >= 0)
+			{
+				sendFrame(c, type | LWD_REPLY, tag, -EINVAL, NULL, 0);
+				return;
+			}
+			serialNumber = payload[0] | (payload[1] << 8) | (payload[2] << 16) | (payload[3] << 24);
+			d = findDevice(serialNumber);
+			if(d < 0)
+			{
+				scanDevices();
+				d = findDevice(serialNumber);
+			}
+			if(verbose)
+				printf("lwd: client %d opens device %d: %s\n", c, serialNumber, (d < 0) ? "not found" : "ok");
+			clients[c].device = d;
+			sendFrame(c, type | LWD_REPLY, tag, (d < 0) ? -ENODEV : 0, NULL, 0);
+			return;
+
+		case LWD_SUBSCRIBE:
+			if(clients[c].device < 0)
+			{
+				sendFrame(c, type | LWD_REPLY, tag, -ENODEV, NULL, 0);
+				return;
+			}
+			if(!clients[c].subscribed)
+			{
+				clients[c].subscribed = 1;
+				devices[clients[c].device].subscribers++;
+			}
+			sendFrame(c, type | LWD_REPLY, tag, 0, NULL, 0);
+			return;
+
+		case LWD_CONTROL:
+			if(clients[c].device < 0)
+			{
+				sendFrame(c, type | LWD_REPLY, tag, -ENODEV, NULL, 0);
+				return;
+			}
+			if(length < 8)
+				break;
+			size = payload[6] | (payload[7] << 8);
+			if(size > LWD_MAX_DATA || (!(payload[0] & USB_ENDPOINT_IN) && length < 8 + size))
+				break;
+			if(pendingCount == MAX_PENDING)
+				runPending();
+			p = &pending[pendingCount++];
+			p->client = c;
+			p->tag = tag;
+			memcpy(p->setup, payload, 8);
+			if(!(payload[0] & USB_ENDPOINT_IN))
+				memcpy(p->data, payload + 8, size);
+			return;
+	}
+	sendFrame(c, type | LWD_REPLY, tag, -EINVAL, NULL, 0);
+}
+
+/* Reads what a client has sent and handles the complete frames */
+static void readClient(int c)
+{
+	lwdClient* client = &clients[c];
+	int n, length, used;
+
+	n = recv(client->fd, client->in + client->have, sizeof(client->in) - client->have, 0);
+	if(n <= 0)
+	{
+		if(n < 0 && errno == EINTR)
+			return;
+		dropClient(c);
+		return;
+	}
+	client->have += n;
+
+	used = 0;
+	while(client->have - used >= LWD_HEADER_SIZE)
+	{
+		length = client->in[used+4] | (client->in[used+5] << 8);
+		if(length > 8 + LWD_MAX_DATA)
+		{
+			dropClient(c);
+			return;
+		}
+		if(client->have - used < LWD_HEADER_SIZE + length)
+			break;
+		handleFrame(c, client->in + used, length);
+		if(client->fd < 0)
+			return;
+		used += LWD_HEADER_SIZE + length;
+	}
+	memmove(client->in, client->in + used, client->have - used);
+	client->have -= used;
+}
+
+/* Reads the interrupt endpoint of the devices someone listens to */
+static void pollEvents()
+{
+	unsigned char report[8];
+	int d, c;
+
+	for(d=0;d<deviceCount;d++)
+	{
+		if(!devices[d].subscribers)
+			continue;
+		if(usb_interrupt_read(devices[d].lw->handle, USB_ENDPOINT_IN | 1, (char*)report, 8, 1) != 8)
+			continue;
+		for(c=0;c<MAX_CLIENTS;c++)
+		{
+			if(clients[c].fd >= 0 && clients[c].subscribed && clients[c].device == d)
+				sendFrame(c, LWD_EVENT, 0, 0, report, 8);
+		}
+	}
+}
+
+/* Takes a new connection on a listening socket */
+static void acceptClient(int listener)
+{
+	int fd, c, yes = 1;
+
+	fd = accept(listener, NULL, NULL);
+	if(fd < 0)
+		return;
+	for(c=0;c<MAX_CLIENTS && clients[c].fd>=0;c++);
+	if(c == MAX_CLIENTS)
+	{
+		close(fd);
+		return;
+	}
+	// Replies are small and pipelined clients wait for them, send them at once
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&yes, sizeof(yes));
+	clients[c].fd = fd;
+	clients[c].device = -1;
+	clients[c].subscribed = 0;
+	clients[c].have = 0;
+	if(verbose)
+		printf("lwd: client %d connected\n", c);
+}
+
+/* Listens for TCP clients on port, on the loopback or the given address */
+static int listenTcp(const char* bindAddress, int port)
+{
+	struct sockaddr_in address;
+	int listener, yes = 1;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bindAddress && inet_pton(AF_INET, bindAddress, &address.sin_addr) != 1)
+		return -1;
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if(listener < 0)
+		return -1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (char*)&yes, sizeof(yes));
+	if(bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 8) < 0)
+	{
+		close(listener);
+		return -1;
+	}
+	return listener;
+}
+
+int main(int argc, char** argv)
+{
+	struct sockaddr_un address;
+	struct pollfd fds[MAX_CLIENTS + 2];
+	int slot[MAX_CLIENTS + 2];
+	const char* path = getenv("LWD_SOCKET");
+	const char* bindAddress = NULL;
+	int listener, tcpListener = -1, port = 0;
+	int listening, count, first, i, c;
+
+	for(i=1;i<argc;i++)
+	{
+		if(strcmp(argv[i], "-d") == 0)
+			debug = 1;
+		else if(strcmp(argv[i], "-v") == 0)
+			verbose = 1;
+		else if((strcmp(argv[i], "-s") == 0) && (i+1 < argc))
+			path = argv[++i];
+		else if((strcmp(argv[i], "-p") == 0) && (i+1 < argc))
+			port = atoi(argv[++i]);
+		else if((strcmp(argv[i], "-b") == 0) && (i+1 < argc))
+			bindAddress = argv[++i];
+		else
+		{
+			usage();
+			exit(1);
+		}
+	}
+	if(path == NULL)
+		path = LWD_SOCKET;
+	if(strlen(path) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "lwd: socket path too long\n");
+		exit(1);
+	}
+
+	openlog("lwd", LOG_PID, LOG_USER);
+	scanDevices();
+	if(verbose)
+		printf("lwd: %d devices\n", deviceCount);
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	unlink(path);
+	if(listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 8) < 0)
+	{
+		perror("lwd: could not listen");
+		exit(1);
+	}
+	syslog(LOG_INFO, "Listening on %s with %d devices\n", path, deviceCount);
+	if(port)
+	{
+		tcpListener = listenTcp(bindAddress, port);
+		if(tcpListener < 0)
+		{
+			perror("lwd: could not listen on the TCP port");
+			exit(1);
+		}
+		syslog(LOG_INFO, "Listening on TCP port %d of %s\n", port, bindAddress ? bindAddress : "127.0.0.1");
+	}
+
+	if(!debug)
+	{
+		verbose = 0;	// no point writing to a closed stdout
+		background();
+	}
+
+	for(c=0;c<MAX_CLIENTS;c++)
+		clients[c].fd = -1;
+
+	while(1)
+	{
+		count = 0;
+		fds[count].fd = listener;
+		fds[count].events = POLLIN;
+		slot[count++] = -1;
+		if(tcpListener >= 0)
+		{
+			fds[count].fd = tcpListener;
+			fds[count].events = POLLIN;
+			slot[count++] = -1;
+		}
+		first = count;
+		listening = 0;
+		for(c=0;c<MAX_CLIENTS;c++)
+		{
+			if(clients[c].fd < 0)
+				continue;
+			fds[count].fd = clients[c].fd;
+			fds[count].events = POLLIN;
+			slot[count++] = c;
+			if(clients[c].subscribed)
+				listening = 1;
+		}
+
+		if(poll(fds, count, listening ? EVENT_POLL : -1) < 0 && errno != EINTR)
+		{
+			perror("lwd: poll");
+			exit(1);
+		}
+
+		for(i=0;i<first;i++)
+		{
+			if(fds[i].revents & POLLIN)
+				acceptClient(fds[i].fd);
+		}
+		for(i=first;i<count;i++)
+		{
+			if((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && clients[slot[i]].fd >= 0)
+				readClient(slot[i]);
+		}
+
+		runPending();
+		if(listening)
+			pollEvents();
+	}
+	return 0;
+}
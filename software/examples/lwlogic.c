@@ -0,0 +1,240 @@
+/*
+	Captures the four free pins of a Little Wire as a simple logic analyzer.
+
+	PIN4, PIN1, PIN2 and PIN3 (PB0, PB1, PB2 and PB5) are channels 0-3. The
+	device waits for the trigger, fills its 128 byte buffer and the capture
+	is written as a VCD file, which GTKWave and PulseView open directly, or
+	as sigrok binary logic data, one byte per sample:
+
+		sigrok-cli -I binary:numchannels=4:samplerate=<rate> -i capture.bin ...
+
+	Usage: lwlogic [-s serialNumber] [-r rate] [-c] [-t pattern] [-e] [-d depth] [-w seconds] [-b] [file]
+		-s	connect to the device with this serial number
+		-r	samples per second, 100000 by default, up to 250000
+		-c	record changes with their time instead of every sample, up to
+			63 changes over as many as 4095 samples each
+		-t	trigger, one character per channel from channel 0: 0, 1 or x
+			for don't care, e.g. x0xx waits for PIN1 low. Starts at once
+			if not given
+		-e	wait for the trigger pattern to be entered, not just present
+		-d	bytes to capture, 128 by default: two samples per byte, or
+			one change per two bytes with -c
+		-w	seconds to wait for the trigger, 10 by default
+		-b	write sigrok binary instead of VCD
+		file	output, standard output by default
+
+	The pins are only read, set them up beforehand if they need pullups.
+	Rates above 4028 per second are sampled with interrupts off: once the
+	trigger is seen the device does not answer on USB for up to 5 ms, so
+	other programs using it see failed requests, and the capture stops at
+	5 ms with fewer bytes if it has not filled the depth by then. Slower
+	rates are sampled from a timer interrupt and USB is served as usual.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "littleWire.h"
+#include "littleWire_util.h"
+
+#define DEFAULT_RATE	100000
+#define DEFAULT_WAIT	10
+#define CHANNELS	4
+
+static const char* channelNames[CHANNELS] = {"PB0", "PB1", "PB2", "PB5"};
+
+/* A change of the channels, at a tick of the sample clock */
+typedef struct logicChange
+{
+	unsigned long tick;
+	unsigned char channels;
+} logicChange;
+
+static logicChange changes[LOGIC_CAPTURE_SIZE*2];
+
+/* Turns a capture into the list of changes, the first entry at tick 0 holds the
+   channels at the trigger. Returns the number of changes, *end gets the tick of
+   the last sample. */
+static int decode(unsigned char* buffer, int length, int edges, unsigned long* end)
+{
+	unsigned long tick = 0;
+	unsigned char channels;
+	int count = 0;
+	int i;
+
+	for(i=0;i<(edges ? length/2 : length*2);i++)
+	{
+		if(edges)
+		{
+			tick += ((buffer[2*i] & 0xF0) << 4) | buffer[2*i+1];
+			channels = buffer[2*i] & 0x0F;
+		}
+		else
+		{
+			tick = i;
+			channels = (buffer[i/2] >> ((i & 1) ? 4 : 0)) & 0x0F;
+		}
+		if(!count || channels != changes[count-1].channels)
+		{
+			changes[count].tick = tick;
+			changes[count].channels = channels;
+			count++;
+		}
+	}
+	*end = tick;
+	return count;
+}
+
+static void writeVcd(FILE* file, int count, unsigned long end, unsigned long rate)
+{
+	int i, c;
+
+	fprintf(file, "$version lwlogic $end\n$timescale 1 ns $end\n$scope module littlewire $end\n");
+	for(c=0;c<CHANNELS;c++)
+		fprintf(file, "$var wire 1 %c %s $end\n", '!'+c, channelNames[c]);
+	fprintf(file, "$upscope $end\n$enddefinitions $end\n");
+
+	for(i=0;i<count;i++)
+	{
+		fprintf(file, "#%llu\n", (unsigned long long)changes[i].tick * 1000000000ULL / rate);
+		if(!i)
+			fprintf(file, "$dumpvars\n");
+		for(c=0;c<CHANNELS;c++)
+		{
+			if(!i || ((changes[i].channels ^ changes[i-1].channels) & (1 << c)))
+				fprintf(file, "%d%c\n", (changes[i].channels >> c) & 1, '!'+c);
+		}
+		if(!i)
+			fprintf(file, "$end\n");
+	}
+	fprintf(file, "#%llu\n", (unsigned long long)(end+1) * 1000000000ULL / rate);
+}
+
+static void writeBinary(FILE* file, int count, unsigned long end)
+{
+	unsigned long tick;
+	int i = 0;
+
+	for(tick=0;tick<=end;tick++)
+	{
+		while((i+1 < count) && (changes[i+1].tick <= tick))
+			i++;
+		fputc(changes[i].channels, file);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	littleWire* lw = NULL;
+	FILE* file = stdout;
+	unsigned char buffer[LOGIC_CAPTURE_SIZE];
+	unsigned long rate = DEFAULT_RATE;
+	unsigned long end;
+	unsigned char mode = LOGIC_SAMPLES;
+	unsigned char triggerMask = 0;
+	unsigned char triggerValue = 0;
+	int serialNumber = -1;
+	int depth = LOGIC_CAPTURE_SIZE;
+	int wait = DEFAULT_WAIT;
+	int binary = 0;
+	int length, count, waited, i, c;
+
+	for(i=1;i<argc && argv[i][0]=='-';i++)
+	{
+		if((strcmp(argv[i], "-s") == 0) && (i+1 < argc))
+			serialNumber = atoi(argv[++i]);
+		else if((strcmp(argv[i], "-r") == 0) && (i+1 < argc))
+			rate = strtoul(argv[++i], NULL, 0);
+		else if(strcmp(argv[i], "-c") == 0)
+			mode = (mode & ~LOGIC_SAMPLES) | LOGIC_EDGES;
+		else if((strcmp(argv[i], "-t") == 0) && (i+1 < argc) && (strlen(argv[i+1]) == CHANNELS))
+		{
+			i++;
+			for(c=0;c<CHANNELS;c++)
+			{
+				if(argv[i][c] == '0' || argv[i][c] == '1')
+					triggerMask |= 1 << c;
+				if(argv[i][c] == '1')
+					triggerValue |= 1 << c;
+			}
+		}
+		else if(strcmp(argv[i], "-e") == 0)
+			mode |= LOGIC_EDGE_TRIGGER;
+		else if((strcmp(argv[i], "-d") == 0) && (i+1 < argc))
+			depth = atoi(argv[++i]);
+		else if((strcmp(argv[i], "-w") == 0) && (i+1 < argc))
+			wait = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-b") == 0)
+			binary = 1;
+		else
+			break;
+	}
+	if((i < argc-1) || ((i == argc-1) && (argv[i][0] == '-')))
+	{
+		fprintf(stderr, "Usage: %s [-s serialNumber] [-r rate] [-c] [-t pattern] [-e] [-d depth] [-w seconds] [-b] [file]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if(depth < 2 || depth > LOGIC_CAPTURE_SIZE)
+		depth = LOGIC_CAPTURE_SIZE;
+	rate = logic_sampleRate(rate);
+
+	if(serialNumber >= 0)
+		lw = littlewire_connect_bySerialNum(serialNumber);
+	else
+		lw = littleWire_connect();
+
+	if(lw == NULL)
+	{
+		fprintf(stderr, "> Little Wire could not be found!\n");
+		exit(EXIT_FAILURE);
+	}
+	if(!lw_hasCapability(lw, LW_CAP_LOGIC))
+	{
+		fprintf(stderr, "> Firmware %d.%d has no logic capture.\n", (lw->firmwareVersion & 0xF0) >> 4, lw->firmwareVersion & 0x0F);
+		exit(EXIT_FAILURE);
+	}
+
+	if(logic_captureStart(lw, mode, rate, triggerMask, triggerValue, depth) < 0)
+	{
+		fprintf(stderr, "> Could not start the capture: %s\n", lw_errorName(lw));
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "> Capturing at %lu samples per second...\n", rate);
+
+	// Requests fail for up to 5 ms while a fast capture runs with interrupts off, keep asking
+	for(waited=0;;waited+=10)
+	{
+		length = logic_captureRead(lw, buffer);
+		if(length > 0)
+			break;
+		if(waited >= wait*1000)
+		{
+			logic_captureStop(lw);
+			fprintf(stderr, "> No trigger within %d seconds.\n", wait);
+			exit(EXIT_FAILURE);
+		}
+		delay(10);
+	}
+
+	if(i < argc)
+	{
+		file = fopen(argv[i], binary ? "wb" : "w");
+		if(file == NULL)
+		{
+			fprintf(stderr, "> Could not create %s\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	count = decode(buffer, length, mode & LOGIC_EDGES, &end);
+	if(binary)
+		writeBinary(file, count, end);
+	else
+		writeVcd(file, count, end, rate);
+	if(file != stdout)
+		fclose(file);
+
+	fprintf(stderr, "> %lu samples, %d changes, %lu us.\n", end+1, count-1, (unsigned long)((end+1) * 1000000ULL / rate));
+	littleWire_disconnect(lw);
+	return 0;
+}
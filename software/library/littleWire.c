@@ -28,20 +28,34 @@
 /******************************************************************************
 * See the littleWire.h for the function descriptions/comments
 ******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include "littleWire.h"
 
+#ifdef LINUX
+	#include <time.h>
+#endif
+#ifndef ETIMEDOUT
+	#define ETIMEDOUT 116
+#endif
+
 // external variables
-lwCollection lwResults[16];
+lwCollection* lwResults;
 int lw_totalDevices;
+
+// device registry behind lwResults, see littlewire_search
+static int lwResultsSize;               // entries allocated for lwResults
+static int* lwSerialTable;              // lwResults index + 1 by serial number hash, 0 for a free slot
+static unsigned int lwSerialTableSize;  // power of two, at least twice lw_totalDevices
+static lwRegistryCallback lwRegistryNotify;
+static void* lwRegistryUserData;
+
+// copies of the state of the last used device, for the single device API
 unsigned char rxBuffer[RX_BUFFER_SIZE]; /* This has to be unsigned for the data's sake */
 unsigned char ROM_NO[8];
 int lwStatus;
 
-unsigned char	crc8;
-int		LastDiscrepancy;
-int 	LastFamilyDiscrepancy;
-int 	LastDeviceFlag;
-
 /******************************************************************************
 * Taken from: http://www.maxim-ic.com/appnotes.cfm/appnote_number/187
 ******************************************************************************/
@@ -64,103 +78,493 @@ static unsigned char dscrc_table[] = {
       116, 42,200,150, 21, 75,169,247,182,232, 10, 84,215,137,107, 53};
 /*****************************************************************************/
 
+/******************************************************************************
+* Transfer counters and hook
+******************************************************************************/
+static lwTransferHook lwHook;
+static void* lwHookUserData;
+
+static unsigned long lwMicros()
+{
+#ifdef LINUX
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+#else
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (unsigned long)(count.QuadPart * 1000000 / frequency.QuadPart);
+#endif
+}
+
+void lw_setTransferHook(lwTransferHook hook, void* userData)
+{
+	lwHook = hook;
+	lwHookUserData = userData;
+}
+
+void lw_stats_reset(lwStats* stats)
+{
+	memset(stats, 0, sizeof(lwStats));
+}
+
+unsigned long lw_micros()
+{
+	return lwMicros();
+}
+
+void lw_stats_count(lwStats* stats, int requestType, int status, unsigned long micros)
+{
+	int bucket;
+
+	stats->transfers++;
+	if(status < 0)
+	{
+		stats->errors++;
+		if((status == -ETIMEDOUT) || (status == -116)) // -116 is the libusb-win32 timeout
+			stats->timeouts++;
+	}
+	else if(requestType & USB_ENDPOINT_IN)
+		stats->bytesIn += status;
+	else
+		stats->bytesOut += status;
+	stats->totalMicros += micros;
+	if(micros > stats->maxMicros)
+		stats->maxMicros = micros;
+	for(bucket=0;(bucket<LW_LATENCY_BUCKETS-1) && (micros >= (64UL << bucket));bucket++);
+	stats->latency[bucket]++;
+}
+
+int lw_control_msg(lwStats* stats, usb_dev_handle* handle, int requestType, int request, int value, int index, char* bytes, int size, int timeout)
+{
+	unsigned long took = lwMicros();
+	int status;
+
+	status = usb_control_msg(handle, requestType, request, value, index, bytes, size, timeout);
+	took = lwMicros() - took;
+
+	if(stats)
+		lw_stats_count(stats, requestType, status, took);
+	if(lwHook)
+		lwHook(stats, request, requestType, status, took, lwHookUserData);
+	return status;
+}
+
+/******************************************************************************
+* A transfer of a remote device, counted like the local ones.
+******************************************************************************/
+static int lwRemoteTransfer(littleWire* lwHandle, int requestType, int request, int value, int index, char* bytes, int size, int timeout)
+{
+	unsigned long took = lwMicros();
+	int status;
+
+	status = lwHandle->remote->transfer(lwHandle, requestType, request, value, index, bytes, size, timeout);
+	took = lwMicros() - took;
+
+	lw_stats_count(&lwHandle->stats, requestType, status, took);
+	if(lwHook)
+		lwHook(&lwHandle->stats, request, requestType, status, took, lwHookUserData);
+	return status;
+}
+
+/******************************************************************************
+* All transfers go through here so that the status is kept in the handle.
+******************************************************************************/
+static int lwTransfer(littleWire* lwHandle, int requestType, unsigned char request, int value, int index, char* buffer, int length)
+{
+	if(lwHandle->remote)
+		lwHandle->status = lwRemoteTransfer(lwHandle, requestType, request, value, index, buffer, length, USB_TIMEOUT);
+	else
+		lwHandle->status = lw_control_msg(&lwHandle->stats, lwHandle->handle, requestType, request, value, index, buffer, length, USB_TIMEOUT);
+	lwStatus = lwHandle->status;
+	return lwHandle->status;
+}
+
+static int lwSend(littleWire* lwHandle, unsigned char request, int value, int index)
+{
+	lwTransfer(lwHandle, 0xC0, request, value, index, (char*)lwHandle->rxBuffer, 8);
+	memcpy(rxBuffer, lwHandle->rxBuffer, 8);
+	return lwHandle->status;
+}
+
+/******************************************************************************
+* Firmware v1.4 returns the result of a job in reply to the request that
+* starts it. Older firmware needs some time to run the job and a request 40
+* to collect the result.
+******************************************************************************/
+static int lwJob(littleWire* lwHandle, unsigned char request, int value, int index, unsigned int waitTime)
+{
+	if((lwSend(lwHandle, request, value, index) < 0) || (lwHandle->firmwareVersion >= 0x14))
+		return lwHandle->status;
+
+	if(waitTime)
+		delay(waitTime);
+	return lwSend(lwHandle, 40, 0, 0);
+}
+
+/******************************************************************************
+* Collects the result of a job run from dwBuf. The device answers with no
+* data until the job has finished, so poll straight away a couple of times,
+* which is enough for short jobs, then once a milisecond up to LW_JOB_TIMEOUT.
+******************************************************************************/
+static int lwCollect(littleWire* lwHandle, unsigned char request, unsigned char* buffer, int length)
+{
+	unsigned long start = lwMicros();
+	int i;
+
+	for(i=0;;i++)
+	{
+		if(lwTransfer(lwHandle, 0xC0, request, 0, 0, (char*)buffer, length) != 0)
+			break;
+		if(lwMicros() - start > LW_JOB_TIMEOUT * 1000UL)
+			break;
+		lwHandle->stats.retries++;
+		if(i >= 2)
+			delay(1);
+	}
+	return lwHandle->status;
+}
+
+int lw_waitIdle(littleWire* lwHandle, unsigned int timeout)
+{
+	unsigned char reply[4];
+	unsigned long start = lwMicros();
+	int i;
+
+	if(lwHandle->firmwareVersion < 0x14)
+	{
+		delay(timeout); // no job status, wait for the worst case
+		return 0;
+	}
+
+	for(i=0;;i++)
+	{
+		// A failed request is not an error here, the device may be running
+		// a job with its interrupts off.
+		if((lwTransfer(lwHandle, 0xC0, 74, 0, 0, (char*)reply, 4) == 4) && !reply[0] && !(reply[1] & 0xBF))
+			return 0;
+		if(lwMicros() - start > timeout * 1000UL)
+			return (lwHandle->status < 0) ? lwHandle->status : 1;
+		lwHandle->stats.retries++;
+		if(i >= 2)
+			delay(1);
+	}
+}
+
+static littleWire* lwOpen(usb_dev_handle* handle)
+{
+	littleWire* lwHandle;
+
+	if(handle == NULL)
+		return NULL;
+
+	lwHandle = calloc(1, sizeof(littleWire));
+	if(lwHandle == NULL)
+	{
+		usb_close(handle);
+		return NULL;
+	}
+	lwHandle->handle = handle;
+	readFirmwareVersion(lwHandle);
+	return lwHandle;
+}
+
+/******************************************************************************
+* Device registry. lwResults keeps the devices found by earlier searches with
+* their bus path, so a search only opens the devices plugged in since, and a
+* hash table on the serial numbers makes connecting by serial number a lookup.
+******************************************************************************/
+static unsigned int lwSerialHash(int serialNumber)
+{
+	return ((unsigned int)serialNumber * 2654435761u) & (lwSerialTableSize - 1);
+}
+
+static void lwSerialTableBuild()
+{
+	unsigned int size = 16;
+	unsigned int slot;
+	int i;
+
+	while(size < 2 * (unsigned int)lw_totalDevices)
+		size *= 2;
+	if(size != lwSerialTableSize)
+	{
+		free(lwSerialTable);
+		lwSerialTable = malloc(size * sizeof(int));
+		lwSerialTableSize = lwSerialTable ? size : 0;
+		if(lwSerialTable == NULL)
+			return;
+	}
+	memset(lwSerialTable, 0, size * sizeof(int));
+
+	// a later device with the same serial number takes the slot over
+	for(i=0;i<lw_totalDevices;i++)
+	{
+		for(slot = lwSerialHash(lwResults[i].serialNumber); lwSerialTable[slot]; slot = (slot + 1) & (size - 1))
+		{
+			if(lwResults[lwSerialTable[slot]-1].serialNumber == lwResults[i].serialNumber)
+				break;
+		}
+		lwSerialTable[slot] = i + 1;
+	}
+}
+
+int lw_registry_find(int serialNumber)
+{
+	unsigned int slot;
+
+	if(lwSerialTable == NULL)
+		return -1;
+	for(slot = lwSerialHash(serialNumber); lwSerialTable[slot]; slot = (slot + 1) & (lwSerialTableSize - 1))
+	{
+		if(lwResults[lwSerialTable[slot]-1].serialNumber == serialNumber)
+			return lwSerialTable[slot] - 1;
+	}
+	return -1;
+}
+
+void lw_registry_onChange(lwRegistryCallback callback, void* userData)
+{
+	lwRegistryNotify = callback;
+	lwRegistryUserData = userData;
+}
+
+static int lwReadSerial(struct usb_device *dev)
+{
+	usb_dev_handle *udev;
+	char string[256];
+	int ret = -1;
+
+	if(!dev->descriptor.iSerialNumber)
+		return -1;
+
+	udev = usb_open(dev);
+	if(udev)
+	{
+		ret = usb_get_string_simple(udev, dev->descriptor.iSerialNumber, string, sizeof(string));
+		usb_close(udev);
+	}
+	if(ret <= 0)
+	{
+		printf("Connection error! Try creating a udev rule or running with sudo.\n");
+		return -1;
+	}
+	string[ret < (int)sizeof(string) ? ret : (int)sizeof(string)-1] = 0;
+	return atoi(string);
+}
+
+/* Matches lwResults against the device list of libusb, which must be up to date.
+   The usb_device pointers of devices that have gone are never used. */
+static int lwRegistryScan()
+{
+	struct usb_bus *bus;
+	struct usb_device *dev;
+	lwCollection* entry;
+	lwCollection gone;
+	char path[LW_PATH_SIZE];
+	int i, n, serialNumber;
+
+	for(i=0;i<lw_totalDevices;i++)
+		lwResults[i].lw_device = NULL;
+
+	for (bus = usb_busses; bus; bus = bus->next)
+	{
+		for (dev = bus->devices; dev; dev = dev->next)
+		{
+			if((dev->descriptor.idVendor != VENDOR_ID) || (dev->descriptor.idProduct != PRODUCT_ID))
+				continue;
+
+			snprintf(path, sizeof(path), "%s/%s", bus->dirname, dev->filename);
+			for(i=0;i<lw_totalDevices;i++)
+			{
+				if(strcmp(lwResults[i].path, path) == 0)
+					break;
+			}
+			if(i < lw_totalDevices)
+			{
+				lwResults[i].lw_device = dev;
+				continue;
+			}
+
+			serialNumber = lwReadSerial(dev);
+			if(serialNumber < 0)
+				continue;
+
+			if(lw_totalDevices == lwResultsSize)
+			{
+				n = lwResultsSize ? 2 * lwResultsSize : 16;
+				entry = realloc(lwResults, n * sizeof(lwCollection));
+				if(entry == NULL)
+					break;
+				lwResults = entry;
+				lwResultsSize = n;
+			}
+			entry = &lwResults[lw_totalDevices++];
+			entry->lw_device = dev;
+			entry->serialNumber = serialNumber;
+			strcpy(entry->path, path);
+			if(lwRegistryNotify)
+				lwRegistryNotify(entry, 1, lwRegistryUserData);
+		}
+	}
+
+	for(i=n=0;i<lw_totalDevices;i++)
+	{
+		if(lwResults[i].lw_device == NULL)
+		{
+			gone = lwResults[i];
+			if(lwRegistryNotify)
+				lwRegistryNotify(&gone, 0, lwRegistryUserData);
+			continue;
+		}
+		if(n != i)
+			lwResults[n] = lwResults[i];
+		n++;
+	}
+	lw_totalDevices = n;
+	lwSerialTableBuild();
+
+	return lw_totalDevices;
+}
+
 int littlewire_search()
 {
-  struct usb_bus *bus;
-  struct usb_device *dev;
+  static int initialised = 0;
 
-  usb_init();
+  if(!initialised)
+  {
+    usb_init();
+    initialised = 1;
+  }
   usb_find_busses();
   usb_find_devices();
 
-  lw_totalDevices = 0;
+  return lwRegistryScan();
+}
 
-  for (bus = usb_busses; bus; bus = bus->next)
+littleWire* littlewire_connect_byID(int desiredID)
+{
+  if((desiredID < 0) || (desiredID > (lw_totalDevices-1)))
   {
-    for (dev = bus->devices; dev; dev = dev->next)
-    {
-      usb_dev_handle *udev;
-      char string[256];
-      int  ret;
-
-      if((dev->descriptor.idVendor == VENDOR_ID) && (dev->descriptor.idProduct == PRODUCT_ID))
-      {
-        udev = usb_open(dev);
-        if (udev)
-        {
-          if (dev->descriptor.iSerialNumber)
-          {
-            ret = usb_get_string_simple(udev, dev->descriptor.iSerialNumber, string, sizeof(string));
-            if (ret > 0)
-            {
-              lwResults[lw_totalDevices].serialNumber = atoi(string);
-              lwResults[lw_totalDevices].lw_device = dev;
-              lw_totalDevices++;
-            } else {
-              printf("Connection error! Try creating a udev rule or running with sudo.\n");
-            }
-          }
-          usb_close(udev);
-        }
-      }
-    }
+    return NULL;
   }
 
-  return lw_totalDevices;
+  return lwOpen(usb_open(lwResults[desiredID].lw_device));
 }
 
-littleWire* littlewire_connect_byID(int desiredID)
+littleWire* littlewire_connect_bySerialNum(int mySerial)
 {
-  littleWire  *tempHandle = NULL;
+  littleWire  *tempHandle;
 
-  if(desiredID > (lw_totalDevices-1))
+  tempHandle = littlewire_connect_byID(lw_registry_find(mySerial));
+  if(tempHandle == NULL)
   {
-    return tempHandle;
+    // not seen yet, or unplugged since
+    littlewire_search();
+    tempHandle = littlewire_connect_byID(lw_registry_find(mySerial));
   }
+  return tempHandle;
+}
 
-  tempHandle = usb_open(lwResults[desiredID].lw_device);
+littleWire* littlewire_connect_byPath(const char* path)
+{
+	usb_dev_handle  *tempHandle = NULL;
+	char devPath[LW_PATH_SIZE];
 
-  return tempHandle;
+	usb_init();
+	snprintf(devPath, sizeof(devPath), "%s", path);
+	usbOpenDevicePath(&tempHandle, VENDOR_ID, PRODUCT_ID, devPath, NULL);
+
+	return lwOpen(tempHandle);
 }
 
-littleWire* littlewire_connect_bySerialNum(int mySerial)
+littleWire* littlewire_connect_bySerialCached(int mySerial, char* cachedPath, int pathSize)
 {
-  littleWire  *tempHandle = NULL;
-  int temp_id = 0xDEAF;
-  int i;
+	usb_dev_handle  *tempHandle = NULL;
+	char serial[16];
 
-  for(i=0;i<lw_totalDevices;i++)
-  {
-    if(lwResults[i].serialNumber == mySerial)
-    {
-      temp_id = i;
-    }
-  }
+	usb_init();
+	snprintf(serial, sizeof(serial), "%d", mySerial);
+	usbOpenDeviceSerial(&tempHandle, VENDOR_ID, PRODUCT_ID, serial, cachedPath, pathSize, NULL);
 
-  tempHandle = littlewire_connect_byID(temp_id);
-  return tempHandle;
+	return lwOpen(tempHandle);
 }
 
 littleWire* littleWire_connect()
 {
-	littleWire  *tempHandle = NULL;
+	usb_dev_handle  *tempHandle = NULL;
 
 	usb_init();
 	usbOpenDevice(&tempHandle, VENDOR_ID, "*", PRODUCT_ID, "*", "*", NULL, NULL );
+	if(lw_totalDevices)
+		lwRegistryScan(); // usbOpenDevice has refreshed the device list of libusb
 
-	return tempHandle;
+	return lwOpen(tempHandle);
+}
+
+void littleWire_disconnect(littleWire* lwHandle)
+{
+	if(lwHandle == NULL)
+		return;
+	if(lwHandle->remote)
+		lwHandle->remote->close(lwHandle);
+	else
+		usb_close(lwHandle->handle);
+	free(lwHandle);
 }
 
 unsigned char readFirmwareVersion(littleWire* lwHandle)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 34, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	lwSend(lwHandle, 34, 0, 0);
+	if(lwHandle->status > 0)
+		lwHandle->firmwareVersion = lwHandle->rxBuffer[0];
+	if(lwHandle->status >= 5)
+		lwHandle->capabilities = lwHandle->rxBuffer[1]
+			| ((unsigned long)lwHandle->rxBuffer[2] << 8)
+			| ((unsigned long)lwHandle->rxBuffer[3] << 16)
+			| ((unsigned long)lwHandle->rxBuffer[4] << 24);
+	else if(lwHandle->status > 0)
+		lwHandle->capabilities = 0;
+
+	return lwHandle->rxBuffer[0];
+}
 
-	return rxBuffer[0];
+int lw_hasCapability(littleWire* lwHandle, unsigned long capability)
+{
+	return (lwHandle->capabilities & capability) == capability;
+}
+
+/******************************************************************************
+* Whether the firmware answers the requests behind a capability. Firmware
+* v1.4 had all of the first ones built in, before capabilities were reported.
+******************************************************************************/
+static int lwHasRequests(littleWire* lwHandle, unsigned long capability)
+{
+	return lw_hasCapability(lwHandle, capability) || (lwHandle->firmwareVersion == 0x14);
 }
 
 void changeSerialNumber(littleWire* lwHandle,int serialNumber)
 {
 	char serBuf[4];
+	unsigned long bcd = 0;
+	int shift;
+
+	// Firmware built with SERIAL_DIGITS=8 takes up to 8 digits as BCD, the rest exactly 3 as ASCII
+	if(lwHasRequests(lwHandle, LW_CAP_SERIAL) && ((serialNumber < 100) || (serialNumber > 999)))
+	{
+		if(serialNumber > LW_SERIAL_MAX)
+			serialNumber = LW_SERIAL_MAX;
+		else if(serialNumber < 0)
+			serialNumber = 0;
+		for(shift=0;shift<32;shift+=4)
+		{
+			bcd |= (unsigned long)(serialNumber % 10) << shift;
+			serialNumber /= 10;
+		}
+		lwSend(lwHandle, 73, bcd & 0xFFFF, bcd >> 16);
+		return;
+	}
 
 	if(serialNumber > 999)
 	{
@@ -173,68 +577,495 @@ void changeSerialNumber(littleWire* lwHandle,int serialNumber)
 
 	sprintf(serBuf,"%d",serialNumber);
 
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 55, (serBuf[1]<<8)|serBuf[0],serBuf[2], (char*)rxBuffer, 8, USB_TIMEOUT);
+	lwSend(lwHandle, 55, (serBuf[1]<<8)|serBuf[0],serBuf[2]);
 }
 
 void digitalWrite(littleWire* lwHandle, unsigned char pin, unsigned char state)
 {
 	if(state){
-		lwStatus=usb_control_msg(lwHandle, 0xC0, 18, pin, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+		lwSend(lwHandle, 18, pin, 0);
 	} else{
-		lwStatus=usb_control_msg(lwHandle, 0xC0, 19, pin, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+		lwSend(lwHandle, 19, pin, 0);
 	}
 }
 
 void pinMode(littleWire* lwHandle, unsigned char pin, unsigned char mode)
 {
 	if(mode){
-		lwStatus=usb_control_msg(lwHandle, 0xC0, 13, pin, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+		lwSend(lwHandle, 13, pin, 0);
 	} else {
-		lwStatus=usb_control_msg(lwHandle, 0xC0, 14, pin, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+		lwSend(lwHandle, 14, pin, 0);
 	}
 }
 
 unsigned char digitalRead(littleWire* lwHandle, unsigned char pin)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 20, pin, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	lwSend(lwHandle, 20, pin, 0);
 
-	return rxBuffer[0];
+	return lwHandle->rxBuffer[0];
 }
 
 void internalPullup(littleWire* lwHandle, unsigned char pin, unsigned char state)
 {
 	if(state){
-		lwStatus=usb_control_msg(lwHandle, 0xC0, 18, pin, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+		lwSend(lwHandle, 18, pin, 0);
 	} else{
-		lwStatus=usb_control_msg(lwHandle, 0xC0, 19, pin, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+		lwSend(lwHandle, 19, pin, 0);
 	}
 }
 
+int portUpdate(littleWire* lwHandle, unsigned char ddrMask, unsigned char ddrValue, unsigned char portMask, unsigned char portValue)
+{
+	static const unsigned char pins[4] = {PIN4, PIN1, PIN2, PIN3};
+	unsigned char state = 0;
+	int i;
+
+	if(lwHasRequests(lwHandle, LW_CAP_PORT_UPDATE))
+	{
+		lwSend(lwHandle, 67, ddrMask | (ddrValue << 8), portMask | (portValue << 8));
+		if(lwHandle->status < 0)
+			return lwHandle->status;
+		return lwHandle->rxBuffer[0];
+	}
+
+	// One request per pin on older firmware and when PORT_UPDATE is not built, in the same order as the firmware does it
+	for(i=0;i<4;i++)
+		if((ddrMask & ~ddrValue) & (1<<pins[i]))
+			pinMode(lwHandle, pins[i], INPUT);
+	for(i=0;i<4;i++)
+		if(portMask & (1<<pins[i]))
+			digitalWrite(lwHandle, pins[i], (portValue >> pins[i]) & 1);
+	for(i=0;i<4;i++)
+		if((ddrMask & ddrValue) & (1<<pins[i]))
+			pinMode(lwHandle, pins[i], OUTPUT);
+	for(i=0;i<4;i++)
+		if(digitalRead(lwHandle, pins[i]))
+			state |= 1<<pins[i];
+	if(lwHandle->status < 0)
+		return lwHandle->status;
+	return state;
+}
+
+void digitalWritePort(littleWire* lwHandle, unsigned char mask, unsigned char value)
+{
+	portUpdate(lwHandle, 0, 0, mask, value);
+}
+
+void pinModePort(littleWire* lwHandle, unsigned char mask, unsigned char outputs)
+{
+	portUpdate(lwHandle, mask, outputs, 0, 0);
+}
+
+unsigned char digitalReadPort(littleWire* lwHandle)
+{
+	return portUpdate(lwHandle, 0, 0, 0, 0);
+}
+
+int pinEvents_enable(littleWire* lwHandle, unsigned char pinMask)
+{
+	unsigned char buffer[8];
+
+	lwHandle->pinEventTicks = 0;
+	if(lwTransfer(lwHandle, 0xC0, 66, pinMask, 0, (char*)buffer, 8) < 0)
+		return lwHandle->status;
+	return (lwHandle->status > 0) && buffer[0];
+}
+
+int pinEvents_read(littleWire* lwHandle, lwPinEvent* events, int timeout)
+{
+	unsigned char report[8];
+	unsigned long ticks;
+	int i, count = 0;
+
+	if(lwHandle->remote)
+		lwHandle->status = lwHandle->remote->interruptRead(lwHandle, (char*)report, 8, timeout);
+	else
+		lwHandle->status = usb_interrupt_read(lwHandle->handle, USB_ENDPOINT_IN | 1, (char*)report, 8, timeout);
+	lwStatus = lwHandle->status;
+	if(lwHandle->status < 0)
+		return lwHandle->status;
+
+	for(i=0;i+4<=lwHandle->status;i+=4)
+	{
+		if(!(report[i] & 0x80))
+			break;
+
+		// extend the 24 bit timestamp, it wraps about every 130 seconds
+		ticks = (lwHandle->pinEventTicks & ~0xFFFFFFUL) | report[i+1] | (report[i+2] << 8) | ((unsigned long)report[i+3] << 16);
+		if(ticks < lwHandle->pinEventTicks)
+			ticks += 0x1000000UL;
+		lwHandle->pinEventTicks = ticks;
+
+		events[count].pins = report[i] & 0x3F;
+		events[count].time = (unsigned long)(ticks * (128.0e6 / LITTLE_WIRE_F_CPU));
+		events[count].lost = (report[i] & 0x40) != 0;
+		count++;
+	}
+	return count;
+}
+
+int pinEvents_dispatch(littleWire* lwHandle, lwPinEventCallback callback, void* userData, int timeout)
+{
+	lwPinEvent events[PIN_EVENTS_PER_READ];
+	int i, count;
+
+	count = pinEvents_read(lwHandle, events, timeout);
+	for(i=0;i<count;i++)
+		callback(lwHandle, &events[i], userData);
+	return count;
+}
+
+int pattern_play(littleWire* lwHandle, unsigned char pinMask, unsigned char tick, unsigned char loops, lwPatternStep* steps, int count)
+{
+	unsigned char buffer[3 + PATTERN_MAX_STEPS*3];
+	int i;
+
+	if(count > PATTERN_MAX_STEPS)
+		count = PATTERN_MAX_STEPS;
+	buffer[0] = pinMask;
+	buffer[1] = tick;
+	buffer[2] = loops;
+	for(i=0;i<count;i++)
+	{
+		buffer[3+3*i] = steps[i].value;
+		buffer[4+3*i] = steps[i].ticks & 0xFF;
+		buffer[5+3*i] = steps[i].ticks >> 8;
+	}
+	return lwTransfer(lwHandle, 0x40, 68, 0, 0, (char*)buffer, 3 + count*3);
+}
+
+int pattern_status(littleWire* lwHandle, int* loopsLeft)
+{
+	lwTransfer(lwHandle, 0xC0, 68, 0, 0, (char*)lwHandle->rxBuffer, 8);
+	if(lwHandle->status < 0)
+		return lwHandle->status;
+	if(loopsLeft)
+		*loopsLeft = lwHandle->rxBuffer[1];
+	return lwHandle->rxBuffer[0];
+}
+
+int pattern_stop(littleWire* lwHandle)
+{
+	return lwTransfer(lwHandle, 0xC0, 68, 1, 0, (char*)lwHandle->rxBuffer, 8);
+}
+
 void analog_init(littleWire* lwHandle, unsigned char voltageRef)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 35, (voltageRef<<8) | 0x07, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	lwSend(lwHandle, 35, (voltageRef<<8) | 0x07, 0);
 }
 
 unsigned int analogRead(littleWire* lwHandle, unsigned char channel)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 15, channel, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	lwSend(lwHandle, 15, channel, 0);
 
-	return ((rxBuffer[1] *256) + (rxBuffer[0]));
+	return ((lwHandle->rxBuffer[1] *256) + (lwHandle->rxBuffer[0]));
+}
+
+/******************************************************************************
+* Timer1 clock select and top for a rate, as clockSelect | top << 8. Timer1
+* runs at F_CPU / 2^(clockSelect-1) and counts top+1 ticks per period.
+******************************************************************************/
+static unsigned int lwTimer1Setting(unsigned long rate)
+{
+	unsigned char clockSelect;
+	unsigned long top = 0;
+
+	for(clockSelect=1;clockSelect<15;clockSelect++)
+	{
+		top = ((LITTLE_WIRE_F_CPU >> (clockSelect-1)) + rate/2) / rate;
+		if(top <= 256)
+			break;
+	}
+	if(top > 256)
+		top = 256;
+	if(top < 1)
+		top = 1;
+	return clockSelect | ((top-1) << 8);
+}
+
+int analog_streamStart(littleWire* lwHandle, unsigned char channel, unsigned int sampleRate, unsigned char flags)
+{
+	unsigned int timer = 0;
+
+	if(sampleRate)
+		timer = lwTimer1Setting(sampleRate);
+	return lwTransfer(lwHandle, 0xC0, 64, channel | ((0x80 | (flags & ADC_STREAM_8BIT)) << 8), timer, NULL, 0);
+}
+
+int analog_streamRead(littleWire* lwHandle, unsigned int* samples, int maxSamples, int* dropped)
+{
+	unsigned char buffer[ADC_STREAM_READ_SIZE];
+	int i, count, length;
+
+	if(maxSamples > (ADC_STREAM_READ_SIZE-3)/2)
+		maxSamples = (ADC_STREAM_READ_SIZE-3)/2;
+	length = lwTransfer(lwHandle, 0xC0, 65, maxSamples, 0, (char*)buffer, 3 + maxSamples*2);
+	if(length < 0)
+		return length;
+	if(length < 3)
+		return 0;
+
+	count = buffer[0];
+	if(count > maxSamples)
+		count = maxSamples;
+	if(dropped)
+		*dropped = buffer[2];
+	for(i=0;i<count;i++)
+	{
+		if(buffer[1] & 4)
+			samples[i] = buffer[3+i];
+		else
+			samples[i] = buffer[3+2*i] | (buffer[4+2*i] << 8);
+	}
+	return count;
+}
+
+int analog_streamStop(littleWire* lwHandle)
+{
+	return lwTransfer(lwHandle, 0xC0, 64, 0, 0, NULL, 0);
+}
+
+int analog_scan(littleWire* lwHandle, unsigned char channels, unsigned char oversampling, unsigned int* results)
+{
+	unsigned char buffer[7];
+	unsigned long start, sum, timeout;
+	int channel, count = 0, status, i;
+
+	channels &= ADC_SCAN_PIN3 | ADC_SCAN_PIN2 | ADC_SCAN_TEMP_SENS;
+	if(oversampling > ADC_SCAN_MAX_OVERSAMPLING)
+		oversampling = ADC_SCAN_MAX_OVERSAMPLING;
+	if(!channels)
+		return 0;
+
+	if(!lw_hasCapability(lwHandle, LW_CAP_ADC_SCAN))
+	{
+		for(channel=0;channel<3;channel++)
+		{
+			if(!(channels & (1 << channel)))
+				continue;
+			sum = 0;
+			for(i=0;i<(1 << (2*oversampling));i++)
+			{
+				sum += analogRead(lwHandle, channel);
+				if(lwHandle->status < 0)
+					return lwHandle->status;
+			}
+			results[count++] = sum >> oversampling;
+		}
+		return count;
+	}
+
+	// about 100 us per conversion, the first on each channel is not used
+	for(channel=0;channel<3;channel++)
+		count += (channels >> channel) & 1;
+	timeout = LW_JOB_TIMEOUT + count * ((1UL << (2*oversampling)) + 1) / 5;
+	status = lwTransfer(lwHandle, 0xC0, 87, channels | (oversampling << 8), 0, (char*)buffer, sizeof(buffer));
+	start = lwMicros();
+	while(status >= 1 && buffer[0])
+	{
+		if(lwMicros() - start > timeout * 1000UL)
+			return -1;
+		delay(1);
+		status = lwTransfer(lwHandle, 0xC0, 87, 0, 0, (char*)buffer, sizeof(buffer));
+	}
+	if(status < 0)
+		return status;
+	if(status != 1 + 2*count)
+		return -1;		// the ADC is streaming, or not initialised
+	for(i=0;i<count;i++)
+		results[i] = buffer[1+2*i] | (buffer[2+2*i] << 8);
+	return count;
+}
+
+unsigned long logic_sampleRate(unsigned long sampleRate)
+{
+	unsigned int timer;
+
+	if(sampleRate > LOGIC_MAX_RATE)
+		sampleRate = LOGIC_MAX_RATE;
+	if(sampleRate < 1)
+		sampleRate = 1;
+	timer = lwTimer1Setting(sampleRate);
+	return (LITTLE_WIRE_F_CPU >> ((timer & 0x0F)-1)) / ((timer >> 8) + 1);
+}
+
+int logic_captureStart(littleWire* lwHandle, unsigned char mode, unsigned long sampleRate, unsigned char triggerMask, unsigned char triggerValue, unsigned char depth)
+{
+	unsigned int timer;
+
+	if(sampleRate > LOGIC_MAX_RATE)
+		sampleRate = LOGIC_MAX_RATE;
+	if(sampleRate < 1)
+		sampleRate = 1;
+	timer = lwTimer1Setting(sampleRate);
+	// value: clock select and mode in the low byte, top in the high byte
+	return lwTransfer(lwHandle, 0x40, 78, (timer & 0xFF00) | (mode & 0x70) | (timer & 0x0F),
+		(triggerMask & 0x0F) | ((triggerValue & 0x0F) << 4) | (depth << 8), NULL, 0);
+}
+
+int logic_captureRead(littleWire* lwHandle, unsigned char* buffer)
+{
+	return lwTransfer(lwHandle, 0xC0, 78, 0, 0, (char*)buffer, LOGIC_CAPTURE_SIZE);
+}
+
+int logic_captureStop(littleWire* lwHandle)
+{
+	return lwTransfer(lwHandle, 0x40, 78, 0, 0, NULL, 0);
+}
+
+// Timer1 at F_CPU/64 overflows every 16384 cycles, the gate unit of an edge count
+#define MEASURE_GATE_CYCLES 16384UL
+
+int measure_edges(littleWire* lwHandle, unsigned int gateTime, unsigned char falling)
+{
+	unsigned long gate = ((unsigned long)gateTime * (LITTLE_WIRE_F_CPU/1000) + MEASURE_GATE_CYCLES/2) / MEASURE_GATE_CYCLES;
+
+	if(gate < 1)
+		gate = 1;
+	if(gate > 0xFFFF)
+		gate = 0xFFFF;
+	return lwTransfer(lwHandle, 0x40, 79, falling ? 2 : 1, gate, NULL, 0);
+}
+
+int measure_pulses(littleWire* lwHandle, unsigned char pin, unsigned char periods, unsigned int timeout)
+{
+	unsigned int units = (timeout + 9) / 10;
+
+	if(units < 1)
+		units = 1;
+	if(units > 255)
+		units = 255;
+	return lwTransfer(lwHandle, 0x40, 79, 3 | (pin << 8), (periods ? periods : 1) | (units << 8), NULL, 0);
+}
+
+int measure_read(littleWire* lwHandle, lwMeasurement* result)
+{
+	unsigned char reply[10];
+
+	if(lwTransfer(lwHandle, 0xC0, 79, 0, 0, (char*)reply, sizeof(reply)) < (int)sizeof(reply))
+		return lwHandle->status < 0 ? lwHandle->status : -1;
+
+	result->state = reply[0];
+	result->periods = reply[1];
+	result->high = reply[2] | (reply[3] << 8) | ((unsigned long)reply[4] << 16) | ((unsigned long)reply[5] << 24);
+	result->low = reply[6] | (reply[7] << 8) | ((unsigned long)reply[8] << 16) | ((unsigned long)reply[9] << 24);
+	result->frequency = 0;
+	result->duty = 0;
+	if(result->periods)
+	{
+		if(result->high + result->low)
+		{
+			result->frequency = (double)LITTLE_WIRE_F_CPU * result->periods / (result->high + result->low);
+			result->duty = (double)result->high / (result->high + result->low);
+		}
+	}
+	else if(result->low)
+		result->frequency = (double)LITTLE_WIRE_F_CPU * result->high / ((double)result->low * MEASURE_GATE_CYCLES);
+	return result->state;
+}
+
+int measure_wait(littleWire* lwHandle, lwMeasurement* result, unsigned int timeout)
+{
+	unsigned long start = lwMicros();
+	int state;
+
+	for(;;)
+	{
+		// A failed request is not an error here, a pulse measurement runs
+		// with interrupts off.
+		state = measure_read(lwHandle, result);
+		if(state >= 0 && state != MEASURE_RUNNING)
+			return state;
+		if(lwMicros() - start > timeout * 1000UL)
+			return state;
+		delay(1);
+	}
+}
+
+int measure_stop(littleWire* lwHandle)
+{
+	return lwTransfer(lwHandle, 0x40, 79, 0, 0, NULL, 0);
+}
+
+/******************************************************************************
+* One request 81: sends length bytes, receives up to receive bytes and waits
+* for the result. Requests fail while the device has interrupts off, so they
+* are retried until timeout.
+******************************************************************************/
+static int uartBurst(littleWire* lwHandle, unsigned int bitTime, const unsigned char* tx, int length, unsigned char* rx, int receive, unsigned int timeout)
+{
+	unsigned char reply[UART_RECEIVE_SIZE+1];
+	unsigned long start;
+	int count;
+
+	if(lwTransfer(lwHandle, 0x40, 81, bitTime, receive, (char*)tx, length) < 0)
+		return lwHandle->status;
+	start = lwMicros();
+	for(;;)
+	{
+		count = lwTransfer(lwHandle, 0xC0, 81, 0, 0, (char*)reply, receive+1);
+		if(count > 0)
+			break;
+		if(lwMicros() - start > timeout * 1000UL)
+			return (count < 0) ? count : -1;
+		lwHandle->stats.retries++;
+		delay(1);
+	}
+	count = reply[0];
+	if(count > receive)
+		count = receive;
+	if(count)
+		memcpy(rx, reply+1, count);
+	return count;
+}
+
+int uart_transfer(littleWire* lwHandle, unsigned long baud, const unsigned char* tx, int txLength, unsigned char* rx, int rxLength)
+{
+	unsigned long cycles;
+	unsigned int bitTime;
+	unsigned int timeout;
+	int chunk, result;
+
+	if(baud < 1)
+		return -1;
+	if(rxLength > UART_RECEIVE_SIZE)
+		rxLength = UART_RECEIVE_SIZE;
+	if(rxLength < 0)
+		rxLength = 0;
+
+	// Each bit takes 4*bitTime+8 cycles, see dwSendBytes in the firmware
+	cycles = (LITTLE_WIRE_F_CPU + baud/2) / baud;
+	bitTime = (cycles > 12) ? (cycles - 8 + 2) / 4 : 1;
+	if(cycles > 4*0xFFFFUL + 8)
+		bitTime = 0xFFFF;
+
+	do
+	{
+		chunk = (txLength > UART_BURST_SIZE) ? UART_BURST_SIZE : txLength;
+		// 10 bits a byte, plus the 24 ms receive timeout of each byte expected
+		timeout = LW_JOB_TIMEOUT + (unsigned int)((chunk + rxLength) * 10000UL / baud) + 25 * (rxLength + 1);
+		result = uartBurst(lwHandle, bitTime, tx, chunk, rx, (chunk == txLength) ? rxLength : 0, timeout);
+		if(result < 0)
+			return result;
+		tx += chunk;
+		txLength -= chunk;
+	} while(txLength > 0);
+	return result;
 }
 
 void pwm_init(littleWire* lwHandle)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 16, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	lwSend(lwHandle, 16, 0, 0);
 }
 
 void pwm_stop(littleWire* lwHandle)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 32, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	lwSend(lwHandle, 32, 0, 0);
 }
 
 void pwm_updateCompare(littleWire* lwHandle, unsigned char channelA, unsigned char channelB)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 17, channelA, channelB, (char*)rxBuffer, 8, USB_TIMEOUT);
+	lwSend(lwHandle, 17, channelA, channelB);
 }
 
 void pwm_updatePrescaler(littleWire* lwHandle, unsigned int value)
@@ -242,163 +1073,812 @@ void pwm_updatePrescaler(littleWire* lwHandle, unsigned int value)
 	switch(value)
 	{
 		case 1024:
-			lwStatus=usb_control_msg(lwHandle, 0xC0, 22, 4, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+			lwSend(lwHandle, 22, 4, 0);
 		break;
 		case 256:
-			lwStatus=usb_control_msg(lwHandle, 0xC0, 22, 3, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+			lwSend(lwHandle, 22, 3, 0);
 		break;
 		case 64:
-			lwStatus=usb_control_msg(lwHandle, 0xC0, 22, 2, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+			lwSend(lwHandle, 22, 2, 0);
 		break;
 		case 8:
-			lwStatus=usb_control_msg(lwHandle, 0xC0, 22, 1, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+			lwSend(lwHandle, 22, 1, 0);
 		break;
 		case 1:
-			lwStatus=usb_control_msg(lwHandle, 0xC0, 22, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+			lwSend(lwHandle, 22, 0, 0);
 		break;
 	}
 }
 
-void spi_init(littleWire* lwHandle)
-{
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 23, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+long pwm_fastStart(littleWire* lwHandle, unsigned long frequency, unsigned int duty, unsigned int deadTime, unsigned char flags)
+{
+	const double pck = 4.0 * LITTLE_WIRE_F_CPU;	// the PLL clocks Timer1
+	unsigned long period;
+	unsigned int clockSelect, top, compare, ticks, prescaler;
+
+	if(frequency < 1)
+		return -1;
+	// Smallest prescaler that fits the period into 8 bits, for the finest duty steps
+	for(clockSelect=1;clockSelect<=15;clockSelect++)
+	{
+		period = (unsigned long)(pck / (1UL << (clockSelect-1)) / frequency + 0.5);
+		if(period <= 256)
+			break;
+	}
+	if(clockSelect > 15)
+		return -1;
+	if(period < 2)
+		period = 2;
+	top = period - 1;
+	compare = (unsigned int)(((unsigned long)duty * period + 32768) >> 16);
+	if(compare > top)
+		compare = top;
+
+	// Dead time counts the PLL clock through a prescaler of 1, 2, 4 or 8, 4 bits each side
+	ticks = (unsigned int)(deadTime * pck / 1.0e9 + 0.5);
+	for(prescaler=0;prescaler<3 && ticks>15;prescaler++)
+		ticks = (ticks + 1) / 2;
+	if(ticks > 15)
+		ticks = 15;
+
+	if(lwSend(lwHandle, 84, clockSelect | (prescaler << 4) | (flags & PWM_FAST_COMPLEMENTARY) | (top << 8), compare | (((ticks << 4) | ticks) << 8)) < 0)
+		return lwHandle->status;
+	if(lwHandle->status < 1)
+		return -1;
+	return (long)(pck / (1UL << (clockSelect-1)) / period + 0.5);
+}
+
+void pwm_fastStop(littleWire* lwHandle)
+{
+	lwSend(lwHandle, 84, 0, 0);
+}
+
+void spi_init(littleWire* lwHandle)
+{
+	lwSend(lwHandle, 23, 0, 0);
+}
+
+void spi_sendMessage(littleWire* lwHandle, unsigned char * sendBuffer, unsigned char * inputBuffer, unsigned char length ,unsigned char mode)
+{
+	int i=0;
+	if(length>4)
+		length=4;
+	lwJob(lwHandle, (0xF0 + length + (mode<<3) ), (sendBuffer[1]<<8) + sendBuffer[0] , (sendBuffer[3]<<8) + sendBuffer[2], 0);
+	for(i=0;i<length;i++)
+		inputBuffer[i]=lwHandle->rxBuffer[i];
+}
+
+int spi_transfer(littleWire* lwHandle, unsigned char* sendBuffer, unsigned char* inputBuffer, int length, unsigned char mode)
+{
+	unsigned char reply[SPI_STREAM_SIZE];
+	int done, chunk, cs;
+
+	if(!lwHasRequests(lwHandle, LW_CAP_SPI_STREAM))
+	{
+		// No SPI streams in the firmware, send 4 bytes at a time
+		if(mode == AUTO_CS)
+			digitalWrite(lwHandle, RESET_PIN, LOW);
+		for(done=0;done<length;done+=chunk)
+		{
+			chunk = (length-done > 4) ? 4 : length-done;
+			memcpy(reply, sendBuffer+done, chunk);
+			spi_sendMessage(lwHandle, reply, reply, chunk, MANUAL_CS);
+			if(lwHandle->status < 0)
+				return lwHandle->status;
+			if(inputBuffer)
+				memcpy(inputBuffer+done, reply, chunk);
+		}
+		if(mode == AUTO_CS)
+			digitalWrite(lwHandle, RESET_PIN, HIGH);
+		return length;
+	}
+
+	for(done=0;done<length;done+=chunk)
+	{
+		chunk = (length-done > SPI_STREAM_SIZE) ? SPI_STREAM_SIZE : length-done;
+		cs = 0;
+		if(mode == AUTO_CS)
+		{
+			if(done == 0)
+				cs |= 1;  // assert chip select before the first block
+			if(done+chunk == length)
+				cs |= 2;  // release it after the last one
+		}
+		if(lwTransfer(lwHandle, 0x40, 57, cs, 0, (char*)sendBuffer+done, chunk) < 0)
+			return lwHandle->status;
+		if(lwCollect(lwHandle, 57, reply, chunk) < chunk)
+			return (lwHandle->status < 0) ? lwHandle->status : done;
+		if(inputBuffer)
+			memcpy(inputBuffer+done, reply, chunk);
+	}
+	return length;
+}
+
+int spi_read(littleWire* lwHandle, unsigned char* inputBuffer, int length, unsigned char fill, unsigned char mode)
+{
+	unsigned char fillBuffer[SPI_STREAM_SIZE];
+	int done, chunk, cs;
+
+	if(!lwHasRequests(lwHandle, LW_CAP_SPI_STREAM))
+	{
+		memset(fillBuffer, fill, sizeof(fillBuffer));
+		if(mode == AUTO_CS)
+			digitalWrite(lwHandle, RESET_PIN, LOW);
+		for(done=0;done<length;done+=chunk)
+		{
+			chunk = (length-done > SPI_STREAM_SIZE) ? SPI_STREAM_SIZE : length-done;
+			if(spi_transfer(lwHandle, fillBuffer, inputBuffer+done, chunk, MANUAL_CS) < 0)
+				return lwHandle->status;
+		}
+		if(mode == AUTO_CS)
+			digitalWrite(lwHandle, RESET_PIN, HIGH);
+		return length;
+	}
+
+	for(done=0;done<length;done+=chunk)
+	{
+		chunk = (length-done > SPI_READ_SIZE) ? SPI_READ_SIZE : length-done;
+		cs = 0;
+		if(mode == AUTO_CS)
+		{
+			if(done == 0)
+				cs |= 1;
+			if(done+chunk == length)
+				cs |= 2;
+		}
+		if(lwTransfer(lwHandle, 0xC0, 58, fill, cs, (char*)inputBuffer+done, chunk) < chunk)
+			return (lwHandle->status < 0) ? lwHandle->status : done;
+	}
+	return length;
+}
+
+unsigned char debugSpi(littleWire* lwHandle, unsigned char message)
+{
+	lwJob(lwHandle, 33, message, 0, 0);
+	return lwHandle->rxBuffer[0];
+}
+
+int debugSpi_start(littleWire* lwHandle, unsigned char gap)
+{
+	if(lwTransfer(lwHandle, 0x40, 80, 1 | (gap << 8), 0, NULL, 0) < 0)
+		return lwHandle->status;
+	// The OUT request has no reply, see whether the console is on from an empty block
+	if(lwTransfer(lwHandle, 0xC0, 80, 0, 0, (char*)lwHandle->rxBuffer, 2) < 2)
+		return lwHandle->status < 0 ? lwHandle->status : 0;
+	return lwHandle->rxBuffer[1] & 1;
+}
+
+int debugSpi_read(littleWire* lwHandle, unsigned char* buffer, int maxLength)
+{
+	unsigned char block[2 + DEBUG_CONSOLE_SIZE];
+	int length, count;
+
+	if(maxLength > DEBUG_CONSOLE_SIZE)
+		maxLength = DEBUG_CONSOLE_SIZE;
+	if(maxLength < 0)
+		maxLength = 0;
+	length = lwTransfer(lwHandle, 0xC0, 80, 0, 0, (char*)block, 2 + maxLength);
+	if(length < 0)
+		return length;
+	if(length < 2)
+		return 0;
+	count = block[0];
+	if(count > length - 2)
+		count = length - 2;
+	memcpy(buffer, block + 2, count);
+	return count;
+}
+
+int debugSpi_stop(littleWire* lwHandle)
+{
+	return lwTransfer(lwHandle, 0x40, 80, 0, 0, NULL, 0);
+}
+
+void spi_updateDelay(littleWire* lwHandle, unsigned int duration)
+{
+	lwSend(lwHandle, 31, duration, 0);
+}
+
+void i2c_init(littleWire* lwHandle)
+{
+	lwSend(lwHandle, 44, 0, 0);
+}
+
+unsigned char i2c_start(littleWire* lwHandle, unsigned char address7bit, unsigned char direction)
+{
+	unsigned char temp;
+
+	temp = (address7bit << 1) | direction;
+
+	lwJob(lwHandle, 45, temp, 0, 0);
+	return !lwHandle->rxBuffer[0];
+}
+
+void i2c_write(littleWire* lwHandle, unsigned char* sendBuffer, unsigned char length, unsigned char endWithStop)
+{
+	lwSend(lwHandle, (0xE0 + length + (endWithStop<<3) ), (sendBuffer[1]<<8) + sendBuffer[0] , (sendBuffer[3]<<8) + sendBuffer[2]);
+}
+
+void i2c_read(littleWire* lwHandle, unsigned char* readBuffer, unsigned char length, unsigned char endWithStop)
+{
+	int i=0;
+
+	if(endWithStop)
+		lwJob(lwHandle, 46, (length<<8) + 1, 1, 3);
+	else
+		lwJob(lwHandle, 46, (length<<8) + 0, 0, 3);
+
+	for(i=0;i<length;i++)
+		readBuffer[i]=lwHandle->rxBuffer[i];
+}
+
+void i2c_updateDelay(littleWire* lwHandle, unsigned int duration)
+{
+	lwSend(lwHandle, 49, duration, 0);
+}
+
+int i2c_transfer(littleWire* lwHandle, unsigned char address7bit, unsigned char* writeBuffer, int writeLength, unsigned char* readBuffer, int readLength)
+{
+	unsigned char buffer[I2C_TRANSFER_SIZE+2];
+	int i, chunk, last;
+
+	if(writeLength > I2C_TRANSFER_SIZE)
+		writeLength = I2C_TRANSFER_SIZE;
+	if(readLength > I2C_TRANSFER_SIZE)
+		readLength = I2C_TRANSFER_SIZE;
+
+	if(!lwHasRequests(lwHandle, LW_CAP_I2C_TRANSFER))
+	{
+		// No I2C transfers in the firmware, use the separate start, write and read requests
+		if(writeLength)
+		{
+			if(!i2c_start(lwHandle, address7bit, WRITE))
+				return (lwHandle->status < 0) ? lwHandle->status : 0;
+			for(i=0;i<writeLength;i+=chunk)
+			{
+				chunk = (writeLength-i > 4) ? 4 : writeLength-i;
+				memcpy(buffer, writeBuffer+i, chunk);
+				i2c_write(lwHandle, buffer, chunk, (readLength == 0) && (i+chunk == writeLength));
+			}
+		}
+		if(readLength)
+		{
+			if(!i2c_start(lwHandle, address7bit, READ))
+				return (lwHandle->status < 0) ? lwHandle->status : 0;
+			for(i=0;i<readLength;i+=chunk)
+			{
+				chunk = (readLength-i > 8) ? 8 : readLength-i;
+				last = (i+chunk == readLength);
+				lwJob(lwHandle, 46, (chunk<<8) + last, last, 3);
+				memcpy(readBuffer+i, lwHandle->rxBuffer, chunk);
+			}
+		}
+		return (lwHandle->status < 0) ? lwHandle->status : 1;
+	}
+
+	if((writeLength <= 2) && (readLength > 0))
+	{
+		// Register read, done in a single request
+		lwTransfer(lwHandle, 0xC0, 61, (writeLength<<8) | address7bit,
+			((writeLength > 1) ? writeBuffer[1]<<8 : 0) | (writeLength ? writeBuffer[0] : 0),
+			(char*)readBuffer, readLength);
+		return (lwHandle->status < 0) ? lwHandle->status : (lwHandle->status == readLength);
+	}
+
+	buffer[0] = address7bit;
+	buffer[1] = readLength;
+	memcpy(buffer+2, writeBuffer, writeLength);
+	if(lwTransfer(lwHandle, 0x40, 59, 0, 0, (char*)buffer, writeLength+2) < 0)
+		return lwHandle->status;
+	if(lwCollect(lwHandle, 59, buffer, readLength+1) < readLength+1)
+		return (lwHandle->status < 0) ? lwHandle->status : 0;
+	if(buffer[0])
+		return 0;
+	memcpy(readBuffer, buffer+1, readLength);
+	return 1;
+}
+
+int i2c_readRegisters(littleWire* lwHandle, unsigned char address7bit, unsigned char reg, unsigned char* readBuffer, int length)
+{
+	return i2c_transfer(lwHandle, address7bit, &reg, 1, readBuffer, length);
+}
+
+int i2c_writeRegisters(littleWire* lwHandle, unsigned char address7bit, unsigned char reg, unsigned char* writeBuffer, int length)
+{
+	unsigned char buffer[I2C_TRANSFER_SIZE];
+
+	if(length > I2C_TRANSFER_SIZE-1)
+		length = I2C_TRANSFER_SIZE-1;
+	buffer[0] = reg;
+	memcpy(buffer+1, writeBuffer, length);
+	return i2c_transfer(lwHandle, address7bit, buffer, length+1, NULL, 0);
+}
+
+void onewire_sendBit(littleWire* lwHandle, unsigned char bitValue)
+{
+	lwSend(lwHandle, 51, bitValue, 0);
+}
+
+void onewire_writeByte(littleWire* lwHandle, unsigned char messageToSend)
+{
+	lwSend(lwHandle, 42, messageToSend, 0);
+	if(lwHandle->firmwareVersion < 0x14)
+		delay(3);
+}
+
+unsigned char onewire_readByte(littleWire* lwHandle)
+{
+	lwJob(lwHandle, 43, 0, 0, 3);
+	return lwHandle->rxBuffer[0];
+}
+
+unsigned char onewire_readBit(littleWire* lwHandle)
+{
+	lwJob(lwHandle, 50, 0, 0, 0);
+	return lwHandle->rxBuffer[0];
+}
+
+unsigned char onewire_resetPulse(littleWire* lwHandle)
+{
+	lwJob(lwHandle, 41, 0, 0, 3);
+	return lwHandle->rxBuffer[0];
+}
+
+int onewire_transfer(littleWire* lwHandle, unsigned char reset, unsigned char* writeBuffer, int writeLength, unsigned char* readBuffer, int readLength)
+{
+	unsigned char buffer[ONEWIRE_TRANSFER_SIZE+2];
+	int i;
+
+	if(writeLength > ONEWIRE_TRANSFER_SIZE)
+		writeLength = ONEWIRE_TRANSFER_SIZE;
+	if(readLength > ONEWIRE_TRANSFER_SIZE)
+		readLength = ONEWIRE_TRANSFER_SIZE;
+
+	if(!lwHasRequests(lwHandle, LW_CAP_ONEWIRE_BULK))
+	{
+		// No block transfers in the firmware, move one byte per request
+		if(reset && !onewire_resetPulse(lwHandle))
+			return (lwHandle->status < 0) ? lwHandle->status : 0;
+		for(i=0;i<writeLength;i++)
+			onewire_writeByte(lwHandle, writeBuffer[i]);
+		for(i=0;i<readLength;i++)
+			readBuffer[i] = onewire_readByte(lwHandle);
+		return (lwHandle->status < 0) ? lwHandle->status : 1;
+	}
+
+	buffer[0] = reset ? 1 : 0;
+	buffer[1] = readLength;
+	if(writeLength)
+		memcpy(buffer+2, writeBuffer, writeLength);
+	if(lwTransfer(lwHandle, 0x40, 63, 0, 0, (char*)buffer, writeLength+2) < 0)
+		return lwHandle->status;
+	if(lwCollect(lwHandle, 63, buffer, readLength+1) < 1)
+		return lwHandle->status;
+	if(!buffer[0])
+		return 0;
+	if(readLength)
+		memcpy(readBuffer, buffer+1, readLength);
+	return 1;
 }
 
-void spi_sendMessage(littleWire* lwHandle, unsigned char * sendBuffer, unsigned char * inputBuffer, unsigned char length ,unsigned char mode)
+void onewire_writeBytes(littleWire* lwHandle, unsigned char* writeBuffer, int length)
 {
-	int i=0;
-	if(length>4)
-		length=4;
-	lwStatus=usb_control_msg(lwHandle, 0xC0, (0xF0 + length + (mode<<3) ), (sendBuffer[1]<<8) + sendBuffer[0] , (sendBuffer[3]<<8) + sendBuffer[2], (char*)rxBuffer, 8, USB_TIMEOUT);
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 40, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
-	for(i=0;i<length;i++)
-		inputBuffer[i]=rxBuffer[i];
+	onewire_transfer(lwHandle, 0, writeBuffer, length, NULL, 0);
 }
 
-unsigned char debugSpi(littleWire* lwHandle, unsigned char message)
+void onewire_readBytes(littleWire* lwHandle, unsigned char* readBuffer, int length)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 33, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 40, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
-	return rxBuffer[0];
+	onewire_transfer(lwHandle, 0, NULL, 0, readBuffer, length);
 }
 
-void spi_updateDelay(littleWire* lwHandle, unsigned int duration)
+int onewire_matchRead(littleWire* lwHandle, unsigned char* rom, unsigned char command, unsigned char* readBuffer, int length)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 31, duration, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	unsigned char buffer[10];
+
+	buffer[0] = 0x55;		// match ROM
+	memcpy(buffer+1, rom, 8);
+	buffer[9] = command;
+	return onewire_transfer(lwHandle, 1, buffer, 10, readBuffer, length);
 }
 
-void i2c_init(littleWire* lwHandle)
+// Families of DS18S20, DS1822, DS18B20 and DS1825
+static int lwIsTemperatureSensor(unsigned char family)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 44, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	return family == 0x10 || family == 0x22 || family == 0x28 || family == 0x3B;
 }
 
-unsigned char i2c_start(littleWire* lwHandle, unsigned char address7bit, unsigned char direction)
+// Fills in a reading from the first two scratchpad bytes
+static void lwSetTemperature(lwTemperature* sensor, int status, unsigned char low, unsigned char high)
 {
-	unsigned char temp;
-
-	temp = (address7bit << 1) | direction;
+	long raw = (short)(low | (high << 8));
 
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 45, temp, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 40, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
-	return !rxBuffer[0];
+	sensor->status = status;
+	if(status != 1)
+		return;
+	if(sensor->rom[0] == 0x10)
+		sensor->milliCelsius = raw * 500;	// DS18S20, half degrees
+	else
+		sensor->milliCelsius = raw * 125 / 2;	// sixteenths of a degree
 }
 
-void i2c_write(littleWire* lwHandle, unsigned char* sendBuffer, unsigned char length, unsigned char endWithStop)
+int onewire_findTemperatures(littleWire* lwHandle, lwTemperature* sensors, int max)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, (0xE0 + length + (endWithStop<<3) ), (sendBuffer[1]<<8) + sendBuffer[0] , (sendBuffer[3]<<8) + sendBuffer[2], (char*)rxBuffer, 8, USB_TIMEOUT);
+	int count = 0;
+	int found;
+
+	for(found=onewire_firstAddress(lwHandle);found && count<max;found=onewire_nextAddress(lwHandle))
+	{
+		if(!lwIsTemperatureSensor(lwHandle->ROM_NO[0]))
+			continue;
+		memcpy(sensors[count].rom, lwHandle->ROM_NO, 8);
+		sensors[count].status = 0;
+		sensors[count].milliCelsius = 0;
+		count++;
+	}
+	return (lwHandle->status < 0) ? lwHandle->status : count;
 }
 
-void i2c_read(littleWire* lwHandle, unsigned char* readBuffer, unsigned char length, unsigned char endWithStop)
+int onewire_readTemperatures(littleWire* lwHandle, lwTemperature* sensors, int count)
 {
-	int i=0;
-
-	if(endWithStop)
-		lwStatus=usb_control_msg(lwHandle, 0xC0, 46, (length<<8) + 1, 1, (char*)rxBuffer, 8, USB_TIMEOUT);
-	else
-		lwStatus=usb_control_msg(lwHandle, 0xC0, 46, (length<<8) + 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	unsigned char command[2] = { 0xCC, 0x44 };	// skip ROM, convert T
+	unsigned char buffer[1+3*ONEWIRE_SWEEP_SIZE];
+	unsigned char roms[8*ONEWIRE_SWEEP_SIZE];
+	unsigned char pad[9];
+	unsigned long start;
+	int done, valid = 0, status, crc, i, n;
+
+	for(i=0;i<count;i++)
+		sensors[i].status = 0;
+	if(count < 1)
+		return 0;
+
+	if(!lw_hasCapability(lwHandle, LW_CAP_ONEWIRE_SWEEP))
+	{
+		status = onewire_transfer(lwHandle, 1, command, 2, NULL, 0);
+		if(status < 1)
+			return status;
+		delay(ONEWIRE_CONVERT_TIME);
+		for(i=0;i<count;i++)
+		{
+			status = onewire_matchRead(lwHandle, sensors[i].rom, 0xBE, pad, 9);
+			if(status < 0)
+				return status;
+			if(!status)
+				continue;
+			for(n=0,crc=0;n<9;n++)
+				crc = dscrc_table[crc ^ pad[n]];
+			lwSetTemperature(sensors+i, crc ? -1 : 1, pad[0], pad[1]);
+			valid += !crc;
+		}
+		return valid;
+	}
 
-	delay(3);
+	// the device answers the poll with the conversion state, 1 while it runs
+	if(lwTransfer(lwHandle, 0x40, 85, 1, 0, NULL, 0) < 0)
+		return lwHandle->status;
+	start = lwMicros();
+	for(;;)
+	{
+		delay(10);
+		status = lwTransfer(lwHandle, 0xC0, 85, 0, 0, (char*)buffer, 1);
+		if(status < 0)
+			return status;
+		if(status == 1 && buffer[0] == 2)
+			return 0;		// no device answered the reset
+		if((status == 1 && buffer[0] == 0) || lwMicros() - start > ONEWIRE_CONVERT_TIME * 1000UL)
+			break;
+	}
 
-  lwStatus=usb_control_msg(lwHandle, 0xC0, 40, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	for(done=0;done<count;done+=n)
+	{
+		n = (count-done > ONEWIRE_SWEEP_SIZE) ? ONEWIRE_SWEEP_SIZE : count-done;
+		for(i=0;i<n;i++)
+			memcpy(roms+8*i, sensors[done+i].rom, 8);
+		if(lwTransfer(lwHandle, 0x40, 85, 2, 0, (char*)roms, 8*n) < 0)
+			return lwHandle->status;
+
+		// about 12 ms per sensor, no reply until all are read
+		start = lwMicros();
+		while((status = lwTransfer(lwHandle, 0xC0, 85, 0, 0, (char*)buffer, 1+3*n)) == 0)
+		{
+			if(lwMicros() - start > (20UL*n + LW_JOB_TIMEOUT) * 1000UL)
+				break;
+			lwHandle->stats.retries++;
+			delay(2);
+		}
+		if(status < 0)
+			return status;
+		if(status < 1+3*n)
+			return -1;
+		for(i=0;i<n;i++)
+		{
+			status = (buffer[1+3*i] & 2) ? 1 : (buffer[1+3*i] & 1) ? -1 : 0;
+			lwSetTemperature(sensors+done+i, status, buffer[2+3*i], buffer[3+3*i]);
+			valid += (status == 1);
+		}
+	}
+	return valid;
+}
 
-	for(i=0;i<length;i++)
-		readBuffer[i]=rxBuffer[i];
+void softPWM_state(littleWire* lwHandle,unsigned char state)
+{
+	lwSend(lwHandle, 47, state, 0);
 }
 
-void i2c_updateDelay(littleWire* lwHandle, unsigned int duration)
+void softPWM_write(littleWire* lwHandle,unsigned char ch1,unsigned char ch2,unsigned char ch3)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 49, duration, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	lwSend(lwHandle, 48, (ch2<<8) | ch1, ch3);
 }
 
-void onewire_sendBit(littleWire* lwHandle, unsigned char bitValue)
+void ws2812_write(littleWire* lwHandle, unsigned char pin, unsigned char r,unsigned char g,unsigned char b)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 51, bitValue, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	lwSend(lwHandle, 54, (g<<8) | pin | 0x30, (b<<8) | r);
 }
 
-void onewire_writeByte(littleWire* lwHandle, unsigned char messageToSend)
+void ws2812_flush(littleWire* lwHandle, unsigned char pin)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 42, messageToSend, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
-	delay(3);
+	lwSend(lwHandle, 54, pin | 0x10, 0);
 }
 
-unsigned char onewire_readByte(littleWire* lwHandle)
+void ws2812_preload(littleWire* lwHandle, unsigned char r,unsigned char g,unsigned char b)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 43, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
-	delay(3);
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 40, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
-	return rxBuffer[0];
+	lwSend(lwHandle, 54, (g<<8) | 0x20, (b<<8) | r);
 }
 
-unsigned char onewire_readBit(littleWire* lwHandle)
+int ws2812_sendFrame(littleWire* lwHandle, unsigned char pin, unsigned char* rgb, int ledCount)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 50, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 40, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
-	return rxBuffer[0];
+	unsigned char frame[WS2812_FRAME_SIZE];
+	unsigned char palette[16*3];
+	int i, j, runs = 0, colours = 0, length, mode;
+
+	// count the runs and the colours
+	for(i=0;i<ledCount;i++)
+	{
+		if(i == 0 || memcmp(rgb+3*i, rgb+3*(i-1), 3) || (i % 255) == 0)
+			runs++;		// may count one run too many for long runs, never too few
+		if(colours <= 16)
+		{
+			for(j=0;j<colours;j++)
+				if(!memcmp(palette+3*j, rgb+3*i, 3))
+					break;
+			if(j == colours)
+			{
+				if(colours < 16)
+					memcpy(palette+3*j, rgb+3*i, 3);
+				colours++;
+			}
+		}
+	}
+
+	// pick the shortest encoding that fits
+	mode = -1;
+	length = WS2812_FRAME_SIZE+1;
+	if(ledCount*3 <= WS2812_FRAME_SIZE)
+	{
+		mode = 0;
+		length = ledCount*3;
+	}
+	if(runs*4 < length)
+	{
+		mode = 1;
+		length = runs*4;
+	}
+	if(colours <= 16 && 48 + (ledCount+1)/2 < length)
+	{
+		mode = 2;
+		length = 48 + (ledCount+1)/2;
+	}
+	if(mode < 0 || length == 0)
+		return -1;
+
+	if(mode == 0)
+	{
+		for(i=0;i<ledCount;i++)
+		{
+			frame[3*i] = rgb[3*i+1];
+			frame[3*i+1] = rgb[3*i];
+			frame[3*i+2] = rgb[3*i+2];
+		}
+	}
+	else if(mode == 1)
+	{
+		for(i=0,j=-4;i<ledCount;i++)
+		{
+			if(i == 0 || memcmp(rgb+3*i, rgb+3*(i-1), 3) || frame[j] == 255)
+			{
+				j += 4;
+				frame[j] = 0;
+				frame[j+1] = rgb[3*i+1];
+				frame[j+2] = rgb[3*i];
+				frame[j+3] = rgb[3*i+2];
+			}
+			frame[j]++;
+		}
+		length = j+4;
+	}
+	else
+	{
+		for(i=0;i<colours;i++)
+		{
+			frame[3*i] = palette[3*i+1];
+			frame[3*i+1] = palette[3*i];
+			frame[3*i+2] = palette[3*i+2];
+		}
+		memset(frame+3*colours, 0, length-3*colours);
+		for(i=0;i<ledCount;i++)
+		{
+			for(j=0;memcmp(palette+3*j, rgb+3*i, 3);j++);
+			frame[48+i/2] |= (i & 1) ? j << 4 : j;
+		}
+	}
+
+	return lwTransfer(lwHandle, 0x40, 69, pin | 0x10 | (mode << 8), ledCount, (char*)frame, length) < 0 ? lwHandle->status : 0;
 }
 
-unsigned char onewire_resetPulse(littleWire* lwHandle)
+int ws2812_sendParallel(littleWire* lwHandle, unsigned char* rgbPin4, unsigned char* rgbPin1, unsigned char* rgbPin2, int ledCount)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 41, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
-	delay(3);
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 40, 0, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
-	return rxBuffer[0];
+	unsigned char frame[WS2812_FRAME_SIZE];
+	unsigned char* strips[3];
+	unsigned char pins = 0;
+	int count = 0, length, i, j;
+
+	// in pin order, PIN4 is PB0, PIN1 PB1 and PIN2 PB2
+	if(rgbPin4)
+	{
+		strips[count++] = rgbPin4;
+		pins |= 1 << PIN4;
+	}
+	if(rgbPin1)
+	{
+		strips[count++] = rgbPin1;
+		pins |= 1 << PIN1;
+	}
+	if(rgbPin2)
+	{
+		strips[count++] = rgbPin2;
+		pins |= 1 << PIN2;
+	}
+	length = ledCount*3*count;
+	if(!count || ledCount < 1 || length > WS2812_FRAME_SIZE)
+		return -1;
+
+	// a byte of every string for each byte position, colours sent as GRB
+	for(i=0;i<ledCount*3;i++)
+		for(j=0;j<count;j++)
+			frame[i*count+j] = strips[j][i - i%3 + (i%3 == 0 ? 1 : i%3 == 1 ? 0 : 2)];
+
+	return lwTransfer(lwHandle, 0x40, 69, 0x10 | (3 << 8), pins, (char*)frame, length) < 0 ? lwHandle->status : 0;
 }
 
-void softPWM_state(littleWire* lwHandle,unsigned char state)
+// Effect parameters: mode, pin, LEDs, interval, GRB colour A, GRB colour B, two arguments
+static int lwEffect(littleWire* lwHandle, unsigned char mode, unsigned char pin, unsigned char ledCount, unsigned char interval,
+	unsigned char r1, unsigned char g1, unsigned char b1, unsigned char r2, unsigned char g2, unsigned char b2, unsigned char arg1, unsigned char arg2)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 47, state, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	unsigned char params[12];
+	unsigned int ticks;
+
+	// the device counts in Timer1 ticks of 16384 clock cycles
+	ticks = (interval * (LITTLE_WIRE_F_CPU / 16384) + 500) / 1000;
+	if(ticks < 1)
+		ticks = 1;
+	if(ticks > 255)
+		ticks = 255;
+
+	params[0] = mode;
+	params[1] = pin;
+	params[2] = ledCount;
+	params[3] = ticks;
+	params[4] = g1;
+	params[5] = r1;
+	params[6] = b1;
+	params[7] = g2;
+	params[8] = r2;
+	params[9] = b2;
+	params[10] = arg1;
+	params[11] = arg2;
+	return lwTransfer(lwHandle, 0x40, 70, 0, 0, (char*)params, 12);
 }
 
-void softPWM_write(littleWire* lwHandle,unsigned char ch1,unsigned char ch2,unsigned char ch3)
+int ws2812_fade(littleWire* lwHandle, unsigned char pin, unsigned char ledCount, unsigned char interval, unsigned char r1, unsigned char g1, unsigned char b1, unsigned char r2, unsigned char g2, unsigned char b2, unsigned char steps, unsigned char pingPong)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 48, (ch2<<8) | ch1, ch3, (char*)rxBuffer, 8, USB_TIMEOUT);
+	return lwEffect(lwHandle, 1, pin, ledCount, interval, r1, g1, b1, r2, g2, b2, steps, pingPong ? 1 : 0);
 }
 
-void ws2812_write(littleWire* lwHandle, unsigned char pin, unsigned char r,unsigned char g,unsigned char b)
+int ws2812_hueCycle(littleWire* lwHandle, unsigned char pin, unsigned char ledCount, unsigned char interval, unsigned char hueStep, unsigned char brightness)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 54, (g<<8) | pin | 0x30, (b<<8) | r, (char*)rxBuffer, 8, USB_TIMEOUT);
+	return lwEffect(lwHandle, 2, pin, ledCount, interval, 0, 0, 0, 0, 0, 0, hueStep, brightness);
 }
 
-void ws2812_flush(littleWire* lwHandle, unsigned char pin)
+int ws2812_chase(littleWire* lwHandle, unsigned char pin, unsigned char ledCount, unsigned char interval, unsigned char r, unsigned char g, unsigned char b, unsigned char rBack, unsigned char gBack, unsigned char bBack, unsigned char length)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 54, pin | 0x10, 0, (char*)rxBuffer, 8, USB_TIMEOUT);
+	return lwEffect(lwHandle, 3, pin, ledCount, interval, r, g, b, rBack, gBack, bBack, length, 0);
 }
 
-void ws2812_preload(littleWire* lwHandle, unsigned char r,unsigned char g,unsigned char b)
+int ws2812_stopEffect(littleWire* lwHandle)
 {
-	lwStatus=usb_control_msg(lwHandle, 0xC0, 54, (g<<8) | 0x20, (b<<8) | r, (char*)rxBuffer, 8, USB_TIMEOUT);
+	return lwTransfer(lwHandle, 0x40, 70, 0, 0, NULL, 0);
 }
 
 int customMessage(littleWire* lwHandle,unsigned char* receiveBuffer,unsigned char command,unsigned char d1,unsigned char d2, unsigned char d3, unsigned char d4)
 {
 	int i;
 	int rc;
-	rc = lwStatus=usb_control_msg(lwHandle, 0xC0, command, (d2<<8)|d1, (d4<<8)|d3, (char*)rxBuffer, 8, USB_TIMEOUT);
+	rc = lwSend(lwHandle, command, (d2<<8)|d1, (d4<<8)|d3);
 	for(i=0;i<8;i++)
-		receiveBuffer[i]=rxBuffer[i];
+		receiveBuffer[i]=lwHandle->rxBuffer[i];
 	return rc;
 }
 
+void lw_batch_begin(lwBatch* batch)
+{
+	batch->commandLength = 0;
+	batch->resultLength = 0;
+}
+
+int lw_batch_add(lwBatch* batch, unsigned char command, unsigned int value, unsigned int index, unsigned char replyLength)
+{
+	unsigned char* cmd;
+	int offset;
+
+	if(replyLength > 8)
+		replyLength = 8;
+
+	// The device writes the replies over the commands as it runs them, so pad
+	// with empty commands (56) until this reply cannot overtake the next command.
+	while(batch->resultLength + replyLength > batch->commandLength + 6)
+	{
+		if(lw_batch_add(batch, 56, 0, 0, 0) < 0)
+			return -1;
+	}
+
+	if((batch->commandLength + 6 > BATCH_BUFFER_SIZE) || (batch->resultLength + replyLength > BATCH_BUFFER_SIZE))
+		return -1;
+
+	cmd = batch->commands + batch->commandLength;
+	cmd[0] = command;
+	cmd[1] = value & 0xFF;
+	cmd[2] = value >> 8;
+	cmd[3] = index & 0xFF;
+	cmd[4] = index >> 8;
+	cmd[5] = replyLength;
+	batch->commandLength += 6;
+
+	offset = batch->resultLength;
+	batch->resultLength += replyLength;
+	return offset;
+}
+
+int lw_batch_submit(littleWire* lwHandle, lwBatch* batch)
+{
+	unsigned char* cmd;
+	int i,j,out;
+
+	if(batch->commandLength == 0)
+		return 0;
+
+	if(!lwHasRequests(lwHandle, LW_CAP_BATCH))
+	{
+		// No batch support in the firmware, send the commands one at a time
+		out = 0;
+		for(i=0;i<batch->commandLength;i+=6)
+		{
+			cmd = batch->commands + i;
+			if(cmd[0] == 56)
+				continue;
+			if(lwSend(lwHandle, cmd[0], (cmd[2]<<8) | cmd[1], (cmd[4]<<8) | cmd[3]) < 0)
+				return lwHandle->status;
+			for(j=0;j<cmd[5];j++)
+				batch->results[out++] = (j < lwHandle->status) ? lwHandle->rxBuffer[j] : 0;
+		}
+		return out;
+	}
+
+	if((lwTransfer(lwHandle, 0x40, 56, 0, 0, (char*)batch->commands, batch->commandLength) < 0) || (batch->resultLength == 0))
+		return lwHandle->status;
+
+	return lwCollect(lwHandle, 56, batch->results, batch->resultLength);
+}
+
 /*------------------------------------------------------------------------------------------------------*/
 
 
@@ -408,13 +1888,41 @@ int customMessage(littleWire* lwHandle,unsigned char* receiveBuffer,unsigned cha
 * Do the crc8 calculation
 * Taken from: http://www.maxim-ic.com/appnotes.cfm/appnote_number/187
 ******************************************************************************/
-unsigned char docrc8(unsigned char value)
+static unsigned char docrc8(littleWire* lwHandle, unsigned char value)
 {
    // See Maxim Application Note 27
 
-   crc8 = dscrc_table[crc8 ^ value];
+   lwHandle->crc8 = dscrc_table[lwHandle->crc8 ^ value];
+
+   return lwHandle->crc8;
+}
+
+// One search step run by the firmware, used from version 0x14 on
+static int lwSearchOnDevice(littleWire* lwHandle)
+{
+	unsigned char buffer[11];
+	int i;
+
+	buffer[0] = lwHandle->LastDiscrepancy;
+	memcpy(buffer+1, lwHandle->ROM_NO, 8);
+	if(lwTransfer(lwHandle, 0x40, 62, 0, 0, (char*)buffer, 9) < 0)
+		return 0;
+	if(lwCollect(lwHandle, 62, buffer, 11) < 11 || buffer[10] != 1)
+		return 0;
 
-   return crc8;
+	memcpy(lwHandle->ROM_NO, buffer+1, 8);
+	lwHandle->crc8 = 0;
+	for(i=0;i<8;i++)
+		docrc8(lwHandle, lwHandle->ROM_NO[i]);
+	if(lwHandle->crc8 != 0)
+		return 0;
+
+	lwHandle->LastDiscrepancy = buffer[0];
+	if(buffer[9])
+		lwHandle->LastFamilyDiscrepancy = buffer[9];
+	if(lwHandle->LastDiscrepancy == 0)
+		lwHandle->LastDeviceFlag = 1;
+	return 1;
 }
 
 int onewire_nextAddress(littleWire* lwHandle)
@@ -430,18 +1938,20 @@ int onewire_nextAddress(littleWire* lwHandle)
    rom_byte_number = 0;
    rom_byte_mask = 1;
    search_result = 0;
-   crc8 = 0;
+   lwHandle->crc8 = 0;
 
    // if the last call was not the last one
-   if (!LastDeviceFlag)
+   if (!lwHandle->LastDeviceFlag && lwHasRequests(lwHandle, LW_CAP_ONEWIRE_BULK))
+      search_result = lwSearchOnDevice(lwHandle);
+   else if (!lwHandle->LastDeviceFlag)
    {
       // 1-Wire reset
       if (!onewire_resetPulse(lwHandle))
       {
          // reset the search
-         LastDiscrepancy = 0;
-         LastDeviceFlag = 0;
-         LastFamilyDiscrepancy = 0;
+         lwHandle->LastDiscrepancy = 0;
+         lwHandle->LastDeviceFlag = 0;
+         lwHandle->LastFamilyDiscrepancy = 0;
          return 0;
       }
 
@@ -467,11 +1977,11 @@ int onewire_nextAddress(littleWire* lwHandle)
             {
                // if this discrepancy if before the Last Discrepancy
                // on a previous next then pick the same as last time
-               if (id_bit_number < LastDiscrepancy)
-                  search_direction = ((ROM_NO[rom_byte_number] & rom_byte_mask) > 0);
+               if (id_bit_number < lwHandle->LastDiscrepancy)
+                  search_direction = ((lwHandle->ROM_NO[rom_byte_number] & rom_byte_mask) > 0);
                else
                   // if equal to last pick 1, if not then pick 0
-                  search_direction = (id_bit_number == LastDiscrepancy);
+                  search_direction = (id_bit_number == lwHandle->LastDiscrepancy);
 
                // if 0 was picked then record its position in LastZero
                if (search_direction == 0)
@@ -480,16 +1990,16 @@ int onewire_nextAddress(littleWire* lwHandle)
 
                   // check for Last discrepancy in family
                   if (last_zero < 9)
-                     LastFamilyDiscrepancy = last_zero;
+                     lwHandle->LastFamilyDiscrepancy = last_zero;
                }
             }
 
             // set or clear the bit in the ROM byte rom_byte_number
             // with mask rom_byte_mask
             if (search_direction == 1)
-              ROM_NO[rom_byte_number] |= rom_byte_mask;
+              lwHandle->ROM_NO[rom_byte_number] |= rom_byte_mask;
             else
-              ROM_NO[rom_byte_number] &= ~rom_byte_mask;
+              lwHandle->ROM_NO[rom_byte_number] &= ~rom_byte_mask;
 
             // serial number search direction write bit
             onewire_sendBit(lwHandle,search_direction);
@@ -502,7 +2012,7 @@ int onewire_nextAddress(littleWire* lwHandle)
             // if the mask is 0 then go to new SerialNum byte rom_byte_number and reset mask
             if (rom_byte_mask == 0)
             {
-                docrc8(ROM_NO[rom_byte_number]);  // accumulate the CRC
+                docrc8(lwHandle, lwHandle->ROM_NO[rom_byte_number]);  // accumulate the CRC
                 rom_byte_number++;
                 rom_byte_mask = 1;
             }
@@ -511,50 +2021,45 @@ int onewire_nextAddress(littleWire* lwHandle)
       while(rom_byte_number < 8);  // loop until through all ROM bytes 0-7
 
       // if the search was successful then
-      if (!((id_bit_number < 65) || (crc8 != 0)))
+      if (!((id_bit_number < 65) || (lwHandle->crc8 != 0)))
       {
-         // search successful so set LastDiscrepancy,LastDeviceFlag,search_result
-         LastDiscrepancy = last_zero;
+         // search successful so set lwHandle->LastDiscrepancy,lwHandle->LastDeviceFlag,search_result
+         lwHandle->LastDiscrepancy = last_zero;
 
          // check for last device
-         if (LastDiscrepancy == 0)
-            LastDeviceFlag = 1;
+         if (lwHandle->LastDiscrepancy == 0)
+            lwHandle->LastDeviceFlag = 1;
 
          search_result = 1;
       }
    }
 
    // if no device found then reset counters so next 'search' will be like a first
-   if (!search_result || !ROM_NO[0])
+   if (!search_result || !lwHandle->ROM_NO[0])
    {
-      LastDiscrepancy = 0;
-      LastDeviceFlag = 0;
-      LastFamilyDiscrepancy = 0;
+      lwHandle->LastDiscrepancy = 0;
+      lwHandle->LastDeviceFlag = 0;
+      lwHandle->LastFamilyDiscrepancy = 0;
       search_result = 0;
    }
 
+   memcpy(ROM_NO, lwHandle->ROM_NO, 8);
+
    return search_result;
 }
 
 int onewire_firstAddress(littleWire* lwHandle)
 {
-	littleWire* temp = lwHandle;
-
    // reset the search state
-   LastDiscrepancy = 0;
-   LastDeviceFlag = 0;
-   LastFamilyDiscrepancy = 0;
-
-   return onewire_nextAddress(temp);
-}
+   lwHandle->LastDiscrepancy = 0;
+   lwHandle->LastDeviceFlag = 0;
+   lwHandle->LastFamilyDiscrepancy = 0;
 
-int littleWire_error () {
-        if (lwStatus<0) return lwStatus;
-        else return 0;
+   return onewire_nextAddress(lwHandle);
 }
 
-char *littleWire_errorName () {
-        if (lwStatus<0) switch (lwStatus) {
+char *lw_statusName(int status) {
+        if (status<0) switch (status) {
                 case -1: return "I/O Error"; break;
                 case -2: return "Invalid paramenter"; break;
                 case -3: return "Access error"; break;
@@ -572,3 +2077,432 @@ char *littleWire_errorName () {
         }
         else return 0;
 }
+
+int littleWire_error () {
+        if (lwStatus<0) return lwStatus;
+        else return 0;
+}
+
+char *littleWire_errorName () {
+        return lw_statusName(lwStatus);
+}
+
+int lw_error(littleWire* lwHandle) {
+        if (lwHandle->status<0) return lwHandle->status;
+        else return 0;
+}
+
+int macro_addWait(lwBatch* batch, unsigned int ms)
+{
+	// Request 82 is the macro request itself, within a macro it means wait
+	return (lw_batch_add(batch, 82, ms, 0, 0) < 0) ? -1 : 0;
+}
+
+int macro_store(littleWire* lwHandle, lwBatch* const* macros, int count)
+{
+	unsigned char image[MACRO_AREA_SIZE];
+	unsigned char reply[3];
+	unsigned long start;
+	int length = 0;
+	int offset, chunk, i;
+
+	for(i=0;i<count;i++)
+	{
+		if(length + 1 + macros[i]->commandLength > MACRO_AREA_SIZE)
+			return -1;
+		image[length++] = macros[i]->commandLength / 6;
+		memcpy(image + length, macros[i]->commands, macros[i]->commandLength);
+		length += macros[i]->commandLength;
+	}
+	if(length < MACRO_AREA_SIZE)
+		image[length++] = 0;
+
+	for(offset=0;offset<length;offset+=chunk)
+	{
+		chunk = (length - offset > BATCH_BUFFER_SIZE) ? BATCH_BUFFER_SIZE : length - offset;
+		if(lwTransfer(lwHandle, 0x40, 82, 2, offset, (char*)image + offset, chunk) < 0)
+			return lwHandle->status;
+		// The status reply only comes back once the EEPROM writes are done
+		start = lwMicros();
+		while(lwTransfer(lwHandle, 0xC0, 82, 0, 0, (char*)reply, sizeof(reply)) < 3)
+		{
+			if(lwMicros() - start > (LW_JOB_TIMEOUT + 4 * chunk) * 1000UL)
+				return -1;
+			lwHandle->stats.retries++;
+			delay(1);
+		}
+	}
+	return 0;
+}
+
+int macro_run(littleWire* lwHandle, unsigned char macro)
+{
+	return lwTransfer(lwHandle, 0x40, 82, 1 | (macro << 8), 0, NULL, 0);
+}
+
+int macro_trigger(littleWire* lwHandle, unsigned char macro, unsigned char pins, unsigned char levels)
+{
+	return lwTransfer(lwHandle, 0x40, 82, 3 | (macro << 8), pins | (levels << 8), NULL, 0);
+}
+
+int macro_read(littleWire* lwHandle, unsigned char* results, int* running)
+{
+	unsigned char reply[MACRO_RESULT_SIZE+3];
+	int count;
+
+	count = lwTransfer(lwHandle, 0xC0, 82, 0, 0, (char*)reply, sizeof(reply));
+	if(count < 0)
+		return count;
+	if(count < 3)
+		return -1;
+	if(running)
+		*running = reply[0];
+	count = (reply[2] < count - 3) ? reply[2] : count - 3;
+	memcpy(results, reply+3, count);
+	return count;
+}
+
+int macro_stop(littleWire* lwHandle)
+{
+	return lwTransfer(lwHandle, 0x40, 82, 0, 0, NULL, 0);
+}
+
+int lw_clockStart(littleWire* lwHandle)
+{
+	if(lwSend(lwHandle, 83, 1, 0) < 0)
+		return lwHandle->status;
+	return (lwHandle->status >= 4) ? 0 : -1;
+}
+
+int lw_clockStop(littleWire* lwHandle)
+{
+	return lwSend(lwHandle, 83, 2, 0);
+}
+
+int lw_clockRead(littleWire* lwHandle, unsigned long* ticks)
+{
+	if(lwSend(lwHandle, 83, 0, 0) < 0)
+		return lwHandle->status;
+	if(lwHandle->status < 4)
+		return -1;
+	*ticks = lwHandle->rxBuffer[0] | (lwHandle->rxBuffer[1] << 8) | ((unsigned long)lwHandle->rxBuffer[2] << 16) | ((unsigned long)lwHandle->rxBuffer[3] << 24);
+	return 0;
+}
+
+int lw_batch_addTimestamp(lwBatch* batch)
+{
+	return lw_batch_add(batch, 83, 0, 0, 4);
+}
+
+/******************************************************************************
+* Extends ticks of the given bits to the value nearest last.
+******************************************************************************/
+static unsigned long long lwClockExtend(unsigned long long last, unsigned long ticks, int bits)
+{
+	unsigned long long span, t;
+
+	if(bits < 1 || bits > 32)
+		bits = 32;
+	span = 1ULL << bits;
+	t = (last & ~(span-1)) | (ticks & (span-1));
+	if(t + span/2 < last)
+		t += span;
+	else if((t > last + span/2) && (t >= span))
+		t -= span;
+	return t;
+}
+
+void lw_clockSyncBegin(lwClockSync* sync)
+{
+	memset(sync, 0, sizeof(lwClockSync));
+	sync->rate = 1.0e6 / LW_CLOCK_HZ;
+}
+
+int lw_clockSync(littleWire* lwHandle, lwClockSync* sync, int rounds)
+{
+	unsigned long before, trip, ticks;
+	unsigned long bestBefore = 0, bestTrip = 0, bestTicks = 0;
+	double meanHost = 0, meanDevice = 0, sxx = 0, sxy = 0, dx;
+	int i, n, got = 0;
+
+	for(i=0;i<rounds;i++)
+	{
+		before = lwMicros();
+		if(lw_clockRead(lwHandle, &ticks) < 0)
+			continue;
+		trip = lwMicros() - before;
+		if(!got || trip < bestTrip)
+		{
+			bestBefore = before;
+			bestTrip = trip;
+			bestTicks = ticks;
+		}
+		got++;
+	}
+	if(!got)
+		return (lwHandle->status < 0) ? lwHandle->status : -1;
+
+	if(!sync->count)
+	{
+		sync->hostBase = bestBefore;
+		sync->lastTicks = bestTicks;
+	}
+	if(sync->count == LW_SYNC_POINTS)
+	{
+		memmove(sync->host, sync->host+1, (LW_SYNC_POINTS-1) * sizeof(sync->host[0]));
+		memmove(sync->device, sync->device+1, (LW_SYNC_POINTS-1) * sizeof(sync->device[0]));
+		sync->count--;
+	}
+	n = sync->count++;
+	sync->host[n] = (double)(unsigned long)(bestBefore - sync->hostBase) + bestTrip / 2.0;
+	sync->device[n] = lwClockExtend(sync->lastTicks, bestTicks, 32);
+	sync->lastTicks = sync->device[n];
+	sync->error = bestTrip / 2.0;
+
+	// Least squares line through the readings, host time over device ticks
+	for(i=0;i<sync->count;i++)
+	{
+		meanHost += sync->host[i];
+		meanDevice += (double)sync->device[i];
+	}
+	meanHost /= sync->count;
+	meanDevice /= sync->count;
+	for(i=0;i<sync->count;i++)
+	{
+		dx = (double)sync->device[i] - meanDevice;
+		sxx += dx * dx;
+		sxy += dx * (sync->host[i] - meanHost);
+	}
+	if(sxx > 0)
+		sync->rate = sxy / sxx;
+	sync->offset = meanHost - sync->rate * meanDevice;
+	sync->drift = (1.0e6 / LW_CLOCK_HZ / sync->rate - 1.0) * 1.0e6;
+	return (int)(bestTrip / 2);
+}
+
+double lw_clockToHost(const lwClockSync* sync, unsigned long ticks, int bits)
+{
+	return sync->hostBase + sync->offset + sync->rate * (double)lwClockExtend(sync->lastTicks, ticks, bits);
+}
+
+int lw_timingStart(littleWire* lwHandle)
+{
+	if(lwSend(lwHandle, 86, 1, 0) < 0)
+		return lwHandle->status;
+	return (lwHandle->status > 0) ? 0 : -1;
+}
+
+int lw_timingStop(littleWire* lwHandle)
+{
+	return lwSend(lwHandle, 86, 2, 0);
+}
+
+int lw_timingRead(littleWire* lwHandle, lwTiming* timing)
+{
+	unsigned char reply[12 + 5*LW_TIMING_SLOTS];
+	unsigned char* slot;
+	unsigned long max;
+	int slots, i, j;
+
+	if(lwTransfer(lwHandle, 0xC0, 86, 0, 0, (char*)reply, sizeof(reply)) < 0)
+		return lwHandle->status;
+	if(lwHandle->status < 12)
+		return -1;
+
+	/* Ticks of the device clock are 128 cycles */
+	timing->running = reply[0] & 1;
+	timing->timerTaken = (reply[0] >> 1) & 1;
+	timing->offMax = (unsigned long)(reply[2] | (reply[3] << 8)) * 128;
+	timing->offTotal = (reply[4] | (reply[5] << 8) | ((unsigned long)reply[6] << 16) | ((unsigned long)reply[7] << 24)) * 128;
+	timing->missedFrames = reply[8] | (reply[9] << 8);
+	timing->loopMax = (unsigned long)(reply[10] | (reply[11] << 8)) * 128;
+
+	slots = (lwHandle->status - 12) / 5;
+	if(slots > reply[1])
+		slots = reply[1];
+	if(slots > LW_TIMING_SLOTS)
+		slots = LW_TIMING_SLOTS;
+
+	timing->count = 0;
+	for(i=0;i<slots;i++)
+	{
+		slot = reply + 12 + 5*i;
+		if(!slot[2])
+			continue;
+		max = (unsigned long)(slot[3] | (slot[4] << 8)) * 128;
+		/* Insert in order, slowest first */
+		for(j=timing->count; j>0 && timing->slowest[j-1].max < max; j--)
+			timing->slowest[j] = timing->slowest[j-1];
+		timing->slowest[j].job = slot[0];
+		timing->slowest[j].id = slot[1];
+		timing->slowest[j].count = slot[2];
+		timing->slowest[j].max = max;
+		timing->count++;
+	}
+	return 0;
+}
+
+/******************************************************************************
+* PIC24F ICSP batches, see pic24Batch in the firmware. The words read are kept
+* behind the operations on the device, so both must fit its buffer.
+******************************************************************************/
+#define PIC24_SIX	0
+#define PIC24_REGOUT	1
+#define PIC24_NOPS	2
+#define PIC24_ENTER	3
+#define PIC24_EXIT	4
+#define PIC24_WAIT	5
+
+static int pic24Add(lwPic24Batch* batch, const unsigned char* op, int length, int reads, unsigned long time)
+{
+	if(batch->length + length + 2 * (batch->reads + reads) > PIC24_BATCH_SIZE)
+		return -1;
+	memcpy(batch->ops + batch->length, op, length);
+	batch->length += length;
+	batch->reads += reads;
+	batch->time += time;
+	return 0;
+}
+
+void pic24_begin(lwPic24Batch* batch)
+{
+	batch->length = 0;
+	batch->reads = 0;
+	batch->time = 0;
+}
+
+int pic24_addEnter(lwPic24Batch* batch, unsigned long key)
+{
+	unsigned char op[5] = { PIC24_ENTER, key >> 24, key >> 16, key >> 8, key };
+	return pic24Add(batch, op, 5, 0, 53000);
+}
+
+int pic24_addExit(lwPic24Batch* batch)
+{
+	unsigned char op[1] = { PIC24_EXIT };
+	return pic24Add(batch, op, 1, 0, 1000);
+}
+
+int pic24_addSix(lwPic24Batch* batch, unsigned long instruction)
+{
+	unsigned char op[4] = { PIC24_SIX, instruction, instruction >> 8, instruction >> 16 };
+	return pic24Add(batch, op, 4, 0, 28);
+}
+
+int pic24_addNops(lwPic24Batch* batch, unsigned char count)
+{
+	unsigned char op[2] = { PIC24_NOPS, count };
+	return count ? pic24Add(batch, op, 2, 0, 28UL * count) : 0;
+}
+
+int pic24_addRegout(lwPic24Batch* batch)
+{
+	unsigned char op[1] = { PIC24_REGOUT };
+	if(pic24Add(batch, op, 1, 1, 28) < 0)
+		return -1;
+	return batch->reads - 1;
+}
+
+int pic24_addWait(lwPic24Batch* batch, unsigned char ms)
+{
+	unsigned char op[2] = { PIC24_WAIT, ms };
+	return pic24Add(batch, op, 2, 0, 1000UL * ms);
+}
+
+int pic24_run(littleWire* lwHandle, lwPic24Batch* batch, unsigned int* words)
+{
+	unsigned char reply[PIC24_BATCH_SIZE];
+	unsigned long start;
+	int i, status;
+
+	if(!lw_hasCapability(lwHandle, LW_CAP_PIC24))
+		return -1;
+	if(!batch->length)
+		return 0;
+	if(lwTransfer(lwHandle, 0x40, 88, 0, 0, (char*)batch->ops, batch->length) < 0)
+		return lwHandle->status;
+
+	// no reply until the batch has run
+	start = lwMicros();
+	while((status = lwTransfer(lwHandle, 0xC0, 88, 0, 0, (char*)reply, 1 + 2*batch->reads)) == 0)
+	{
+		if(lwMicros() - start > LW_JOB_TIMEOUT * 1000UL + batch->time)
+			break;
+		lwHandle->stats.retries++;
+		delay(1);
+	}
+	if(status < 0)
+		return status;
+	if(status != 1 + 2*batch->reads || !reply[0])
+		return -1;
+	for(i=0;i<batch->reads;i++)
+		words[i] = reply[1+2*i] | (reply[2+2*i] << 8);
+	return batch->reads;
+}
+
+/******************************************************************************
+* Servo multiplexer, request 89. Value holds the mode and its argument, the
+* pulse widths go in the data stage of an OUT transfer.
+******************************************************************************/
+static int servoMuxRequest(littleWire* lwHandle, int mode, int arg, int* count)
+{
+	unsigned char reply[2];
+
+	if(lwTransfer(lwHandle, 0xC0, 89, mode | (arg << 8), 0, (char*)reply, 2) < 0)
+		return lwHandle->status;
+	if(lwHandle->status < 2)
+		return -1;
+	if(count)
+		*count = reply[1];
+	return reply[0];
+}
+
+int servoMux_startPins(littleWire* lwHandle, unsigned char pins)
+{
+	int status;
+
+	if(!lw_hasCapability(lwHandle, LW_CAP_SERVO_MUX))
+		return 0;
+	status = servoMuxRequest(lwHandle, 1, pins, NULL);
+	return status < 0 ? status : (status & 1);
+}
+
+int servoMux_startShiftRegister(littleWire* lwHandle, int count)
+{
+	int status;
+
+	if(!lw_hasCapability(lwHandle, LW_CAP_SERVO_MUX) || count < 1 || count > SERVO_MUX_MAX)
+		return 0;
+	status = servoMuxRequest(lwHandle, 2, count, NULL);
+	return status < 0 ? status : (status & 1);
+}
+
+int servoMux_write(littleWire* lwHandle, const unsigned int* pulseWidths, int count)
+{
+	unsigned char buffer[2*SERVO_MUX_MAX];
+	int i;
+
+	if(count > SERVO_MUX_MAX)
+		count = SERVO_MUX_MAX;
+	for(i=0;i<count;i++)
+	{
+		buffer[2*i] = pulseWidths[i] & 0xFF;
+		buffer[2*i+1] = pulseWidths[i] >> 8;
+	}
+	return lwTransfer(lwHandle, 0x40, 89, 0, 0, (char*)buffer, 2*count);
+}
+
+int servoMux_stop(littleWire* lwHandle)
+{
+	int status = servoMuxRequest(lwHandle, 0, 0, NULL);
+	return status < 0 ? status : 0;
+}
+
+int servoMux_status(littleWire* lwHandle, int* count)
+{
+	return servoMuxRequest(lwHandle, 3, 0, count);
+}
+
+char *lw_errorName(littleWire* lwHandle) {
+        return lw_statusName(lwHandle->status);
+}
@@ -40,7 +40,35 @@
 #define	VENDOR_ID 0x1781
 #define	PRODUCT_ID 0x0c9f
 #define USB_TIMEOUT 5000
+#define LW_JOB_TIMEOUT 100		// miliseconds to wait for the result of a job
+#define LW_SERIAL_MAX 99999999	// largest serial number, 8 digits
 #define RX_BUFFER_SIZE 64
+#define BATCH_BUFFER_SIZE 128
+#define SPI_STREAM_SIZE 128		// bytes per spi_transfer request
+#define SPI_READ_SIZE 248		// bytes per spi_read request
+#define I2C_TRANSFER_SIZE 126	// maximum bytes written or read by i2c_transfer
+#define ONEWIRE_TRANSFER_SIZE 126	// maximum bytes written or read by onewire_transfer
+#define ONEWIRE_SWEEP_SIZE 16		// sensors read by one request of onewire_readTemperatures
+#define ONEWIRE_CONVERT_TIME 750	// miliseconds of a 12 bit temperature conversion
+#define ADC_STREAM_READ_SIZE 254	// bytes per analog_streamRead request
+#define PIN_EVENTS_PER_READ 2		// events returned by one pinEvents_read
+#define PATTERN_MAX_STEPS 41		// steps in one pattern_play
+#define WS2812_FRAME_SIZE 192		// bytes of the device frame buffer
+#define LOGIC_CAPTURE_SIZE 128		// bytes of the device capture buffer
+#define DEBUG_CONSOLE_SIZE 127		// bytes the device queues for debugSpi_read
+#define UART_BURST_SIZE 128		// bytes sent per uart_transfer request
+#define UART_RECEIVE_SIZE 127		// most bytes received by one uart_transfer
+#define MACRO_AREA_SIZE 464		// EEPROM bytes for stored macros, after the serial number
+#define MACRO_RESULT_SIZE 125		// most reply bytes a macro run collects
+#define LW_SYNC_POINTS 16		// clock readings kept by lw_clockSync for the fit
+#define LW_TIMING_SLOTS 6		// slowest requests and jobs kept by the device, see lw_timingRead
+#define PIC24_BATCH_SIZE 128	// bytes of operations and words read in one pic24_run
+#define SERVO_MUX_MAX 16		// servos on shift registers, see servoMux_startShiftRegister
+#define LOGIC_MAX_RATE 250000		// fastest sample rate the capture loop keeps up with
+#define LOGIC_TIMED_RATE 4028		// fastest sample rate captured with USB running, F_CPU/4096
+
+#define LITTLE_WIRE_F_CPU 16500000UL	// clock of the littleWire, for timing calculations
+#define LW_CLOCK_HZ (LITTLE_WIRE_F_CPU / 128.0)	// nominal ticks per second of the device clock
 
 #define INPUT 1
 #define OUTPUT 0
@@ -64,6 +92,8 @@
 #define NO_STOP 0
 #define READ 1
 #define WRITE 0
+#define I2C_USI_STANDARD 0x100	// i2c_updateDelay: USI hardware at 100 kHz
+#define I2C_USI_FAST 0x200	// i2c_updateDelay: USI hardware at 400 kHz
 
 // General Purpose Pins
 #define PIN1 1
@@ -76,6 +106,74 @@
 #define ADC_PIN2 1
 #define ADC_TEMP_SENS 2
 
+// Capabilities reported by firmware v1.5 on, see lw_hasCapability. Apart
+// from the job status each is only built into the firmware when asked for,
+// with the make flag given, e.g. make hex BATCH=1 UART=1. Without it the
+// functions named fall back to older requests where there are some.
+#define LW_CAP_BATCH        (1UL << 0)   // lw_batch_submit in one request, BATCH=1
+#define LW_CAP_SPI_STREAM   (1UL << 1)   // spi_transfer, spi_read, SPI_STREAM=1
+#define LW_CAP_I2C_TRANSFER (1UL << 2)   // i2c_transfer, register reads, I2C_TRANSFER=1
+#define LW_CAP_ONEWIRE_BULK (1UL << 3)   // on device search, onewire_transfer, ONEWIRE_BULK=1
+#define LW_CAP_ADC_STREAM   (1UL << 4)   // analog_streamStart/Read, ADC_STREAM=1
+#define LW_CAP_PIN_EVENTS   (1UL << 5)   // pinEvents_read, PIN_EVENTS=1
+#define LW_CAP_PORT_UPDATE  (1UL << 6)   // port update, PORT_UPDATE=1
+#define LW_CAP_SEQUENCER    (1UL << 7)   // pattern_play, SEQUENCER=1
+#define LW_CAP_WS2812_FRAME (1UL << 8)   // ws2812 frame upload and effects, WS2812_FRAME=1
+#define LW_CAP_SERVO        (1UL << 9)   // timer driven servo, SERVO=1
+#define LW_CAP_SERIAL       (1UL << 10)  // 8 digit serial numbers, SERIAL_DIGITS=8
+#define LW_CAP_JOB_STATUS   (1UL << 11)  // lw_waitIdle polls the device
+#define LW_CAP_DW_STREAM    (1UL << 12)  // debugWIRE stream read, DW_STREAM=1
+#define LW_CAP_DW_REPEAT    (1UL << 13)  // debugWIRE repeat, DW_REPEAT=1
+#define LW_CAP_DW_TRACE     (1UL << 14)  // debugWIRE trace, DW_TRACE=1
+#define LW_CAP_DW_BREAK     (1UL << 15)  // debugWIRE break on the interrupt-in endpoint, DW_BREAK=1
+#define LW_CAP_LOGIC        (1UL << 16)  // logic_captureStart/Read, CAPTURE=1
+#define LW_CAP_MEASURE      (1UL << 17)  // measure_edges, measure_pulses, MEASURE=1
+#define LW_CAP_DEBUG_FIFO   (1UL << 18)  // debugSpi_start/read, DEBUG_FIFO=1
+#define LW_CAP_UART         (1UL << 19)  // uart_transfer, UART=1
+#define LW_CAP_MACRO        (1UL << 20)  // macro_store and friends, MACRO=1
+#define LW_CAP_CLOCK        (1UL << 21)  // lw_clockRead, lw_batch_addTimestamp, CLOCK=1
+#define LW_CAP_PWM_FAST     (1UL << 22)  // pwm_fastStart, FAST_PWM=1
+#define LW_CAP_I2C_USI      (1UL << 23)  // I2C_USI_STANDARD, I2C_USI_FAST, I2C_USI=1
+#define LW_CAP_WS2812_PARALLEL (1UL << 24) // ws2812_sendParallel, WS2812_PARALLEL=1
+#define LW_CAP_ONEWIRE_SWEEP (1UL << 25) // onewire_readTemperatures on the device, ONEWIRE_SWEEP=1
+#define LW_CAP_TIMING       (1UL << 26)  // lw_timingRead, TIMING=1
+#define LW_CAP_ADC_SCAN     (1UL << 27)  // analog_scan on the device, ADC_SCAN=1
+#define LW_CAP_PIC24        (1UL << 28)  // pic24_run, PIC24=1
+#define LW_CAP_SERVO_MUX    (1UL << 29)  // servoMux_startPins and friends, SERVO_MUX=1
+
+// Logic capture modes and flags, see logic_captureStart
+#define LOGIC_SAMPLES 0x10		// a 4 bit sample at every tick, two per byte
+#define LOGIC_EDGES 0x20		// a 2 byte entry at every change: channels and ticks since the last
+#define LOGIC_EDGE_TRIGGER 0x40	// wait for the trigger pattern to be entered, not just present
+
+// Measurement states, see lwMeasurement
+#define MEASURE_IDLE 0
+#define MEASURE_RUNNING 1
+#define MEASURE_DONE 2
+#define MEASURE_TIMEOUT 3
+
+// Fast PWM flags
+#define PWM_FAST_COMPLEMENTARY 0x40	// inverse output on PIN4, with dead time
+
+// Soft PWM flags
+#define SOFTPWM_GAMMA 2
+
+// ADC stream flags
+#define ADC_STREAM_8BIT 1
+
+// ADC scan channels, see analog_scan
+#define ADC_SCAN_PIN3 (1 << ADC_PIN3)
+#define ADC_SCAN_PIN2 (1 << ADC_PIN2)
+#define ADC_SCAN_TEMP_SENS (1 << ADC_TEMP_SENS)
+#define ADC_SCAN_MAX_OVERSAMPLING 6	// 4^6 conversions per channel, a 16 bit result
+
+// Pattern sequencer tick lengths, see pattern_play
+#define PATTERN_TICK_60ns 1
+#define PATTERN_TICK_485ns 4
+#define PATTERN_TICK_3880ns 7
+#define PATTERN_TICK_15500ns 9
+#define PATTERN_TICK_62000ns 11
+
 // PWM Pins
 #define PWM1 PIN4
 #define PWM2 PIN1
@@ -93,6 +191,8 @@
 #define MOSI_PIN PIN4
 #define RESET_PIN PIN3
 
+/* Copies of the state of the last used device. Kept for single device programs, */
+/* use the fields of the littleWire handle when driving several devices.          */
 extern unsigned char rxBuffer[RX_BUFFER_SIZE]; /* This has to be unsigned for the data's sake */
 extern unsigned char ROM_NO[8];
 extern int lwStatus;
@@ -102,27 +202,149 @@ extern int lwStatus;
 *  @{
 */
 
-typedef usb_dev_handle littleWire;
+#define LW_LATENCY_BUCKETS 16	// bucket n counts transfers taking less than 64<<n us, the last one the rest
+
+/* Transfer counters, kept for each device */
+typedef struct lwStats
+{
+  unsigned long transfers;     /* control transfers made */
+  unsigned long errors;        /* transfers which failed */
+  unsigned long timeouts;      /* transfers which failed with a timeout */
+  unsigned long retries;       /* polls repeated while waiting for the device */
+  unsigned long bytesIn;       /* bytes received */
+  unsigned long bytesOut;      /* bytes sent */
+  unsigned long totalMicros;   /* time spent in transfers, wraps */
+  unsigned long maxMicros;     /* longest transfer */
+  unsigned long latency[LW_LATENCY_BUCKETS];
+} lwStats;
+
+/**
+  * Called after every control transfer.
+  *
+  * @param stats Counters of the device the transfer was made on, already updated
+  * @param request Firmware command
+  * @param requestType bmRequestType of the transfer, USB_ENDPOINT_IN set for a read
+  * @param status Number of bytes transferred, negative for a failure
+  * @param micros Time the transfer took in microseconds
+  * @param userData Pointer given to lw_setTransferHook
+  */
+typedef void (*lwTransferHook)(lwStats* stats, int request, int requestType, int status, unsigned long micros, void* userData);
+
+struct littleWire;
+
+/* Transport of a device that is not on the local USB, such as one shared by lwd.
+   The transport keeps its own state after these, see littleWire_remote.h. */
+typedef struct lwRemote
+{
+  int (*transfer)(struct littleWire* lwHandle, int requestType, int request, int value, int index, char* bytes, int size, int timeout);
+  int (*interruptRead)(struct littleWire* lwHandle, char* bytes, int size, int timeout);
+  void (*close)(struct littleWire* lwHandle);
+} lwRemote;
+
+/* Per device state. Each device can be driven from its own thread. */
+typedef struct littleWire
+{
+  usb_dev_handle* handle;                 /* NULL for a remote device */
+  lwRemote* remote;                       /* NULL for a local device */
+  unsigned char rxBuffer[RX_BUFFER_SIZE]; /* reply to the last request */
+  int status;                             /* status of the last request */
+  unsigned char firmwareVersion;          /* read when the device is connected */
+  unsigned long capabilities;             /* LW_CAP_ bits, read with the version */
+
+  /* 1-Wire search state. ROM_NO holds the last address found. */
+  unsigned char ROM_NO[8];
+  unsigned char crc8;
+  int LastDiscrepancy;
+  int LastFamilyDiscrepancy;
+  int LastDeviceFlag;
+
+  /* Pin change events: timestamp of the last event in device timer ticks */
+  unsigned long pinEventTicks;
+
+  lwStats stats;                          /* transfer counters, see lw_stats_reset */
+} littleWire;
+
+/**
+  * A change of the pins watched with pinEvents_enable.
+  */
+typedef struct lwPinEvent
+{
+  unsigned char pins;   /* state of the watched pins after the change, bit n is pin n (PIN1 is bit 1 ...) */
+  unsigned long time;   /* microseconds since pinEvents_enable */
+  int lost;             /* nonzero if events were dropped before this one */
+} lwPinEvent;
+
+typedef void (*lwPinEventCallback)(littleWire* lwHandle, lwPinEvent* event, void* userData);
+
+/**
+  * Result of measure_edges or measure_pulses.
+  */
+typedef struct lwMeasurement
+{
+  int state;            /* MEASURE_DONE, MEASURE_TIMEOUT if not all periods were seen, MEASURE_RUNNING */
+  int periods;          /* periods timed by measure_pulses */
+  unsigned long high;   /* CPU cycles high over all periods, or edges counted */
+  unsigned long low;    /* CPU cycles low over all periods, or gate time in Timer1 overflows */
+  double frequency;     /* Hz */
+  double duty;          /* share of the period spent high, 0 for an edge count */
+} lwMeasurement;
+
+/**
+  * One step of a pattern played by pattern_play.
+  */
+typedef struct lwPatternStep
+{
+  unsigned char value;  /* pin states, bit n is pin n */
+  unsigned int ticks;   /* time until the next step */
+} lwPatternStep;
+
+#define LW_PATH_SIZE 64
 
 typedef struct lwCollection
 {
   struct usb_device* lw_device;
   int serialNumber;
+  char path[LW_PATH_SIZE];  /* bus and device name, changes when the device is plugged in again */
 } lwCollection;
 
-extern lwCollection lwResults[16];
+/**
+  * Called by littlewire_search for a device that was plugged in or removed since the
+  * last search. A removed device has already left lwResults and its lw_device is NULL.
+  */
+typedef void (*lwRegistryCallback)(lwCollection* device, int arrived, void* userData);
+
+extern lwCollection* lwResults;
 
 extern int lw_totalDevices;
 
 /**
   * Tries to cache all the littleWire devices and stores them in lwResults array. \n
-  * Don't actually connects to any of the device(s).
+  * Don't actually connects to any of the device(s). The array is kept between calls,
+  * and only the devices plugged in since the last call are opened to read their
+  * serial number.
   *
   * @param (none)
   * @return Total number of littleWire devices found in the USB system.
   */
 int littlewire_search();
 
+/**
+  * Sets the function littlewire_search calls for each device plugged in or removed.
+  *
+  * @param callback Function to call, NULL for none
+  * @param userData Passed to the callback
+  * @return (none)
+  */
+void lw_registry_onChange(lwRegistryCallback callback, void* userData);
+
+/**
+  * Looks up a serial number in lwResults without searching the USB system.
+  *
+  * @param serialNumber Serial number of the desired littlewire device.
+  * @return Array index of the device in lwResults, -1 if it is not there.
+  */
+int lw_registry_find(int serialNumber);
+
 /**
   * Tries to connect to the spesific littleWire device by array id.
   *
@@ -133,13 +355,40 @@ littleWire* littlewire_connect_byID(int desiredID);
 
 /**
   * Tries to connect to the spesific littleWire with a given serial number. \n
-  * If multiple devices have the same serial number, it connects to the last one it finds
+  * If multiple devices have the same serial number, it connects to the last one it finds.
+  * Devices already in lwResults are opened straight away, the USB system is only searched
+  * again when the serial number is not known or the device has gone.
   *
   * @param mySerial Serial number of the desired littlewire device.
   * @return littleWire pointer for healthy connection, NULL for a failed trial.
   */
 littleWire* littlewire_connect_bySerialNum(int mySerial);
 
+/**
+  * Connects to the littleWire at a bus path, as in lwCollection.path. \n
+  * Only that device is opened and no string descriptor is read, the quickest way to pick
+  * one of many. The path changes when the device is plugged in again.
+  *
+  * @param path Bus and device name, "001/004" on Linux
+  * @return littleWire pointer for healthy connection, NULL for a failed trial.
+  */
+littleWire* littlewire_connect_byPath(const char* path);
+
+/**
+  * Connects to the littleWire with a given serial number, reading the serial number of
+  * no other device than needed. \n
+  * The device at cachedPath is tried first, so one connected before, whose path was kept,
+  * costs a single string descriptor read. Otherwise only serial numbers are read, not the
+  * vendor and product names, up to the first match. The path of the device found is stored
+  * in cachedPath for next time; it may be kept in a file between runs.
+  *
+  * @param mySerial Serial number of the desired littlewire device.
+  * @param cachedPath Path where it was found before, "" if unknown, updated
+  * @param pathSize Size of cachedPath, LW_PATH_SIZE
+  * @return littleWire pointer for healthy connection, NULL for a failed trial.
+  */
+littleWire* littlewire_connect_bySerialCached(int mySerial, char* cachedPath, int pathSize);
+
 /**
   * Tries to connect to the first littleWire device that libusb can find.
   *
@@ -148,6 +397,14 @@ littleWire* littlewire_connect_bySerialNum(int mySerial);
   */
 littleWire* littleWire_connect();
 
+/**
+  * Closes the connection to a littleWire device and frees its handle.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return (none)
+  */
+void littleWire_disconnect(littleWire* lwHandle);
+
 /**
   * Reads the firmware version of the Little Wire \n
   * Format: 0xXY => X: Primary version Y: Minor version
@@ -158,9 +415,24 @@ littleWire* littleWire_connect();
 unsigned char readFirmwareVersion(littleWire* lwHandle);
 
 /**
-  * Changes the USB serial number of the Little Wire
+  * Tells whether the firmware answers a group of requests. \n
+  * Firmware v1.5 on reports a capability bitmap with its version; older
+  * firmware reports none and 0 is returned for every capability.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param capability One of the LW_CAP_ flags
+  * @return 1 if the firmware has the capability, 0 if not
+  */
+int lw_hasCapability(littleWire* lwHandle, unsigned long capability);
+
+/**
+  * Changes the USB serial number of the Little Wire. \n
+  * The new number is used once the device is plugged in again. Only firmware built with
+  * SERIAL_DIGITS=8, see \b LW_CAP_SERIAL, takes any number up to LW_SERIAL_MAX, or up to
+  * as many digits as SERIAL_DIGITS gives and refuses larger ones. The rest, the default
+  * build among them, only take serial numbers from 100 to 999.
   *
-  * @param serialNumber Serial number integer value (100-99)
+  * @param serialNumber Serial number integer value (0-LW_SERIAL_MAX)
   * @return (none)
   */
 void changeSerialNumber(littleWire* lwHandle,int serialNumber);
@@ -179,6 +451,65 @@ void changeSerialNumber(littleWire* lwHandle,int serialNumber);
   */
 int customMessage(littleWire* lwHandle,unsigned char* receiveBuffer,unsigned char command,unsigned char d1,unsigned char d2, unsigned char d3, unsigned char d4);
 
+/**
+  * Waits until the device has finished the job it is running. \n
+  * The job status is polled, so the wait ends as soon as the device is done. Firmware
+  * before v1.4 has no job status and the full timeout is waited instead.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param timeout Longest wait in miliseconds
+  * @return 0 once the device is idle, 1 if it is still busy after the timeout, negative for a failed communication.
+  */
+int lw_waitIdle(littleWire* lwHandle, unsigned int timeout);
+
+/**
+  * Sets a function to be called after every control transfer of every device,
+  * for example to feed the transfer times to a monitoring system.
+  *
+  * @param hook Function to call, NULL for none
+  * @param userData Passed to the hook
+  * @return (none)
+  */
+void lw_setTransferHook(lwTransferHook hook, void* userData);
+
+/**
+  * Clears transfer counters, such as lwHandle->stats.
+  *
+  * @param stats Counters to clear
+  * @return (none)
+  */
+void lw_stats_reset(lwStats* stats);
+
+/**
+  * Counts one transfer made some other way, for example through a serial port,
+  * just as lw_control_msg counts its own.
+  *
+  * @param stats Counters to update
+  * @param requestType USB_ENDPOINT_IN set for a read
+  * @param status Number of bytes transferred, negative for a failure
+  * @param micros Time the transfer took in microseconds
+  * @return (none)
+  */
+void lw_stats_count(lwStats* stats, int requestType, int status, unsigned long micros);
+
+/**
+  * Monotonic time in microseconds as used for the transfer times, wraps.
+  *
+  * @param (none)
+  * @return Microseconds
+  */
+unsigned long lw_micros();
+
+/**
+  * usb_control_msg with the transfer counted in stats and passed to the transfer hook.
+  * Every transfer of the library goes through here. Code which talks to the device
+  * directly, such as the debugWIRE tools, can use it too.
+  *
+  * @param stats Counters to update, may be NULL
+  * @return Same as usb_control_msg.
+  */
+int lw_control_msg(lwStats* stats, usb_dev_handle* handle, int requestType, int request, int value, int index, char* bytes, int size, int timeout);
+
 /**
   * Returns the numeric value of the status of the last communication attempt
   *
@@ -195,6 +526,30 @@ int littleWire_error ();
   */
 char *littleWire_errorName ();
 
+/**
+  * Returns the numeric value of the status of the last communication attempt with a device
+  *
+  * @param lwHandle littleWire device pointer
+  * @return Numeric value of the status of the last communication attempt
+  */
+int lw_error(littleWire* lwHandle);
+
+/**
+  * Returns the string version of the last communication attempt status with a device if there was an error
+  *
+  * @param lwHandle littleWire device pointer
+  * @return String version of the last communication attempt status if there was an error
+  */
+char *lw_errorName(littleWire* lwHandle);
+
+/**
+  * Returns the string version of a status returned by the library
+  *
+  * @param status Negative status, as returned by lw_error
+  * @return String version of the status, NULL if it is not an error
+  */
+char *lw_statusName(int status);
+
 /*! @} */
 
 /*! \addtogroup GPIO
@@ -242,256 +597,791 @@ unsigned char digitalRead(littleWire* lwHandle, unsigned char pin);
   */
 void internalPullup(littleWire* lwHandle, unsigned char pin, unsigned char state);
 
-/*! @} */
-
-/*! \addtogroup ADC
-*  @brief Analog to digital converter functions.
-*  @{
-*/
+/**
+  * Update the direction and output registers of all pins at once.
+  * \n Bit n of each mask and value is pin n (PIN1 is bit 1, PIN2 bit 2, PIN3 bit 5 and PIN4 bit 0).
+  * Pins not in a mask keep their setting. For inputs the output value selects the internal pullup.
+  * All pins change together and without intermediate levels.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param ddrMask Pins whose direction changes
+  * @param ddrValue Directions, 1 for output
+  * @param portMask Pins whose output value changes
+  * @param portValue Output values
+  * @return State of all pins afterwards, negative for a USB error.
+  */
+int portUpdate(littleWire* lwHandle, unsigned char ddrMask, unsigned char ddrValue, unsigned char portMask, unsigned char portValue);
 
 /**
-  * Initialize the analog module. VREF_VCC is the standard voltage coming from the USB plug
-  * \n Others are the Attiny's internal voltage references.
+  * Set the state of several output pins at once.
   *
   * @param lwHandle littleWire device pointer
-  * @param voltageRef (\b VREF_VCC , \b VREF_110mV or \b VREF_2560mV )
+  * @param mask Pins to change, for example (1<<PIN1)|(1<<PIN2)
+  * @param value New states
   * @return (none)
   */
-void analog_init(littleWire* lwHandle, unsigned char voltageRef);
+void digitalWritePort(littleWire* lwHandle, unsigned char mask, unsigned char value);
 
 /**
-  * Read analog voltage. Analog voltage reading from ADC_PIN3 isn't advised (it is a bit noisy) but supported. Use it at your own risk.
-  * \n For more about internal temperature sensor, look at the Attiny85 datasheet.
+  * Set several pins as inputs or outputs at once.
   *
   * @param lwHandle littleWire device pointer
-  * @param channel Source of ADC reading (\b ADC_PIN2 , \b ADC_PIN3 or \b ADC_TEMP_SENS )
-  * @return 10 bit ADC result
+  * @param mask Pins to change
+  * @param outputs 1 for output, 0 for input
+  * @return (none)
   */
-unsigned int analogRead(littleWire* lwHandle, unsigned char channel);
-
-/*! @} */
-
-/*! \addtogroup PWM
-*  @brief Pulse width modulation functions.
-*  @{
-*/
+void pinModePort(littleWire* lwHandle, unsigned char mask, unsigned char outputs);
 
 /**
-  * Initialize the PWM module on the Little-Wire
+  * Read all pins at once.
   *
   * @param lwHandle littleWire device pointer
-  * @return (none)
+  * @return Pin states, bit n is pin n
   */
-void pwm_init(littleWire* lwHandle);
+unsigned char digitalReadPort(littleWire* lwHandle);
 
 /**
-  * Stop the PWM module on the Little-Wire
+  * Start reporting changes of some pins as timestamped events, instead of polling them with digitalRead.
+  * \n The device samples the pins and Timer1 on every pin change interrupt, so an event is stamped
+  * with the time of its edge, and reports the changes on its interrupt endpoint, every 10 ms at most
+  * two events. A change that arrives during a USB packet, or while the previous sample still waits for
+  * the main loop, is stamped when the main loop next looks. Uses Timer1 for the timestamps, so it cannot
+  * run together with a timed analog_streamStart. Requires firmware built with PIN_EVENTS=1.
   *
   * @param lwHandle littleWire device pointer
-  * @return (none)
+  * @param pinMask Pins to watch, for example (1<<PIN1)|(1<<PIN3). 0 stops the events.
+  * @return 1 if events are on, 0 if the device refused, negative for a USB error.
   */
-void pwm_stop(littleWire* lwHandle);
+int pinEvents_enable(littleWire* lwHandle, unsigned char pinMask);
 
 /**
-  * Update the compare values of the PWM output pins. Resolution is 8 bit.
+  * Wait for pin change events.
   *
   * @param lwHandle littleWire device pointer
-  * @param channelA Compare value of \b PWMA pin
-  * @param channelB Compare value of \b PWMB pin
-  * @return (none)
+  * @param events Buffer for at least \b PIN_EVENTS_PER_READ events
+  * @param timeout Maximum time to wait in miliseconds
+  * @return Number of events read, negative for a timeout or a USB error.
   */
-void pwm_updateCompare(littleWire* lwHandle, unsigned char channelA, unsigned char channelB);
+int pinEvents_read(littleWire* lwHandle, lwPinEvent* events, int timeout);
 
 /**
-  * Update the prescaler of the PWM module. Adjust this value according to your need for speed in PWM output. Default is 1024. Lower prescale means higher frequency PWM output.
+  * Wait for pin change events and pass each one to a callback.
   *
   * @param lwHandle littleWire device pointer
-  * @param value Presecaler value (\b 1024, \b 256, \b 64, \b 8 or \b 1)
-  * @return (none)
+  * @param callback Called for each event
+  * @param userData Passed to the callback
+  * @param timeout Maximum time to wait in miliseconds
+  * @return Number of events handled, negative for a timeout or a USB error.
   */
-void pwm_updatePrescaler(littleWire* lwHandle, unsigned int value);
+int pinEvents_dispatch(littleWire* lwHandle, lwPinEventCallback callback, void* userData, int timeout);
 
 /*! @} */
 
-/*! \addtogroup SPI
-*  @brief Serial peripheral interface functions.
+/*! \addtogroup Pattern
+*  @brief Timed GPIO patterns played by the device.
 *  @{
 */
 
 /**
-  * Initialize the SPI module on the Little-Wire
+  * Upload a pattern of pin states and play it on the device, without USB traffic while it runs.
+  * \n The pins in the mask are made outputs. Each step sets them and then waits its number of
+  * timer ticks. Waits are at least about 16 microseconds. Uses Timer1, so it cannot run together with
+  * pin events or a timed ADC stream. Avoid other requests while it plays, as USB interrupts add jitter.
   *
   * @param lwHandle littleWire device pointer
-  * @return (none)
+  * @param pinMask Pins driven by the pattern, for example (1<<PIN1)|(1<<PIN2)
+  * @param tick Tick length (\b PATTERN_TICK_60ns , \b PATTERN_TICK_485ns , \b PATTERN_TICK_3880ns , \b PATTERN_TICK_15500ns or \b PATTERN_TICK_62000ns ), or the Timer1 clock select of the device
+  * @param loops Number of times to play the pattern, 0 to repeat until pattern_stop
+  * @param steps The pattern
+  * @param count Number of steps, up to 41
+  * @return Negative for a USB error.
   */
-void spi_init(littleWire* lwHandle);
+int pattern_play(littleWire* lwHandle, unsigned char pinMask, unsigned char tick, unsigned char loops, lwPatternStep* steps, int count);
 
 /**
-  * Send SPI message(s). SPI Mode is 0.
+  * Check on a pattern started by pattern_play.
   *
   * @param lwHandle littleWire device pointer
-  * @param sendBuffer Message array to send
-  * @param inputBuffer Returned answer message
-  * @param length Message length - maximum 4
-  * @param mode \b AUTO_CS or \b MANUAL_CS
-  * @return (none)
+  * @param loopsLeft If not NULL, receives the number of loops left (0 when repeating forever)
+  * @return 1 while the pattern plays, 0 once it is done, negative for a USB error.
   */
-void spi_sendMessage(littleWire* lwHandle, unsigned char * sendBuffer, unsigned char * inputBuffer, unsigned char length ,unsigned char mode);
+int pattern_status(littleWire* lwHandle, int* loopsLeft);
 
 /**
-  * Send one byte SPI message over MOSI pin. Slightly slower than the actual one.
-  * \n There isn't any chip select control involved. Useful for debug console app
+  * Stop a pattern. The pins keep their last state.
   *
   * @param lwHandle littleWire device pointer
-  * @param message Message to send
-  * @return Received SPI message
+  * @return Negative for a USB error.
   */
-unsigned char debugSpi(littleWire* lwHandle, unsigned char message);
+int pattern_stop(littleWire* lwHandle);
+
+/*! @} */
+
+/*! \addtogroup ADC
+*  @brief Analog to digital converter functions.
+*  @{
+*/
 
 /**
-  * Change the SPI message frequency by adjusting delay duration. By default, Little-Wire sends the SPI messages with maximum speed.
-  * \n If your hardware can't catch up with the speed, increase the duration value to lower the SPI speed.
+  * Initialize the analog module. VREF_VCC is the standard voltage coming from the USB plug
+  * \n Others are the Attiny's internal voltage references.
   *
   * @param lwHandle littleWire device pointer
-  * @param duration Amount of delay.
+  * @param voltageRef (\b VREF_VCC , \b VREF_110mV or \b VREF_2560mV )
   * @return (none)
   */
-void spi_updateDelay(littleWire* lwHandle, unsigned int duration);
-
-/*! @} */
-
-/*! \addtogroup I2C
-  *  @brief Inter IC communication functions.
-  *  @{
-  */
+void analog_init(littleWire* lwHandle, unsigned char voltageRef);
 
 /**
-  * Initialize the I2C module on the Little-Wire
+  * Read analog voltage. Analog voltage reading from ADC_PIN3 isn't advised (it is a bit noisy) but supported. Use it at your own risk.
+  * \n For more about internal temperature sensor, look at the Attiny85 datasheet.
   *
-  * @return (none)
+  * @param lwHandle littleWire device pointer
+  * @param channel Source of ADC reading (\b ADC_PIN2 , \b ADC_PIN3 or \b ADC_TEMP_SENS )
+  * @return 10 bit ADC result
   */
-void i2c_init(littleWire* lwHandle);
+unsigned int analogRead(littleWire* lwHandle, unsigned char channel);
 
 /**
-  * Start the i2c communication
+  * Start continuous sampling of an ADC channel into a ring buffer on the device.
+  * \n The buffer holds 63 10 bit samples or 127 8 bit samples, drain it with analog_streamRead.
+  * \n Call analog_init first to select the voltage reference. While streaming the device uses
+  * Timer1 and the buffer shared with debugWIRE and the other block requests, and analogRead must not be used.
   *
   * @param lwHandle littleWire device pointer
-  * @param address 7 bit slave address.
-  * @param direction ( \b READ or \b WRITE )
-  * @return 1 if received ACK
+  * @param channel Source of ADC reading (\b ADC_PIN2 , \b ADC_PIN3 or \b ADC_TEMP_SENS )
+  * @param sampleRate Samples per second, or 0 to free run at the ADC conversion rate
+  * @param flags \b ADC_STREAM_8BIT for 8 bit samples, otherwise 0
+  * @return Negative for a USB error.
   */
-unsigned char i2c_start(littleWire* lwHandle, unsigned char address7bit, unsigned char direction);
+int analog_streamStart(littleWire* lwHandle, unsigned char channel, unsigned int sampleRate, unsigned char flags);
 
 /**
-  * Send byte(s) over i2c bus
+  * Collect the samples queued since the last call.
   *
   * @param lwHandle littleWire device pointer
-  * @param sendBuffer Message array to send
-  * @param length Message length -> Max = 4
-  * @param endWithStop Should we send a STOP condition after this buffer? ( \b END_WITH_STOP or \b NO_STOP )
-  * @return (none)
+  * @param samples Buffer for the samples, oldest first
+  * @param maxSamples Size of the buffer in samples, up to 125 are read per call
+  * @param dropped If not NULL, receives the number of samples lost to a full buffer since the last call (at most 255)
+  * @return Number of samples read, negative for a USB error.
   */
-void i2c_write(littleWire* lwHandle, unsigned char* sendBuffer, unsigned char length, unsigned char endWithStop);
+int analog_streamRead(littleWire* lwHandle, unsigned int* samples, int maxSamples, int* dropped);
 
 /**
-  * Read byte(s) over i2c bus
+  * Stop sampling started by analog_streamStart.
   *
   * @param lwHandle littleWire device pointer
-  * @param readBuffer Returned message array
-  * @param length Message length -> Max = 8
-  * @param endWithStop Should we send a STOP condition after this buffer? ( \b END_WITH_STOP or \b NO_STOP )
-  * @return (none)
+  * @return Negative for a USB error.
   */
-void i2c_read(littleWire* lwHandle, unsigned char* readBuffer, unsigned char length, unsigned char endWithStop);
+int analog_streamStop(littleWire* lwHandle);
 
 /**
-  * Update i2c signal delay amount. Tune if neccessary to fit your requirements.
+  * Read several ADC channels at a higher resolution in one exchange.
+  * \n Each channel is converted 4^oversampling times on the device and the sum shifted right
+  * by oversampling, for a 10+oversampling bit result with the noise averaged out. Scanning all
+  * three channels at the highest oversampling takes about 1.3 s.
+  * \n Call analog_init first to select the voltage reference; the temperature sensor is always
+  * read against the 1.1 V reference. Firmware without LW_CAP_ADC_SCAN is asked for each conversion.
   *
   * @param lwHandle littleWire device pointer
-  * @param duration Delay amount
-  * @return (none)
+  * @param channels \b ADC_SCAN_PIN2 , \b ADC_SCAN_PIN3 and \b ADC_SCAN_TEMP_SENS ored together
+  * @param oversampling 0 to \b ADC_SCAN_MAX_OVERSAMPLING
+  * @param results One per channel chosen, in the order PIN3, PIN2, TEMP_SENS
+  * @return Number of results, negative for a USB error.
   */
-void i2c_updateDelay(littleWire* lwHandle, unsigned int duration);
+int analog_scan(littleWire* lwHandle, unsigned char channels, unsigned char oversampling, unsigned int* results);
 
 /*! @} */
 
-/*! \addtogroup Onewire
- *  @brief Onewire functions.
- *  @{
- */
+/*! \addtogroup Logic
+*  @brief Logic analyzer. Captures PIN4, PIN1, PIN2 and PIN3 (PB0, PB1, PB2 and PB5) as channels 0-3.
+*  @{
+*/
 
 /**
-  * Send a single bit over onewire bus.
+  * Arm a capture of the four pins into the device buffer. \n
+  * Once the trigger pattern is seen the pins are sampled at a fixed rate. Up to
+  * \b LOGIC_TIMED_RATE samples per second the device samples from a timer interrupt and
+  * answers as usual while the capture runs, a sample may be late by one USB interrupt.
+  * Faster captures run with interrupts off, for up to 5 ms once triggered: the device does
+  * not answer on USB during that time, so requests and interrupt-in reads from any program
+  * using it fail, and the capture ends with fewer bytes than depth if it has not filled
+  * them by then. While
+  * armed the device answers as usual. Requires firmware version 0x15, see \b LW_CAP_LOGIC.
+  * \n The device uses Timer1 and the buffer shared with debugWIRE and the other block
+  * requests until the capture is read or logic_captureStop is called.
   *
   * @param lwHandle littleWire device pointer
-  * @param bitValue \b 1 or \b 0
-  * @return (none)
+  * @param mode \b LOGIC_SAMPLES or \b LOGIC_EDGES , optionally with \b LOGIC_EDGE_TRIGGER
+  * @param sampleRate Samples per second, up to \b LOGIC_MAX_RATE , about 252 at the slowest
+  * @param triggerMask Channels the trigger looks at in bits 0-3, 0 to start at once
+  * @param triggerValue Levels of those channels that trigger the capture
+  * @param depth Bytes to capture, up to \b LOGIC_CAPTURE_SIZE (0 for all of them)
+  * @return Negative for a USB error.
   */
-void onewire_sendBit(littleWire* lwHandle, unsigned char bitValue);
+int logic_captureStart(littleWire* lwHandle, unsigned char mode, unsigned long sampleRate, unsigned char triggerMask, unsigned char triggerValue, unsigned char depth);
 
 /**
-  * Send a byte over onewire bus.
+  * Collect a completed capture. \n
+  * In \b LOGIC_SAMPLES mode each byte holds two samples, the earlier in the low nibble.
+  * In \b LOGIC_EDGES mode each entry is two bytes: the channels in the low nibble of the
+  * first, and 12 bits of ticks since the previous entry in its high nibble and the second
+  * byte. The first entry holds the channels at the trigger. An entry with unchanged
+  * channels marks 4095 ticks without a change.
+  * \n The device buffer is released once read.
   *
   * @param lwHandle littleWire device pointer
-  * @param messageToSend Message to send
-  * @return (none)
+  * @param buffer Receives the capture, \b LOGIC_CAPTURE_SIZE bytes
+  * @return Number of bytes read, 0 while the capture is armed or running, negative for a USB error (as while the capture runs).
   */
-void onewire_writeByte(littleWire* lwHandle, unsigned char messageToSend);
+int logic_captureRead(littleWire* lwHandle, unsigned char* buffer);
 
 /**
-  * Read a byte over onewire bus.
+  * The sample rate the device runs at when asked for sampleRate, for timing the capture.
   *
-  * @param lwHandle littleWire device pointer
-  * @return Read byte
+  * @param sampleRate Samples per second as given to logic_captureStart
+  * @return Samples per second, rounded down
   */
-unsigned char onewire_readByte(littleWire* lwHandle);
+unsigned long logic_sampleRate(unsigned long sampleRate);
 
 /**
-  * Read a single bit over onewire bus
+  * Disarm a capture, or drop one not yet read.
   *
   * @param lwHandle littleWire device pointer
-  * @return Read bit ( \b 1 or \b 0 )
+  * @return Negative for a USB error.
   */
-unsigned char onewire_readBit(littleWire* lwHandle);
+int logic_captureStop(littleWire* lwHandle);
+
+/*! @} */
+
+/*! \addtogroup Measure
+*  @brief Frequency counter and pulse width measurement.
+*  @{
+*/
 
 /**
-  * Send a reset pulse over onewire bus
+  * Start counting the edges on PIN2 for a gate time. \n
+  * The edges clock Timer0 directly, so anything up to a few MHz is counted while the
+  * device goes on serving USB. Collect the count with measure_wait or measure_read.
+  * Requires firmware version 0x15, see \b LW_CAP_MEASURE. Uses Timer0 and Timer1,
+  * so PWM must be off.
   *
   * @param lwHandle littleWire device pointer
-  * @return Nonzero if any device presents on the bus
+  * @param gateTime Milliseconds to count for, up to 65000
+  * @param falling 1 to count falling edges, 0 for rising ones
+  * @return Negative for a USB error.
   */
-unsigned char onewire_resetPulse(littleWire* lwHandle);
+int measure_edges(littleWire* lwHandle, unsigned int gateTime, unsigned char falling);
 
 /**
-  * Start searching for device address on the onewire bus.
-  * \n Read the 8 byte address from \b ROM_NO array
+  * Start timing the high and low phases of a signal over one or more periods. \n
+  * Timing starts at a rising edge and each edge is seen within about a microsecond.
+  * The device times in windows of 4 ms with interrupts off, and serves USB for about
+  * a millisecond between them, so a transfer that arrives during a window can fail.
+  * Only periods that fit within one window are counted, signals slower than about
+  * 500 Hz end in \b MEASURE_TIMEOUT , count their edges with measure_edges instead.
   *
   * @param lwHandle littleWire device pointer
-  * @return Nonzero if any device found
+  * @param pin Pin to measure (\b PIN1 , \b PIN2 , \b PIN3 or \b PIN4 )
+  * @param periods Periods to average over, 1 to 255
+  * @param timeout Milliseconds to give up after, up to 2550
+  * @return Negative for a USB error.
   */
-int onewire_firstAddress(littleWire* lwHandle);
+int measure_pulses(littleWire* lwHandle, unsigned char pin, unsigned char periods, unsigned int timeout);
 
 /**
-  * Try to find the next adress on the onewire bus.
-  * \n Read the 8 byte address from \b ROM_NO array
+  * Read the state of the last measurement without waiting for it.
   *
   * @param lwHandle littleWire device pointer
-  * @return Nonzero if any new device found
+  * @param result Receives the measurement, frequency and duty are worked out from the counts
+  * @return State of the measurement (\b MEASURE_DONE ...), negative for a USB error.
   */
-int onewire_nextAddress(littleWire* lwHandle);
+int measure_read(littleWire* lwHandle, lwMeasurement* result);
 
-/*! @} */
+/**
+  * Wait for the measurement started last to complete.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param result Receives the measurement
+  * @param timeout Longest wait in miliseconds
+  * @return State of the measurement, \b MEASURE_RUNNING if it is still going after the timeout, negative for a USB error.
+  */
+int measure_wait(littleWire* lwHandle, lwMeasurement* result, unsigned int timeout);
 
-/*! \addtogroup SOFT_PWM
+/**
+  * Stop an edge count early.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return Negative for a USB error.
+  */
+int measure_stop(littleWire* lwHandle);
+
+/*! @} */
+
+/*! \addtogroup Serial
+*  @brief Half duplex serial bridge on PIN3, using the debugWIRE serial engine.
+*  @{
+*/
+
+/**
+  * Send bytes on PIN3 as 8N1 serial, then receive the reply on the same pin. \n
+  * The bytes go to the device in bursts of \b UART_BURST_SIZE and are sent back to back.
+  * The line is driven while sending and pulled up while receiving, so connect PIN3 to a
+  * single wire serial line, or to TX and, through a resistor, RX of the other side.
+  * Interrupts are off while sending and receiving, and the receive ends after about
+  * 24 ms without a start bit. Requires firmware version 0x15, see \b LW_CAP_UART.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param baud Bits per second, from about 63 to 1375000
+  * @param tx Bytes to send, may be NULL if txLength is 0
+  * @param txLength Number of bytes to send
+  * @param rx Receives the bytes after the last one sent, may be NULL if rxLength is 0
+  * @param rxLength Most bytes to receive, up to \b UART_RECEIVE_SIZE
+  * @return Number of bytes received, negative for an error.
+  */
+int uart_transfer(littleWire* lwHandle, unsigned long baud, const unsigned char* tx, int txLength, unsigned char* rx, int rxLength);
+
+/*! @} */
+
+/*! \addtogroup PWM
+*  @brief Pulse width modulation functions.
+*  @{
+*/
+
+/**
+  * Initialize the PWM module on the Little-Wire
+  *
+  * @param lwHandle littleWire device pointer
+  * @return (none)
+  */
+void pwm_init(littleWire* lwHandle);
+
+/**
+  * Stop the PWM module on the Little-Wire
+  *
+  * @param lwHandle littleWire device pointer
+  * @return (none)
+  */
+void pwm_stop(littleWire* lwHandle);
+
+/**
+  * Update the compare values of the PWM output pins. Resolution is 8 bit.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param channelA Compare value of \b PWMA pin
+  * @param channelB Compare value of \b PWMB pin
+  * @return (none)
+  */
+void pwm_updateCompare(littleWire* lwHandle, unsigned char channelA, unsigned char channelB);
+
+/**
+  * Update the prescaler of the PWM module. Adjust this value according to your need for speed in PWM output. Default is 1024. Lower prescale means higher frequency PWM output.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param value Presecaler value (\b 1024, \b 256, \b 64, \b 8 or \b 1)
+  * @return (none)
+  */
+void pwm_updatePrescaler(littleWire* lwHandle, unsigned int value);
+
+/**
+  * Start a high frequency PWM on PIN1 from Timer1, clocked by the 66 MHz PLL. \n
+  * The period is 2 to 256 timer ticks, so the duty resolution drops as the frequency
+  * rises: 8 bits up to about 258 kHz, 6 bits at 1 MHz. With \b PWM_FAST_COMPLEMENTARY
+  * PIN4 gives the inverse, and each output turns on deadTime after the other turns
+  * off, for half bridges. Timer1 is taken until pwm_fastStop, and the Timer0 PWM and
+  * soft PWM outputs on PIN4 and PIN1 are turned off. Call again to change the
+  * frequency or duty. Requires firmware version 0x15, see \b LW_CAP_PWM_FAST.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param frequency Hertz, from about 8 Hz to 33 MHz
+  * @param duty High time of PIN1 as a fraction of 65536
+  * @param deadTime Nanoseconds, up to about 1800, 0 for none
+  * @param flags \b PWM_FAST_COMPLEMENTARY or 0
+  * @return Frequency set in Hertz, negative for an error or if Timer1 is taken.
+  */
+long pwm_fastStart(littleWire* lwHandle, unsigned long frequency, unsigned int duty, unsigned int deadTime, unsigned char flags);
+
+/**
+  * Stop the PWM of pwm_fastStart and give Timer1 back.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return (none)
+  */
+void pwm_fastStop(littleWire* lwHandle);
+
+/*! @} */
+
+/*! \addtogroup SPI
+*  @brief Serial peripheral interface functions.
+*  @{
+*/
+
+/**
+  * Initialize the SPI module on the Little-Wire
+  *
+  * @param lwHandle littleWire device pointer
+  * @return (none)
+  */
+void spi_init(littleWire* lwHandle);
+
+/**
+  * Send SPI message(s). SPI Mode is 0.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param sendBuffer Message array to send
+  * @param inputBuffer Returned answer message
+  * @param length Message length - maximum 4
+  * @param mode \b AUTO_CS or \b MANUAL_CS
+  * @return (none)
+  */
+void spi_sendMessage(littleWire* lwHandle, unsigned char * sendBuffer, unsigned char * inputBuffer, unsigned char length ,unsigned char mode);
+
+/**
+  * Exchange a buffer of any length over SPI. SPI Mode is 0.
+  * \n The buffer is sent in blocks of up to 128 bytes. With \b AUTO_CS the chip
+  * select stays asserted for the whole buffer.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param sendBuffer Message array to send
+  * @param inputBuffer Returned answer message, may be NULL
+  * @param length Message length
+  * @param mode \b AUTO_CS or \b MANUAL_CS
+  * @return Number of bytes exchanged, negative for an error.
+  */
+int spi_transfer(littleWire* lwHandle, unsigned char* sendBuffer, unsigned char* inputBuffer, int length, unsigned char mode);
+
+/**
+  * Read a buffer of any length over SPI while sending a fixed byte. SPI Mode is 0.
+  * \n Useful for reading SPI memories, up to 248 bytes are read per USB transfer.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param inputBuffer Returned answer message
+  * @param length Message length
+  * @param fill Byte sent for every byte read, usually 0xFF
+  * @param mode \b AUTO_CS or \b MANUAL_CS
+  * @return Number of bytes read, negative for an error.
+  */
+int spi_read(littleWire* lwHandle, unsigned char* inputBuffer, int length, unsigned char fill, unsigned char mode);
+
+/**
+  * Send one byte SPI message over MOSI pin. Slightly slower than the actual one.
+  * \n There isn't any chip select control involved. Useful for debug console app
+  *
+  * @param lwHandle littleWire device pointer
+  * @param message Message to send
+  * @return Received SPI message
+  */
+unsigned char debugSpi(littleWire* lwHandle, unsigned char message);
+
+/**
+  * Let the device poll the debug console target by itself. \n
+  * The device clocks a byte in with debugSpi's timing every pass of its main loop and
+  * queues those that are not 0, up to \b DEBUG_CONSOLE_SIZE of them. Nothing is clocked
+  * while the queue is full. Requires firmware version 0x15, see \b LW_CAP_DEBUG_FIFO.
+  * \n The device uses the buffer shared with debugWIRE and the other block requests
+  * until debugSpi_stop.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param gap Microseconds to leave the target before each byte, 0 to 255
+  * @return 1 if the console started, 0 if the device buffer is busy, negative for a USB error.
+  */
+int debugSpi_start(littleWire* lwHandle, unsigned char gap);
+
+/**
+  * Collect the bytes queued by the device since the last call, in one transfer.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param buffer Receives the bytes
+  * @param maxLength Size of the buffer, up to \b DEBUG_CONSOLE_SIZE bytes are read per call
+  * @return Number of bytes read, negative for a USB error.
+  */
+int debugSpi_read(littleWire* lwHandle, unsigned char* buffer, int maxLength);
+
+/**
+  * Stop polling started by debugSpi_start.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return Negative for a USB error.
+  */
+int debugSpi_stop(littleWire* lwHandle);
+
+/**
+  * Change the SPI message frequency by adjusting delay duration. By default, Little-Wire sends the SPI messages with maximum speed.
+  * \n If your hardware can't catch up with the speed, increase the duration value to lower the SPI speed.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param duration Amount of delay.
+  * @return (none)
+  */
+void spi_updateDelay(littleWire* lwHandle, unsigned int duration);
+
+/*! @} */
+
+/*! \addtogroup I2C
+  *  @brief Inter IC communication functions.
+  *  @{
+  */
+
+/**
+  * Initialize the I2C module on the Little-Wire
+  *
+  * @return (none)
+  */
+void i2c_init(littleWire* lwHandle);
+
+/**
+  * Start the i2c communication
+  *
+  * @param lwHandle littleWire device pointer
+  * @param address 7 bit slave address.
+  * @param direction ( \b READ or \b WRITE )
+  * @return 1 if received ACK
+  */
+unsigned char i2c_start(littleWire* lwHandle, unsigned char address7bit, unsigned char direction);
+
+/**
+  * Send byte(s) over i2c bus
+  *
+  * @param lwHandle littleWire device pointer
+  * @param sendBuffer Message array to send
+  * @param length Message length -> Max = 4
+  * @param endWithStop Should we send a STOP condition after this buffer? ( \b END_WITH_STOP or \b NO_STOP )
+  * @return (none)
+  */
+void i2c_write(littleWire* lwHandle, unsigned char* sendBuffer, unsigned char length, unsigned char endWithStop);
+
+/**
+  * Read byte(s) over i2c bus
+  *
+  * @param lwHandle littleWire device pointer
+  * @param readBuffer Returned message array
+  * @param length Message length -> Max = 8
+  * @param endWithStop Should we send a STOP condition after this buffer? ( \b END_WITH_STOP or \b NO_STOP )
+  * @return (none)
+  */
+void i2c_read(littleWire* lwHandle, unsigned char* readBuffer, unsigned char length, unsigned char endWithStop);
+
+/**
+  * Update i2c signal delay amount. Tune if neccessary to fit your requirements. \n
+  * \b I2C_USI_STANDARD or \b I2C_USI_FAST move the bus from the bit banged routines to
+  * the USI at 100 or 400 kHz, a delay of 0 to 255 brings the bit banged routines back.
+  * Both wait for slaves that stretch the clock, for up to 10 ms per bit. Every I2C
+  * function, i2c_transfer and the register functions included, uses the chosen mode. The USI mode
+  * requires firmware version 0x15, see \b LW_CAP_I2C_USI.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param duration Microseconds per half clock, or \b I2C_USI_STANDARD or \b I2C_USI_FAST
+  * @return (none)
+  */
+void i2c_updateDelay(littleWire* lwHandle, unsigned int duration);
+
+/**
+  * Complete I2C transaction: start, write, repeated start, read and stop.
+  * \n Either length may be 0. Up to 126 bytes are written and read. Reads after a write of
+  * at most 2 bytes, such as register reads, take a single USB transfer.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param address7bit Slave address
+  * @param writeBuffer Bytes to write
+  * @param writeLength Number of bytes to write
+  * @param readBuffer Buffer for the bytes read
+  * @param readLength Number of bytes to read
+  * @return 1 if the slave acknowledged, 0 if not, negative for a USB error.
+  */
+int i2c_transfer(littleWire* lwHandle, unsigned char address7bit, unsigned char* writeBuffer, int writeLength, unsigned char* readBuffer, int readLength);
+
+/**
+  * Read consecutive registers of an I2C device with 8 bit register addresses.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param address7bit Slave address
+  * @param reg First register to read
+  * @param readBuffer Buffer for the register values
+  * @param length Number of registers to read
+  * @return 1 if the slave acknowledged, 0 if not, negative for a USB error.
+  */
+int i2c_readRegisters(littleWire* lwHandle, unsigned char address7bit, unsigned char reg, unsigned char* readBuffer, int length);
+
+/**
+  * Write consecutive registers of an I2C device with 8 bit register addresses.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param address7bit Slave address
+  * @param reg First register to write
+  * @param writeBuffer Register values
+  * @param length Number of registers to write
+  * @return 1 if the slave acknowledged, 0 if not, negative for a USB error.
+  */
+int i2c_writeRegisters(littleWire* lwHandle, unsigned char address7bit, unsigned char reg, unsigned char* writeBuffer, int length);
+
+/*! @} */
+
+/*! \addtogroup Onewire
+ *  @brief Onewire functions.
+ *  @{
+ */
+
+/**
+  * Send a single bit over onewire bus.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param bitValue \b 1 or \b 0
+  * @return (none)
+  */
+void onewire_sendBit(littleWire* lwHandle, unsigned char bitValue);
+
+/**
+  * Send a byte over onewire bus.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param messageToSend Message to send
+  * @return (none)
+  */
+void onewire_writeByte(littleWire* lwHandle, unsigned char messageToSend);
+
+/**
+  * Read a byte over onewire bus.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return Read byte
+  */
+unsigned char onewire_readByte(littleWire* lwHandle);
+
+/**
+  * Read a single bit over onewire bus
+  *
+  * @param lwHandle littleWire device pointer
+  * @return Read bit ( \b 1 or \b 0 )
+  */
+unsigned char onewire_readBit(littleWire* lwHandle);
+
+/**
+  * Send a reset pulse over onewire bus
+  *
+  * @param lwHandle littleWire device pointer
+  * @return Nonzero if any device presents on the bus
+  */
+unsigned char onewire_resetPulse(littleWire* lwHandle);
+
+/**
+  * Start searching for device address on the onewire bus.
+  * \n Read the 8 byte address from \b lwHandle->ROM_NO (or the \b ROM_NO copy)
+  *
+  * @param lwHandle littleWire device pointer
+  * @return Nonzero if any device found
+  */
+int onewire_firstAddress(littleWire* lwHandle);
+
+/**
+  * Try to find the next adress on the onewire bus.
+  * \n Read the 8 byte address from \b lwHandle->ROM_NO (or the \b ROM_NO copy)
+  * \n In firmware built with ONEWIRE_BULK=1 the search runs on the device, one USB round trip per address.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return Nonzero if any new device found
+  */
+int onewire_nextAddress(littleWire* lwHandle);
+
+/**
+  * Reset the bus if asked, then write and read a block of bytes.
+  * \n Up to 126 bytes are written and read, in a single round trip with firmware built with ONEWIRE_BULK=1.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param reset Nonzero to start with a reset pulse
+  * @param writeBuffer Bytes to write
+  * @param writeLength Number of bytes to write
+  * @param readBuffer Buffer for the bytes read
+  * @param readLength Number of bytes to read
+  * @return 1 for success, 0 if the reset found no device, negative for a USB error.
+  */
+int onewire_transfer(littleWire* lwHandle, unsigned char reset, unsigned char* writeBuffer, int writeLength, unsigned char* readBuffer, int readLength);
+
+/**
+  * Write a block of bytes to the onewire bus.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param writeBuffer Bytes to write
+  * @param length Number of bytes to write, up to 126
+  * @return (none)
+  */
+void onewire_writeBytes(littleWire* lwHandle, unsigned char* writeBuffer, int length);
+
+/**
+  * Read a block of bytes from the onewire bus.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param readBuffer Buffer for the bytes read
+  * @param length Number of bytes to read, up to 126
+  * @return (none)
+  */
+void onewire_readBytes(littleWire* lwHandle, unsigned char* readBuffer, int length);
+
+/**
+  * Reset, select one device with match ROM, send a command and read its reply.
+  * \n For example a DS18B20 scratchpad is read with command 0xBE and length 9.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param rom 8 byte address of the device
+  * @param command Function command sent after the address
+  * @param readBuffer Buffer for the bytes read
+  * @param length Number of bytes to read, up to 126
+  * @return 1 for success, 0 if no device is present, negative for a USB error.
+  */
+int onewire_matchRead(littleWire* lwHandle, unsigned char* rom, unsigned char command, unsigned char* readBuffer, int length);
+
+/**
+  * A temperature sensor of the bus, DS18B20, DS18S20, DS1822 or DS1825, and its last reading.
+  */
+typedef struct lwTemperature
+{
+  unsigned char rom[8]; /* address of the sensor */
+  int status;           /* 1 for a reading, 0 if the sensor did not answer, -1 for a bad CRC */
+  long milliCelsius;    /* temperature in thousandths of a degree Celsius */
+} lwTemperature;
+
+/**
+  * Searches the bus for temperature sensors.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param sensors Table filled in with the address of each sensor found
+  * @param max Number of entries of the table
+  * @return Number of sensors found, negative for a USB error.
+  */
+int onewire_findTemperatures(littleWire* lwHandle, lwTemperature* sensors, int max);
+
+/**
+  * Reads every sensor of a table at once. \n
+  * All sensors start converting together with skip ROM, and the bus is polled until they
+  * are done, about 750 ms at 12 bits. The device then reads the scratchpads of up to 16
+  * sensors per request and checks their CRC itself, so 20 sensors take about a second.
+  * With firmware without \b LW_CAP_ONEWIRE_SWEEP the conversion time is
+  * waited out and the scratchpads are read one round trip each. Sensors powered from the
+  * data line do not report the end of the conversion and get the full 750 ms.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param sensors Table of the sensors, from onewire_findTemperatures; status and
+  * milliCelsius are filled in
+  * @param count Number of sensors
+  * @return Number of sensors read, negative for a USB error.
+  */
+int onewire_readTemperatures(littleWire* lwHandle, lwTemperature* sensors, int count);
+
+/*! @} */
+
+/*! \addtogroup SOFT_PWM
   *  @brief Software PWM functions. Designed to be used with RGB LEDs.
   *  @{
   */
 
 /**
   * Sets the state of the softPWM module
+  * \n In firmware built with SOFT_PWM_TIMER=1 the PWM runs from a timer interrupt at a steady 100 Hz.
+  * It shares Timer0 with the hardware PWM, so pwm_init stops it.
+  * ENABLE | SOFTPWM_GAMMA squares the values given to softPWM_write, for an even brightness curve on LEDs.
+  * Other firmware steps the PWM in its main loop and ignores SOFTPWM_GAMMA.
   *
   * @param lwHandle littleWire device pointer
-  * @param state State of the softPWM module ( \b ENABLE or \b DISABLE )
+  * @param state State of the softPWM module ( \b ENABLE or \b DISABLE , optionally with \b SOFTPWM_GAMMA )
   * @return (none)
   */
 void softPWM_state(littleWire* lwHandle,unsigned char state);
@@ -555,6 +1445,96 @@ void ws2812_flush(littleWire* lwHandle, unsigned char pin);
   */
 void ws2812_preload(littleWire* lwHandle, unsigned char r,unsigned char g,unsigned char b);
 
+  /**
+  * Uploads a whole frame in one transfer and sends it to the LED string.
+  * \n The frame is sent as plain colours, as runs of equal colours or as indices into a palette
+  * of up to 16 colours, whichever is shortest. Up to 64 LEDs always fit, longer strips fit with
+  * run or palette encoding (up to 288 LEDs). Requires firmware built with WS2812_FRAME=1.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param pin Pin the LED string is connected to
+  * @param rgb Red, green and blue value of each LED, 3 bytes per LED
+  * @param ledCount Number of LEDs
+  * @return 0 for success, -1 if the frame does not fit in any encoding, other negative values for a USB error.
+  */
+int ws2812_sendFrame(littleWire* lwHandle, unsigned char pin, unsigned char* rgb, int ledCount);
+
+  /**
+  * Uploads a frame for up to three LED strings, on PIN4, PIN1 and PIN2, and sends them all at once.
+  * \n The device interleaves the bits of the strings in one pass, so the frame takes as long as it
+  * does for a single string. The strings are of the same length; pass NULL for a pin without one.
+  * Up to 64 LEDs fit over all strings: 32 per string for two, 21 for three. Requires firmware
+  * version 0x15, see \b LW_CAP_WS2812_PARALLEL.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param rgbPin4 Red, green and blue value of each LED of the string on PIN4, or NULL
+  * @param rgbPin1 String on PIN1, or NULL
+  * @param rgbPin2 String on PIN2, or NULL
+  * @param ledCount Number of LEDs of each string
+  * @return 0 for success, -1 if the frame does not fit or no string is given, other negative values for a USB error.
+  */
+int ws2812_sendParallel(littleWire* lwHandle, unsigned char* rgbPin4, unsigned char* rgbPin1, unsigned char* rgbPin2, int ledCount);
+
+  /**
+  * Lets the device fade a whole LED string between two colours on its own.
+  * \n Effects run until another ws2812 function is called. They use Timer1, so they cannot run
+  * together with pin events, patterns or a timed ADC stream. Requires firmware built with WS2812_FRAME=1.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param pin Pin the LED string is connected to
+  * @param ledCount Number of LEDs, up to 64
+  * @param interval Time between frames in miliseconds, up to 250
+  * @param r1 red value of the first colour
+  * @param g1 green value of the first colour
+  * @param b1 blue value of the first colour
+  * @param r2 red value of the second colour
+  * @param g2 green value of the second colour
+  * @param b2 blue value of the second colour
+  * @param steps Number of frames from the first colour to the second
+  * @param pingPong Nonzero to fade back again, otherwise restart from the first colour
+  * @return Negative for a USB error.
+  */
+int ws2812_fade(littleWire* lwHandle, unsigned char pin, unsigned char ledCount, unsigned char interval, unsigned char r1, unsigned char g1, unsigned char b1, unsigned char r2, unsigned char g2, unsigned char b2, unsigned char steps, unsigned char pingPong);
+
+  /**
+  * Lets the device cycle a rainbow along an LED string.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param pin Pin the LED string is connected to
+  * @param ledCount Number of LEDs, up to 64
+  * @param interval Time between frames in miliseconds, up to 250. Each frame moves the hue by one step of 256.
+  * @param hueStep Hue difference between neighbouring LEDs, of 256 for the whole colour wheel
+  * @param brightness Brightness, 255 for full
+  * @return Negative for a USB error.
+  */
+int ws2812_hueCycle(littleWire* lwHandle, unsigned char pin, unsigned char ledCount, unsigned char interval, unsigned char hueStep, unsigned char brightness);
+
+  /**
+  * Lets the device move a segment of one colour along an LED string lit in another colour.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param pin Pin the LED string is connected to
+  * @param ledCount Number of LEDs, up to 64
+  * @param interval Time for the segment to move by one LED in miliseconds, up to 250
+  * @param r red value of the segment
+  * @param g green value of the segment
+  * @param b blue value of the segment
+  * @param rBack red value of the background
+  * @param gBack green value of the background
+  * @param bBack blue value of the background
+  * @param length Number of LEDs in the segment
+  * @return Negative for a USB error.
+  */
+int ws2812_chase(littleWire* lwHandle, unsigned char pin, unsigned char ledCount, unsigned char interval, unsigned char r, unsigned char g, unsigned char b, unsigned char rBack, unsigned char gBack, unsigned char bBack, unsigned char length);
+
+  /**
+  * Stops the effect running on the device. The LEDs keep the last frame.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return Negative for a USB error.
+  */
+int ws2812_stopEffect(littleWire* lwHandle);
+
 
 
 
@@ -563,6 +1543,444 @@ void ws2812_preload(littleWire* lwHandle, unsigned char r,unsigned char g,unsign
 
   /*! @} */
 
+/*! \addtogroup Batch
+  *  @brief Command batching. Sends a series of commands in a single USB transfer.
+  *  @{
+  */
+
+typedef struct lwBatch
+{
+  unsigned char commands[BATCH_BUFFER_SIZE];
+  unsigned char results[BATCH_BUFFER_SIZE];
+  int commandLength;
+  int resultLength;
+} lwBatch;
+
+/**
+  * Empties a batch so that new commands can be added to it.
+  *
+  * @param batch Batch to be cleared
+  * @return (none)
+  */
+void lw_batch_begin(lwBatch* batch);
+
+/**
+  * Adds a command to a batch. \n
+  * The command is the same firmware request id and data that would otherwise be sent
+  * on its own, see customMessage. Commands which start a job on the device should be
+  * followed by a command 40 to collect their result.
+  * \n The device runs each command as a request without a data stage, an IN request if
+  * replyLength is not 0 and an OUT request otherwise. This matters for the requests with
+  * an IN and an OUT form: 68 reads the pattern state with a reply, 79 reads the measurement
+  * with a reply and stops it without, 82 reads the macro results with a reply and stops,
+  * runs or triggers a macro without, and 89 starts, stops or reports only with a reply.
+  * Requests that need a data stage or the device buffer, such as 57, 69, 85 or 88, do
+  * nothing here. Nested batches (56), debugWIRE (60), the logic capture (78) and the
+  * serial bridge (81) are refused and give zeros. The same holds for macro commands.
+  *
+  * @param batch Batch to add the command to
+  * @param command Firmware command
+  * @param value Value word for the command
+  * @param index Index word for the command
+  * @param replyLength Number of reply bytes to collect for this command (0-8)
+  * @return Offset of the reply in batch->results, -1 if the batch is full.
+  */
+int lw_batch_add(lwBatch* batch, unsigned char command, unsigned int value, unsigned int index, unsigned char replyLength);
+
+/**
+  * Sends a batch to the device and collects the replies in batch->results. \n
+  * Firmware without \b LW_CAP_BATCH is sent the commands one by one.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param batch Batch to be sent
+  * @return Number of reply bytes collected, negative for an error.
+  */
+int lw_batch_submit(littleWire* lwHandle, lwBatch* batch);
+
+/*! @} */
+
+/*! \addtogroup Macro
+  *  @brief Batches stored in the device EEPROM, started by a request or a pin change.
+  *  @{
+  */
+
+/**
+  * Adds a pause to a batch that is going to be stored as a macro. \n
+  * The device keeps serving USB while it waits. Only macros can wait, a batch sent with
+  * lw_batch_submit skips the pause.
+  *
+  * @param batch Batch to add the pause to
+  * @param ms Miliseconds to wait before the next command
+  * @return 0, -1 if the batch is full.
+  */
+int macro_addWait(lwBatch* batch, unsigned int ms);
+
+/**
+  * Stores batches in the device EEPROM as macros 0 to count-1, replacing the macros
+  * stored before. \n
+  * The macros take 1 byte plus the length of their commands each, and one more byte
+  * ends the list, all within \b MACRO_AREA_SIZE. Only bytes that change are written,
+  * each taking about 3.4 ms. Requires firmware version 0x15, see \b LW_CAP_MACRO.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param macros Batches built with lw_batch_add and macro_addWait
+  * @param count Number of batches
+  * @return 0, negative for an error or if the macros do not fit.
+  */
+int macro_store(littleWire* lwHandle, lwBatch* const* macros, int count);
+
+/**
+  * Starts a stored macro. \n
+  * It runs one command per pass of the device main loop, fetch the replies with
+  * macro_read. Fails if a macro or any other operation using the device buffer is running.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param macro Number of the macro
+  * @return Negative for a USB error.
+  */
+int macro_run(littleWire* lwHandle, unsigned char macro);
+
+/**
+  * Starts a stored macro each time the pins change to the given levels. \n
+  * The pins are polled by the device main loop, so pulses shorter than a few hundred
+  * microseconds can be missed. The trigger stays armed until macro_stop.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param macro Number of the macro
+  * @param pins Pins to watch, e.g. (1<<PIN1) | (1<<PIN3)
+  * @param levels Levels of the watched pins that start the macro, same bit layout
+  * @return Negative for a USB error.
+  */
+int macro_trigger(littleWire* lwHandle, unsigned char macro, unsigned char pins, unsigned char levels);
+
+/**
+  * Collects the replies of the macro running or run last, in the order their commands
+  * were added to the batch.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param results Receives up to \b MACRO_RESULT_SIZE reply bytes
+  * @param running Set to 1 while the macro is still running, may be NULL
+  * @return Number of reply bytes, negative for an error or if the buffer is in use by
+  * another operation.
+  */
+int macro_read(littleWire* lwHandle, unsigned char* results, int* running);
+
+/**
+  * Stops the running macro and disarms the trigger.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return Negative for a USB error.
+  */
+int macro_stop(littleWire* lwHandle);
+
+/*! @} */
+
+/*! \addtogroup Clock
+  *  @brief Device clock for stamping results, and its offset and drift from the host clock.
+  *  @{
+  */
+
+/**
+  * Relation between the clock of one device and lw_micros(), fitted by lw_clockSync.
+  */
+typedef struct lwClockSync
+{
+  int count;                         /* readings held, up to LW_SYNC_POINTS */
+  unsigned long hostBase;            /* lw_micros() of the first reading */
+  double host[LW_SYNC_POINTS];       /* microseconds since hostBase at each reading */
+  unsigned long long device[LW_SYNC_POINTS]; /* device ticks of each reading */
+  unsigned long long lastTicks;      /* device ticks of the last reading, for lw_clockToHost */
+  double offset;                     /* host microseconds since hostBase at device tick 0 */
+  double rate;                       /* host microseconds per device tick */
+  double drift;                      /* device clock error in ppm, positive if it runs fast */
+  double error;                      /* half the round trip of the last reading, microseconds */
+} lwClockSync;
+
+/**
+  * Keeps the device clock running. \n
+  * The clock counts Timer1 at F_CPU/128, about 7.76 us a tick, in 32 bits and wraps after
+  * about 9 hours. Its low 24 bits are the pin event timestamps, so events and stamped
+  * results share one time base; pin event times then count from the clock start instead
+  * of pinEvents_enable. Timer1 is not free for pwm_ or ADC streams while the clock runs.
+  * Requires firmware version 0x15, see \b LW_CAP_CLOCK.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return 0, negative for an error or if Timer1 is taken.
+  */
+int lw_clockStart(littleWire* lwHandle);
+
+/**
+  * Lets the device clock stop, it keeps running while pin events are enabled.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return Negative for a USB error.
+  */
+int lw_clockStop(littleWire* lwHandle);
+
+/**
+  * Reads the device clock.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param ticks Receives the device ticks
+  * @return 0, negative for an error or if the clock is not running.
+  */
+int lw_clockRead(littleWire* lwHandle, unsigned long* ticks);
+
+/**
+  * Adds a read of the device clock to a batch. \n
+  * The 4 reply bytes, low byte first, are the device ticks when the batch reached this
+  * command, a few microseconds from the commands next to it. Convert them with
+  * lw_clockToHost.
+  *
+  * @param batch Batch to add the command to
+  * @return Offset of the ticks in batch->results, -1 if the batch is full.
+  */
+int lw_batch_addTimestamp(lwBatch* batch);
+
+/**
+  * Empties a clock fit, before the first lw_clockSync of a device.
+  *
+  * @param sync Fit to be cleared
+  * @return (none)
+  */
+void lw_clockSyncBegin(lwClockSync* sync);
+
+/**
+  * Adds a reading of the device clock to the fit and updates offset, rate and drift. \n
+  * Of the given number of reads, the one with the shortest round trip is kept and the
+  * device time is taken as the middle of it. The oldest readings are dropped past
+  * \b LW_SYNC_POINTS. Call it every few seconds: the drift settles after a minute or so,
+  * and the fit follows the slow changes of the device RC oscillator.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param sync Fit of this device
+  * @param rounds Reads to take, 8 is plenty
+  * @return Half the shortest round trip in microseconds, the bound of the reading error,
+  * negative for an error.
+  */
+int lw_clockSync(littleWire* lwHandle, lwClockSync* sync, int rounds);
+
+/**
+  * Converts device ticks to the lw_micros() time base. \n
+  * Ticks of fewer bits, such as the 24 bit pin event timestamps, are extended to the
+  * value nearest the last reading of lw_clockSync.
+  *
+  * @param sync Fit of the device
+  * @param ticks Device ticks
+  * @param bits Bits of ticks, 32 for lw_clockRead and batch stamps
+  * @return lw_micros() time of ticks, may be past its wrap.
+  */
+double lw_clockToHost(const lwClockSync* sync, unsigned long ticks, int bits);
+
+/*! @} */
+
+/*! \addtogroup Timing
+  *  @brief Time taken on the device by requests and jobs, against the 1 ms USB frame.
+  *  @{
+  */
+
+/**
+  * Device timing counters read by lw_timingRead. Times are in CPU cycles, to the 128
+  * cycles of a device clock tick; a USB frame is 16500 cycles.
+  */
+typedef struct lwTiming
+{
+  int running;                       /* counters are being kept */
+  int timerTaken;                    /* Timer1 was taken by another function, some time was not counted */
+  unsigned long offMax;              /* longest window with interrupts off */
+  unsigned long offTotal;            /* all the windows with interrupts off */
+  int missedFrames;                  /* USB frames estimated lost in those windows */
+  unsigned long loopMax;             /* longest pass of the main loop */
+  int count;                         /* entries in slowest */
+  struct
+  {
+    int job;                         /* 1 for a job, 0 for a request */
+    int id;                          /* job or request number */
+    int count;                       /* times it ran since it was kept, up to 255 */
+    unsigned long max;               /* longest time it took */
+  } slowest[LW_TIMING_SLOTS];        /* slowest first */
+} lwTiming;
+
+/**
+  * Clears the timing counters and starts keeping them. \n
+  * The device times every request and job on the device clock, see lw_clockStart, and
+  * keeps the \b LW_TIMING_SLOTS slowest, so that the ones that overrun the USB frame and
+  * cause retries show up under load. Windows with interrupts off, in the debugWIRE and
+  * WS2812 transfers, are added up as well. Only firmware built with TIMING=1 has them,
+  * see \b LW_CAP_TIMING.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return 0, negative for an error, or if Timer1 is taken or the firmware has no timing.
+  */
+int lw_timingStart(littleWire* lwHandle);
+
+/**
+  * Stops keeping the timing counters, they can still be read.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return Negative for a USB error.
+  */
+int lw_timingStop(littleWire* lwHandle);
+
+/**
+  * Reads the timing counters.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param timing Receives the counters
+  * @return 0, negative for an error or if the firmware has no timing.
+  */
+int lw_timingRead(littleWire* lwHandle, lwTiming* timing);
+
+/*! @} */
+
+/*! \addtogroup PIC24
+  *  @brief PIC24F in-circuit serial programming, a batch of operations per transfer.
+  *  \n The target's MCLR is on PIN3, PGD on PIN1 and PGC on PIN4, and bits are clocked
+  *  at the SPI delay, see spi_updateDelay; 0 is the fastest. littleWire_pic24.h programs
+  *  flash with these. Only firmware built with PIC24=1 has them, see \b LW_CAP_PIC24.
+  *  @{
+  */
+
+typedef struct lwPic24Batch
+{
+  unsigned char ops[PIC24_BATCH_SIZE];
+  int length;                        /* bytes of ops */
+  int reads;                         /* words read by the REGOUTs */
+  unsigned long time;                /* microseconds the device takes at the fastest, waits included */
+} lwPic24Batch;
+
+/**
+  * Empties a batch so that new operations can be added to it.
+  *
+  * @param batch Batch to be cleared
+  * @return (none)
+  */
+void pic24_begin(lwPic24Batch* batch);
+
+/**
+  * Adds the ICSP entry: MCLR is pulsed, the key clocked in and MCLR raised, then the
+  * device waits 50 ms and gives the five extra clocks of the first SIX.
+  *
+  * @param batch Batch to add to
+  * @param key Entry key, 0x4D434851 for PIC24F
+  * @return 0, -1 if the batch is full.
+  */
+int pic24_addEnter(lwPic24Batch* batch, unsigned long key);
+
+/**
+  * Adds the end of ICSP: PGC and PGD are released and MCLR held low, in reset.
+  *
+  * @param batch Batch to add to
+  * @return 0, -1 if the batch is full.
+  */
+int pic24_addExit(lwPic24Batch* batch);
+
+/**
+  * Adds a SIX: the target runs the instruction.
+  *
+  * @param batch Batch to add to
+  * @param instruction 24 bit instruction word
+  * @return 0, -1 if the batch is full.
+  */
+int pic24_addSix(lwPic24Batch* batch, unsigned long instruction);
+
+/**
+  * Adds count SIX NOPs, in two bytes of the batch.
+  *
+  * @param batch Batch to add to
+  * @param count Number of NOPs, up to 255
+  * @return 0, -1 if the batch is full.
+  */
+int pic24_addNops(lwPic24Batch* batch, unsigned char count);
+
+/**
+  * Adds a REGOUT: the target's VISI register is read.
+  *
+  * @param batch Batch to add to
+  * @return Index of the word among those pic24_run returns, -1 if the batch is full.
+  */
+int pic24_addRegout(lwPic24Batch* batch);
+
+/**
+  * Adds a pause, while the target erases or writes.
+  *
+  * @param batch Batch to add to
+  * @param ms Milliseconds, up to 255
+  * @return 0, -1 if the batch is full.
+  */
+int pic24_addWait(lwPic24Batch* batch, unsigned char ms);
+
+/**
+  * Runs a batch on the device in one transfer and collects the words read.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param batch Batch to run
+  * @param words Receives batch->reads words, may be NULL if there are none
+  * @return Number of words read, negative for an error or if the firmware has no PIC24F support.
+  */
+int pic24_run(littleWire* lwHandle, lwPic24Batch* batch, unsigned int* words);
+
+/*! @} */
+
+/*! \addtogroup ServoMux
+  *  @brief Many servos on one timer. \n
+  *  The device sends the servo pulses one after the other, every 20 ms, or longer if they
+  *  add up to more, and takes new pulse widths for all servos in one request. It uses
+  *  Timer1 and the pattern sequencer, like servo_initPrecise, and only one of them runs.
+  *  @{
+  */
+
+/**
+  * Starts servos on up to four pins, each pulse in turn. \n
+  * The servos are numbered in the order PIN4, PIN1, PIN2, PIN3, leaving out the pins not
+  * chosen, and start centred at 1500 us.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param pins Mask of the pins, such as (1 << PIN1) | (1 << PIN4)
+  * @return 1 for success, 0 if the device could not start it, negative for a failed communication.
+  */
+int servoMux_startPins(littleWire* lwHandle, unsigned char pins);
+
+/**
+  * Starts servos on a chain of 74HC164 shift registers, data on PIN4 and clock on PIN2. \n
+  * A 1 is clocked along the outputs once per frame, so output n carries the pulse of
+  * servo n. The servos start centred at 1500 us.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param count Number of servos, up to \b SERVO_MUX_MAX
+  * @return 1 for success, 0 if the device could not start it, negative for a failed communication.
+  */
+int servoMux_startShiftRegister(littleWire* lwHandle, int count);
+
+/**
+  * Sets the pulse widths of the first count servos, all at the start of the same frame.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param pulseWidths Pulse widths in microseconds, clamped to 400-2600
+  * @param count Number of pulse widths, up to the servos started
+  * @return Negative for a USB error.
+  */
+int servoMux_write(littleWire* lwHandle, const unsigned int* pulseWidths, int count);
+
+/**
+  * Stops the servo multiplexer and drives its pins low.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return Negative for a USB error.
+  */
+int servoMux_stop(littleWire* lwHandle);
+
+/**
+  * Reads the state of the servo multiplexer.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param count Receives the number of servos, may be NULL
+  * @return Bit 0 set while it runs, bit 1 while written pulse widths wait for the next frame, negative for a failed communication.
+  */
+int servoMux_status(littleWire* lwHandle, int* count);
+
+/*! @} */
+
 
 /**
 * @mainpage Introduction
@@ -0,0 +1,411 @@
+#ifndef LITTLEWIRE_HPP
+#define LITTLEWIRE_HPP
+/*
+	C++ interface to Little Wire devices, header only, on top of the C library.
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+	of the Software, and to permit persons to whom the Software is furnished to do
+	so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+extern "C" {
+#include "littleWire.h"
+}
+
+/*! \addtogroup Cpp
+  *  @brief C++11 wrapper. \n
+  *  lw::Device owns a connection and closes it when it goes out of scope. Results are
+  *  read straight into the caller's buffers, given as lw::Span, and every call returns
+  *  an lw::Expected holding either the result or the lw::Error of the device. Nothing
+  *  on the transfer path allocates: the buffers, the results and lw::Batch live
+  *  wherever the caller puts them.
+  *  @{
+  */
+
+namespace lw {
+
+typedef unsigned char byte;
+
+/**
+  * View of a contiguous buffer owned by someone else.
+  */
+template<class T>
+class Span
+{
+public:
+	Span() : data_(0), size_(0) {}
+	Span(T* data, std::size_t size) : data_(data), size_(size) {}
+	template<std::size_t N>
+	Span(T (&array)[N]) : data_(array), size_(N) {}
+	// Span<byte> converts to Span<const byte>
+	template<class U>
+	Span(const Span<U>& other, typename std::enable_if<std::is_convertible<U*, T*>::value>::type* = 0)
+		: data_(other.data()), size_(other.size()) {}
+
+	T* data() const { return data_; }
+	std::size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	T& operator[](std::size_t i) const { return data_[i]; }
+	T* begin() const { return data_; }
+	T* end() const { return data_ + size_; }
+
+	/* Part of the view from offset on, count elements at most */
+	Span subspan(std::size_t offset, std::size_t count = static_cast<std::size_t>(-1)) const
+	{
+		if(offset > size_)
+			offset = size_;
+		if(count > size_ - offset)
+			count = size_ - offset;
+		return Span(data_ + offset, count);
+	}
+
+private:
+	T* data_;
+	std::size_t size_;
+};
+
+/**
+  * Failure of a call: the negative status of the device, see lw_error.
+  */
+class Error
+{
+public:
+	explicit Error(int code = -1) : code_(code) {}
+	int code() const { return code_; }
+	const char* message() const { return lw_statusName(code_); }
+
+private:
+	int code_;
+};
+
+/**
+  * Either a value or the Error that prevented it.
+  */
+template<class T>
+class Expected
+{
+public:
+	Expected(const T& value) : ok_(true) { new (&store_) T(value); }
+	Expected(T&& value) : ok_(true) { new (&store_) T(std::move(value)); }
+	Expected(Error error) : ok_(false), error_(error) {}
+	Expected(const Expected& other) : ok_(other.ok_), error_(other.error_)
+	{
+		if(ok_)
+			new (&store_) T(other.value());
+	}
+	Expected(Expected&& other) : ok_(other.ok_), error_(other.error_)
+	{
+		if(ok_)
+			new (&store_) T(std::move(other.value()));
+	}
+	~Expected()
+	{
+		if(ok_)
+			value().~T();
+	}
+	Expected& operator=(Expected other)
+	{
+		this->~Expected();
+		new (this) Expected(std::move(other));
+		return *this;
+	}
+
+	bool has_value() const { return ok_; }
+	explicit operator bool() const { return ok_; }
+	T& value() { return *reinterpret_cast<T*>(&store_); }
+	const T& value() const { return *reinterpret_cast<const T*>(&store_); }
+	T& operator*() { return value(); }
+	const T& operator*() const { return value(); }
+	T* operator->() { return &value(); }
+	const T* operator->() const { return &value(); }
+	T value_or(const T& other) const { return ok_ ? value() : other; }
+	Error error() const { return error_; }
+
+private:
+	bool ok_;
+	Error error_;
+	typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type store_;
+};
+
+template<>
+class Expected<void>
+{
+public:
+	Expected() : ok_(true) {}
+	Expected(Error error) : ok_(false), error_(error) {}
+
+	bool has_value() const { return ok_; }
+	explicit operator bool() const { return ok_; }
+	Error error() const { return error_; }
+
+private:
+	bool ok_;
+	Error error_;
+};
+
+/**
+  * Commands built up on the host and sent in one transfer with Device::submit. The
+  * replies stay in the batch, read them with reply() once it has been submitted.
+  * Can be stored as a macro through handle() and macro_store.
+  */
+class Batch
+{
+public:
+	/* Where the reply of one command lands in the results */
+	struct Reply
+	{
+		int offset;
+		int length;
+	};
+
+	Batch() { lw_batch_begin(&batch_); }
+
+	void clear() { lw_batch_begin(&batch_); }
+
+	/* Adds a firmware command, see lw_batch_add */
+	Expected<Reply> add(byte command, unsigned int value, unsigned int index, byte replyLength)
+	{
+		int offset = lw_batch_add(&batch_, command, value, index, replyLength);
+		if(offset < 0)
+			return Error(-1);
+		Reply reply = {offset, replyLength > 8 ? 8 : replyLength};
+		return reply;
+	}
+
+	/* Adds a read of the device clock, see lw_batch_addTimestamp */
+	Expected<Reply> timestamp() { return add(83, 0, 0, 4); }
+
+	/* Adds a pause, only waited for when the batch runs as a macro */
+	Expected<void> wait(unsigned int ms)
+	{
+		if(macro_addWait(&batch_, ms) < 0)
+			return Error(-1);
+		return Expected<void>();
+	}
+
+	/* Reply bytes of one command, valid after submit */
+	Span<const byte> reply(Reply reply) const
+	{
+		return Span<const byte>(batch_.results + reply.offset, reply.length);
+	}
+
+	/* The reply read as a little endian number, such as a timestamp */
+	unsigned long number(Reply reply) const
+	{
+		unsigned long value = 0;
+		int i;
+
+		for(i=reply.length-1;i>=0;i--)
+			value = (value << 8) | batch_.results[reply.offset + i];
+		return value;
+	}
+
+	lwBatch* handle() { return &batch_; }
+	const lwBatch* handle() const { return &batch_; }
+
+private:
+	lwBatch batch_;
+};
+
+/**
+  * One connected Little Wire. Movable, not copyable; the connection is closed by the
+  * destructor.
+  */
+class Device
+{
+public:
+	static Expected<Device> open() { return adopt(littleWire_connect()); }
+	static Expected<Device> openBySerial(int serialNumber) { return adopt(littlewire_connect_bySerialNum(serialNumber)); }
+	static Expected<Device> openById(int id) { return adopt(littlewire_connect_byID(id)); }
+	static Expected<Device> openByPath(const char* path) { return adopt(littlewire_connect_byPath(path)); }
+
+	/* Takes over a handle from the C interface */
+	explicit Device(littleWire* handle) : handle_(handle) {}
+	Device(Device&& other) : handle_(other.handle_) { other.handle_ = 0; }
+	Device& operator=(Device&& other)
+	{
+		if(this != &other)
+		{
+			close();
+			handle_ = other.handle_;
+			other.handle_ = 0;
+		}
+		return *this;
+	}
+	Device(const Device&) = delete;
+	Device& operator=(const Device&) = delete;
+	~Device() { close(); }
+
+	void close()
+	{
+		littleWire_disconnect(handle_);
+		handle_ = 0;
+	}
+
+	/* The C handle, for the calls not wrapped here. release() gives up ownership. */
+	littleWire* handle() const { return handle_; }
+	littleWire* release()
+	{
+		littleWire* handle = handle_;
+		handle_ = 0;
+		return handle;
+	}
+
+	unsigned char firmwareVersion() const { return handle_->firmwareVersion; }
+	bool has(unsigned long capability) const { return lw_hasCapability(handle_, capability) != 0; }
+
+	Expected<void> pinMode(byte pin, byte mode) { ::pinMode(handle_, pin, mode); return done(); }
+	Expected<void> digitalWrite(byte pin, byte state) { ::digitalWrite(handle_, pin, state); return done(); }
+	Expected<void> internalPullup(byte pin, byte state) { ::internalPullup(handle_, pin, state); return done(); }
+
+	Expected<bool> digitalRead(byte pin)
+	{
+		byte state = ::digitalRead(handle_, pin);
+		if(lw_error(handle_))
+			return Error(lw_error(handle_));
+		return state != 0;
+	}
+
+	Expected<void> analogInit(byte voltageRef) { analog_init(handle_, voltageRef); return done(); }
+
+	Expected<unsigned int> analogRead(byte channel)
+	{
+		unsigned int value = ::analogRead(handle_, channel);
+		if(lw_error(handle_))
+			return Error(lw_error(handle_));
+		return value;
+	}
+
+	/* Exchanges tx over SPI, the reply fills rx up to the shorter of the two */
+	Expected<std::size_t> spiTransfer(Span<const byte> tx, Span<byte> rx, byte mode = AUTO_CS)
+	{
+		std::size_t length = tx.size();
+		if(!rx.empty() && rx.size() < length)
+			length = rx.size();
+		return count(spi_transfer(handle_, const_cast<byte*>(tx.data()), rx.empty() ? 0 : rx.data(), (int)length, mode));
+	}
+
+	Expected<std::size_t> spiRead(Span<byte> rx, byte fill = 0xFF, byte mode = AUTO_CS)
+	{
+		return count(spi_read(handle_, rx.data(), (int)rx.size(), fill, mode));
+	}
+
+	/* Write then read in one I2C transaction; true if the slave acknowledged */
+	Expected<bool> i2cTransfer(byte address7bit, Span<const byte> tx, Span<byte> rx)
+	{
+		return ack(i2c_transfer(handle_, address7bit, const_cast<byte*>(tx.data()), (int)tx.size(), rx.data(), (int)rx.size()));
+	}
+
+	Expected<bool> i2cReadRegisters(byte address7bit, byte reg, Span<byte> rx)
+	{
+		return ack(i2c_readRegisters(handle_, address7bit, reg, rx.data(), (int)rx.size()));
+	}
+
+	Expected<bool> i2cWriteRegisters(byte address7bit, byte reg, Span<const byte> tx)
+	{
+		return ack(i2c_writeRegisters(handle_, address7bit, reg, const_cast<byte*>(tx.data()), (int)tx.size()));
+	}
+
+	/* Optional reset, then write and read; true if the reset found a device */
+	Expected<bool> onewireTransfer(bool reset, Span<const byte> tx, Span<byte> rx)
+	{
+		return ack(onewire_transfer(handle_, reset, const_cast<byte*>(tx.data()), (int)tx.size(), rx.data(), (int)rx.size()));
+	}
+
+	/* Sends tx on PIN3 and returns the number of bytes received into rx */
+	Expected<std::size_t> uartTransfer(unsigned long baud, Span<const byte> tx, Span<byte> rx)
+	{
+		return count(uart_transfer(handle_, baud, tx.data(), (int)tx.size(), rx.data(), (int)rx.size()));
+	}
+
+	/* rgb holds 3 bytes per LED */
+	Expected<void> ws2812SendFrame(byte pin, Span<const byte> rgb)
+	{
+		if(ws2812_sendFrame(handle_, pin, const_cast<byte*>(rgb.data()), (int)(rgb.size() / 3)) < 0)
+			return Error(lw_error(handle_));
+		return Expected<void>();
+	}
+
+	/* Strings on PIN4, PIN1 and PIN2 sent at once, an empty span for a pin without one */
+	Expected<void> ws2812SendParallel(Span<const byte> pin4, Span<const byte> pin1, Span<const byte> pin2 = Span<const byte>())
+	{
+		std::size_t size = pin4.empty() ? (pin1.empty() ? pin2.size() : pin1.size()) : pin4.size();
+		if((!pin1.empty() && pin1.size() != size) || (!pin2.empty() && pin2.size() != size))
+			return Error();
+		if(ws2812_sendParallel(handle_, pin4.empty() ? 0 : const_cast<byte*>(pin4.data()),
+			pin1.empty() ? 0 : const_cast<byte*>(pin1.data()), pin2.empty() ? 0 : const_cast<byte*>(pin2.data()), (int)(size / 3)) < 0)
+			return Error(lw_error(handle_));
+		return Expected<void>();
+	}
+
+	Expected<unsigned long> clockRead()
+	{
+		unsigned long ticks;
+		int status = lw_clockRead(handle_, &ticks);
+		if(status < 0)
+			return Error(status);
+		return ticks;
+	}
+
+	/* Runs the batch on the device, returns the number of reply bytes */
+	Expected<std::size_t> submit(Batch& batch)
+	{
+		return count(lw_batch_submit(handle_, batch.handle()));
+	}
+
+private:
+	static Expected<Device> adopt(littleWire* handle)
+	{
+		if(!handle)
+			return Error(-4);   // No device
+		return Device(handle);
+	}
+
+	Expected<void> done()
+	{
+		if(lw_error(handle_))
+			return Error(lw_error(handle_));
+		return Expected<void>();
+	}
+
+	static Expected<std::size_t> count(int status)
+	{
+		if(status < 0)
+			return Error(status);
+		return (std::size_t)status;
+	}
+
+	static Expected<bool> ack(int status)
+	{
+		if(status < 0)
+			return Error(status);
+		return status != 0;
+	}
+
+	littleWire* handle_;
+};
+
+} // namespace lw
+
+/*! @} */
+
+#endif
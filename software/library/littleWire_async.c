@@ -0,0 +1,490 @@
+/*
+	Asynchronous access to Little Wire devices, built on libusb-1.0.
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+	of the Software, and to permit persons to whom the Software is furnished to do
+	so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+/******************************************************************************
+* See the littleWire_async.h for the function descriptions/comments
+******************************************************************************/
+#include <stdlib.h>
+#include "littleWire_async.h"
+
+/* A request waiting in the queue of a device */
+typedef struct lwAsyncOp
+{
+	struct lwAsyncOp* next;
+	unsigned char command;
+	unsigned int value;
+	unsigned int index;
+	int fetch;
+	lwAsyncCallback callback;
+	void* userData;
+} lwAsyncOp;
+
+struct lwAsyncDevice
+{
+	libusb_device_handle* handle;
+	struct libusb_transfer* transfer;
+	unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + 8];
+	lwAsyncOp* head;
+	lwAsyncOp* tail;
+	int pending;
+	int busy;     // transfer in flight
+	int fetching; // the transfer in flight is request 40 for the head request
+	int closing;
+};
+
+static libusb_context* lwContext = NULL;
+
+static void LIBUSB_CALL lwAsyncComplete(struct libusb_transfer* transfer);
+
+/* Removes the head request from the queue and runs its callback */
+static void lwAsyncFinish(lwAsyncDevice* device, int status, unsigned char* reply)
+{
+	lwAsyncOp* op = device->head;
+
+	device->head = op->next;
+	if(device->head == NULL)
+		device->tail = NULL;
+	device->pending--;
+	device->fetching = 0;
+
+	if(op->callback)
+		op->callback(device, status, reply, op->userData);
+	free(op);
+}
+
+/* Starts the transfer for the head request if the control pipe is free */
+static void lwAsyncKick(lwAsyncDevice* device)
+{
+	lwAsyncOp* op;
+	int rc;
+
+	while(device->head && !device->busy)
+	{
+		op = device->head;
+		if(device->closing)
+		{
+			lwAsyncFinish(device, LIBUSB_ERROR_INTERRUPTED, NULL);
+			continue;
+		}
+
+		if(device->fetching)
+			libusb_fill_control_setup(device->buffer, 0xC0, 40, 0, 0, 8);
+		else
+			libusb_fill_control_setup(device->buffer, 0xC0, op->command, op->value, op->index, 8);
+		libusb_fill_control_transfer(device->transfer, device->handle, device->buffer, lwAsyncComplete, device, USB_TIMEOUT);
+
+		rc = libusb_submit_transfer(device->transfer);
+		if(rc == 0)
+			device->busy = 1;
+		else
+			lwAsyncFinish(device, rc, NULL);
+	}
+}
+
+static void LIBUSB_CALL lwAsyncComplete(struct libusb_transfer* transfer)
+{
+	lwAsyncDevice* device = transfer->user_data;
+	int status;
+
+	device->busy = 0;
+
+	switch(transfer->status)
+	{
+		case LIBUSB_TRANSFER_COMPLETED: status = transfer->actual_length; break;
+		case LIBUSB_TRANSFER_TIMED_OUT: status = LIBUSB_ERROR_TIMEOUT; break;
+		case LIBUSB_TRANSFER_CANCELLED: status = LIBUSB_ERROR_INTERRUPTED; break;
+		case LIBUSB_TRANSFER_STALL:     status = LIBUSB_ERROR_PIPE; break;
+		case LIBUSB_TRANSFER_NO_DEVICE: status = LIBUSB_ERROR_NO_DEVICE; break;
+		case LIBUSB_TRANSFER_OVERFLOW:  status = LIBUSB_ERROR_OVERFLOW; break;
+		default:                        status = LIBUSB_ERROR_IO; break;
+	}
+
+	// Firmware v1.4 returns a job result with the command itself, older
+	// firmware answers with no data and needs a request 40 to collect it.
+	if((status == 0) && device->head->fetch && !device->fetching)
+		device->fetching = 1;
+	else
+		lwAsyncFinish(device, status, libusb_control_transfer_get_data(transfer));
+
+	lwAsyncKick(device);
+}
+
+int lw_async_init()
+{
+	if(lwContext)
+		return 0;
+	return libusb_init(&lwContext);
+}
+
+void lw_async_exit()
+{
+	if(lwContext)
+		libusb_exit(lwContext);
+	lwContext = NULL;
+}
+
+/* Wraps an open handle, closes it on failure */
+static lwAsyncDevice* lwAsyncWrap(libusb_device_handle* handle)
+{
+	lwAsyncDevice* device;
+
+	device = calloc(1, sizeof(lwAsyncDevice));
+	if(device)
+		device->transfer = libusb_alloc_transfer(0);
+	if((device == NULL) || (device->transfer == NULL))
+	{
+		free(device);
+		libusb_close(handle);
+		return NULL;
+	}
+	device->handle = handle;
+	return device;
+}
+
+/* Opens the Little Wires with a given serial number, or any serial number,
+   until maxDevices of them are open. Returns the number opened. */
+static int lwAsyncOpen(int mySerial, int anySerial, lwAsyncDevice** devices, int maxDevices)
+{
+	libusb_device** list;
+	libusb_device_handle* handle = NULL;
+	struct libusb_device_descriptor desc;
+	unsigned char string[256];
+	ssize_t count;
+	int i, opened = 0;
+
+	if(lw_async_init() < 0)
+		return 0;
+
+	count = libusb_get_device_list(lwContext, &list);
+	if(count < 0)
+		return 0;
+
+	for(i=0;(i<count) && (opened<maxDevices);i++)
+	{
+		if(libusb_get_device_descriptor(list[i], &desc) < 0)
+			continue;
+		if((desc.idVendor != VENDOR_ID) || (desc.idProduct != PRODUCT_ID))
+			continue;
+		if(libusb_open(list[i], &handle) < 0)
+			continue;
+		if(!anySerial && !(desc.iSerialNumber && (libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, string, sizeof(string)) > 0) && (atoi((char*)string) == mySerial)))
+		{
+			libusb_close(handle);
+			continue;
+		}
+		devices[opened] = lwAsyncWrap(handle);
+		if(devices[opened])
+			opened++;
+	}
+	libusb_free_device_list(list, 1);
+
+	return opened;
+}
+
+lwAsyncDevice* lw_async_connect()
+{
+	lwAsyncDevice* device;
+
+	return lwAsyncOpen(0, 1, &device, 1) ? device : NULL;
+}
+
+lwAsyncDevice* lw_async_connect_bySerialNum(int mySerial)
+{
+	lwAsyncDevice* device;
+
+	return lwAsyncOpen(mySerial, 0, &device, 1) ? device : NULL;
+}
+
+int lw_async_connect_all(lwAsyncDevice** devices, int maxDevices)
+{
+	return lwAsyncOpen(0, 1, devices, maxDevices);
+}
+
+void lw_async_disconnect(lwAsyncDevice* device)
+{
+	if(device == NULL)
+		return;
+
+	device->closing = 1;
+	if(device->busy)
+		libusb_cancel_transfer(device->transfer);
+	while(device->busy)
+		lw_async_handleEvents(100);
+	lwAsyncKick(device); // fails whatever is still queued
+
+	libusb_free_transfer(device->transfer);
+	libusb_close(device->handle);
+	free(device);
+}
+
+int lw_async_handleEvents(int timeout)
+{
+	struct timeval tv;
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	return libusb_handle_events_timeout_completed(lwContext, &tv, NULL);
+}
+
+int lw_async_wait(lwAsyncDevice* device)
+{
+	int rc = 0;
+
+	while(device->pending && (rc == 0))
+		rc = lw_async_handleEvents(USB_TIMEOUT);
+	return rc;
+}
+
+int lw_async_pending(lwAsyncDevice* device)
+{
+	return device->pending;
+}
+
+int lw_async_submit(lwAsyncDevice* device, unsigned char command, unsigned int value, unsigned int index, int fetch, lwAsyncCallback callback, void* userData)
+{
+	lwAsyncOp* op;
+
+	if(device->closing)
+		return LIBUSB_ERROR_INTERRUPTED;
+
+	op = malloc(sizeof(lwAsyncOp));
+	if(op == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+	op->next = NULL;
+	op->command = command;
+	op->value = value;
+	op->index = index;
+	op->fetch = fetch;
+	op->callback = callback;
+	op->userData = userData;
+
+	if(device->tail)
+		device->tail->next = op;
+	else
+		device->head = op;
+	device->tail = op;
+	device->pending++;
+
+	lwAsyncKick(device);
+	return 0;
+}
+
+/*------------------------------------------------------------------------------------------------------*/
+
+static void lwBroadcastDone(lwAsyncDevice* device, int status, unsigned char* reply, void* userData)
+{
+	lwBroadcastResult* result = userData;
+	int i;
+
+	(void)device;
+	result->status = status;
+	for(i=0;i<8;i++)
+		result->reply[i] = (reply && (i < status)) ? reply[i] : 0;
+}
+
+/******************************************************************************
+* The command is queued on every device before waiting for any of them, so
+* all the devices work on it at the same time.
+******************************************************************************/
+int lw_async_broadcast(lwAsyncDevice** devices, int count, unsigned char command, unsigned int value, unsigned int index, int fetch, lwBroadcastResult* results)
+{
+	int i, rc, ok = 0;
+
+	for(i=0;i<count;i++)
+	{
+		results[i].status = LIBUSB_ERROR_BUSY; // until the callback has run
+		rc = lw_async_submit(devices[i], command, value, index, fetch, lwBroadcastDone, &results[i]);
+		if(rc < 0)
+			results[i].status = rc;
+	}
+
+	for(i=0;i<count;i++)
+	{
+		lw_async_wait(devices[i]);
+		if(results[i].status >= 0)
+			ok++;
+	}
+	return ok;
+}
+
+int lw_async_readFirmwareVersion(lwAsyncDevice* device, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 34, 0, 0, 0, callback, userData);
+}
+
+int lw_async_digitalWrite(lwAsyncDevice* device, unsigned char pin, unsigned char state, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, state ? 18 : 19, pin, 0, 0, callback, userData);
+}
+
+int lw_async_pinMode(lwAsyncDevice* device, unsigned char pin, unsigned char mode, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, mode ? 13 : 14, pin, 0, 0, callback, userData);
+}
+
+int lw_async_digitalRead(lwAsyncDevice* device, unsigned char pin, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 20, pin, 0, 0, callback, userData);
+}
+
+int lw_async_internalPullup(lwAsyncDevice* device, unsigned char pin, unsigned char state, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, state ? 18 : 19, pin, 0, 0, callback, userData);
+}
+
+int lw_async_analog_init(lwAsyncDevice* device, unsigned char voltageRef, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 35, (voltageRef<<8) | 0x07, 0, 0, callback, userData);
+}
+
+int lw_async_analogRead(lwAsyncDevice* device, unsigned char channel, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 15, channel, 0, 0, callback, userData);
+}
+
+int lw_async_pwm_init(lwAsyncDevice* device, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 16, 0, 0, 0, callback, userData);
+}
+
+int lw_async_pwm_stop(lwAsyncDevice* device, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 32, 0, 0, 0, callback, userData);
+}
+
+int lw_async_pwm_updateCompare(lwAsyncDevice* device, unsigned char channelA, unsigned char channelB, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 17, channelA, channelB, 0, callback, userData);
+}
+
+int lw_async_pwm_updatePrescaler(lwAsyncDevice* device, unsigned int value, lwAsyncCallback callback, void* userData)
+{
+	switch(value)
+	{
+		case 1024: return lw_async_submit(device, 22, 4, 0, 0, callback, userData);
+		case 256:  return lw_async_submit(device, 22, 3, 0, 0, callback, userData);
+		case 64:   return lw_async_submit(device, 22, 2, 0, 0, callback, userData);
+		case 8:    return lw_async_submit(device, 22, 1, 0, 0, callback, userData);
+		case 1:    return lw_async_submit(device, 22, 0, 0, 0, callback, userData);
+	}
+	return LIBUSB_ERROR_INVALID_PARAM;
+}
+
+int lw_async_spi_init(lwAsyncDevice* device, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 23, 0, 0, 0, callback, userData);
+}
+
+int lw_async_spi_sendMessage(lwAsyncDevice* device, unsigned char* sendBuffer, unsigned char length, unsigned char mode, lwAsyncCallback callback, void* userData)
+{
+	if(length>4)
+		length=4;
+	return lw_async_submit(device, (0xF0 + length + (mode<<3)), (sendBuffer[1]<<8) + sendBuffer[0], (sendBuffer[3]<<8) + sendBuffer[2], 1, callback, userData);
+}
+
+int lw_async_debugSpi(lwAsyncDevice* device, unsigned char message, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 33, message, 0, 1, callback, userData);
+}
+
+int lw_async_spi_updateDelay(lwAsyncDevice* device, unsigned int duration, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 31, duration, 0, 0, callback, userData);
+}
+
+int lw_async_i2c_init(lwAsyncDevice* device, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 44, 0, 0, 0, callback, userData);
+}
+
+int lw_async_i2c_start(lwAsyncDevice* device, unsigned char address7bit, unsigned char direction, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 45, (address7bit << 1) | direction, 0, 1, callback, userData);
+}
+
+int lw_async_i2c_write(lwAsyncDevice* device, unsigned char* sendBuffer, unsigned char length, unsigned char endWithStop, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, (0xE0 + length + (endWithStop<<3)), (sendBuffer[1]<<8) + sendBuffer[0], (sendBuffer[3]<<8) + sendBuffer[2], 0, callback, userData);
+}
+
+int lw_async_i2c_read(lwAsyncDevice* device, unsigned char length, unsigned char endWithStop, lwAsyncCallback callback, void* userData)
+{
+	if(endWithStop)
+		return lw_async_submit(device, 46, (length<<8) + 1, 1, 1, callback, userData);
+	else
+		return lw_async_submit(device, 46, (length<<8) + 0, 0, 1, callback, userData);
+}
+
+int lw_async_i2c_updateDelay(lwAsyncDevice* device, unsigned int duration, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 49, duration, 0, 0, callback, userData);
+}
+
+int lw_async_onewire_sendBit(lwAsyncDevice* device, unsigned char bitValue, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 51, bitValue, 0, 0, callback, userData);
+}
+
+int lw_async_onewire_writeByte(lwAsyncDevice* device, unsigned char messageToSend, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 42, messageToSend, 0, 0, callback, userData);
+}
+
+int lw_async_onewire_readByte(lwAsyncDevice* device, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 43, 0, 0, 1, callback, userData);
+}
+
+int lw_async_onewire_readBit(lwAsyncDevice* device, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 50, 0, 0, 1, callback, userData);
+}
+
+int lw_async_onewire_resetPulse(lwAsyncDevice* device, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 41, 0, 0, 1, callback, userData);
+}
+
+int lw_async_softPWM_state(lwAsyncDevice* device, unsigned char state, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 47, state, 0, 0, callback, userData);
+}
+
+int lw_async_softPWM_write(lwAsyncDevice* device, unsigned char ch1, unsigned char ch2, unsigned char ch3, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 48, (ch2<<8) | ch1, ch3, 0, callback, userData);
+}
+
+int lw_async_ws2812_write(lwAsyncDevice* device, unsigned char pin, unsigned char r, unsigned char g, unsigned char b, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 54, (g<<8) | pin | 0x30, (b<<8) | r, 0, callback, userData);
+}
+
+int lw_async_ws2812_flush(lwAsyncDevice* device, unsigned char pin, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 54, pin | 0x10, 0, 0, callback, userData);
+}
+
+int lw_async_ws2812_preload(lwAsyncDevice* device, unsigned char r, unsigned char g, unsigned char b, lwAsyncCallback callback, void* userData)
+{
+	return lw_async_submit(device, 54, (g<<8) | 0x20, (b<<8) | r, 0, callback, userData);
+}
@@ -0,0 +1,202 @@
+#ifndef LITTLEWIRE_ASYNC_H
+#define LITTLEWIRE_ASYNC_H
+/*
+	Asynchronous access to Little Wire devices, built on libusb-1.0.
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+	of the Software, and to permit persons to whom the Software is furnished to do
+	so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <libusb.h>			// this is libusb-1.0, see http://libusb.info/
+#include "littleWire.h"
+
+/*! \addtogroup Async
+  *  @brief Non-blocking versions of the library functions. \n
+  *  Every call queues a request and returns straight away. The requests of a device are
+  *  sent in order, and requests to different devices are in flight at the same time.
+  *  Completion callbacks run from inside lw_async_handleEvents.
+  *  @{
+  */
+
+typedef struct lwAsyncDevice lwAsyncDevice;
+
+/**
+  * Called when a queued request completes.
+  *
+  * @param device Device the request was sent to
+  * @param status Number of reply bytes, negative libusb error code for a failure
+  * @param reply Reply bytes of the request
+  * @param userData Pointer given when the request was queued
+  */
+typedef void (*lwAsyncCallback)(lwAsyncDevice* device, int status, unsigned char* reply, void* userData);
+
+/**
+  * Result of a broadcast command on one device.
+  */
+typedef struct lwBroadcastResult
+{
+	int status;              /* number of reply bytes, negative libusb error code for a failure */
+	unsigned char reply[8];  /* reply bytes of the command */
+} lwBroadcastResult;
+
+/**
+  * Initialises libusb-1.0. Must be called before any other lw_async function.
+  *
+  * @param (none)
+  * @return 0 for success, negative libusb error code for a failure.
+  */
+int lw_async_init();
+
+/**
+  * Releases libusb-1.0. All devices must have been disconnected.
+  *
+  * @param (none)
+  * @return (none)
+  */
+void lw_async_exit();
+
+/**
+  * Connects to the first littleWire device that libusb can find.
+  *
+  * @param (none)
+  * @return Device pointer for healthy connection, NULL for a failed trial.
+  */
+lwAsyncDevice* lw_async_connect();
+
+/**
+  * Connects to the littleWire with a given serial number.
+  *
+  * @param mySerial Serial number of the desired littlewire device.
+  * @return Device pointer for healthy connection, NULL for a failed trial.
+  */
+lwAsyncDevice* lw_async_connect_bySerialNum(int mySerial);
+
+/**
+  * Connects to all the littleWire devices that libusb can find.
+  *
+  * @param devices Array filled with the device pointers
+  * @param maxDevices Size of the array
+  * @return Number of devices connected.
+  */
+int lw_async_connect_all(lwAsyncDevice** devices, int maxDevices);
+
+/**
+  * Closes a device. Requests still queued complete with LIBUSB_ERROR_INTERRUPTED.
+  *
+  * @param device Device pointer
+  * @return (none)
+  */
+void lw_async_disconnect(lwAsyncDevice* device);
+
+/**
+  * Handles completed transfers and runs their callbacks.
+  *
+  * @param timeout Maximum time to wait for a completion in miliseconds
+  * @return 0 for success, negative libusb error code for a failure.
+  */
+int lw_async_handleEvents(int timeout);
+
+/**
+  * Handles events until all the requests queued for a device have completed.
+  *
+  * @param device Device pointer
+  * @return 0 for success, negative libusb error code for a failure.
+  */
+int lw_async_wait(lwAsyncDevice* device);
+
+/**
+  * Number of requests queued for a device which have not completed yet.
+  *
+  * @param device Device pointer
+  * @return Number of pending requests
+  */
+int lw_async_pending(lwAsyncDevice* device);
+
+/**
+  * Queues a raw firmware command, the asynchronous version of customMessage.
+  *
+  * @param device Device pointer
+  * @param command Firmware command
+  * @param value Value word for the command
+  * @param index Index word for the command
+  * @param fetch Non zero to collect the result of the job started by the command with request 40 when the firmware does not return it directly
+  * @param callback Completion callback, may be NULL
+  * @param userData Passed to the callback
+  * @return 0 for success, negative libusb error code for a failure.
+  */
+int lw_async_submit(lwAsyncDevice* device, unsigned char command, unsigned int value, unsigned int index, int fetch, lwAsyncCallback callback, void* userData);
+
+/**
+  * Sends the same raw firmware command to several devices at once and waits for all of them.
+  *
+  * @param devices Device pointers
+  * @param count Number of devices
+  * @param command Firmware command
+  * @param value Value word for the command
+  * @param index Index word for the command
+  * @param fetch Non zero to collect the result of a job with request 40 when the firmware does not return it directly
+  * @param results Array of count results, in the order of devices
+  * @return Number of devices on which the command succeeded.
+  */
+int lw_async_broadcast(lwAsyncDevice** devices, int count, unsigned char command, unsigned int value, unsigned int index, int fetch, lwBroadcastResult* results);
+
+/*
+  Asynchronous versions of the littleWire.h functions. They take the same arguments
+  followed by the callback and its user data. Where the blocking function returns a
+  value, the callback receives the raw reply:
+    readFirmwareVersion, digitalRead, debugSpi, onewire_readByte, onewire_readBit,
+    onewire_resetPulse: reply[0]
+    analogRead: (reply[1]<<8) | reply[0]
+    spi_sendMessage: reply[0..length-1]
+    i2c_start: reply[0] is zero when the address was acknowledged
+    i2c_read: reply[0..length-1]
+*/
+int lw_async_readFirmwareVersion(lwAsyncDevice* device, lwAsyncCallback callback, void* userData);
+int lw_async_digitalWrite(lwAsyncDevice* device, unsigned char pin, unsigned char state, lwAsyncCallback callback, void* userData);
+int lw_async_pinMode(lwAsyncDevice* device, unsigned char pin, unsigned char mode, lwAsyncCallback callback, void* userData);
+int lw_async_digitalRead(lwAsyncDevice* device, unsigned char pin, lwAsyncCallback callback, void* userData);
+int lw_async_internalPullup(lwAsyncDevice* device, unsigned char pin, unsigned char state, lwAsyncCallback callback, void* userData);
+int lw_async_analog_init(lwAsyncDevice* device, unsigned char voltageRef, lwAsyncCallback callback, void* userData);
+int lw_async_analogRead(lwAsyncDevice* device, unsigned char channel, lwAsyncCallback callback, void* userData);
+int lw_async_pwm_init(lwAsyncDevice* device, lwAsyncCallback callback, void* userData);
+int lw_async_pwm_stop(lwAsyncDevice* device, lwAsyncCallback callback, void* userData);
+int lw_async_pwm_updateCompare(lwAsyncDevice* device, unsigned char channelA, unsigned char channelB, lwAsyncCallback callback, void* userData);
+int lw_async_pwm_updatePrescaler(lwAsyncDevice* device, unsigned int value, lwAsyncCallback callback, void* userData);
+int lw_async_spi_init(lwAsyncDevice* device, lwAsyncCallback callback, void* userData);
+int lw_async_spi_sendMessage(lwAsyncDevice* device, unsigned char* sendBuffer, unsigned char length, unsigned char mode, lwAsyncCallback callback, void* userData);
+int lw_async_debugSpi(lwAsyncDevice* device, unsigned char message, lwAsyncCallback callback, void* userData);
+int lw_async_spi_updateDelay(lwAsyncDevice* device, unsigned int duration, lwAsyncCallback callback, void* userData);
+int lw_async_i2c_init(lwAsyncDevice* device, lwAsyncCallback callback, void* userData);
+int lw_async_i2c_start(lwAsyncDevice* device, unsigned char address7bit, unsigned char direction, lwAsyncCallback callback, void* userData);
+int lw_async_i2c_write(lwAsyncDevice* device, unsigned char* sendBuffer, unsigned char length, unsigned char endWithStop, lwAsyncCallback callback, void* userData);
+int lw_async_i2c_read(lwAsyncDevice* device, unsigned char length, unsigned char endWithStop, lwAsyncCallback callback, void* userData);
+int lw_async_i2c_updateDelay(lwAsyncDevice* device, unsigned int duration, lwAsyncCallback callback, void* userData);
+int lw_async_onewire_sendBit(lwAsyncDevice* device, unsigned char bitValue, lwAsyncCallback callback, void* userData);
+int lw_async_onewire_writeByte(lwAsyncDevice* device, unsigned char messageToSend, lwAsyncCallback callback, void* userData);
+int lw_async_onewire_readByte(lwAsyncDevice* device, lwAsyncCallback callback, void* userData);
+int lw_async_onewire_readBit(lwAsyncDevice* device, lwAsyncCallback callback, void* userData);
+int lw_async_onewire_resetPulse(lwAsyncDevice* device, lwAsyncCallback callback, void* userData);
+int lw_async_softPWM_state(lwAsyncDevice* device, unsigned char state, lwAsyncCallback callback, void* userData);
+int lw_async_softPWM_write(lwAsyncDevice* device, unsigned char ch1, unsigned char ch2, unsigned char ch3, lwAsyncCallback callback, void* userData);
+int lw_async_ws2812_write(lwAsyncDevice* device, unsigned char pin, unsigned char r, unsigned char g, unsigned char b, lwAsyncCallback callback, void* userData);
+int lw_async_ws2812_flush(lwAsyncDevice* device, unsigned char pin, lwAsyncCallback callback, void* userData);
+int lw_async_ws2812_preload(lwAsyncDevice* device, unsigned char r, unsigned char g, unsigned char b, lwAsyncCallback callback, void* userData);
+
+/*! @} */
+
+#endif
@@ -0,0 +1,593 @@
+/*
+	An emulated Little Wire, see littleWire_mock.h.
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+	of the Software, and to permit persons to whom the Software is furnished to do
+	so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "littleWire_mock.h"
+
+#ifdef LINUX
+	#include <time.h>
+#endif
+#ifndef ETIMEDOUT
+	#define ETIMEDOUT 116
+#endif
+
+#define MOCK_VERSION 0x15
+#define MOCK_CAPABILITIES (LW_CAP_BATCH | LW_CAP_SPI_STREAM | LW_CAP_I2C_TRANSFER | \
+	LW_CAP_ONEWIRE_BULK | LW_CAP_PORT_UPDATE | LW_CAP_JOB_STATUS)
+#define MOCK_PINS 0x27			// PB0, PB1, PB2 and PB5, the free pins
+#define MOCK_BUFFER_SIZE 128		// dwBuf
+#define MOCK_LEDS_SIZE 192		// ws2812_grb
+
+/* State of an emulated device. The handle's remote points at ops. */
+typedef struct lwMock
+{
+	lwRemote ops;
+	lwMockTiming timing;
+	unsigned long elapsed;		// microseconds on the clock of the model
+	unsigned long random;		// jitter generator
+	unsigned long busMicros;	// device time of the transfer being run
+
+	unsigned char port, ddr, inputs;
+	unsigned int adc[3];
+	unsigned char pwm[2];
+	unsigned char softPwm[3];
+	unsigned int spiDelay;
+	unsigned char i2cDelay, i2cMode;
+	unsigned char serial[3];
+
+	// I2C memory, see lw_mock_addI2cMemory
+	unsigned char i2cAddress;
+	unsigned char i2cSelected;	// 1 written to, 2 read from, 0 not addressed
+	unsigned char i2cPointerSet;	// the pointer byte of a write is in
+	unsigned char i2cPointer;
+	unsigned char i2cMemory[256];
+
+	unsigned char sendBuffer[9];	// job replies, sendBuffer[8] is the length
+	unsigned char buffer[MOCK_BUFFER_SIZE];
+	int bufferLength;
+	unsigned char leds[MOCK_LEDS_SIZE];
+	int ledLength;
+	unsigned char reply[8];
+} lwMock;
+
+/******************************************************************************
+* Buses. The device time follows the firmware loops: usiTransfer spends
+* SPI_DELAY per clock edge, a bit banged I2C bit four I2C_DELAY waits, a
+* 1-Wire slot about 70 us and a reset 960 us.
+******************************************************************************/
+static unsigned char mockSpi(lwMock* m, unsigned char value)
+{
+	m->busMicros += 16UL * m->spiDelay + 2;
+	return value;				// MISO wired to MOSI
+}
+
+static void mockI2cBits(lwMock* m, int bits)
+{
+	unsigned long perBit = m->i2cMode == 2 ? 3 : m->i2cMode == 1 ? 10 : 4UL * m->i2cDelay + 3;
+
+	m->busMicros += perBit * bits;
+}
+
+// Start or repeated start with the address byte, returns 1 for a nack
+static int mockI2cStart(lwMock* m, unsigned char addressByte)
+{
+	mockI2cBits(m, 10);
+	m->i2cSelected = 0;
+	if(!m->i2cAddress || (addressByte >> 1) != m->i2cAddress)
+		return 1;
+	m->i2cSelected = (addressByte & 1) ? 2 : 1;
+	m->i2cPointerSet = 0;
+	return 0;
+}
+
+static int mockI2cWrite(lwMock* m, unsigned char value)
+{
+	mockI2cBits(m, 9);
+	if(m->i2cSelected != 1)
+		return 1;
+	if(!m->i2cPointerSet)
+	{
+		m->i2cPointer = value;
+		m->i2cPointerSet = 1;
+	}
+	else
+		m->i2cMemory[m->i2cPointer++] = value;
+	return 0;
+}
+
+static unsigned char mockI2cRead(lwMock* m)
+{
+	mockI2cBits(m, 9);
+	if(m->i2cSelected != 2)
+		return 0xFF;			// nobody drives SDA
+	return m->i2cMemory[m->i2cPointer++];
+}
+
+static void mockI2cStop(lwMock* m)
+{
+	mockI2cBits(m, 1);
+	m->i2cSelected = 0;
+}
+
+// i2cTransfer of the firmware, returns 1 for a nack
+static int mockI2cTransfer(lwMock* m, unsigned char address, unsigned char* write, int writeLength, unsigned char* read, int readLength)
+{
+	int nack = 0;
+	int i;
+
+	if(writeLength)
+	{
+		nack = mockI2cStart(m, address << 1);
+		for(i=0;i<writeLength && !nack;i++)
+			nack = mockI2cWrite(m, write[i]);
+	}
+	if(readLength && !nack)
+	{
+		nack = mockI2cStart(m, (address << 1) | 1);
+		for(i=0;i<readLength && !nack;i++)
+			read[i] = mockI2cRead(m);
+	}
+	mockI2cStop(m);
+	return nack;
+}
+
+// An empty 1-Wire bus: no presence pulse, the pullup reads 1
+static unsigned char mockOnewireReset(lwMock* m)
+{
+	m->busMicros += 960;
+	return 0;
+}
+
+static unsigned char mockOnewireBits(lwMock* m, int bits)
+{
+	m->busMicros += 70UL * bits;
+	return 0xFF;
+}
+
+static unsigned char mockPins(lwMock* m)
+{
+	return (m->port & m->ddr) | (m->inputs & ~m->ddr);
+}
+
+/******************************************************************************
+* A request as usbFunctionSetup and usbFunctionWrite see it. data holds the
+* data stage of an OUT transfer. Returns the reply length, *reply its bytes.
+******************************************************************************/
+static int mockRequest(lwMock* m, unsigned char* setup, unsigned char* data, int size, unsigned char** reply);
+
+// Request 56, see runBatch in the firmware
+static void mockBatch(lwMock* m, unsigned char* commands, int length)
+{
+	unsigned char result[MOCK_BUFFER_SIZE];
+	unsigned char cmd[8];
+	unsigned char* reply;
+	int in, out = 0, i, len;
+
+	for(in=0;in+6<=length;in+=6)
+	{
+		cmd[0] = commands[in+5] ? 0xC0 : 0x40;
+		memcpy(cmd+1, commands+in, 5);
+		cmd[6] = 0;
+		cmd[7] = 0;
+		len = 0;
+		if(cmd[1] != 56 && cmd[1] != 60 && cmd[1] != 78 && cmd[1] != 81)
+			len = mockRequest(m, cmd, NULL, 0, &reply);
+		if(len > 8)
+			len = 0;
+		for(i=0;i<commands[in+5] && out<MOCK_BUFFER_SIZE;i++)
+			result[out++] = (i < len) ? reply[i] : 0;
+	}
+	memcpy(m->buffer, result, out);
+	m->bufferLength = out;
+}
+
+static int mockRequest(lwMock* m, unsigned char* setup, unsigned char* data, int size, unsigned char** reply)
+{
+	int in = setup[0] & USB_ENDPOINT_IN;
+	unsigned char req = setup[1];
+	unsigned char bit = setup[2] & 7;
+	unsigned char* r = m->reply;
+	int length = 0, i, n, nack;
+
+	*reply = r;
+	m->sendBuffer[8] = 0;
+
+	switch(req)
+	{
+		case 0:	// echo
+			memcpy(r, setup, 8);
+			r[1] = 0x21;
+			return 8;
+		case 1:	// read
+			r[0] = mockPins(m);
+			return 1;
+		case 2:	// write
+			m->port = setup[2];
+			return 0;
+		case 3:
+		case 19:
+			m->port &= ~(1 << bit);
+			return 0;
+		case 4:
+		case 18:
+			m->port |= 1 << bit;
+			return 0;
+		case 13:
+			m->ddr &= ~(1 << bit);
+			return 0;
+		case 14:
+			m->ddr |= 1 << bit;
+			return 0;
+		case 15:	// analogRead, 13 ADC clocks at 8 us
+			m->busMicros += 104;
+			n = (setup[2] < 3) ? m->adc[setup[2]] : 0;
+			r[0] = n & 0xFF;
+			r[1] = n >> 8;
+			return 2;
+		case 16:
+			m->ddr |= 3;
+			return 0;
+		case 17:
+			m->pwm[0] = setup[2];
+			m->pwm[1] = setup[4];
+			return 0;
+		case 20:
+			r[0] = (mockPins(m) >> bit) & 1;
+			return 1;
+		case 22:
+		case 32:
+		case 35:
+		case 44:
+			return 0;
+		case 31:
+			m->spiDelay = setup[2] | (setup[3] << 8);
+			return 0;
+		case 33:	// debug SPI
+			r[0] = mockSpi(m, setup[2]);
+			return 1;
+		case 34:
+			r[0] = MOCK_VERSION;
+			r[1] = MOCK_CAPABILITIES & 0xFF;
+			r[2] = (MOCK_CAPABILITIES >> 8) & 0xFF;
+			r[3] = (MOCK_CAPABILITIES >> 16) & 0xFF;
+			r[4] = (MOCK_CAPABILITIES >> 24) & 0xFF;
+			return 5;
+		case 40:	// results of the last job
+			*reply = m->sendBuffer;
+			return 0;
+		case 41:
+			m->sendBuffer[0] = mockOnewireReset(m);
+			m->sendBuffer[8] = 1;
+			break;
+		case 42:
+			mockOnewireBits(m, 8);
+			break;
+		case 43:
+			m->sendBuffer[0] = mockOnewireBits(m, 8);
+			m->sendBuffer[8] = 1;
+			break;
+		case 50:
+			m->sendBuffer[0] = mockOnewireBits(m, 1) & 1;
+			m->sendBuffer[8] = 1;
+			break;
+		case 51:
+			mockOnewireBits(m, 1);
+			break;
+		case 45:	// i2c start with the address
+			m->sendBuffer[0] = mockI2cStart(m, setup[2]);
+			m->sendBuffer[8] = 1;
+			break;
+		case 46:	// i2c read, setup[2] nack the last, setup[3] length, setup[4] stop
+			n = setup[3] > 8 ? 8 : setup[3];
+			for(i=0;i<n;i++)
+				m->sendBuffer[i] = mockI2cRead(m);
+			if(setup[4])
+				mockI2cStop(m);
+			m->sendBuffer[8] = n;
+			break;
+		case 47:
+			return 0;
+		case 48:
+			memcpy(m->softPwm, setup+2, 3);
+			return 0;
+		case 49:
+			m->i2cDelay = setup[2];
+			m->i2cMode = setup[3] > 2 ? 0 : setup[3];
+			return 0;
+		case 54:	// ws2812 preload and flush
+			if((setup[2] & 0x20) && m->ledLength+3 <= MOCK_LEDS_SIZE)
+			{
+				memcpy(m->leds+m->ledLength, setup+3, 3);
+				m->ledLength += 3;
+			}
+			if((setup[2] & 0x10) && m->ledLength)
+			{
+				m->busMicros += 10UL * m->ledLength;	// 8 bits of 1.25 us per byte
+				m->ledLength = 0;
+			}
+			return 0;
+		case 55:
+			memcpy(m->serial, setup+2, 3);
+			return 0;
+		case 56:	// command batch, run as soon as it is in
+			if(in)
+				break;
+			mockBatch(m, data, size);
+			return 0;
+		case 57:	// SPI stream, exchanged in place
+			if(in)
+				break;
+			n = size > MOCK_BUFFER_SIZE ? MOCK_BUFFER_SIZE : size;
+			for(i=0;i<n;i++)
+				m->buffer[i] = mockSpi(m, data[i]);
+			m->bufferLength = n;
+			return 0;
+		case 58:	// SPI stream read, clocking out the fill byte
+			n = setup[6];
+			for(i=0;i<n && i<MOCK_BUFFER_SIZE;i++)
+				m->buffer[i] = mockSpi(m, setup[2]);
+			*reply = m->buffer;
+			return i;
+		case 59:	// i2c transfer: address, read length, bytes to write
+			if(in)
+				break;
+			if(size < 2)
+				return 0;
+			n = data[1] > MOCK_BUFFER_SIZE-1 ? MOCK_BUFFER_SIZE-1 : data[1];
+			nack = mockI2cTransfer(m, data[0], data+2, size-2, m->buffer+1, n);
+			m->buffer[0] = nack;
+			m->bufferLength = n+1;
+			return 0;
+		case 61:	// i2c register read
+			n = setup[6] > MOCK_BUFFER_SIZE ? MOCK_BUFFER_SIZE : setup[6];
+			if(mockI2cTransfer(m, setup[2], setup+4, setup[3] & 3, m->buffer, n))
+				return 0;
+			*reply = m->buffer;
+			return n;
+		case 62:	// onewire search step: no presence pulse
+			if(in)
+				break;
+			if(size != 9)
+				return 0;
+			memcpy(m->buffer, data, 9);
+			m->buffer[9] = 0;
+			m->buffer[10] = mockOnewireReset(m);
+			m->bufferLength = 11;
+			return 0;
+		case 63:	// onewire block transfer
+			if(in)
+				break;
+			if(size < 2)
+				return 0;
+			if(data[0] & 1)
+			{
+				m->buffer[0] = mockOnewireReset(m);
+				m->bufferLength = 1;
+				return 0;
+			}
+			mockOnewireBits(m, 8*(size-2));
+			n = data[1] > MOCK_BUFFER_SIZE-1 ? MOCK_BUFFER_SIZE-1 : data[1];
+			m->buffer[0] = 1;
+			memset(m->buffer+1, 0xFF, n);
+			mockOnewireBits(m, 8*n);
+			m->bufferLength = n+1;
+			return 0;
+		case 67:	// port update
+			n = setup[2] & MOCK_PINS;
+			i = setup[4] & MOCK_PINS;
+			m->ddr &= ~(n & ~setup[3]);
+			m->port = (m->port & ~i) | (setup[5] & i);
+			m->ddr |= n & setup[3];
+			r[0] = mockPins(m);
+			r[1] = m->ddr;
+			r[2] = m->port;
+			return 3;
+		case 74:	// job status: every job has finished
+			memset(r, 0, 6);
+			return 6;
+		default:
+			if((req & 0xF0) == 0xE0)	// i2c write of up to 4 bytes, bit 3 for a stop
+			{
+				nack = 0;
+				for(i=0;i<(req & 7) && i<4;i++)
+					nack = mockI2cWrite(m, setup[2+i]);
+				if(req & 8)
+					mockI2cStop(m);
+				m->sendBuffer[0] = nack;
+				m->sendBuffer[8] = 1;
+				break;
+			}
+			if((req & 0xF0) == 0xF0)	// SPI exchange of up to 4 bytes, bit 3 for chip select
+			{
+				n = (req & 7) > 4 ? 4 : (req & 7);
+				for(i=0;i<n;i++)
+					m->sendBuffer[i] = mockSpi(m, setup[2+i]);
+				m->sendBuffer[8] = n;
+				break;
+			}
+			return 0;
+	}
+
+	// Requests 56 to 63 in: the result in dwBuf
+	if(req >= 56 && req <= 63)
+	{
+		*reply = m->buffer;
+		return m->bufferLength;
+	}
+	// A job, run at once with its result in the reply, as jobReply does
+	*reply = m->sendBuffer;
+	length = m->sendBuffer[8];
+	return length;
+}
+
+/******************************************************************************
+* Time of a transfer on the model's clock
+******************************************************************************/
+static unsigned long mockJitter(lwMock* m)
+{
+	if(!m->timing.jitterMicros)
+		return 0;
+	// xorshift32, the same sequence for the same seed
+	m->random ^= m->random << 13;
+	m->random ^= m->random >> 17;
+	m->random ^= m->random << 5;
+	return m->random % (m->timing.jitterMicros + 1);
+}
+
+static void mockSleep(unsigned long micros)
+{
+#ifdef LINUX
+	struct timespec ts;
+
+	ts.tv_sec = micros / 1000000UL;
+	ts.tv_nsec = (micros % 1000000UL) * 1000;
+	while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+#else
+	Sleep((micros + 999) / 1000);
+#endif
+}
+
+static void mockAdvance(lwMock* m, int size)
+{
+	unsigned long start = m->elapsed;
+	unsigned long took;
+
+	took = m->timing.transferMicros + m->timing.packetMicros * ((size + 7) / 8) + m->busMicros + mockJitter(m);
+	m->elapsed += took;
+	if(m->timing.frameMicros)
+		m->elapsed = (m->elapsed + m->timing.frameMicros - 1) / m->timing.frameMicros * m->timing.frameMicros;
+	if(m->timing.realTime)
+		mockSleep(m->elapsed - start);
+}
+
+/******************************************************************************
+* lwRemote of an emulated device
+******************************************************************************/
+static int mockTransfer(littleWire* lwHandle, int requestType, int request, int value, int index, char* bytes, int size, int timeout)
+{
+	lwMock* m = (lwMock*)lwHandle->remote;
+	unsigned char setup[8];
+	unsigned char* reply;
+	int in = requestType & USB_ENDPOINT_IN;
+	int length;
+
+	(void)timeout;
+	setup[0] = requestType;
+	setup[1] = request;
+	setup[2] = value & 0xFF;
+	setup[3] = (value >> 8) & 0xFF;
+	setup[4] = index & 0xFF;
+	setup[5] = (index >> 8) & 0xFF;
+	setup[6] = size & 0xFF;
+	setup[7] = (size >> 8) & 0xFF;
+
+	m->busMicros = 0;
+	length = mockRequest(m, setup, in ? NULL : (unsigned char*)bytes, in ? 0 : size, &reply);
+	mockAdvance(m, size);
+	if(!in)
+		return size;
+	if(length > size)
+		length = size;
+	memcpy(bytes, reply, length);
+	return length;
+}
+
+static int mockInterruptRead(littleWire* lwHandle, char* bytes, int size, int timeout)
+{
+	(void)lwHandle;
+	(void)bytes;
+	(void)size;
+	(void)timeout;
+	return -ETIMEDOUT;			// no pin ever changes by itself
+}
+
+static void mockClose(littleWire* lwHandle)
+{
+	free(lwHandle->remote);
+}
+
+littleWire* lw_mock_connect(const lwMockTiming* timing)
+{
+	littleWire* lwHandle;
+	lwMock* m;
+
+	m = calloc(1, sizeof(lwMock));
+	lwHandle = calloc(1, sizeof(littleWire));
+	if(m == NULL || lwHandle == NULL)
+	{
+		free(m);
+		free(lwHandle);
+		return NULL;
+	}
+	m->ops.transfer = mockTransfer;
+	m->ops.interruptRead = mockInterruptRead;
+	m->ops.close = mockClose;
+	if(timing)
+		m->timing = *timing;
+	else
+	{
+		m->timing.transferMicros = LW_MOCK_TRANSFER_US;
+		m->timing.packetMicros = LW_MOCK_PACKET_US;
+		m->timing.frameMicros = LW_MOCK_FRAME_US;
+	}
+	m->random = m->timing.seed ? m->timing.seed : 1;
+	m->spiDelay = 10;			// firmware defaults
+	m->adc[ADC_TEMP_SENS] = 300;
+	memset(m->i2cMemory, 0xFF, sizeof(m->i2cMemory));
+
+	lwHandle->remote = &m->ops;
+	readFirmwareVersion(lwHandle);
+	return lwHandle;
+}
+
+unsigned long lw_mock_elapsed(littleWire* lwHandle)
+{
+	return ((lwMock*)lwHandle->remote)->elapsed;
+}
+
+void lw_mock_setInput(littleWire* lwHandle, unsigned char pin, unsigned char state)
+{
+	lwMock* m = (lwMock*)lwHandle->remote;
+
+	if(state)
+		m->inputs |= 1 << pin;
+	else
+		m->inputs &= ~(1 << pin);
+}
+
+void lw_mock_setAnalog(littleWire* lwHandle, unsigned char channel, unsigned int value)
+{
+	if(channel < 3)
+		((lwMock*)lwHandle->remote)->adc[channel] = value & 0x3FF;
+}
+
+unsigned char lw_mock_pins(littleWire* lwHandle)
+{
+	return mockPins((lwMock*)lwHandle->remote);
+}
+
+void lw_mock_addI2cMemory(littleWire* lwHandle, unsigned char address7bit)
+{
+	((lwMock*)lwHandle->remote)->i2cAddress = address7bit;
+}
@@ -0,0 +1,116 @@
+#ifndef LITTLEWIRE_MOCK_H
+#define LITTLEWIRE_MOCK_H
+/*
+	An emulated Little Wire for testing and benchmarking without a device.
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+	of the Software, and to permit persons to whom the Software is furnished to do
+	so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include "littleWire.h"
+
+// Default latency model, close to a low speed device on a full speed hub
+#define LW_MOCK_TRANSFER_US 250		// setup and status stages of a control transfer
+#define LW_MOCK_PACKET_US 120		// each 8 byte data packet
+#define LW_MOCK_FRAME_US 1000		// transfers complete on a USB frame boundary
+
+/*! \addtogroup Mock
+  *  @brief An emulated device. \n
+  *  The handle answers the requests of the firmware the way a device does: GPIO, ADC, PWM,
+  *  soft PWM, SPI looped back from MOSI to MISO, bit banged and block I2C, 1-Wire on an
+  *  empty bus, WS2812, command batches and job status. Transfers take the time of a
+  *  latency model, counted on a clock of its own, so benchmarks of batching or caching
+  *  give the same numbers on every run and need no hardware. Requests the emulation
+  *  does not know, debugWIRE among them, get no reply.
+  *  @{
+  */
+
+/**
+  * Latency model of an emulated device. A transfer takes transferMicros, plus
+  * packetMicros per 8 bytes of data, plus the time the device spends on the bus
+  * (SPI, I2C and 1-Wire bits, ADC conversions, LED data), plus up to jitterMicros.
+  * It then ends on the next frameMicros boundary.
+  */
+typedef struct lwMockTiming
+{
+  unsigned long transferMicros;
+  unsigned long packetMicros;
+  unsigned long frameMicros;    /* 0 for transfers that end at once */
+  unsigned long jitterMicros;   /* drawn from a generator started from seed */
+  unsigned long seed;
+  int realTime;                 /* nonzero to also sleep for the time of each transfer */
+} lwMockTiming;
+
+/**
+  * Makes an emulated device.
+  *
+  * @param timing Latency model, NULL for the LW_MOCK_ defaults without jitter
+  * @return littleWire pointer, to be closed with littleWire_disconnect. NULL if out of memory.
+  */
+littleWire* lw_mock_connect(const lwMockTiming* timing);
+
+/**
+  * Time the transfers of an emulated device have taken so far.
+  *
+  * @param lwHandle littleWire pointer from lw_mock_connect
+  * @return Microseconds.
+  */
+unsigned long lw_mock_elapsed(littleWire* lwHandle);
+
+/**
+  * Drives an input pin of an emulated device from outside.
+  *
+  * @param lwHandle littleWire pointer from lw_mock_connect
+  * @param pin Pin name (\b PIN1 , \b PIN2 , \b PIN3 or \b PIN4 )
+  * @param state \b HIGH or \b LOW, read while the pin is an input
+  * @return (none)
+  */
+void lw_mock_setInput(littleWire* lwHandle, unsigned char pin, unsigned char state);
+
+/**
+  * Sets what an ADC channel of an emulated device reads.
+  *
+  * @param lwHandle littleWire pointer from lw_mock_connect
+  * @param channel \b ADC_PIN3, \b ADC_PIN2 or \b ADC_TEMP_SENS
+  * @param value 0 to 1023
+  * @return (none)
+  */
+void lw_mock_setAnalog(littleWire* lwHandle, unsigned char channel, unsigned int value);
+
+/**
+  * State of the pins of an emulated device.
+  *
+  * @param lwHandle littleWire pointer from lw_mock_connect
+  * @return Levels of the pins as the device reads them, bit n is pin n.
+  */
+unsigned char lw_mock_pins(littleWire* lwHandle);
+
+/**
+  * Puts a 256 byte memory on the I2C bus of an emulated device, addressed like a 24C02
+  * EEPROM: the first byte written after the address sets the pointer, further bytes are
+  * written from there and reads go on from the pointer.
+  *
+  * @param lwHandle littleWire pointer from lw_mock_connect
+  * @param address7bit Address of the memory, 0 to take it off the bus
+  * @return (none)
+  */
+void lw_mock_addI2cMemory(littleWire* lwHandle, unsigned char address7bit);
+
+/*! @} */
+
+#endif
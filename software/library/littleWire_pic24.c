@@ -0,0 +1,239 @@
+/*
+	PIC24FJ flash programming over ICSP for Little Wire.
+
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+	of the Software, and to permit persons to whom the Software is furnished to do
+	so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include "littleWire_pic24.h"
+
+/********************************************************************************
+* Instructions of the programming specification
+********************************************************************************/
+#define NOP		0x000000UL
+#define GOTO_200	0x040200UL	// GOTO 0x200, out of the reset vector
+#define MOV_W0_TBLPAG	0x880190UL
+#define MOV_W10_NVMCON	0x883B0AUL
+#define MOV_NVMCON_W2	0x803B02UL
+#define MOV_W2_VISI	0x883C22UL
+#define BSET_NVMCON_WR	0xA8E761UL
+#define CLR_W6		0xEB0300UL
+#define TBLWTL_W0	0xBB0800UL	// TBLWTL W0, [W0]
+#define TBLRDL_VISI	0xBA0B96UL	// TBLRDL [W6], [W7]
+#define TBLRDH_VISI	0xBA8BB6UL	// TBLRDH [W6++], [W7]
+#define VISI		0x0784
+#define NVMCON_ERASE	0x404F
+#define NVMCON_ROW	0x4001
+
+static const unsigned long loadLatches[8] =
+{
+	0xBB0BB6UL,	// TBLWTL [W6++], [W7]
+	0xBBDBB6UL,	// TBLWTH.B [W6++], [W7++]
+	0xBBEBB6UL,	// TBLWTH.B [W6++], [++W7]
+	0xBB1BB6UL,	// TBLWTL [W6++], [W7++]
+	0xBB0BB6UL,
+	0xBBDBB6UL,
+	0xBBEBB6UL,
+	0xBB1BB6UL
+};
+
+#define READS_PER_BATCH 5	// words read by one pic24_run, 22 bytes each
+
+/* MOV #value, Wn */
+static unsigned long movLiteral(unsigned int value, int reg)
+{
+	return 0x200000UL | ((unsigned long)value << 4) | reg;
+}
+
+static void addResetVector(lwPic24Batch* batch)
+{
+	pic24_addSix(batch, NOP);
+	pic24_addSix(batch, GOTO_200);
+	pic24_addSix(batch, NOP);
+}
+
+/* Sets TBLPAG and puts the low 16 bits of the address in reg */
+static void addTablePointer(lwPic24Batch* batch, unsigned long address, int reg)
+{
+	pic24_addSix(batch, movLiteral(address >> 16, 0));
+	pic24_addSix(batch, MOV_W0_TBLPAG);
+	pic24_addSix(batch, movLiteral(address & 0xFFFF, reg));
+}
+
+/* Starts the erase or write set up in NVMCON and polls WR until it ends */
+static int startWrite(littleWire* lwHandle)
+{
+	lwPic24Batch batch;
+	unsigned long start;
+	unsigned int nvmcon;
+	int status;
+
+	pic24_begin(&batch);
+	pic24_addSix(&batch, BSET_NVMCON_WR);
+	pic24_addNops(&batch, 2);
+	if((status = pic24_run(lwHandle, &batch, NULL)) < 0)
+		return status;
+
+	pic24_begin(&batch);
+	pic24_addSix(&batch, GOTO_200);
+	pic24_addNops(&batch, 1);
+	pic24_addSix(&batch, MOV_NVMCON_W2);
+	pic24_addSix(&batch, MOV_W2_VISI);
+	pic24_addNops(&batch, 1);
+	pic24_addRegout(&batch);
+	pic24_addNops(&batch, 1);
+	start = lw_micros();
+	do
+	{
+		if(lw_micros() - start > PIC24_WRITE_TIMEOUT * 1000UL)
+			return -1;
+		if((status = pic24_run(lwHandle, &batch, &nvmcon)) < 0)
+			return status;
+	} while(nvmcon & 0x8000);
+
+	pic24_begin(&batch);
+	pic24_addSix(&batch, GOTO_200);
+	pic24_addNops(&batch, 1);
+	status = pic24_run(lwHandle, &batch, NULL);
+	return status < 0 ? status : 0;
+}
+
+int pic24_enterIcsp(littleWire* lwHandle)
+{
+	lwPic24Batch batch;
+	int status;
+
+	spi_updateDelay(lwHandle, 0);
+	pic24_begin(&batch);
+	pic24_addEnter(&batch, PIC24_KEY);
+	addResetVector(&batch);
+	status = pic24_run(lwHandle, &batch, NULL);
+	return status < 0 ? status : 0;
+}
+
+int pic24_exitIcsp(littleWire* lwHandle)
+{
+	lwPic24Batch batch;
+	int status;
+
+	pic24_begin(&batch);
+	pic24_addExit(&batch);
+	status = pic24_run(lwHandle, &batch, NULL);
+	return status < 0 ? status : 0;
+}
+
+int pic24_bulkErase(littleWire* lwHandle)
+{
+	lwPic24Batch batch;
+	int status;
+
+	pic24_begin(&batch);
+	addResetVector(&batch);
+	pic24_addSix(&batch, movLiteral(NVMCON_ERASE, 10));
+	pic24_addSix(&batch, MOV_W10_NVMCON);
+	pic24_addSix(&batch, movLiteral(0, 0));
+	pic24_addSix(&batch, MOV_W0_TBLPAG);
+	pic24_addSix(&batch, TBLWTL_W0);	// the dummy write picks the block to erase
+	pic24_addNops(&batch, 2);
+	if((status = pic24_run(lwHandle, &batch, NULL)) < 0)
+		return status;
+	return startWrite(lwHandle);
+}
+
+int pic24_readWords(littleWire* lwHandle, unsigned long address, unsigned long* words, int count)
+{
+	lwPic24Batch batch;
+	unsigned int reads[2*READS_PER_BATCH];
+	int done, n, i, status;
+
+	pic24_begin(&batch);
+	addResetVector(&batch);
+	addTablePointer(&batch, address, 6);
+	pic24_addSix(&batch, movLiteral(VISI, 7));
+	pic24_addNops(&batch, 1);
+	if((status = pic24_run(lwHandle, &batch, NULL)) < 0)
+		return status;
+
+	for(done=0;done<count;done+=n)
+	{
+		n = (count-done > READS_PER_BATCH) ? READS_PER_BATCH : count-done;
+		pic24_begin(&batch);
+		for(i=0;i<n;i++)
+		{
+			pic24_addSix(&batch, TBLRDL_VISI);
+			pic24_addNops(&batch, 2);
+			pic24_addRegout(&batch);
+			pic24_addNops(&batch, 1);
+			pic24_addSix(&batch, TBLRDH_VISI);
+			pic24_addNops(&batch, 2);
+			pic24_addRegout(&batch);
+			pic24_addNops(&batch, 1);
+		}
+		if((status = pic24_run(lwHandle, &batch, reads)) < 0)
+			return status;
+		for(i=0;i<n;i++)
+			words[done+i] = reads[2*i] | ((unsigned long)(reads[2*i+1] & 0xFF) << 16);
+	}
+
+	pic24_begin(&batch);
+	addResetVector(&batch);
+	status = pic24_run(lwHandle, &batch, NULL);
+	return status < 0 ? status : 0;
+}
+
+int pic24_writeRow(littleWire* lwHandle, unsigned long address, const unsigned long* words, int count)
+{
+	lwPic24Batch batch;
+	const unsigned long* w;
+	int done, i, status;
+
+	if(count < 4 || count > PIC24_ROW_WORDS || (count & 3))
+		return -1;
+
+	pic24_begin(&batch);
+	addResetVector(&batch);
+	pic24_addSix(&batch, movLiteral(NVMCON_ROW, 10));
+	pic24_addSix(&batch, MOV_W10_NVMCON);
+	addTablePointer(&batch, address, 7);
+	if((status = pic24_run(lwHandle, &batch, NULL)) < 0)
+		return status;
+
+	// W0 to W5 take four words packed, the latches are loaded from them
+	for(done=0;done<count;done+=4)
+	{
+		w = words + done;
+		pic24_begin(&batch);
+		pic24_addSix(&batch, movLiteral(w[0] & 0xFFFF, 0));
+		pic24_addSix(&batch, movLiteral(((w[1] >> 8) & 0xFF00) | ((w[0] >> 16) & 0xFF), 1));
+		pic24_addSix(&batch, movLiteral(w[1] & 0xFFFF, 2));
+		pic24_addSix(&batch, movLiteral(w[2] & 0xFFFF, 3));
+		pic24_addSix(&batch, movLiteral(((w[3] >> 8) & 0xFF00) | ((w[2] >> 16) & 0xFF), 4));
+		pic24_addSix(&batch, movLiteral(w[3] & 0xFFFF, 5));
+		pic24_addSix(&batch, CLR_W6);
+		pic24_addNops(&batch, 1);
+		for(i=0;i<8;i++)
+		{
+			pic24_addSix(&batch, loadLatches[i]);
+			pic24_addNops(&batch, 2);
+		}
+		if((status = pic24_run(lwHandle, &batch, NULL)) < 0)
+			return status;
+	}
+	return startWrite(lwHandle);
+}
@@ -0,0 +1,87 @@
+#ifndef LITTLEWIRE_PIC24_H
+#define LITTLEWIRE_PIC24_H
+/*
+	PIC24FJ flash programming over ICSP for Little Wire, after the PIC24FJ
+	flash programming specification, on the batches of pic24_run.
+
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+	of the Software, and to permit persons to whom the Software is furnished to do
+	so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include "littleWire.h"
+
+#define PIC24_KEY 0x4D434851UL		// ICSP entry key
+#define PIC24_ROW_WORDS 64		// instruction words per flash row
+#define PIC24_WRITE_TIMEOUT 1000	// miliseconds to wait for an erase or a row write
+
+/*! \addtogroup PIC24
+  *  @{
+  */
+
+/**
+  * Holds the target in reset and enters ICSP mode, at the fastest bit rate. \n
+  * Soft PWM and SPI must not be in use, they share the pins.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return 0, negative for an error.
+  */
+int pic24_enterIcsp(littleWire* lwHandle);
+
+/**
+  * Leaves ICSP mode. The target stays in reset until PIN3 is released, see pinMode.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return 0, negative for an error.
+  */
+int pic24_exitIcsp(littleWire* lwHandle);
+
+/**
+  * Erases all of code memory and the configuration words, and waits for the erase to end.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return 0, negative for an error or a timeout.
+  */
+int pic24_bulkErase(littleWire* lwHandle);
+
+/**
+  * Reads instruction words from code memory.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param address Program memory address of the first word, even
+  * @param words Receives the 24 bit words
+  * @param count Number of words
+  * @return 0, negative for an error.
+  */
+int pic24_readWords(littleWire* lwHandle, unsigned long address, unsigned long* words, int count);
+
+/**
+  * Writes a row of code memory, which must have been erased, and waits for the write to end. \n
+  * The words are loaded four per transfer.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param address Program memory address of the row, a multiple of 2 * \b PIC24_ROW_WORDS
+  * @param words The 24 bit words of the row
+  * @param count Number of words, a multiple of 4 up to \b PIC24_ROW_WORDS, the rest of the row is left erased
+  * @return 0, negative for an error or a timeout.
+  */
+int pic24_writeRow(littleWire* lwHandle, unsigned long address, const unsigned long* words, int count);
+
+/*! @} */
+
+#endif
@@ -0,0 +1,442 @@
+/*
+	Little Wire devices shared through the lwd daemon, see littleWire_remote.h.
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+	of the Software, and to permit persons to whom the Software is furnished to do
+	so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "littleWire_remote.h"
+
+#ifdef LINUX
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define LWD_EVENT_QUEUE 16		// reports kept while waiting for a reply
+
+/* State of a connection to lwd. The handle's remote points at ops. */
+typedef struct lwDaemon
+{
+	lwRemote ops;
+	int fd;
+	unsigned short tag;
+	int subscribed;
+	unsigned char events[LWD_EVENT_QUEUE][8];
+	int eventHead;
+	int eventCount;
+	lwPosted* posted[LWD_PIPELINE_DEPTH];	// in flight, oldest first
+	int postedCount;
+	unsigned char frame[LWD_HEADER_SIZE + 8 + LWD_MAX_DATA];
+} lwDaemon;
+
+/******************************************************************************
+* Socket helpers. A broken connection is reported as -1, like an I/O error.
+******************************************************************************/
+static int lwdWrite(int fd, const unsigned char* buffer, int length)
+{
+	int n;
+
+	while(length > 0)
+	{
+		n = send(fd, buffer, length, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return -1;
+		buffer += n;
+		length -= n;
+	}
+	return 0;
+}
+
+static int lwdRead(int fd, unsigned char* buffer, int length, int timeout)
+{
+	struct pollfd p;
+	int n;
+
+	while(length > 0)
+	{
+		p.fd = fd;
+		p.events = POLLIN;
+		n = poll(&p, 1, timeout);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n == 0)
+			return -ETIMEDOUT;
+		n = recv(fd, buffer, length, 0);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return -1;
+		buffer += n;
+		length -= n;
+	}
+	return 0;
+}
+
+static int lwdSend(lwDaemon* d, int type, const unsigned char* payload, int length, const char* data, int dataLength)
+{
+	unsigned char* frame = d->frame;
+
+	frame[0] = type;
+	frame[1] = 0;
+	frame[2] = d->tag & 0xFF;
+	frame[3] = d->tag >> 8;
+	frame[4] = (length + dataLength) & 0xFF;
+	frame[5] = (length + dataLength) >> 8;
+	if(length)
+		memcpy(frame + LWD_HEADER_SIZE, payload, length);
+	if(dataLength)
+		memcpy(frame + LWD_HEADER_SIZE + length, data, dataLength);
+	return lwdWrite(d->fd, frame, LWD_HEADER_SIZE + length + dataLength);
+}
+
+/******************************************************************************
+* Hands a reply in d->frame to the posted transfer with its tag, returns 0 if
+* none has it.
+******************************************************************************/
+static int lwdComplete(lwDaemon* d, int tag, int length)
+{
+	lwPosted* request;
+	int i, n;
+
+	for(i=0;i<d->postedCount && d->posted[i]->tag!=tag;i++);
+	if(i == d->postedCount)
+		return 0;
+	request = d->posted[i];
+	memmove(d->posted+i, d->posted+i+1, (d->postedCount-i-1) * sizeof(lwPosted*));
+	d->postedCount--;
+
+	request->status = (length < 2) ? -1 : (short)(d->frame[LWD_HEADER_SIZE] | (d->frame[LWD_HEADER_SIZE+1] << 8));
+	if(request->status > 0 && (request->requestType & USB_ENDPOINT_IN))
+	{
+		n = length - 2;
+		if(n > request->size)
+			n = request->size;
+		if(n > request->status)
+			n = request->status;
+		memcpy(request->bytes, d->frame + LWD_HEADER_SIZE + 2, n);
+	}
+	request->done = 1;
+	return 1;
+}
+
+/******************************************************************************
+* Reads frames until the reply with the given tag, which is left in d->frame,
+* with tag -1 until a pin event report is queued, or with tag -2 until a
+* posted transfer is complete. Reports and the replies of posted transfers
+* that come in meanwhile are taken care of. Returns the payload length.
+******************************************************************************/
+static int lwdReceive(lwDaemon* d, int tag, int timeout)
+{
+	unsigned char* frame = d->frame;
+	int length, status, slot, replyTag;
+
+	for(;;)
+	{
+		status = lwdRead(d->fd, frame, LWD_HEADER_SIZE, timeout);
+		if(status < 0)
+			return status;
+		length = frame[4] | (frame[5] << 8);
+		if(length > LWD_MAX_DATA + 2)
+			return -1;
+		status = lwdRead(d->fd, frame + LWD_HEADER_SIZE, length, timeout);
+		if(status < 0)
+			return status;
+
+		if(frame[0] == LWD_EVENT && length == 8)
+		{
+			if(d->eventCount == LWD_EVENT_QUEUE)
+			{
+				d->eventHead = (d->eventHead + 1) % LWD_EVENT_QUEUE;	// drop the oldest
+				d->eventCount--;
+			}
+			slot = (d->eventHead + d->eventCount) % LWD_EVENT_QUEUE;
+			memcpy(d->events[slot], frame + LWD_HEADER_SIZE, 8);
+			d->eventCount++;
+			if(tag < 0)
+				return 0;
+		}
+		else if(frame[0] & LWD_REPLY)
+		{
+			replyTag = frame[2] | (frame[3] << 8);
+			if(tag == replyTag)
+				return length;
+			if(lwdComplete(d, replyTag, length) && tag == -2)
+				return 0;
+		}
+	}
+}
+
+/* Sends a request and waits for its reply, returns the status at its start */
+static int lwdCall(lwDaemon* d, int type, const unsigned char* payload, int length, const char* data, int dataLength, int timeout)
+{
+	int status;
+
+	d->tag++;
+	if(lwdSend(d, type, payload, length, data, dataLength) < 0)
+		return -1;
+	status = lwdReceive(d, d->tag, timeout);
+	if(status < 0)
+		return status;
+	if(status < 2)
+		return -1;
+	return (short)(d->frame[LWD_HEADER_SIZE] | (d->frame[LWD_HEADER_SIZE+1] << 8));
+}
+
+/******************************************************************************
+* lwRemote of a device reached through lwd
+******************************************************************************/
+static int lwdTransfer(littleWire* lwHandle, int requestType, int request, int value, int index, char* bytes, int size, int timeout)
+{
+	lwDaemon* d = (lwDaemon*)lwHandle->remote;
+	unsigned char payload[8];
+	int in = requestType & USB_ENDPOINT_IN;
+	int status, length;
+
+	if(size > LWD_MAX_DATA)
+		return -1;
+	payload[0] = requestType;
+	payload[1] = request;
+	payload[2] = value & 0xFF;
+	payload[3] = (value >> 8) & 0xFF;
+	payload[4] = index & 0xFF;
+	payload[5] = (index >> 8) & 0xFF;
+	payload[6] = size & 0xFF;
+	payload[7] = size >> 8;
+
+	status = lwdCall(d, LWD_CONTROL, payload, 8, bytes, in ? 0 : size, timeout);
+	if(status > 0 && in)
+	{
+		length = (d->frame[4] | (d->frame[5] << 8)) - 2;
+		if(length > size)
+			length = size;
+		if(length > status)
+			length = status;
+		memcpy(bytes, d->frame + LWD_HEADER_SIZE + 2, length);
+	}
+	return status;
+}
+
+static int lwdInterruptRead(littleWire* lwHandle, char* bytes, int size, int timeout)
+{
+	lwDaemon* d = (lwDaemon*)lwHandle->remote;
+	int status;
+
+	if(!d->subscribed)
+	{
+		status = lwdCall(d, LWD_SUBSCRIBE, NULL, 0, NULL, 0, USB_TIMEOUT);
+		if(status < 0)
+			return status;
+		d->subscribed = 1;
+	}
+	if(!d->eventCount)
+	{
+		status = lwdReceive(d, -1, timeout);
+		if(status < 0)
+			return status;
+	}
+	if(size > 8)
+		size = 8;
+	memcpy(bytes, d->events[d->eventHead], size);
+	d->eventHead = (d->eventHead + 1) % LWD_EVENT_QUEUE;
+	d->eventCount--;
+	return size;
+}
+
+static void lwdClose(littleWire* lwHandle)
+{
+	lwDaemon* d = (lwDaemon*)lwHandle->remote;
+
+	close(d->fd);
+	free(d);
+}
+
+/******************************************************************************
+* Binds a connected socket to a device and makes the handle for it.
+******************************************************************************/
+static littleWire* lwdOpen(int fd, int serialNumber)
+{
+	unsigned char payload[4];
+	littleWire* lwHandle;
+	lwDaemon* d;
+
+	d = calloc(1, sizeof(lwDaemon));
+	lwHandle = calloc(1, sizeof(littleWire));
+	if(d == NULL || lwHandle == NULL)
+		goto fail;
+	d->ops.transfer = lwdTransfer;
+	d->ops.interruptRead = lwdInterruptRead;
+	d->ops.close = lwdClose;
+	d->fd = fd;
+
+	payload[0] = serialNumber & 0xFF;
+	payload[1] = (serialNumber >> 8) & 0xFF;
+	payload[2] = (serialNumber >> 16) & 0xFF;
+	payload[3] = (serialNumber >> 24) & 0xFF;
+	if(lwdCall(d, LWD_OPEN, payload, 4, NULL, 0, USB_TIMEOUT) != 0)
+		goto fail;
+
+	lwHandle->remote = &d->ops;
+	readFirmwareVersion(lwHandle);
+	return lwHandle;
+
+fail:
+	close(fd);
+	free(d);
+	free(lwHandle);
+	return NULL;
+}
+
+littleWire* lw_daemon_connect(const char* path, int serialNumber)
+{
+	struct sockaddr_un address;
+	int fd;
+
+	if(path == NULL)
+		path = getenv("LWD_SOCKET");
+	if(path == NULL)
+		path = LWD_SOCKET;
+	if(strlen(path) >= sizeof(address.sun_path))
+		return NULL;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0)
+		return NULL;
+	if(connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	return lwdOpen(fd, serialNumber);
+}
+
+littleWire* lw_remote_connect(const char* host, int port, int serialNumber)
+{
+	struct addrinfo hints, *found, *a;
+	char service[16];
+	int fd = -1, yes = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if(getaddrinfo(host, service, &hints, &found) != 0)
+		return NULL;
+	for(a=found;a;a=a->ai_next)
+	{
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if(fd < 0)
+			continue;
+		if(connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(found);
+	if(fd < 0)
+		return NULL;
+	// Requests are small, send each at once instead of waiting to fill a segment
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&yes, sizeof(yes));
+	return lwdOpen(fd, serialNumber);
+}
+
+int lw_remote_post(littleWire* lwHandle, lwPosted* request)
+{
+	lwDaemon* d = (lwDaemon*)lwHandle->remote;
+	unsigned char payload[8];
+	int in = request->requestType & USB_ENDPOINT_IN;
+	int status;
+
+	if(d == NULL || request->size > LWD_MAX_DATA || request->size < 0)
+		return -1;
+	if(d->postedCount == LWD_PIPELINE_DEPTH)
+	{
+		status = lw_remote_wait(lwHandle, d->posted[0], USB_TIMEOUT);
+		if(status < 0 && !d->posted[0]->done)
+			return status;
+	}
+	payload[0] = request->requestType;
+	payload[1] = request->request;
+	payload[2] = request->value & 0xFF;
+	payload[3] = (request->value >> 8) & 0xFF;
+	payload[4] = request->index & 0xFF;
+	payload[5] = (request->index >> 8) & 0xFF;
+	payload[6] = request->size & 0xFF;
+	payload[7] = request->size >> 8;
+
+	request->done = 0;
+	request->status = 0;
+	request->tag = ++d->tag;
+	if(lwdSend(d, LWD_CONTROL, payload, 8, request->bytes, in ? 0 : request->size) < 0)
+		return -1;
+	d->posted[d->postedCount++] = request;
+	lwHandle->stats.transfers++;
+	return 0;
+}
+
+int lw_remote_wait(littleWire* lwHandle, lwPosted* request, int timeout)
+{
+	lwDaemon* d = (lwDaemon*)lwHandle->remote;
+	int status;
+
+	while(!request->done)
+	{
+		status = lwdReceive(d, -2, timeout);
+		if(status < 0)
+			return status;
+	}
+	if(request->status < 0)
+		lwHandle->stats.errors++;
+	return request->status;
+}
+
+#else
+
+littleWire* lw_daemon_connect(const char* path, int serialNumber)
+{
+	return NULL;	// lwd runs on Linux
+}
+
+littleWire* lw_remote_connect(const char* host, int port, int serialNumber)
+{
+	return NULL;
+}
+
+int lw_remote_post(littleWire* lwHandle, lwPosted* request)
+{
+	return -1;
+}
+
+int lw_remote_wait(littleWire* lwHandle, lwPosted* request, int timeout)
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef LITTLEWIRE_REMOTE_H
+#define LITTLEWIRE_REMOTE_H
+/*
+	Little Wire devices shared through the lwd daemon.
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy of
+	this software and associated documentation files (the "Software"), to deal in
+	the Software without restriction, including without limitation the rights to
+	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+	of the Software, and to permit persons to whom the Software is furnished to do
+	so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#include "littleWire.h"
+
+/*
+	Protocol between lwd and its clients. Every message is a frame of a 6 byte
+	header, then the payload. Numbers are little endian.
+
+		byte 0		type, the reply to a request has bit 7 set
+		byte 1		0
+		bytes 2-3	tag, copied into the reply
+		bytes 4-5	payload length
+
+	LWD_OPEN	i32 serial number, -1 for any device
+			reply: i16 status, 0 once the connection is bound to the device
+	LWD_CONTROL	u8 bmRequestType, u8 bRequest, u16 wValue, u16 wIndex, u16 wLength,
+			then the data stage of an OUT transfer
+			reply: i16 status of usb_control_msg, then the data of an IN transfer
+	LWD_SUBSCRIBE	no payload, the pin event reports of the device are sent from now on
+			reply: i16 status
+	LWD_EVENT	from lwd only, tag 0: an interrupt report of the device, 8 bytes
+
+	A connection drives one device. Requests are answered in order, and a
+	client may send more before the replies of the earlier ones are in.
+*/
+#define LWD_SOCKET "/tmp/lwd.sock"	// default socket, LWD_SOCKET in the environment overrides
+#define LWD_HEADER_SIZE 6
+#define LWD_MAX_DATA 512		// largest data stage of an LWD_CONTROL
+#define LWD_REPLY 0x80
+#define LWD_PIPELINE_DEPTH 64		// requests lw_remote_post keeps in flight
+
+#define LWD_OPEN 1
+#define LWD_CONTROL 2
+#define LWD_SUBSCRIBE 3
+#define LWD_EVENT 4
+
+/*! \addtogroup Remote
+  *  @brief Devices shared through lwd. \n
+  *  lwd owns the attached devices and runs the requests of all its clients, so several
+  *  programs, on this machine or over TCP, can use a device at once. The handle works
+  *  with every function of littleWire.h; lw_control_msg on the handle's usb_dev_handle
+  *  is the only thing that needs a local device.
+  *  @{
+  */
+
+/**
+  * Connects to a device through lwd.
+  *
+  * @param path Socket of lwd, NULL for LWD_SOCKET from the environment or the default
+  * @param serialNumber Serial number of the device, -1 for any device
+  * @return littleWire pointer, NULL if lwd or the device could not be reached.
+  */
+littleWire* lw_daemon_connect(const char* path, int serialNumber);
+
+/**
+  * Connects to a device through lwd on another machine, started with -p port and
+  * -b with an address the host is reachable on, as lwd only listens on the loopback
+  * address by default.
+  *
+  * @param host Name or address of the machine
+  * @param port TCP port of lwd
+  * @param serialNumber Serial number of the device, -1 for any device
+  * @return littleWire pointer, NULL if lwd or the device could not be reached.
+  */
+littleWire* lw_remote_connect(const char* host, int port, int serialNumber);
+
+/**
+  * A control transfer sent with lw_remote_post. The caller keeps it, and its buffer,
+  * until lw_remote_wait has returned for it.
+  */
+typedef struct lwPosted
+{
+  int requestType;      /* 0xC0 for a vendor request in, 0x40 out */
+  int request;
+  int value;
+  int index;
+  char* bytes;          /* data stage, filled in for an IN transfer */
+  int size;
+  int status;           /* set when the reply is in: bytes transferred, negative for an error */
+  int done;             /* nonzero once the reply is in */
+  unsigned short tag;
+} lwPosted;
+
+/**
+  * Sends a control transfer to a device reached through lwd without waiting for the
+  * reply. \n
+  * Up to \b LWD_PIPELINE_DEPTH transfers can be in flight, so their round trips over
+  * the network overlap, and the short ones lwd reads together go to the device in a
+  * single batch. The replies come back in order. The synchronous functions of
+  * littleWire.h can be called meanwhile. Runs lw_remote_wait on the oldest transfer
+  * when the pipeline is full.
+  *
+  * @param lwHandle littleWire device pointer from lw_daemon_connect or lw_remote_connect
+  * @param request Transfer to send
+  * @return Negative for an error.
+  */
+int lw_remote_post(littleWire* lwHandle, lwPosted* request);
+
+/**
+  * Waits for the reply of a transfer sent with lw_remote_post, taking the replies of
+  * the transfers sent before it on the way.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param request Transfer to wait for
+  * @param timeout Miliseconds
+  * @return request->status, negative for an error or a timeout.
+  */
+int lw_remote_wait(littleWire* lwHandle, lwPosted* request, int timeout);
+
+/*! @} */
+
+#endif
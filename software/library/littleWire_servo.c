@@ -55,4 +55,51 @@ void servo_updateLocation(littleWire* lwHandle,unsigned char locationChannelA,un
 	locationChannelB=(((locationChannelB/RANGE)*(MAX_LIMIT-MIN_LIMIT))+MIN_LIMIT)/STEP_SIZE;
 	pwm_updateCompare(lwHandle,locationChannelA,locationChannelB);
 }
-/*******************************************************************************/
\ No newline at end of file
+/*******************************************************************************/
+
+/********************************************************************************
+* Microsecond servo mode, driven by Timer1 on the device
+********************************************************************************/
+static int servo_command(littleWire* lwHandle, unsigned char mode, unsigned int* pulseWidthA, unsigned int* pulseWidthB)
+{
+	unsigned char reply[8];
+
+	if(customMessage(lwHandle, reply, 71, 0, 0, mode, 0) < 5)
+		return lw_error(lwHandle);
+	if(pulseWidthA) *pulseWidthA = reply[1] | (reply[2] << 8);
+	if(pulseWidthB) *pulseWidthB = reply[3] | (reply[4] << 8);
+	return reply[0];
+}
+
+int servo_initPrecise(littleWire* lwHandle)
+{
+	int rc;
+	pinMode(lwHandle,PWMA,OUTPUT); pinMode(lwHandle,PWMB,OUTPUT);
+	rc = servo_command(lwHandle, 1, NULL, NULL);
+	return rc < 0 ? rc : rc & 1;
+}
+
+void servo_stopPrecise(littleWire* lwHandle)
+{
+	servo_command(lwHandle, 0, NULL, NULL);
+}
+
+void servo_writeMicroseconds(littleWire* lwHandle, unsigned char channel, unsigned int pulseWidth)
+{
+	servo_moveTo(lwHandle, channel, pulseWidth, 0, SERVO_LINEAR);
+}
+
+void servo_moveTo(littleWire* lwHandle, unsigned char channel, unsigned int pulseWidth, unsigned int duration, unsigned char profile)
+{
+	unsigned char reply[8];
+	unsigned int frames = (duration + 10) / 20;
+
+	if(frames > 255) frames = 255;
+	customMessage(lwHandle, reply, 72, pulseWidth & 0xFF, pulseWidth >> 8, (channel & 1) | ((profile & 3) << 4), frames);
+}
+
+int servo_status(littleWire* lwHandle, unsigned int* pulseWidthA, unsigned int* pulseWidthB)
+{
+	return servo_command(lwHandle, 2, pulseWidthA, pulseWidthB);
+}
+/*******************************************************************************/
@@ -49,6 +49,62 @@ void servo_init(littleWire* lwHandle);
   */
 void servo_updateLocation(littleWire* lwHandle,unsigned char locationChannelA,unsigned char locationChannelB);
 
+#define SERVO_LINEAR	0	// constant speed
+#define SERVO_TRAPEZOID	1	// speed up over the first quarter of the move, slow down over the last
+#define SERVO_EASE		2	// smooth start and stop
+
+/**
+  * Starts the microsecond servo mode. \n
+  * The device drives the servos on PWMA and PWMB with Timer1, every 20 ms, and both
+  * start centred at 1500 us. Timer1 must be free, and the mode replaces servo_init.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return 1 for success, 0 if the device could not start it, negative for a failed communication.
+  */
+int servo_initPrecise(littleWire* lwHandle);
+
+/**
+  * Stops the microsecond servo mode and drives both pins low.
+  *
+  * @param lwHandle littleWire device pointer
+  * @return (none)
+  */
+void servo_stopPrecise(littleWire* lwHandle);
+
+/**
+  * Sets the pulse width of a servo straight away, in the microsecond servo mode.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param channel 0 for channel A, 1 for channel B
+  * @param pulseWidth Pulse width in microseconds, clamped to 400-2600
+  * @return (none)
+  */
+void servo_writeMicroseconds(littleWire* lwHandle, unsigned char channel, unsigned int pulseWidth);
+
+/**
+  * Moves a servo to a new pulse width over a given time, in the microsecond servo mode. \n
+  * The device updates the pulse width once per 20 ms frame, so the move needs a single
+  * request. A new move of the same channel starts from wherever the servo is.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param channel 0 for channel A, 1 for channel B
+  * @param pulseWidth Target pulse width in microseconds, clamped to 400-2600
+  * @param duration Duration of the move in miliseconds, rounded to 20 ms, up to 5100
+  * @param profile SERVO_LINEAR, SERVO_TRAPEZOID or SERVO_EASE
+  * @return (none)
+  */
+void servo_moveTo(littleWire* lwHandle, unsigned char channel, unsigned int pulseWidth, unsigned int duration, unsigned char profile);
+
+/**
+  * Reads the state of the microsecond servo mode.
+  *
+  * @param lwHandle littleWire device pointer
+  * @param pulseWidthA Current pulse width of channel A in microseconds, may be NULL
+  * @param pulseWidthB Current pulse width of channel B in microseconds, may be NULL
+  * @return Bit 0 set while the mode runs, bits 1 and 2 while channel A and B are moving, negative for a failed communication.
+  */
+int servo_status(littleWire* lwHandle, unsigned int* pulseWidthA, unsigned int* pulseWidthB);
+
 /*! @} */
 
 #endif
\ No newline at end of file
@@ -15,6 +15,7 @@ libusb or libusb-win32.
 */
 
 #include <stdio.h>
+#include <string.h>
 #include "opendevice.h"
 
 /* ------------------------------------------------------------------------- */
@@ -113,6 +114,14 @@ int     rval, i;
 
 /* ------------------------------------------------------------------------- */
 
+/* A pattern that any string matches needs no string descriptor read. */
+static int  matchesAnything(char *pattern)
+{
+    return pattern == NULL || strcmp(pattern, "*") == 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
 int usbOpenDevice(usb_dev_handle **device, int vendorID, char *vendorNamePattern, int productID, char *productNamePattern, char *serialNamePattern, FILE *printMatchingDevicesFp, FILE *warningsFp)
 {
 struct usb_bus      *bus;
@@ -137,7 +146,7 @@ int                 errorCode = USBOPEN_ERR_NOTFOUND;
                 }
                 /* now check whether the names match: */
                 len = vendor[0] = 0;
-                if(dev->descriptor.iManufacturer > 0){
+                if(dev->descriptor.iManufacturer > 0 && (printMatchingDevicesFp != NULL || !matchesAnything(vendorNamePattern))){
                     len = usbGetStringAscii(handle, dev->descriptor.iManufacturer, vendor, sizeof(vendor));
                 }
                 if(len < 0){
@@ -149,7 +158,7 @@ int                 errorCode = USBOPEN_ERR_NOTFOUND;
                     /* printf("seen device from vendor ->%s<-\n", vendor); */
                     if(shellStyleMatch(vendor, vendorNamePattern)){
                         len = product[0] = 0;
-                        if(dev->descriptor.iProduct > 0){
+                        if(dev->descriptor.iProduct > 0 && (printMatchingDevicesFp != NULL || !matchesAnything(productNamePattern))){
                             len = usbGetStringAscii(handle, dev->descriptor.iProduct, product, sizeof(product));
                         }
                         if(len < 0){
@@ -161,7 +170,7 @@ int                 errorCode = USBOPEN_ERR_NOTFOUND;
                             /* printf("seen product ->%s<-\n", product); */
                             if(shellStyleMatch(product, productNamePattern)){
                                 len = serial[0] = 0;
-                                if(dev->descriptor.iSerialNumber > 0){
+                                if(dev->descriptor.iSerialNumber > 0 && (printMatchingDevicesFp != NULL || !matchesAnything(serialNamePattern))){
                                     len = usbGetStringAscii(handle, dev->descriptor.iSerialNumber, serial, sizeof(serial));
                                 }
                                 if(len < 0){
@@ -201,3 +210,101 @@ int                 errorCode = USBOPEN_ERR_NOTFOUND;
 }
 
 /* ------------------------------------------------------------------------- */
+
+static void usbDevicePath(struct usb_bus *bus, struct usb_device *dev, char *path, int pathSize)
+{
+    snprintf(path, pathSize, "%s/%s", bus->dirname, dev->filename);
+}
+
+int usbOpenDevicePath(usb_dev_handle **device, int vendorID, int productID, char *path, FILE *warningsFp)
+{
+struct usb_bus      *bus;
+struct usb_device   *dev;
+char                devPath[USBOPEN_PATH_SIZE];
+
+    usb_find_busses();
+    usb_find_devices();
+    for(bus = usb_get_busses(); bus; bus = bus->next){
+        for(dev = bus->devices; dev; dev = dev->next){
+            usbDevicePath(bus, dev, devPath, sizeof(devPath));
+            if(strcmp(devPath, path) != 0)
+                continue;
+            if((vendorID != 0 && dev->descriptor.idVendor != vendorID)
+                        || (productID != 0 && dev->descriptor.idProduct != productID))
+                return USBOPEN_ERR_NOTFOUND;
+            *device = usb_open(dev);
+            if(*device == NULL){
+                if(warningsFp != NULL)
+                    fprintf(warningsFp, "Warning: cannot open %s: %s\n", path, usb_strerror());
+                return USBOPEN_ERR_ACCESS;
+            }
+            return USBOPEN_SUCCESS;
+        }
+    }
+    return USBOPEN_ERR_NOTFOUND;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* private interface: opens dev if its serial number matches, else returns NULL. */
+static usb_dev_handle *openIfSerial(struct usb_device *dev, char *serialNamePattern, int *errorCode, FILE *warningsFp)
+{
+usb_dev_handle      *handle;
+char                serial[256];
+int                 len = serial[0] = 0;
+
+    handle = usb_open(dev);
+    if(!handle){
+        *errorCode = USBOPEN_ERR_ACCESS;
+        if(warningsFp != NULL)
+            fprintf(warningsFp, "Warning: cannot open VID=0x%04x PID=0x%04x: %s\n", dev->descriptor.idVendor, dev->descriptor.idProduct, usb_strerror());
+        return NULL;
+    }
+    if(dev->descriptor.iSerialNumber > 0)
+        len = usbGetStringAscii(handle, dev->descriptor.iSerialNumber, serial, sizeof(serial));
+    if(len < 0){
+        *errorCode = USBOPEN_ERR_ACCESS;
+        if(warningsFp != NULL)
+            fprintf(warningsFp, "Warning: cannot query serial for VID=0x%04x PID=0x%04x: %s\n", dev->descriptor.idVendor, dev->descriptor.idProduct, usb_strerror());
+    }else if(shellStyleMatch(serial, serialNamePattern)){
+        return handle;
+    }
+    usb_close(handle);
+    return NULL;
+}
+
+int usbOpenDeviceSerial(usb_dev_handle **device, int vendorID, int productID, char *serialNamePattern, char *cachedPath, int pathSize, FILE *warningsFp)
+{
+struct usb_bus      *bus;
+struct usb_device   *dev;
+usb_dev_handle      *handle = NULL;
+char                devPath[USBOPEN_PATH_SIZE];
+int                 pass, errorCode = USBOPEN_ERR_NOTFOUND;
+
+    usb_find_busses();
+    usb_find_devices();
+    /* pass 0 tries the cached path only, pass 1 every other device */
+    for(pass = (cachedPath[0] ? 0 : 1); pass < 2 && !handle; pass++){
+        for(bus = usb_get_busses(); bus && !handle; bus = bus->next){
+            for(dev = bus->devices; dev; dev = dev->next){
+                if((vendorID != 0 && dev->descriptor.idVendor != vendorID)
+                            || (productID != 0 && dev->descriptor.idProduct != productID))
+                    continue;
+                usbDevicePath(bus, dev, devPath, sizeof(devPath));
+                if((strcmp(devPath, cachedPath) == 0) != (pass == 0))
+                    continue;
+                handle = openIfSerial(dev, serialNamePattern, &errorCode, warningsFp);
+                if(handle){
+                    snprintf(cachedPath, pathSize, "%s", devPath);
+                    break;
+                }
+            }
+        }
+    }
+    if(handle == NULL)
+        return errorCode;
+    *device = handle;
+    return USBOPEN_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
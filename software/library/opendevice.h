@@ -49,7 +49,8 @@ int usbOpenDevice(usb_dev_handle **device, int vendorID, char *vendorNamePattern
  * matching can be done on textual vendor name ('vendorNamePattern'), product
  * name ('productNamePattern') and serial number ('serialNamePattern'). A
  * device matches only if all non-null pattern match. If you don't care about
- * a string, pass NULL for the pattern. Patterns are Unix shell style pattern:
+ * a string, pass NULL (or "*") for the pattern, and it is not read from the
+ * device unless matching devices are printed. Patterns are Unix shell style pattern:
  * '*' stands for 0 or more characters, '?' for one single character, a list
  * of characters in square brackets for a single character from the list
  * (dashes are allowed to specify a range) and if the lis of characters begins
@@ -63,6 +64,28 @@ int usbOpenDevice(usb_dev_handle **device, int vendorID, char *vendorNamePattern
  * Returns: 0 on success, an error code (see defines below) on failure.
  */
 
+int usbOpenDevicePath(usb_dev_handle **device, int vendorID, int productID, char *path, FILE *warningsFp);
+/* This function opens the device at 'path', the bus and device names of
+ * libusb joined by a slash ("001/004" on Linux), if it matches by its IDs.
+ * No string descriptor is read, so one of many devices is opened at the cost
+ * of a single open. Most systems give a device a new name when it is plugged
+ * in again. The path of a device is at most USBOPEN_PATH_SIZE - 1 characters.
+ * Returns: 0 on success, an error code (see defines below) on failure.
+ */
+
+int usbOpenDeviceSerial(usb_dev_handle **device, int vendorID, int productID, char *serialNamePattern, char *cachedPath, int pathSize, FILE *warningsFp);
+/* This function opens the first device matching by its IDs whose serial
+ * number matches 'serialNamePattern', as usbOpenDevice() does, but reads
+ * only the serial number of each device, not its vendor and product names.
+ * If 'cachedPath' is not empty, the device at that path (see
+ * usbOpenDevicePath()) is tried before any other, so a device found before
+ * costs one string descriptor read. The path of the device opened is stored
+ * in 'cachedPath', a buffer of 'pathSize' bytes.
+ * Returns: 0 on success, an error code (see defines below) on failure.
+ */
+
+#define USBOPEN_PATH_SIZE       64
+
 /* usbOpenDevice() error codes: */
 #define USBOPEN_SUCCESS         0   /* no error */
 #define USBOPEN_ERR_ACCESS      1   /* not enough permissions to open device */